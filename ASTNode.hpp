@@ -1,16 +1,142 @@
 #pragma once
 
+#include <algorithm>
+#include <bit>
 #include <cmath>
+#include <functional>
+#include <map>
 #include <memory>
+#include <optional>
+#include <set>
+#include <span>
 #include <sstream>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include "Constant.hpp"
 #include "Control.hpp"
 #include "lexer.hpp"
+#include "MemReport.hpp"
 #include "SymbolTable.hpp"
+#include "VM.hpp"
 
-class ASTNode {
+class ASTNode;
+
+// The steps of a pass over a tree (see StepQueue in tools.hpp), as in code generation (see
+// Control::Then).  A node's value (such as a replacement for it) is left by its last step,
+// for whoever called it to take.
+template <typename RESULT_T>
+class PassSteps {
+private:
+  using step_t = StepQueue<>::step_t;
+  StepQueue<> steps{};
+  RESULT_T result{};
+
+public:
+  void Then(step_t step) { steps.Then(std::move(step)); }
+
+  // Queue a call (which may queue steps of its own), then a step taking the value it left.
+  template <typename CALL_T, typename THEN_T>
+  void Call(CALL_T call, THEN_T then) {
+    Then([this, call, then]() {
+      result = RESULT_T{};
+      call();
+      Then([this, then]() { then(std::exchange(result, RESULT_T{})); });
+    });
+  }
+
+  // Keep an object (such as a table shared by the steps queued so far) until they are done.
+  template <typename T>
+  void Keep(std::shared_ptr<T> ptr) { Then([ptr]() { }); }
+
+  void Return(RESULT_T in) { result = std::move(in); }
+
+  // Run a step, then everything it queues; return the value it leaves.
+  RESULT_T Run(step_t first) {
+    result = RESULT_T{};
+    steps.Run(std::move(first));
+    return std::exchange(result, RESULT_T{});
+  }
+};
+
+using FoldSteps = PassSteps<std::unique_ptr<ASTNode>>;  // Replacement node, if any
+using NumberSteps = PassSteps<size_t>;                  // Value number (0 for none)
+using SSASteps = PassSteps<ssa::ValueID>;               // Value (statements have none)
+
+// Lowering into bytecode leaves the register holding each value, and needs to know which
+// nodes have an assignment somewhere below them (see ASTNode_Math2::ToVM).
+struct VMSteps : PassSteps<vm::Reg> {
+  std::unordered_set<const ASTNode *> assigning{};
+};
+
+// Expressions being moved out of a while loop because they give the same value on every
+// iteration (see ASTNode_While::HoistLoops).
+struct LoopInvariants {
+  SymbolTable & symbols;
+  std::vector<size_t> & new_vars;                 // Variables created for hoisted values.
+  std::set<size_t> assigned{};                    // Variables that may change in the loop.
+  std::vector<std::unique_ptr<ASTNode>> setup{};  // Assignments to run before the loop.
+
+  // Replace an invariant expression with a new variable that is set before the loop.
+  void Hoist(std::unique_ptr<ASTNode> & node);
+
+  // Hoist the largest invariant expressions anywhere below a loop.
+  void Find(ASTNode & loop);
+};
+
+// Value numbers for one straight-line stretch of code: expressions built from the same
+// operations on the same values get the same number, so a repeat can reuse the first
+// result (see ASTNode::NumberValues).  Tables are copied into nested blocks.
+struct ValueNumbering {
+  // The first unconditional place a value was computed.
+  struct Available {
+    std::unique_ptr<ASTNode> * slot;  // Where the computing node is held
+    const ASTNode * node;             // ...and which node that was (in case it moved)
+    size_t var_id = SymbolTable::NO_ID;  // Variable the value is saved in, once reused
+  };
+
+  SymbolTable & symbols;
+  std::vector<size_t> & new_vars;                    // Variables created to save values.
+  std::shared_ptr<size_t> next_number = std::make_shared<size_t>(0);  // Shared by all copies.
+  std::unordered_map<std::string, size_t> numbers{}; // Description -> value number
+  std::unordered_map<size_t, size_t> versions{};     // Var ID -> number of its current value
+  std::unordered_map<size_t, std::shared_ptr<Available>> available{};
+  size_t conditional = 0;    // Inside code that might not run?  (Don't make values available.)
+
+  ValueNumbering(SymbolTable & symbols, std::vector<size_t> & new_vars)
+    : symbols(symbols), new_vars(new_vars) { }
+  ValueNumbering(const ValueNumbering &) = default;
+
+  size_t Number(const std::string & key) {
+    auto [it, added] = numbers.emplace(key, 0);
+    if (added) it->second = ++*next_number;
+    return it->second;
+  }
+
+  // The value of a variable changes whenever it is assigned.
+  size_t VarNumber(size_t var_id) {
+    auto [it, added] = versions.emplace(var_id, 0);
+    if (added) it->second = ++*next_number;
+    return it->second;
+  }
+  void Assigned(size_t var_id) { versions[var_id] = ++*next_number; }
+  void Assigned(const std::set<size_t> & var_ids) {
+    for (size_t id : var_ids) Assigned(id);
+  }
+
+  // Queue numbering the node in a slot, then 'then' with its number; if its value was
+  // already computed, reuse that instead.
+  template <typename THEN_T>
+  void Visit(std::unique_ptr<ASTNode> & slot, NumberSteps & steps, THEN_T then);
+
+  // Reuse an earlier value for the node in a slot, if there is one; return its number.
+  size_t Reuse(std::unique_ptr<ASTNode> & slot, size_t number);
+};
+
+class ASTNode : public memory::Tagged<memory::Tag::AST> {
 protected:
   FilePos file_pos;   // What file position was this node parsed from in the original file?
 
@@ -29,17 +155,19 @@ public:
   FilePos GetFilePos() const { return file_pos; }
 
   // What position in the original file was this whole code segment defined at?
-  virtual FilePos GetFirstPos() const { return file_pos; }
+  FilePos GetFirstPos() const;
 
   virtual void AddChild(ptr_t &&) {
     // Cannot call AddChild on a non-parent class.
     assert(false);
   }
 
+  // The nodes directly below this one (only parents have any).
+  virtual std::span<ptr_t> Children() { return {}; }
+  virtual std::span<const ptr_t> Children() const { return {}; }
+
   virtual std::string GetTypeName() const = 0;
-  virtual void Print(std::string prefix="") const {
-    std::cout << prefix << GetTypeName() << std::endl;
-  }
+  void Print(std::string prefix="") const;
 
   // Does this node represent a guaranteed return? Options are:
   // - A return node.
@@ -56,21 +184,142 @@ public:
     return Type();
   }
 
+  // Operations find their type from their children's, so they remember it once known
+  // (see ASTNode_Operation); any other node can give its type without looking far.
+  virtual bool TypeKnown() const { return true; }
+  virtual void RememberType(const SymbolTable & /* symbols */) const { }
+
+  // Check the types in this node, after any checks before its children and after the
+  // children themselves (TypeCheckTree checks a whole tree in that order).
+  virtual void PreTypeCheck(const SymbolTable & /* symbols */) { }
   virtual void TypeCheck(const SymbolTable & /* symbols */) { }
+  void TypeCheckTree(const SymbolTable & symbols);
+
+  // Simplify this node after type checking, using (and updating) the values of variables
+  // that are known to be constant.  Leave a replacement node (see PassSteps), or nothing to
+  // keep this one.  OptimizeTree does a whole tree.
+  virtual void Optimize(ConstantTable & /* constants */, FoldSteps & /* steps */) { }
+  void OptimizeTree(ConstantTable & constants);
+
+  // If this node is a literal, what is its value?
+  virtual std::optional<Constant> GetConstant() const { return std::nullopt; }
+
+  // Can running this node as a statement do anything (change variables, trap, return, ...)?
+  // HasEffect checks a whole tree; HasOwnEffect is for this node apart from its children.
+  virtual bool HasOwnEffect() const { return true; }
+  bool HasEffect() const;
+
+  // Is the value of this node always exactly 0 or 1?
+  virtual bool IsBoolean() const { return false; }
+
+  // Which variable does this node itself assign (if any)?
+  virtual size_t AssignedVar() const { return SymbolTable::NO_ID; }
+
+  // Add the IDs of any variables that this code may change.
+  void FindAssigned(std::set<size_t> & var_ids) const;
+
+  // Note whether this node breaks out of, or continues, the innermost enclosing loop, and
+  // return whether any jumps below it would too.
+  virtual bool FindLoopJumps(bool & /* has_break */, bool & /* has_continue */) const { return true; }
+
+  // Move loop-invariant expressions out of while loops, adding any new variables to
+  // new_vars.  A loop collects the code to run before it, which its parent then places in
+  // front of it (TakeLoopSetup); HoistTree does a whole tree, outer loops first.
+  virtual void HoistLoops(SymbolTable & /* symbols */, std::vector<size_t> & /* new_vars */) { }
+  virtual std::vector<ptr_t> TakeLoopSetup() { return {}; }
+  void HoistTree(SymbolTable & symbols, std::vector<size_t> & new_vars);
+
+  // Does this node (without children) give the same value on every iteration of the loop,
+  // with no effects (so it can run once, before the loop)?
+  virtual bool IsInvariant(const LoopInvariants & /* loop */) const { return GetConstant().has_value(); }
+
+  // Can this node run before a loop whenever all of its children can?
+  virtual bool CanHoist() const { return false; }
+
+  // Is this node's value determined entirely by the values of its children?
+  virtual bool IsValueOp() const { return false; }
+
+  // Give this node's value a number in the table (left as in PassSteps; 0 if it has none),
+  // replacing any repeated expressions inside it with the value computed earlier.
+  // NumberTree does a whole tree.
+  virtual void NumberValues(ValueNumbering & table, NumberSteps & steps) {
+    auto value = GetConstant();
+    if (!value) return;
+    steps.Return(table.Number(ToString("const:", static_cast<int>(value->kind), ":", value->i, ":",
+                                       std::bit_cast<uint64_t>(value->d))));
+  }
+  void NumberTree(ValueNumbering & table);
 
-  // Generate any GLOBAL code that is needed to initialize this node.
-  // (For example, place literal strings in memory.)
+  // How many nodes make up this code?
+  size_t CountNodes() const;
+
+  // Count the nodes that make up this code by kind (their type name, without details).
+  void CountKinds(std::map<std::string, size_t> & counts) const;
+
+  // Generate any GLOBAL code that is needed to initialize this node, before that for its
+  // children (InitializeTreeWAT does a whole tree).  (For example, place literal strings in memory.)
   virtual void InitializeWAT(Control & /* control */) { }
+  void InitializeTreeWAT(Control & control);
 
-  // Generate WAT code and return (true/false) whether a value was left on the stack.
+  // Generate WAT code and return (true/false) whether a value will be left on the stack.
+  // Only the code before the first child is generated directly; the rest is queued in
+  // order, each child with ChildToWAT and the code that follows it with control.Then().
+  // TreeToWAT runs the queue for a whole tree.
   virtual bool ToWAT(Control & /* control */) = 0;
+  bool TreeToWAT(Control & control);
+
+  // Lower this node into SSA form (see SSA.hpp), leaving its value, if it has one (see
+  // PassSteps).
+  virtual void ToSSA(ssa::Builder & /* builder */, const SymbolTable & /* symbols */, SSASteps & /* steps */) {
+    assert(false);  // Every statement and expression node must be lowered.
+  }
+
+  // Lower this node into bytecode for the VM (see VM.hpp), leaving the register that holds
+  // its value, if it has one (see PassSteps).
+  virtual void ToVM(vm::Builder & /* builder */, const SymbolTable & /* symbols */, VMSteps & /* steps */) {
+    assert(false);  // Every statement and expression node must be lowered.
+  }
 
   virtual bool CanAssign() const { return false; }
   virtual void ToAssignWAT(Control & /* control */) {
     assert(false); // By default, nodes are not assignable!
   }
+  virtual size_t AssignID() const {
+    assert(false); // By default, nodes are not assignable!
+    return SymbolTable::NO_ID;
+  }
 };
 
+// Visit every node in a tree, calling enter(node) before its children and leave(node) after
+// them; if enter returns false, the children (and leave) are skipped.  Trees can be any
+// depth (each operator in a chain like a+b+c+... nests one more node), so the walk keeps
+// its place with an explicit stack rather than by recursing.  Leave may replace the
+// node's children.
+template <typename NODE_T, typename ENTER_T, typename LEAVE_T = void (*)(NODE_T &)>
+void WalkTree(NODE_T & root, ENTER_T enter, LEAVE_T leave = [](NODE_T &){}) {
+  struct Place {
+    NODE_T * node;
+    size_t next = 0;   // Child to visit next.
+  };
+  if (!enter(root)) return;
+  std::vector<Place> stack{Place{&root}};
+  while (stack.size()) {
+    Place & place = stack.back();
+    const auto children = place.node->Children();
+    if (place.next < children.size()) {
+      NODE_T * child = children[place.next++].get();
+      if (child && enter(*child)) stack.push_back(Place{child});
+      continue;
+    }
+    NODE_T & node = *place.node;
+    stack.pop_back();
+    leave(node);
+  }
+}
+
+// Build a literal node for a constant value (defined once literal nodes are available).
+inline ASTNode::ptr_t MakeLiteral(FilePos file_pos, const Constant & value);
+
 class ASTNode_Parent : public ASTNode {
 private:
   std::vector< ptr_t > children{};
@@ -81,18 +330,57 @@ public:
     (AddChild(std::move(nodes)), ...);
   }
 
-  void TypeCheck(const SymbolTable & symbols) override {
-    TypeCheckChildren(symbols);
+  // Take the tree apart one node at a time; letting each node destroy its own children
+  // would recurse once per level.
+  ~ASTNode_Parent() {
+    std::vector<ptr_t> doomed = std::move(children);
+    while (doomed.size()) {
+      ptr_t node = std::move(doomed.back());
+      doomed.pop_back();
+      if (!node) continue;
+      for (ptr_t & child : node->Children()) doomed.push_back(std::move(child));
+    }
   }
 
+  std::span<ptr_t> Children() override { return children; }
+  std::span<const ptr_t> Children() const override { return children; }
+
   // Tools to work with child nodes...
 
-  void TypeCheckChildren(const SymbolTable & symbols) {
-    for (auto & child : children) { child->TypeCheck(symbols); }
+  void Optimize(ConstantTable & constants, FoldSteps & steps) override {
+    OptimizeChildren(constants, steps);
   }
 
-  void InitializeWAT(Control & control) override {
-    for (auto & child : children) { child->InitializeWAT(control); }
+  // Queue optimizing a specified child, replacing it if needed.  The table must last until
+  // the child is done.
+  void OptimizeChild(size_t id, ConstantTable & constants, FoldSteps & steps) {
+    assert(HasChild(id));
+    steps.Call([child = children[id].get(), &constants, &steps]() { child->Optimize(constants, steps); },
+               [this, id](ptr_t replacement) {
+                 if (replacement) children[id] = std::move(replacement);
+               });
+  }
+
+  void OptimizeChildren(ConstantTable & constants, FoldSteps & steps) {
+    for (size_t id = 0; id < children.size(); ++id) OptimizeChild(id, constants, steps);
+  }
+
+  void NumberValues(ValueNumbering & table, NumberSteps & steps) override {
+    auto args = std::make_shared<std::vector<size_t>>();
+    for (auto & child : children) {
+      table.Visit(child, steps, [args](size_t number) { args->push_back(number); });
+    }
+    steps.Then([this, args, &table, &steps]() {
+      if (!IsValueOp() || std::count(args->begin(), args->end(), 0)) return;
+      steps.Return(table.Number(ValueKey(*args)));
+    });
+  }
+
+  // A description of this operation on the given child value numbers.
+  virtual std::string ValueKey(const std::vector<size_t> & args) const {
+    std::string key = GetTypeName();
+    for (size_t arg : args) key += ToString(":", arg);
+    return key;
   }
 
   size_t NumChildren() const { return children.size(); }
@@ -100,21 +388,22 @@ public:
 
   ASTNode & GetChild(size_t id) { assert(HasChild(id)); return *children[id]; }
   const ASTNode & GetChild(size_t id) const { assert(HasChild(id)); return *children[id]; }
+  ptr_t & ChildPtr(size_t id) { assert(HasChild(id)); return children[id]; }
   ASTNode & LastChild() { assert(children.size()); return *children.back(); }
   const ASTNode & LastChild() const { assert(children.size()); return *children.back(); }
 
-  FilePos GetFirstPos() const override {
-    FilePos first_pos = file_pos;
-    for (const auto & child : children) {
-      if (child->GetFirstPos() < first_pos) first_pos = child->GetFirstPos();
-    }
-    return first_pos;
-  }
-
   void AddChild(ptr_t && child) override {
     children.push_back(std::move(child));
   }
 
+  // Remove a child from this node and return it.
+  ptr_t TakeChild(size_t id) {
+    assert(HasChild(id));
+    ptr_t out = std::move(children[id]);
+    children.erase(children.begin() + static_cast<std::ptrdiff_t>(id));
+    return out;
+  }
+
   template <typename NODE_T, typename... ARG_Ts>
   void MakeChild(ARG_Ts &&... args) {
     AddChild( std::make_unique<NODE_T>(std::forward<ARG_Ts>(args)...) );
@@ -127,27 +416,66 @@ public:
     children[id] = std::make_unique<NODE_T>(std::move(children[id]));
   }
 
-  // Generate WAT code for a specified child.
-  // Make sure there is an 'out_value' if needed; otherwise drop any out value.
-  void ChildToWAT(size_t id, Control & control, bool out_needed) { 
+  // Queue lowering a specified child into SSA form, then 'then' with its value.
+  template <typename THEN_T>
+  void ChildToSSA(size_t id, ssa::Builder & builder, const SymbolTable & symbols, SSASteps & steps,
+                  THEN_T then) {
     assert(HasChild(id));
-    const bool has_out = children[id]->ToWAT(control);
-    assert(!out_needed || has_out);  // If we need an out value, make sure one is provided.
-    if (!out_needed && has_out) {    // If we don't need an out value and one is provided, drop it.
-      control.Drop();
-    }
+    steps.Call([child = children[id].get(), &builder, &symbols, &steps]() {
+                 child->ToSSA(builder, symbols, steps);
+               }, then);
   }
 
-  void Print(std::string prefix="") const override {
-    PrintChildren(prefix);
+  // Queue lowering a specified child into bytecode, then 'then' with its register.
+  template <typename THEN_T>
+  void ChildToVM(size_t id, vm::Builder & builder, const SymbolTable & symbols, VMSteps & steps,
+                 THEN_T then) {
+    assert(HasChild(id));
+    steps.Call([child = children[id].get(), &builder, &symbols, &steps]() {
+                 child->ToVM(builder, symbols, steps);
+               }, then);
   }
 
-  void PrintChildren(std::string prefix="") const {
-    std::cout << prefix << GetTypeName() << std::endl;
-    for (size_t i = 0; i < NumChildren(); ++i) {
-      GetChild(i).Print(prefix + "  ");
+  // Queue WAT code for a specified child (see ToWAT).
+  // Make sure there is an 'out_value' if needed; otherwise drop any out value.
+  void ChildToWAT(size_t id, Control & control, bool out_needed) {
+    assert(HasChild(id));
+    control.Then([child = children[id].get(), out_needed](Control & control) {
+      const uint32_t outer_pos = control.SetPosition(child->GetFilePos());
+      const bool has_out = child->ToWAT(control);
+      assert(!out_needed || has_out);  // If we need an out value, make sure one is provided.
+      control.Then([outer_pos, drop = !out_needed && has_out](Control & control) {
+        control.RestorePosition(outer_pos);
+        if (drop) control.Drop();      // If we don't need an out value and one is provided, drop it.
+      });
+    });
+  }
+};
+
+// An operation on values, whose type comes from the types of its children.  Operations
+// can nest to any depth, so each one works out its type only once, after those below it;
+// types do not change as the tree is rewritten.
+class ASTNode_Operation : public ASTNode_Parent {
+private:
+  mutable std::optional<Type> known_type{};
+
+protected:
+  // The type of this operation's value, given that its children's types are known.
+  virtual Type FindReturnType(const SymbolTable & symbols) const = 0;
+
+public:
+  using ASTNode_Parent::ASTNode_Parent;
+
+  Type ReturnType(const SymbolTable & symbols) const override {
+    if (!known_type) {
+      WalkTree<const ASTNode>(*this, [](const ASTNode & node){ return !node.TypeKnown(); },
+               [&symbols](const ASTNode & node){ node.RememberType(symbols); });
     }
+    return *known_type;
   }
+
+  bool TypeKnown() const override { return known_type.has_value(); }
+  void RememberType(const SymbolTable & symbols) const override { known_type.emplace(FindReturnType(symbols)); }
 };
 
 class ASTNode_Block : public ASTNode_Parent {
@@ -176,22 +504,68 @@ public:
     return LastChild().ReturnType(symbols);
   }
 
+  bool HasOwnEffect() const override { return false; }   // (Only its statements can.)
+
+  void Optimize(ConstantTable & constants, FoldSteps & steps) override {
+    OptimizeChildren(constants, steps);
+    steps.Then([this]() {
+      // Remove statements that no longer do anything (keeping the last, which may provide a type).
+      for (size_t i = NumChildren(); i-- > 1;) {
+        if (!GetChild(i-1).HasEffect()) TakeChild(i-1);
+      }
+
+      // Simplified children may have changed how this block returns.
+      is_return = may_return = false;
+      for (size_t i = 0; i < NumChildren(); ++i) {
+        if (GetChild(i).IsReturn()) is_return = true;
+        if (GetChild(i).MayReturn()) may_return = true;
+      }
+    });
+  }
+
+  // Values from before the block are still available inside, but not the other way.
+  void NumberValues(ValueNumbering & outer, NumberSteps & steps) override {
+    auto table = std::make_shared<ValueNumbering>(outer);
+    table->conditional = 0;
+    ASTNode_Parent::NumberValues(*table, steps);
+    steps.Then([this, &outer, &steps, table]() {
+      std::set<size_t> var_ids;
+      FindAssigned(var_ids);
+      outer.Assigned(var_ids);
+      steps.Return(0);
+    });
+  }
+
   bool ToWAT(Control & control) override { 
     bool is_final_node = control.FinalNode();
     control.FinalNode(false);
     for (size_t i = 0; i < NumChildren(); ++i) {
       // Only the final node in the block should be marked as such.
-      if (i == NumChildren()-1) control.FinalNode(is_final_node);
-
-      bool leftover_value = GetChild(i).ToWAT(control); // Run children.
-      if (leftover_value) {
-        // If child statement left an unneeded value on the stack, remove it.
-        control.Drop();
+      if (i == NumChildren()-1) {
+        control.Then([is_final_node](Control & control){ control.FinalNode(is_final_node); });
       }
+
+      // If child statement left an unneeded value on the stack, remove it.
+      ChildToWAT(i, control, false);
     }
 
     return false; // Value is left on the stack only if this is a return statement.
   }
+
+  void ToSSA(ssa::Builder & builder, const SymbolTable & symbols, SSASteps & steps) override {
+    for (size_t i = 0; i < NumChildren(); ++i) ChildToSSA(i, builder, symbols, steps, [](ssa::ValueID) { });
+  }
+
+  // Temporaries are only needed until the end of each statement.
+  void ToVM(vm::Builder & builder, const SymbolTable & symbols, VMSteps & steps) override {
+    for (size_t i = 0; i < NumChildren(); ++i) {
+      steps.Then([this, i, &builder, &symbols, &steps]() {
+        ChildToVM(i, builder, symbols, steps, [&builder, mark = builder.Mark()](vm::Reg) {
+          builder.Release(mark);
+        });
+      });
+    }
+  }
 };
 
 class ASTNode_Function : public ASTNode_Parent {
@@ -199,6 +573,7 @@ protected:
   size_t fun_id;
   std::vector<size_t> param_ids;    // The set of variables used as function parameters.
   std::vector<size_t> var_ids;      // The set of variables used inside the function. 
+  uint32_t entry_counter = 0;       // Profiling counter for calls (see --instrument).
 public:
   ASTNode_Function(
     const emplex::Token & name_token,
@@ -218,36 +593,109 @@ public:
     return symbols.At(fun_id).type.ReturnType();
   }
 
-  bool ToWAT(Control & control) override {
-    assert(NumChildren() == 1);
+  void Optimize(ConstantTable & constants, FoldSteps & steps) override {
+    // Local variables always start at zero; parameters are unknown.
+    for (size_t var_id : var_ids) {
+      constants.Set(var_id, Constant::Zero(constants.symbols.GetType(var_id)));
+    }
+    OptimizeChildren(constants, steps);
+  }
 
-    std::string param_declare;
-    for (size_t id : param_ids) {
-      std::string type = control.WATType(id);
-      param_declare += ToString(" (param $var", id, " ", type, ")");
+  void InitializeWAT(Control & control) override {
+    if (control.profile.Enabled()) {
+      entry_counter = control.profile.Add(profile::Kind::FUNCTION, control.symbols.At(fun_id).name, file_pos);
     }
+  }
+
+  bool ToWAT(Control & control) override {
+    assert(NumChildren() == 1);
 
     auto fun_name = control.symbols.At(fun_id).name;
     auto fun_type = control.symbols.At(fun_id).type;
 
-    std::string wat_return = fun_type.ReturnType().ToWAT();
-    control.Code("(func $", fun_name, param_declare, " (result ", wat_return, ")");
+    const uint32_t outer_pos = control.SetPosition(file_pos);
+    control.StartFunction(fun_name, Control::ToValType(fun_type.ReturnType()));
+    const size_t wat_fun_id = control.functions.size() - 1;
+    control.WATDeclareParams(param_ids);
     control.Indent(2);
-    control.WATDeclareSymbols(var_ids);
-    control.FinalNode(true);     // Since there is only one node in this function, in must be the final one.
-    ChildToWAT(0, control, false);
-    control.Indent(-2);
-    control.Code(")").Comment("END '", fun_name, "' function definition.")
-           .Code("")  // Skip a line.
-           .Code("(export \"", fun_name, "\" (func $", fun_name, "))")
-           .Code("");  // Skip a line.
+    // Instrumented code is generated straight from the AST, where loops and branches are.
+    if (control.pipeline.Has(passes::ID::SSA) && !control.profile.Enabled()) ToWAT_SSA(control);
+    else {
+      control.WATDeclareSymbols(var_ids);
+      if (control.profile.Enabled()) {
+        control.CountProfile(entry_counter).Comment("Count calls to '", fun_name, "'.");
+      }
+      control.FinalNode(true);     // Since there is only one node in this function, in must be the final one.
+      ChildToWAT(0, control, false);
+    }
+    control.Then([fun_name, wat_fun_id, outer_pos](Control & control) {
+      control.Indent(-2);
+      control.Code(Op::END).Comment("END '", fun_name, "' function definition.")
+             .Blank()  // Skip a line.
+             .Export(wat_fun_id)
+             .Blank();  // Skip a line.
+      control.RestorePosition(outer_pos);
+    });
 
     return false;
   }
+
+  // Lower this function into SSA form and check the result.
+  ssa::Function BuildSSA(const SymbolTable & symbols) {
+    auto ValTypeOf = [&symbols](size_t var_id) { return Control::ToValType(symbols.GetType(var_id)); };
+    ssa::Builder builder(Control::ToValType(ReturnType(symbols)));
+    for (size_t i = 0; i < param_ids.size(); ++i) {
+      builder.Param(param_ids[i], ValTypeOf(param_ids[i]), static_cast<uint32_t>(i));
+    }
+    for (size_t var_id : var_ids) builder.DeclareVar(var_id, ValTypeOf(var_id));
+    SSASteps steps;
+    steps.Run([this, &builder, &symbols, &steps]() { GetChild(0).ToSSA(builder, symbols, steps); });
+
+    ssa::Function fun = builder.Finish();
+    if (const std::string problem = ssa::Verify(fun); problem.size()) {
+      Error(file_pos, "Internal error: invalid SSA form: ", problem);
+    }
+    return fun;
+  }
+
+  // Generate the body by way of SSA form, rebuilding structured code from it.
+  void ToWAT_SSA(Control & control) {
+    ssa::Emit(BuildSSA(control.symbols), control, control.ssa_stats);
+  }
+
+  // Lower this function into bytecode for the VM, either straight from the AST or by way
+  // of SSA form (to run the code that --ssa generates).
+  vm::Function ToVM(const SymbolTable & symbols, bool via_ssa=false) {
+    assert(NumChildren() == 1);
+    vm::Builder builder(symbols.At(fun_id).name, VMKind(ReturnType(symbols)));
+    for (size_t var_id : param_ids) builder.Param(var_id, VMKind(symbols.GetType(var_id)));
+    if (via_ssa) {
+      ssa::ToVM(BuildSSA(symbols), builder);
+      return builder.Finish();
+    }
+    for (size_t var_id : var_ids) builder.DeclareVar(var_id);
+
+    VMSteps steps;
+    WalkTree<const ASTNode>(*this, [](const ASTNode &) { return true; }, [&steps](const ASTNode & node) {
+      bool assigning = node.AssignedVar() != SymbolTable::NO_ID;
+      for (const ptr_t & child : node.Children()) assigning = assigning || steps.assigning.count(child.get());
+      if (assigning) steps.assigning.insert(&node);
+    });
+    steps.Run([this, &builder, &symbols, &steps]() { GetChild(0).ToVM(builder, symbols, steps); });
+    return builder.Finish();
+  }
+
+  static vm::Kind VMKind(const Type & type) {
+    if (type.IsDouble()) return vm::Kind::DOUBLE;
+    return type.IsChar() ? vm::Kind::CHAR : vm::Kind::INT;
+  }
 };
 
 
 class ASTNode_If : public ASTNode_Parent {
+private:
+  uint32_t then_counter = 0;   // Profiling counters for each branch taken (see --instrument);
+  uint32_t else_counter = 0;   // without an else, counts the times the test fails.
 public:
   ASTNode_If(FilePos file_pos, ptr_t && test, ptr_t && action)
     : ASTNode_Parent(file_pos, test, action) { }
@@ -271,7 +719,7 @@ public:
     return GetChild(1).ReturnType(symbols);
   }
 
-  void TypeCheck(const SymbolTable & symbols) override {
+  void PreTypeCheck(const SymbolTable & symbols) override {
     if (NumChildren() < 2 || NumChildren() > 3) {
       Error(file_pos, "Internal error: Expected 2 or 3 children in if node, found ", NumChildren());
     }
@@ -279,38 +727,138 @@ public:
       Error(file_pos, "Condition for if-statement must evaluate to type int, not ",
             GetChild(0).ReturnType(symbols).Name());
     }
-    TypeCheckChildren(symbols);
+  }
+
+  void Optimize(ConstantTable & constants, FoldSteps & steps) override {
+    OptimizeChild(0, constants, steps);
+    steps.Then([this, &constants, &steps]() {
+      // If the condition is known, only one branch can ever run.
+      if (auto test = GetChild(0).GetConstant()) {
+        const size_t branch = test->IsTrue() ? 1 : 2;
+        if (branch >= NumChildren()) { steps.Return(std::make_unique<ASTNode_Block>(file_pos)); return; }
+        OptimizeChild(branch, constants, steps);
+        steps.Then([this, branch, &steps]() { steps.Return(TakeChild(branch)); });
+        return;
+      }
+
+      auto else_constants = std::make_shared<ConstantTable>(constants);
+      OptimizeChild(1, constants, steps);
+      if (NumChildren() == 3) OptimizeChild(2, *else_constants, steps);
+      steps.Then([&constants, else_constants]() { constants.Merge(*else_constants); });
+    });
+  }
+
+  void NumberValues(ValueNumbering & table, NumberSteps & steps) override {
+    table.Visit(ChildPtr(0), steps, [&table](size_t) { ++table.conditional; });
+    for (size_t id = 1; id < NumChildren(); ++id) table.Visit(ChildPtr(id), steps, [](size_t) { });
+    steps.Then([&table]() { --table.conditional; });
+  }
+
+  void InitializeWAT(Control & control) override {
+    if (control.profile.Enabled()) {
+      then_counter = control.profile.Add(profile::Kind::THEN, GetChild(1).GetFirstPos());
+      if (NumChildren() == 3) else_counter = control.profile.Add(profile::Kind::ELSE, GetChild(2).GetFirstPos());
+      else else_counter = control.profile.Add(profile::Kind::NOT_TAKEN, file_pos);
+    }
   }
 
   bool ToWAT(Control & control) override {
     control.CommentLine("Test condition for if.");
     ChildToWAT(0, control, true);
-    std::string result_str;
-    if (control.FinalNode()) {
-      std::string type = ReturnType(control.symbols).ToWAT();
-      result_str = ToString("(result ", type, ")");
-    }
-    control.Code("(if ", result_str, "").Comment("Execute code based on result of condition.")
-           .Indent(2)
-           .Code("(then").Comment("'then' block")
-           .Indent(2);
+    control.Then([this](Control & control) {
+      ValType result_type = ValType::NONE;
+      if (control.FinalNode()) {
+        result_type = Control::ToValType(ReturnType(control.symbols));
+      }
+      control.Code(Op::IF, Instr::NO_ARG, result_type).Comment("Execute code based on result of condition.")
+             .Indent(2)
+             .Code(Op::THEN).Comment("'then' block")
+             .Indent(2);
+      if (control.profile.Enabled()) control.CountProfile(then_counter).Comment("Count 'then' taken.");
+    });
     ChildToWAT(1, control, false);
-    control.Indent(-2);
-    control.Code(")").Comment("End 'then'");
+    control.Then([](Control & control) {
+      control.Indent(-2);
+      control.Code(Op::END).Comment("End 'then'");
+    });
     if (NumChildren() == 3) {
-      control.Code("(else").Comment("'else' block");
-      control.Indent(2);
+      control.Then([this](Control & control) {
+        control.Code(Op::ELSE).Comment("'else' block");
+        control.Indent(2);
+        if (control.profile.Enabled()) control.CountProfile(else_counter).Comment("Count 'else' taken.");
+      });
       ChildToWAT(2, control, false);
-      control.Indent(-2);
-      control.Code(")").Comment("End 'else'");
+      control.Then([](Control & control) {
+        control.Indent(-2);
+        control.Code(Op::END).Comment("End 'else'");
+      });
+    }
+    else if (control.profile.Enabled()) {   // Count the times the test fails, too.
+      control.Then([this](Control & control) {
+        control.Code(Op::ELSE).Comment("Implicit 'else' block")
+               .Indent(2)
+               .CountProfile(else_counter).Comment("Count 'if' not taken.")
+               .Indent(-2)
+               .Code(Op::END).Comment("End 'else'");
+      });
     }
-    control.Indent(-2);
-    control.Code(")").Comment("End 'if'");
+    control.Then([](Control & control) {
+      control.Indent(-2);
+      control.Code(Op::END).Comment("End 'if'");
+    });
     return false;
   }
+
+  void ToSSA(ssa::Builder & builder, const SymbolTable & symbols, SSASteps & steps) override {
+    ChildToSSA(0, builder, symbols, steps, [this, &builder, &symbols, &steps](ssa::ValueID test) {
+      const ssa::BlockID then_block = builder.NewBlock();
+      const ssa::BlockID end_block = builder.NewBlock();
+      const ssa::BlockID else_block = (NumChildren() == 3) ? builder.NewBlock() : end_block;
+      builder.Branch(test, then_block, else_block);
+      builder.Seal(then_block);
+      builder.SetBlock(then_block);
+      ChildToSSA(1, builder, symbols, steps, [&builder, end_block](ssa::ValueID) { builder.Jump(end_block); });
+      if (NumChildren() == 3) {
+        steps.Then([&builder, else_block]() {
+          builder.Seal(else_block);
+          builder.SetBlock(else_block);
+        });
+        ChildToSSA(2, builder, symbols, steps, [&builder, end_block](ssa::ValueID) { builder.Jump(end_block); });
+      }
+      steps.Then([&builder, end_block]() {
+        builder.Seal(end_block);
+        builder.SetBlock(end_block);
+      });
+    });
+  }
+
+  void ToVM(vm::Builder & builder, const SymbolTable & symbols, VMSteps & steps) override {
+    const vm::Label else_label = builder.NewLabel();
+    ChildToVM(0, builder, symbols, steps, [&builder, else_label](vm::Reg test) {
+      builder.JumpIfNot(test, else_label);
+    });
+    ChildToVM(1, builder, symbols, steps, [](vm::Reg) { });
+    if (NumChildren() == 3) {
+      const vm::Label end_label = builder.NewLabel();
+      steps.Then([&builder, else_label, end_label]() {
+        builder.Jump(end_label);
+        builder.Place(else_label);
+      });
+      ChildToVM(2, builder, symbols, steps, [&builder, end_label](vm::Reg) { builder.Place(end_label); });
+    }
+    else steps.Then([&builder, else_label]() { builder.Place(else_label); });
+  }
 };
 
 class ASTNode_While : public ASTNode_Parent {
+private:
+  uint32_t loop_counter = 0;   // Profiling counter for iterations (see --instrument).
+  std::vector<ptr_t> setup{};  // Hoisted code to run before the loop (see HoistLoops).
+
+  void CountIteration(Control & control) const {
+    if (control.profile.Enabled()) control.CountProfile(loop_counter).Comment("Count an iteration.");
+  }
+
 public:
   ASTNode_While(FilePos file_pos, ptr_t && test, ptr_t && action)
     : ASTNode_Parent(file_pos, test, action) { }
@@ -332,49 +880,239 @@ public:
     if (NumChildren() != 2) {
       Error(file_pos, "Internal error: Expected 2 in while node, found ", NumChildren());
     }
-    TypeCheckChildren(symbols);
     if (!GetChild(0).ReturnType(symbols).IsInt()) {
       Error(GetChild(0).GetFilePos(), "Condition for while-statement must evaluate to type int, not ",
             GetChild(0).ReturnType(symbols).Name());
     }
   }
 
+  void Optimize(ConstantTable & constants, FoldSteps & steps) override {
+    // Anything changed in the loop is unknown at the start of each iteration and afterward.
+    std::set<size_t> var_ids;
+    FindAssigned(var_ids);
+    constants.Forget(var_ids);
+
+    auto loop_constants = std::make_shared<ConstantTable>(constants);
+    OptimizeChild(0, *loop_constants, steps);
+    steps.Then([this, loop_constants, &steps]() {
+      if (auto test = GetChild(0).GetConstant(); test && !test->IsTrue()) {
+        steps.Return(std::make_unique<ASTNode_Block>(file_pos));  // Loop never runs.
+        return;
+      }
+      OptimizeChild(1, *loop_constants, steps);
+      steps.Keep(loop_constants);
+    });
+  }
+
+  // Jumps inside a nested loop belong to that loop.
+  bool FindLoopJumps(bool &, bool &) const override { return false; }
+
+  // Values from before the loop can be used inside it unless the loop changes them.
+  void NumberValues(ValueNumbering & outer, NumberSteps & steps) override {
+    std::set<size_t> var_ids;
+    FindAssigned(var_ids);
+    outer.Assigned(var_ids);
+    auto table = std::make_shared<ValueNumbering>(outer);
+    table->conditional = 0;
+    ASTNode_Parent::NumberValues(*table, steps);
+    steps.Keep(table);
+  }
+
+  // Compute expressions that cannot change during the loop once, beforehand.  Only
+  // expressions with no effects and no traps qualify, so running them even when the loop
+  // does not (or leaves early through break) changes nothing.  Nested loops are handled
+  // after this one.
+  void HoistLoops(SymbolTable & symbols, std::vector<size_t> & new_vars) override {
+    LoopInvariants loop{symbols, new_vars};
+    FindAssigned(loop.assigned);
+    loop.Find(*this);
+    setup = std::move(loop.setup);
+  }
+  std::vector<ptr_t> TakeLoopSetup() override { return std::exchange(setup, {}); }
+
+  void InitializeWAT(Control & control) override {
+    if (control.profile.Enabled()) loop_counter = control.profile.Add(profile::Kind::LOOP, file_pos);
+  }
+
   bool ToWAT(Control & control) override {
     assert(NumChildren() == 2);
     // A while loop may go around again, so we cannot treat any node inside of it as final.
     // (In practice, though programs functions should end with a while anyway)
     control.FinalNode(false);
-    std::string while_exit = control.MakeLabel("$exit");
-    std::string while_loop = control.MakeLabel("$loop");
+    bool has_break = false, has_continue = false;
+    WalkTree(std::as_const(GetChild(1)),
+             [&](const ASTNode & node){ return node.FindLoopJumps(has_break, has_continue); });
+
+    // A condition that is always true never needs to be tested (and constant false
+    // loops were already removed).
+    const auto test = GetChild(0).GetConstant();
+    const bool forever = test && test->IsTrue();
+    const bool rotate = control.pipeline.Has(passes::ID::ROTATE);
+
+    uint32_t while_exit = control.MakeLabel("$exit");
+    uint32_t while_loop = control.MakeLabel("$loop");
+    // Once the test moves to the bottom, continue must skip only the rest of the body.
+    uint32_t while_next = (has_continue && !forever && rotate) ? control.MakeLabel("$next") : while_loop;
 
     // Store labels in case of break or continue.
     control.PushBreakLabel(while_exit);
-    control.PushLoopLabel(while_loop);
-    
-    control.Code("(block ", while_exit, "").Comment("Outer block for breaking while loop.")
-           .Code("  (loop ", while_loop, "").Comment("Inner loop for continuing while.");
-    control.Indent(4);
-    control.CommentLine("WHILE Test condition...");
+    control.PushLoopLabel(while_next);
 
-    ChildToWAT(0, control, true);
+    if (forever) {
+      // A bare loop; only break (or return) can leave it.
+      if (has_break) {
+        control.Code(Op::BLOCK, while_exit).Comment("Outer block for breaking while loop.")
+               .Indent(2);
+      }
+      control.Code(Op::LOOP, while_loop).Comment("Loop forever (no test needed).")
+             .Indent(2)
+             .CommentLine("WHILE Loop body...");
+      CountIteration(control);
+      ChildToWAT(1, control, false);
+      control.Then([while_loop, has_break](Control & control) {
+        control.CommentLine("WHILE start next loop.")
+               .Code(Op::BR, while_loop).Comment("Jump back to the start of the loop")
+               .Indent(-2)
+               .Code(Op::END).Comment("End loop");
+        if (has_break) control.Indent(-2).Code(Op::END).Comment("End block");
+      });
+    }
+    else if (!rotate) {
+      // Test at the top of every iteration (smaller, since the test appears only once).
+      control.Code(Op::BLOCK, while_exit).Comment("Outer block for breaking while loop.")
+             .Indent(2)
+             .Code(Op::LOOP, while_loop).Comment("Inner loop for continuing while.")
+             .Indent(2)
+             .CommentLine("WHILE Test condition...");
+      ChildToWAT(0, control, true);
+      control.Then([this, while_exit](Control & control) {
+        control.Code(Op::I32_EQZ).Comment("Invert the result of the test condition.")
+               .Code(Op::BR_IF, while_exit).Comment("If condition is false (0), exit the loop")
+               .CommentLine("WHILE Loop body...");
+        CountIteration(control);
+      });
+      ChildToWAT(1, control, false);
+      control.Then([while_loop](Control & control) {
+        control.CommentLine("WHILE start next loop.")
+               .Code(Op::BR, while_loop).Comment("Jump back to the start of the loop")
+               .Indent(-2)
+               .Code(Op::END).Comment("End loop")
+               .Indent(-2)
+               .Code(Op::END).Comment("End block");
+      });
+    }
+    else {
+      // Rotate into a guarded do-while: test once before entering the loop, then again at
+      // the bottom, so each iteration ends in a single conditional branch back to the top.
+      control.Code(Op::BLOCK, while_exit).Comment("Outer block for breaking while loop.")
+             .Indent(2)
+             .CommentLine("WHILE Test condition...");
+      ChildToWAT(0, control, true);
+      control.Then([this, while_exit, while_loop, while_next, has_continue](Control & control) {
+        control.Code(Op::I32_EQZ).Comment("Invert the result of the test condition.")
+               .Code(Op::BR_IF, while_exit).Comment("If condition is false (0), skip the loop")
+               .Code(Op::LOOP, while_loop).Comment("Inner loop for repeating while.")
+               .Indent(2);
+        if (has_continue) {
+          control.Code(Op::BLOCK, while_next).Comment("Block to skip to the next test on continue.")
+                 .Indent(2);
+        }
+        control.CommentLine("WHILE Loop body...");
+        CountIteration(control);
+      });
+      ChildToWAT(1, control, false);
+      control.Then([has_continue](Control & control) {
+        if (has_continue) control.Indent(-2).Code(Op::END).Comment("End of loop body");
+        control.CommentLine("WHILE Test condition to start next loop.");
+      });
+      ChildToWAT(0, control, true);
+      control.Then([while_loop](Control & control) {
+        control.Code(Op::BR_IF, while_loop).Comment("If condition is true, go around again")
+               .Indent(-2)
+               .Code(Op::END).Comment("End loop")
+               .Indent(-2)
+               .Code(Op::END).Comment("End block");
+      });
+    }
 
-    control.Code("(i32.eqz)").Comment("Invert the result of the test condition.")
-           .Code("(br_if ", while_exit, ")").Comment("If condition is false (0), exit the loop")
-           .CommentLine("WHILE Loop body...");
+    // Remove labels for break and continue;
+    control.Then([](Control & control) {
+      control.PopBreakLabel();
+      control.PopLoopLabel();
+    });
 
-    ChildToWAT(1, control, false);
+    return false;
+  }
 
-    control.CommentLine("WHILE start next loop.")
-           .Code("(br ", while_loop, ")").Comment("Jump back to the start of the loop");
-    control.Indent(-4);
-    control.Code("  )").Comment("End loop")
-           .Code(")").Comment("End block");
+  // As with ToWAT, the test runs once before the loop and again at the bottom of each
+  // iteration (where continue goes), unless it is always true.
+  void ToSSA(ssa::Builder & builder, const SymbolTable & symbols, SSASteps & steps) override {
+    const auto test = GetChild(0).GetConstant();
+    const bool forever = test && test->IsTrue();
 
-    // Remove labels for break and continue;
-    control.PopBreakLabel();
-    control.PopLoopLabel();
+    const ssa::BlockID body_block = builder.NewBlock();
+    const ssa::BlockID exit_block = builder.NewBlock();
+    const ssa::BlockID next_block = forever ? body_block : builder.NewBlock();
+    if (forever) builder.Jump(body_block);
+    else {
+      ChildToSSA(0, builder, symbols, steps, [&builder, body_block, exit_block](ssa::ValueID first_test) {
+        builder.Branch(first_test, body_block, exit_block);
+      });
+    }
 
-    return false;
+    steps.Then([&builder, body_block, exit_block, next_block]() {
+      builder.PushLoop(exit_block, next_block);
+      builder.SetBlock(body_block);
+    });
+    ChildToSSA(1, builder, symbols, steps, [&builder, next_block](ssa::ValueID) { builder.Jump(next_block); });
+    if (!forever) {
+      steps.Then([&builder, next_block]() {
+        builder.Seal(next_block);
+        builder.SetBlock(next_block);
+      });
+      ChildToSSA(0, builder, symbols, steps, [&builder, body_block, exit_block](ssa::ValueID next_test) {
+        builder.Branch(next_test, body_block, exit_block);
+      });
+    }
+    steps.Then([&builder, body_block, exit_block]() {
+      builder.PopLoop();
+      builder.Seal(body_block);
+      builder.Seal(exit_block);
+      builder.SetBlock(exit_block);
+    });
+  }
+
+  // The same layout again, so that each iteration takes a single jump.
+  void ToVM(vm::Builder & builder, const SymbolTable & symbols, VMSteps & steps) override {
+    const auto test = GetChild(0).GetConstant();
+    const bool forever = test && test->IsTrue();
+
+    const vm::Label body_label = builder.NewLabel();
+    const vm::Label exit_label = builder.NewLabel();
+    const vm::Label next_label = forever ? body_label : builder.NewLabel();
+    if (!forever) {
+      ChildToVM(0, builder, symbols, steps, [&builder, exit_label](vm::Reg test) {
+        builder.JumpIfNot(test, exit_label);
+      });
+    }
+
+    steps.Then([&builder, body_label, exit_label, next_label]() {
+      builder.PushLoop(exit_label, next_label);
+      builder.Place(body_label);
+    });
+    ChildToVM(1, builder, symbols, steps, [&builder, forever, body_label, next_label](vm::Reg) {
+      if (forever) builder.Jump(body_label);
+      else builder.Place(next_label);
+    });
+    if (!forever) {
+      ChildToVM(0, builder, symbols, steps, [&builder, body_label](vm::Reg test) {
+        builder.JumpIf(test, body_label);
+      });
+    }
+    steps.Then([&builder, exit_label]() {
+      builder.PopLoop();
+      builder.Place(exit_label);
+    });
   }
 };
 
@@ -392,11 +1130,10 @@ public:
     return GetChild(0).ReturnType(symbols);
   }
 
-  void TypeCheck(const SymbolTable & symbols) override {
+  void TypeCheck(const SymbolTable &) override {
     if (NumChildren() != 1) {
       Error(file_pos, "Internal error: Expected one arg in return node, found ", NumChildren());
     }
-    TypeCheckChildren(symbols);
     // @CAO - SHOULD CHECK RETURN TYPE.
   }
 
@@ -404,37 +1141,69 @@ public:
     // Simply leave the return value on the stack.
     ChildToWAT(0, control, true);
     // If this is not a final node, we should set up a break.
-    if (!control.FinalNode()) {
-      control.Code("(return)").Comment("Halt and return value.");
-    }
+    control.Then([](Control & control) {
+      if (!control.FinalNode()) {
+        control.Code(Op::RETURN).Comment("Halt and return value.");
+      }
+    });
     return false;
   }
+
+  void ToSSA(ssa::Builder & builder, const SymbolTable & symbols, SSASteps & steps) override {
+    ChildToSSA(0, builder, symbols, steps, [&builder](ssa::ValueID value) { builder.Return(value); });
+  }
+
+  void ToVM(vm::Builder & builder, const SymbolTable & symbols, VMSteps & steps) override {
+    ChildToVM(0, builder, symbols, steps, [&builder](vm::Reg value) {
+      builder.Emit(vm::Code::RETURN, value);
+    });
+  }
 };
 
 class ASTNode_Break : public ASTNode {
 public:
   ASTNode_Break(FilePos file_pos) : ASTNode(file_pos) { }
   std::string GetTypeName() const override { return "BREAK"; }
+  bool FindLoopJumps(bool & has_break, bool &) const override { has_break = true; return true; }
 
   bool ToWAT(Control & control) override {
     if (!control.HasLoopLabel()) Error(file_pos, "No loop for `break` to exit.");
-    std::string loop_exit = control.GetBreakLabel();
-    control.Code("(br ", loop_exit, ")").Comment("'break' command.");
+    uint32_t loop_exit = control.GetBreakLabel();
+    control.Code(Op::BR, loop_exit).Comment("'break' command.");
     return false;
   }
+
+  void ToSSA(ssa::Builder & builder, const SymbolTable &, SSASteps &) override {
+    builder.Jump(builder.BreakTarget());
+  }
+
+  void ToVM(vm::Builder & builder, const SymbolTable &, VMSteps &) override {
+    if (!builder.InLoop()) Error(file_pos, "No loop for `break` to exit.");
+    builder.Jump(builder.BreakTarget());
+  }
 };
 
 class ASTNode_Continue : public ASTNode {
 public:
   ASTNode_Continue(FilePos file_pos) : ASTNode(file_pos) { }
   std::string GetTypeName() const override { return "CONTINUE"; }
+  bool FindLoopJumps(bool &, bool & has_continue) const override { has_continue = true; return true; }
 
   bool ToWAT(Control & control) override {
     if (!control.HasLoopLabel()) Error(file_pos, "No loop for `continue` to operate on.");
-    std::string loop_label = control.GetLoopLabel();
-    control.Code("(br ", loop_label, ")").Comment("'continue' command.");
+    uint32_t loop_label = control.GetLoopLabel();
+    control.Code(Op::BR, loop_label).Comment("'continue' command.");
     return false;
   }
+
+  void ToSSA(ssa::Builder & builder, const SymbolTable &, SSASteps &) override {
+    builder.Jump(builder.ContinueTarget());
+  }
+
+  void ToVM(vm::Builder & builder, const SymbolTable &, VMSteps &) override {
+    if (!builder.InLoop()) Error(file_pos, "No loop for `continue` to operate on.");
+    builder.Jump(builder.ContinueTarget());
+  }
 };
 
 class ASTNode_ToDouble : public ASTNode_Parent {
@@ -447,21 +1216,49 @@ public:
     if (NumChildren() != 1) {
       Error(file_pos, "Internal error: Expected child in ToDouble node, found ", NumChildren());
     }
-    TypeCheckChildren(symbols);
     const Type & child_type = GetChild(0).ReturnType(symbols);
     if (!child_type.CastToOK(Type("double"))) {
       Error(file_pos, "Cannot convert type ", child_type.Name(), " to double.");
     }
   }
 
+  void Optimize(ConstantTable & constants, FoldSteps & steps) override {
+    OptimizeChildren(constants, steps);
+    steps.Then([this, &steps]() {
+      if (auto value = GetChild(0).GetConstant()) steps.Return(MakeLiteral(file_pos, fold::ToDouble(*value)));
+    });
+  }
+
+  bool HasOwnEffect() const override { return false; }  // Conversion can't trap.
+  bool CanHoist() const override { return true; }
+  bool IsValueOp() const override { return true; }
+
   bool ToWAT(Control & control) override {
     assert(NumChildren() == 1);
     ChildToWAT(0, control, true);
-    if (!GetChild(0).ReturnType(control.symbols).IsDouble()) {
-      control.Code("(f64.convert_i32_s)").Comment("Convert to double.");
-    }
+    control.Then([this](Control & control) {
+      if (!GetChild(0).ReturnType(control.symbols).IsDouble()) {
+        control.Code(Op::F64_CONVERT_I32_S).Comment("Convert to double.");
+      }
+    });
     return true;
   }
+
+  void ToSSA(ssa::Builder & builder, const SymbolTable & symbols, SSASteps & steps) override {
+    ChildToSSA(0, builder, symbols, steps, [this, &builder, &symbols, &steps](ssa::ValueID value) {
+      if (GetChild(0).ReturnType(symbols).IsDouble()) steps.Return(value);
+      else steps.Return(builder.Unary(Op::F64_CONVERT_I32_S, value));
+    });
+  }
+
+  void ToVM(vm::Builder & builder, const SymbolTable & symbols, VMSteps & steps) override {
+    ChildToVM(0, builder, symbols, steps, [this, &builder, &symbols, &steps](vm::Reg value) {
+      if (GetChild(0).ReturnType(symbols).IsDouble()) { steps.Return(value); return; }
+      const vm::Reg result = builder.Temp();
+      builder.Emit(vm::Code::I_TO_D, result, value);
+      steps.Return(result);
+    });
+  }
 };
 
 class ASTNode_ToInt : public ASTNode_Parent {
@@ -474,36 +1271,64 @@ public:
     if (NumChildren() != 1) {
       Error(file_pos, "Internal error: Expected child in ToInt node, found ", NumChildren());
     }
-    TypeCheckChildren(symbols);
     const Type & child_type = GetChild(0).ReturnType(symbols);
     if (!child_type.CastToOK(Type("int"))) {
       Error(file_pos, "Cannot convert type ", child_type.Name(), " to int.");
     }
   }
 
+  void Optimize(ConstantTable & constants, FoldSteps & steps) override {
+    OptimizeChildren(constants, steps);
+    steps.Then([this, &steps]() {
+      auto value = GetChild(0).GetConstant();
+      if (!value) return;
+      if (auto result = fold::ToInt(*value)) steps.Return(MakeLiteral(file_pos, *result));
+    });
+  }
+
+  bool IsValueOp() const override { return true; }
+
   bool ToWAT(Control & control) override {
     assert(NumChildren() == 1);
     ChildToWAT(0, control, true);
-    if (GetChild(0).ReturnType(control.symbols).IsDouble()) {
-      control.Code("(i32.trunc_f64_s)").Comment("Convert to int.");
-    }
+    control.Then([this](Control & control) {
+      if (GetChild(0).ReturnType(control.symbols).IsDouble()) {
+        control.Code(Op::I32_TRUNC_F64_S).Comment("Convert to int.");
+      }
+    });
     return true;
   }
+
+  void ToSSA(ssa::Builder & builder, const SymbolTable & symbols, SSASteps & steps) override {
+    ChildToSSA(0, builder, symbols, steps, [this, &builder, &symbols, &steps](ssa::ValueID value) {
+      if (!GetChild(0).ReturnType(symbols).IsDouble()) steps.Return(value);
+      else steps.Return(builder.Unary(Op::I32_TRUNC_F64_S, value));
+    });
+  }
+
+  void ToVM(vm::Builder & builder, const SymbolTable & symbols, VMSteps & steps) override {
+    ChildToVM(0, builder, symbols, steps, [this, &builder, &symbols, &steps](vm::Reg value) {
+      if (!GetChild(0).ReturnType(symbols).IsDouble()) { steps.Return(value); return; }
+      const vm::Reg result = builder.Temp();
+      builder.Emit(vm::Code::D_TO_I, result, value);
+      steps.Return(result);
+    });
+  }
 };
 
 
-class ASTNode_Math1 : public ASTNode_Parent {
+class ASTNode_Math1 : public ASTNode_Operation {
 protected:
   std::string op;
 public:
   ASTNode_Math1(FilePos file_pos, std::string op, ptr_t && child)
-    : ASTNode_Parent(file_pos, child), op(op) { }
+    : ASTNode_Operation(file_pos, child), op(op) { }
   ASTNode_Math1(const emplex::Token & token, ptr_t && child)
     : ASTNode_Math1(token, token.lexeme, std::move(child)) { }
 
   std::string GetTypeName() const override { return std::string("MATH1: ") + op; }
 
-  Type ReturnType(const SymbolTable & symbols) const override {
+  Type FindReturnType(const SymbolTable & symbols) const override {
     if (op == "!") return Type("int");
     if (op == "sqrt") return Type("double");
 
@@ -515,7 +1340,6 @@ public:
     if (NumChildren() != 1) {
       Error(file_pos, "Internal error: Expected one child in Math1 node (", op, "), found ", NumChildren());
     }
-    TypeCheckChildren(symbols);
 
     const Type & child_type = GetChild(0).ReturnType(symbols);
     if (op == "-") {
@@ -534,40 +1358,78 @@ public:
     }
   }
 
+  void Optimize(ConstantTable & constants, FoldSteps & steps) override {
+    OptimizeChildren(constants, steps);
+    steps.Then([this, &steps]() {
+      auto value = GetChild(0).GetConstant();
+      if (!value) return;
+      if (auto result = fold::Math1(op, *value)) steps.Return(MakeLiteral(file_pos, *result));
+    });
+  }
+
+  bool HasOwnEffect() const override { return false; }
+  bool IsBoolean() const override { return op == "!"; }
+  bool CanHoist() const override { return true; }
+  bool IsValueOp() const override { return true; }
+
   bool ToWAT(Control & control) override {
     assert(NumChildren() == 1);
 
     if (op == "!") {
       ChildToWAT(0, control, true);
-      control.Code("i32.eqz").Comment("Boolean NOT.");
+      control.Then([](Control & control){ control.Code(Op::I32_EQZ).Comment("Boolean NOT."); });
     }
     else if (op == "-") {
-      std::string type = ReturnType(control.symbols).ToWAT();
-      control.Code("(", type, ".const 0)").Comment("Setup unary negation");
-      ChildToWAT(0, control, true);
-      control.Code("(", type, ".sub)").Comment("Unary negation.");
+      if (ReturnType(control.symbols).IsDouble()) {
+        ChildToWAT(0, control, true);
+        control.Then([](Control & control){ control.Code(Op::F64_NEG).Comment("Unary negation."); });
+      } else {  // WASM has no integer negation, so subtract from zero.
+        control.I32Const(0).Comment("Setup unary negation");
+        ChildToWAT(0, control, true);
+        control.Then([](Control & control){ control.Code(Op::I32_SUB).Comment("Unary negation."); });
+      }
     }
     else if (op == "sqrt") {
       ChildToWAT(0, control, true);
-      control.Code("(f64.sqrt)").Comment("Square Root");
+      control.Then([](Control & control){ control.Code(Op::F64_SQRT).Comment("Square Root"); });
     }
 
     return true;
   }
+
+  void ToSSA(ssa::Builder & builder, const SymbolTable & symbols, SSASteps & steps) override {
+    ChildToSSA(0, builder, symbols, steps, [this, &builder, &symbols, &steps](ssa::ValueID value) {
+      if (op == "!") steps.Return(builder.Unary(Op::I32_EQZ, value));
+      else if (op == "sqrt") steps.Return(builder.Unary(Op::F64_SQRT, value));
+      else if (ReturnType(symbols).IsDouble()) steps.Return(builder.Unary(Op::F64_NEG, value));
+      else steps.Return(builder.Binary(Op::I32_SUB, builder.I32(0), value));
+    });
+  }
+
+  void ToVM(vm::Builder & builder, const SymbolTable & symbols, VMSteps & steps) override {
+    ChildToVM(0, builder, symbols, steps, [this, &builder, &symbols, &steps](vm::Reg value) {
+      const vm::Reg result = builder.Temp();
+      if (op == "!") builder.Emit(vm::Code::EQZ_I, result, value);
+      else if (op == "sqrt") builder.Emit(vm::Code::SQRT_D, result, value);
+      else if (ReturnType(symbols).IsDouble()) builder.Emit(vm::Code::NEG_D, result, value);
+      else builder.Emit(vm::Code::NEG_I, result, value);
+      steps.Return(result);
+    });
+  }
 };
 
-class ASTNode_Math2 : public ASTNode_Parent {
+class ASTNode_Math2 : public ASTNode_Operation {
 protected:
   std::string op;
 public:
   ASTNode_Math2(FilePos file_pos, std::string op, ptr_t && child1, ptr_t && child2)
-    : ASTNode_Parent(file_pos, child1, child2), op(op) { }
+    : ASTNode_Operation(file_pos, child1, child2), op(op) { }
   ASTNode_Math2(const emplex::Token & token, ptr_t && child1, ptr_t && child2)
-    : ASTNode_Parent(token, std::move(child1), std::move(child2)), op(token.lexeme) { }
+    : ASTNode_Operation(token, std::move(child1), std::move(child2)), op(token.lexeme) { }
 
   std::string GetTypeName() const override { return std::string("MATH2: " + op); }
 
-  Type ReturnType(const SymbolTable & symbols) const override {
+  Type FindReturnType(const SymbolTable & symbols) const override {
     // Assignments use the type of the variable being assigned.
     if (op == "=") return GetChild(0).ReturnType(symbols);
 
@@ -595,9 +1457,6 @@ public:
       Error(file_pos, "Internal error: Expected two children in ToDouble node, found ", NumChildren());
     }
 
-    // Resolve types of children before checking this node.
-    TypeCheckChildren(symbols);
-
     const Type & type0 = GetChild(0).ReturnType(symbols);
     const Type & type1 = GetChild(1).ReturnType(symbols);
 
@@ -681,56 +1540,205 @@ public:
     }
   }
 
+  void Optimize(ConstantTable & constants, FoldSteps & steps) override {
+    if (op == "=") {
+      OptimizeChild(1, constants, steps);
+      steps.Then([this, &constants]() {
+        const size_t var_id = GetChild(0).AssignID();
+        if (auto value = GetChild(1).GetConstant()) constants.Set(var_id, *value);
+        else constants.Forget(var_id);
+      });
+      return;
+    }
+
+    OptimizeChild(0, constants, steps);
+    if (op == "&&" || op == "||") {
+      // The right-hand side only runs if the left-hand side does not decide the result.
+      steps.Then([this, &constants, &steps]() {
+        auto rhs_constants = std::make_shared<ConstantTable>(constants);
+        OptimizeChild(1, *rhs_constants, steps);
+        steps.Then([this, &constants, &steps, rhs_constants]() {
+          steps.Return(OptimizeLogic(constants, *rhs_constants));
+        });
+      });
+      return;
+    }
+
+    OptimizeChild(1, constants, steps);
+    steps.Then([this, &steps]() {
+      auto lhs = GetChild(0).GetConstant();
+      auto rhs = GetChild(1).GetConstant();
+      if (!lhs || !rhs) return;
+      if (auto result = fold::Math2(op, *lhs, *rhs)) steps.Return(MakeLiteral(file_pos, *result));
+    });
+  }
+
+  // Simplify && or || once both sides are optimized (the right with its own table).
+  ptr_t OptimizeLogic(ConstantTable & constants, const ConstantTable & rhs_constants) {
+    auto lhs = GetChild(0).GetConstant();
+    if (!lhs) {
+      std::set<size_t> var_ids;
+      GetChild(1).FindAssigned(var_ids);
+      constants.Forget(var_ids);
+      return nullptr;
+    }
+    if (lhs->IsTrue() == (op == "||")) return MakeLiteral(file_pos, Constant::Int(op == "||"));
+    constants.Restore(rhs_constants);
+    if (auto rhs = GetChild(1).GetConstant()) return MakeLiteral(file_pos, Constant::Int(rhs->IsTrue()));
+    // Result is whether the right-hand side is non-zero.
+    return std::make_unique<ASTNode_Math2>(file_pos, "!=", TakeChild(1), MakeLiteral(file_pos, Constant::Int(0)));
+  }
+
+  size_t AssignedVar() const override { return (op == "=") ? GetChild(0).AssignID() : SymbolTable::NO_ID; }
+
+  bool CanHoist() const override {
+    if (op == "=") return false;
+    if (op == "/" || op == "%") {
+      // Integer division traps on a zero divisor (or INT_MIN / -1); only trust constants.
+      auto rhs = GetChild(1).GetConstant();
+      if (!rhs) return false;
+      if (!rhs->IsDouble() && (rhs->i == 0 || (op == "/" && rhs->i == -1))) return false;
+    }
+    return true;
+  }
+
+  bool HasOwnEffect() const override { return !CanHoist(); }
+
+  bool IsBoolean() const override {
+    // An assignment's value is whatever was assigned (at the end of any chain a = b = ...).
+    const ASTNode_Math2 * node = this;
+    while (node->op == "=") {
+      const ASTNode & value = node->GetChild(1);
+      node = dynamic_cast<const ASTNode_Math2 *>(&value);
+      if (!node) return value.IsBoolean();
+    }
+    const std::string & op = node->op;
+    return op == "<" || op == "<=" || op == ">" || op == ">=" || op == "==" || op == "!=" ||
+           op == "&&" || op == "||";
+  }
+
+  // Division may trap, but if an earlier copy did not, a repeat will not either.
+  bool IsValueOp() const override { return op != "="; }
+
+  void NumberValues(ValueNumbering & table, NumberSteps & steps) override {
+    if (op == "=") {
+      table.Visit(ChildPtr(1), steps, [this, &table](size_t) { table.Assigned(GetChild(0).AssignID()); });
+      return;
+    }
+    if (op == "&&" || op == "||") {
+      // The right-hand side only runs sometimes.
+      table.Visit(ChildPtr(0), steps, [this, &table, &steps](size_t lhs) {
+        ++table.conditional;
+        table.Visit(ChildPtr(1), steps, [this, &table, &steps, lhs](size_t rhs) {
+          --table.conditional;
+          if (lhs && rhs) steps.Return(table.Number(ValueKey({lhs, rhs})));
+        });
+      });
+      return;
+    }
+    ASTNode_Parent::NumberValues(table, steps);
+  }
+
+  std::string ValueKey(const std::vector<size_t> & args) const override {
+    // Operand order does not matter for these (including for doubles).
+    if ((op == "+" || op == "*" || op == "==" || op == "!=") && args[0] > args[1]) {
+      return ASTNode_Parent::ValueKey({args[1], args[0]});
+    }
+    return ASTNode_Parent::ValueKey(args);
+  }
+
+  // Put a child's value on the stack as exactly 0 or 1.
+  void ChildToBoolean(size_t id, Control & control) {
+    ChildToWAT(id, control, true);
+    control.Then([this, id](Control & control) {
+      if (GetChild(id).IsBoolean()) return;
+      control.I32Const(0).Comment("Put a zero on the stack for comparison)")
+             .Code(Op::I32_NE).Comment("Set any non-zero value to one.)");
+    });
+  }
+
+  // When the right-hand side of && or || is cheap to always run (no effects and no traps),
+  // combine both sides with bitwise logic rather than branching around the right side.
+  void ToWAT_Bitwise(Control & control) {
+    control.CommentLine("Setup the ", op, " operation (without branches)");
+    if (op == "&&") {
+      ChildToBoolean(0, control);
+      ChildToBoolean(1, control);
+      control.Then([](Control & control){ control.Code(Op::I32_AND).Comment("Both sides must be true."); });
+    } else {
+      // (a | b) is non-zero exactly when either side is, so normalize only once.
+      ChildToWAT(0, control, true);
+      ChildToWAT(1, control, true);
+      control.Then([this](Control & control) {
+        control.Code(Op::I32_OR).Comment("Either side may be true.");
+        if (!GetChild(0).IsBoolean() || !GetChild(1).IsBoolean()) {
+          control.I32Const(0).Comment("Put a zero on the stack for comparison)")
+                 .Code(Op::I32_NE).Comment("Set any non-zero value to one.)");
+        }
+      });
+    }
+    control.Then([this](Control & control){ control.CommentLine("End of ", op, " operation"); });
+  }
+
   void ToWAT_Assign(Control & control) {
     if (!GetChild(0).CanAssign()) {
       Error(file_pos, "Left-hand-side of assignment must be a variable.");
     }
     
     ChildToWAT(1, control, true);      // Generate the value to assign
-    GetChild(0).ToAssignWAT(control);  // Do the assignment
+    control.Then([this](Control & control){ GetChild(0).ToAssignWAT(control); });  // Do the assignment
     ChildToWAT(0, control, true);      // Place the current value of var on the stack.
   }
 
   void ToWAT_AND(Control & control) {
+    if (!GetChild(1).HasEffect()) { ToWAT_Bitwise(control); return; }
     control.CommentLine("Setup the && operation");
     ChildToWAT(0, control, true); // First value sets the condition.
-    control.Code("(if (result i32)").Comment("Setup for && operator")
-           .Code("  (then").Indent(4);
-    ChildToWAT(1, control, true); // If first value was true, result is second value.
-    control.Code("(i32.const 0)").Comment("Put a zero on the stack for comparison)")
-           .Code("(i32.ne)").Comment("Set any non-zero value to one.)")
-           .Indent(-4)
-           .Code("  )")
-           .Code("  (else ")
-           .Code("    (i32.const 0)").Comment("First clause of && was false.")
-           .Code("  )")
-           .Code(")")
-           .CommentLine("End of && operation");
+    control.Then([](Control & control) {
+      control.Code(Op::IF, Instr::NO_ARG, ValType::I32).Comment("Setup for && operator")
+             .Indent(2).Code(Op::THEN).Indent(2);
+    });
+    ChildToBoolean(1, control);   // If first value was true, result is second value.
+    control.Then([](Control & control) {
+      control.Indent(-2)
+             .Code(Op::END)
+             .Code(Op::ELSE)
+             .Indent(2).I32Const(0).Comment("First clause of && was false.").Indent(-2)
+             .Code(Op::END)
+             .Indent(-2)
+             .Code(Op::END)
+             .CommentLine("End of && operation");
+    });
   }
 
   void ToWAT_OR(Control & control) {
+    if (!GetChild(1).HasEffect()) { ToWAT_Bitwise(control); return; }
     control.CommentLine("Setup the || operation");
     ChildToWAT(0, control, true); // First value sets the condition.
-    control.Code("(if (result i32)").Comment("Setup for || operator")
-           .Code("  (then")
-           .Code("    (i32.const 1)").Comment("First clause of || was true.")
-           .Code("  )")
-           .Code("  (else ")
-           .Indent(4);
-    ChildToWAT(1, control, true); // If first value was true, result is true.
-    control.Code("(i32.const 0)").Comment("Put a zero on the stack for comparison)")
-           .Code("(i32.ne)").Comment("Set any non-zero value to one.)")
-           .Indent(-4)
-           .Code("  )")
-           .Code(")")
-           .CommentLine("End of || operation");
+    control.Then([](Control & control) {
+      control.Code(Op::IF, Instr::NO_ARG, ValType::I32).Comment("Setup for || operator")
+             .Indent(2)
+             .Code(Op::THEN)
+             .Indent(2).I32Const(1).Comment("First clause of || was true.").Indent(-2)
+             .Code(Op::END)
+             .Code(Op::ELSE)
+             .Indent(2);
+    });
+    ChildToBoolean(1, control);   // If first value was false, result is second value.
+    control.Then([](Control & control) {
+      control.Indent(-2)
+             .Code(Op::END)
+             .Indent(-2)
+             .Code(Op::END)
+             .CommentLine("End of || operation");
+    });
   }
 
   void ToWAT_Multiply(Control & control) {
     Type type = GetChild(0).ReturnType(control.symbols);
     if (type.IsNumeric()) {
       // Standard mathematical multiple.
-      control.Code("(", type.ToWAT(), ".mul)").Comment("Stack2 * Stack1");
+      control.Code(Control::TypedOp(type, Op::I32_MUL, Op::F64_MUL)).Comment("Stack2 * Stack1");
     }
   }
 
@@ -738,8 +1746,143 @@ public:
     Type type = GetChild(0).ReturnType(control.symbols);
     if (type.IsNumeric()) {
       // Standard mathematical addition.
-      control.Code("(", type.ToWAT(), ".add)").Comment("Stack2 + Stack1");
+      control.Code(Control::TypedOp(type, Op::I32_ADD, Op::F64_ADD)).Comment("Stack2 + Stack1");
+    }
+  }
+
+  // The operation for an arithmetic or comparison operator, on its children's type.
+  Op ValueOp(const SymbolTable & symbols) const {
+    Type type = GetChild(0).ReturnType(symbols);
+    auto typed = [&type](Op int_op, Op double_op) { return Control::TypedOp(type, int_op, double_op); };
+    if (op == "*")  return typed(Op::I32_MUL, Op::F64_MUL);
+    if (op == "/")  return typed(Op::I32_DIV_S, Op::F64_DIV);
+    if (op == "%")  return Op::I32_REM_S;
+    if (op == "+")  return typed(Op::I32_ADD, Op::F64_ADD);
+    if (op == "-")  return typed(Op::I32_SUB, Op::F64_SUB);
+    if (op == "<")  return typed(Op::I32_LT_S, Op::F64_LT);
+    if (op == "<=") return typed(Op::I32_LE_S, Op::F64_LE);
+    if (op == ">")  return typed(Op::I32_GT_S, Op::F64_GT);
+    if (op == ">=") return typed(Op::I32_GE_S, Op::F64_GE);
+    if (op == "==") return typed(Op::I32_EQ, Op::F64_EQ);
+    if (op == "!=") return typed(Op::I32_NE, Op::F64_NE);
+    assert(false);
+    return Op::NOP;
+  }
+
+  // Lower a child as exactly 0 or 1, then pass it on to 'then'.
+  template <typename THEN_T>
+  void ChildToBooleanSSA(size_t id, ssa::Builder & builder, const SymbolTable & symbols, SSASteps & steps,
+                         THEN_T then) {
+    ChildToSSA(id, builder, symbols, steps, [this, id, &builder, then](ssa::ValueID value) {
+      if (GetChild(id).IsBoolean()) then(value);
+      else then(builder.Binary(Op::I32_NE, value, builder.I32(0)));
+    });
+  }
+
+  // Logic operators branch around the right-hand side (and merge the result with a phi)
+  // unless it is cheap to always run, as in ToWAT_Bitwise.
+  void ToSSA_Logic(ssa::Builder & builder, const SymbolTable & symbols, SSASteps & steps) {
+    if (!GetChild(1).HasEffect()) {
+      if (op == "&&") {
+        ChildToBooleanSSA(0, builder, symbols, steps, [this, &builder, &symbols, &steps](ssa::ValueID lhs) {
+          ChildToBooleanSSA(1, builder, symbols, steps, [&builder, &steps, lhs](ssa::ValueID rhs) {
+            steps.Return(builder.Binary(Op::I32_AND, lhs, rhs));
+          });
+        });
+        return;
+      }
+      ChildToSSA(0, builder, symbols, steps, [this, &builder, &symbols, &steps](ssa::ValueID lhs) {
+        ChildToSSA(1, builder, symbols, steps, [this, &builder, &steps, lhs](ssa::ValueID rhs) {
+          const ssa::ValueID either = builder.Binary(Op::I32_OR, lhs, rhs);
+          if (GetChild(0).IsBoolean() && GetChild(1).IsBoolean()) steps.Return(either);
+          else steps.Return(builder.Binary(Op::I32_NE, either, builder.I32(0)));
+        });
+      });
+      return;
+    }
+
+    ChildToSSA(0, builder, symbols, steps, [this, &builder, &symbols, &steps](ssa::ValueID lhs) {
+      const ssa::ValueID decided = builder.I32(op == "||");  // Result if the left side decides.
+      const ssa::BlockID rhs_block = builder.NewBlock();
+      const ssa::BlockID end_block = builder.NewBlock();
+      if (op == "&&") builder.Branch(lhs, rhs_block, end_block);
+      else builder.Branch(lhs, end_block, rhs_block);
+      builder.Seal(rhs_block);
+      builder.SetBlock(rhs_block);
+      ChildToBooleanSSA(1, builder, symbols, steps, [&builder, &steps, decided, end_block](ssa::ValueID rhs) {
+        builder.Jump(end_block);
+        builder.Seal(end_block);
+        builder.SetBlock(end_block);
+        steps.Return(builder.Phi(ValType::I32, {decided, rhs}));
+      });
+    });
+  }
+
+  void ToSSA(ssa::Builder & builder, const SymbolTable & symbols, SSASteps & steps) override {
+    if (op == "=") {
+      if (!GetChild(0).CanAssign()) {
+        Error(file_pos, "Left-hand-side of assignment must be a variable.");
+      }
+      ChildToSSA(1, builder, symbols, steps, [this, &builder, &steps](ssa::ValueID value) {
+        builder.WriteVar(GetChild(0).AssignID(), value);
+        steps.Return(value);
+      });
+      return;
     }
+    if (op == "&&" || op == "||") { ToSSA_Logic(builder, symbols, steps); return; }
+
+    ChildToSSA(0, builder, symbols, steps, [this, &builder, &symbols, &steps](ssa::ValueID lhs) {
+      ChildToSSA(1, builder, symbols, steps, [this, &builder, &symbols, &steps, lhs](ssa::ValueID rhs) {
+        steps.Return(builder.Binary(ValueOp(symbols), lhs, rhs));
+      });
+    });
+  }
+
+  // Logic operators always branch around the right-hand side; a branch is no dearer than
+  // the bitwise form here.
+  void ToVM_Logic(vm::Builder & builder, const SymbolTable & symbols, VMSteps & steps) {
+    ChildToVM(0, builder, symbols, steps, [this, &builder, &symbols, &steps](vm::Reg lhs) {
+      const vm::Reg result = builder.Temp();
+      const vm::Label end_label = builder.NewLabel();
+      builder.Emit(vm::Code::MOV, result, builder.Int(op == "||"));  // Result if the left side decides.
+      if (op == "&&") builder.JumpIfNot(lhs, end_label);
+      else builder.JumpIf(lhs, end_label);
+      ChildToVM(1, builder, symbols, steps, [this, &builder, &steps, result, end_label](vm::Reg rhs) {
+        builder.Emit(GetChild(1).IsBoolean() ? vm::Code::MOV : vm::Code::BOOL_I, result, rhs);
+        builder.Place(end_label);
+        steps.Return(result);
+      });
+    });
+  }
+
+  void ToVM(vm::Builder & builder, const SymbolTable & symbols, VMSteps & steps) override {
+    if (op == "=") {
+      if (!GetChild(0).CanAssign()) {
+        Error(file_pos, "Left-hand-side of assignment must be a variable.");
+      }
+      ChildToVM(1, builder, symbols, steps, [this, &builder, &steps](vm::Reg value) {
+        const vm::Reg var = builder.Var(GetChild(0).AssignID());
+        builder.Move(var, value);
+        steps.Return(var);
+      });
+      return;
+    }
+    if (op == "&&" || op == "||") { ToVM_Logic(builder, symbols, steps); return; }
+
+    // A variable's register changes if the right-hand side assigns to it, but the
+    // left-hand side must keep the value it had when it was evaluated.
+    ChildToVM(0, builder, symbols, steps, [this, &builder, &symbols, &steps](vm::Reg lhs) {
+      if (builder.IsVar(lhs) && steps.assigning.count(&GetChild(1))) {
+        const vm::Reg copy = builder.Temp();
+        builder.Emit(vm::Code::MOV, copy, lhs);
+        lhs = copy;
+      }
+      ChildToVM(1, builder, symbols, steps, [this, &builder, &symbols, &steps, lhs](vm::Reg rhs) {
+        const vm::Reg result = builder.Temp();
+        builder.Emit(vm::FromOp(ValueOp(symbols)), result, lhs, rhs);
+        steps.Return(result);
+      });
+    });
   }
 
   bool ToWAT(Control & control) override {
@@ -752,25 +1895,28 @@ public:
 
     ChildToWAT(0, control, true); // Calculate the first arg (so it's top of the stack)
     ChildToWAT(1, control, true); // Calculate the second arg (so it's one down on the stack)
+    control.Then([this](Control & control){ ToWAT_Math(control); });
+    return true;
+  }
 
-    std::string type = GetChild(0).ReturnType(control.symbols).ToWAT();
-    std::string extra = (type == "i32") ? "_s" : "";
-
-    if (op == "*")  { ToWAT_Multiply(control); return true; }
-    if (op == "/")  { control.Code("(", type, ".div", extra, ")").Comment("Stack2 / Stack1"); return true; }
-    if (op == "%")  { control.Code("(", type, ".rem", extra, ")").Comment("Stack2 % Stack1"); return true; }
-    if (op == "+")  { ToWAT_Add(control); return true; }
-    if (op == "-")  { control.Code("(", type, ".sub)").Comment("Stack2 - Stack1"); return true; }
-
-    if (op == "<")  { control.Code("(", type, ".lt", extra, ")").Comment("Stack2 < Stack1"); return true; }
-    if (op == "<=") { control.Code("(", type, ".le", extra, ")").Comment("Stack2 <= Stack1"); return true; }
-    if (op == ">")  { control.Code("(", type, ".gt", extra, ")").Comment("Stack2 > Stack1"); return true; }
-    if (op == ">=") { control.Code("(", type, ".ge", extra, ")").Comment("Stack2 >= Stack1"); return true; }
-    if (op == "==") { control.Code("(", type, ".eq)").Comment("Stack2 == Stack1"); return true; }
-    if (op == "!=") { control.Code("(", type, ".ne)").Comment("Stack2 != Stack1"); return true; }
-
-
-    return false;
+  // Combine the values of both children (once they are on the stack).
+  void ToWAT_Math(Control & control) {
+    Type type = GetChild(0).ReturnType(control.symbols);
+    auto typed = [&type](Op int_op, Op double_op) { return Control::TypedOp(type, int_op, double_op); };
+
+    if (op == "*")  { ToWAT_Multiply(control); return; }
+    if (op == "/")  { control.Code(typed(Op::I32_DIV_S, Op::F64_DIV)).Comment("Stack2 / Stack1"); return; }
+    if (op == "%")  { control.Code(Op::I32_REM_S).Comment("Stack2 % Stack1"); return; }
+    if (op == "+")  { ToWAT_Add(control); return; }
+    if (op == "-")  { control.Code(typed(Op::I32_SUB, Op::F64_SUB)).Comment("Stack2 - Stack1"); return; }
+
+    if (op == "<")  { control.Code(typed(Op::I32_LT_S, Op::F64_LT)).Comment("Stack2 < Stack1"); return; }
+    if (op == "<=") { control.Code(typed(Op::I32_LE_S, Op::F64_LE)).Comment("Stack2 <= Stack1"); return; }
+    if (op == ">")  { control.Code(typed(Op::I32_GT_S, Op::F64_GT)).Comment("Stack2 > Stack1"); return; }
+    if (op == ">=") { control.Code(typed(Op::I32_GE_S, Op::F64_GE)).Comment("Stack2 >= Stack1"); return; }
+    if (op == "==") { control.Code(typed(Op::I32_EQ, Op::F64_EQ)).Comment("Stack2 == Stack1"); return; }
+    if (op == "!=") { control.Code(typed(Op::I32_NE, Op::F64_NE)).Comment("Stack2 != Stack1"); return; }
+    assert(false);  // Unknown operators fail type checking.
   }
 };
 
@@ -789,10 +1935,16 @@ public:
     return Type("char");
   }
 
+  std::optional<Constant> GetConstant() const override { return Constant::Char(value); }
+  bool HasOwnEffect() const override { return false; }
+
   bool ToWAT(Control & control) override {
-    control.Code("(i32.const ", value, ")").Comment("Put a char \\", value, " on the stack");
+    control.I32Const(value).Comment("Put a char \\", value, " on the stack");
     return true;
   }
+
+  void ToSSA(ssa::Builder & builder, const SymbolTable &, SSASteps & steps) override { steps.Return(builder.I32(value)); }
+  void ToVM(vm::Builder & builder, const SymbolTable &, VMSteps & steps) override { steps.Return(builder.Int(value)); }
 };
 
 class ASTNode_IntLit : public ASTNode {
@@ -810,10 +1962,17 @@ public:
     return Type("int");
   }
 
+  std::optional<Constant> GetConstant() const override { return Constant::Int(value); }
+  bool HasOwnEffect() const override { return false; }
+  bool IsBoolean() const override { return value == 0 || value == 1; }
+
   bool ToWAT(Control & control) override {
-    control.Code("(i32.const ", value, ")").Comment("Put a ", value, " on the stack");
+    control.I32Const(value).Comment("Put a ", value, " on the stack");
     return true;
   }
+
+  void ToSSA(ssa::Builder & builder, const SymbolTable &, SSASteps & steps) override { steps.Return(builder.I32(value)); }
+  void ToVM(vm::Builder & builder, const SymbolTable &, VMSteps & steps) override { steps.Return(builder.Int(value)); }
 };
 
 class ASTNode_FloatLit : public ASTNode {
@@ -831,10 +1990,16 @@ public:
     return Type("double");
   }
 
+  std::optional<Constant> GetConstant() const override { return Constant::Double(value); }
+  bool HasOwnEffect() const override { return false; }
+
   bool ToWAT(Control & control) override {
-    control.Code("(f64.const ", value, ")").Comment("Put a ", value, " on the stack");
+    control.F64Const(value).Comment("Put a ", value, " on the stack");
     return true;
   }
+
+  void ToSSA(ssa::Builder & builder, const SymbolTable &, SSASteps & steps) override { steps.Return(builder.F64(value)); }
+  void ToVM(vm::Builder & builder, const SymbolTable &, VMSteps & steps) override { steps.Return(builder.Double(value)); }
 };
 
 
@@ -855,7 +2020,18 @@ public:
   void ToAssignWAT(Control & control) override {
     TestOK();
     const std::string var_name = control.symbols.GetName(var_id);
-    control.Code("(local.set $var", var_id, ")").Comment("Set var '", var_name, "' from stack");
+    control.VarCode(Op::LOCAL_SET, var_id).Comment("Set var '", var_name, "' from stack");
+  }
+  size_t AssignID() const override { return var_id; }
+
+  void Optimize(ConstantTable & constants, FoldSteps & steps) override {
+    if (const Constant * value = constants.Find(var_id)) steps.Return(MakeLiteral(file_pos, *value));
+  }
+
+  bool HasOwnEffect() const override { return false; }
+  bool IsInvariant(const LoopInvariants & loop) const override { return !loop.assigned.count(var_id); }
+  void NumberValues(ValueNumbering & table, NumberSteps & steps) override {
+    steps.Return(table.VarNumber(var_id));
   }
 
   Type ReturnType(const SymbolTable & symbols) const override {
@@ -868,10 +2044,178 @@ public:
     TestOK();
     const std::string var_name = control.symbols.GetName(var_id);
 
-    control.Code("(local.get $var", var_id, ")").Comment("Place var '", var_name, "' onto stack");
+    control.VarCode(Op::LOCAL_GET, var_id).Comment("Place var '", var_name, "' onto stack");
     return true;
   }
 
+  void ToSSA(ssa::Builder & builder, const SymbolTable &, SSASteps & steps) override {
+    TestOK();
+    steps.Return(builder.ReadVar(var_id));
+  }
+  void ToVM(vm::Builder & builder, const SymbolTable &, VMSteps & steps) override {
+    TestOK();
+    steps.Return(builder.Var(var_id));
+  }
+
 };
 
+inline ASTNode::ptr_t MakeLiteral(FilePos file_pos, const Constant & value) {
+  switch (value.kind) {
+  case Constant::INT: return std::make_unique<ASTNode_IntLit>(file_pos, value.i);
+  case Constant::CHAR: return std::make_unique<ASTNode_CharLit>(file_pos, value.i);
+  case Constant::DOUBLE: return std::make_unique<ASTNode_FloatLit>(file_pos, value.d);
+  }
+  return nullptr;
+}
+
+inline void LoopInvariants::Hoist(ASTNode::ptr_t & node) {
+  if (node->GetConstant() || node->CanAssign()) return;  // Literals and variables are cheap.
+  const FilePos pos = node->GetFilePos();
+  const size_t var_id = symbols.AddTempVar("_invariant", pos, node->ReturnType(symbols));
+  new_vars.push_back(var_id);
+  setup.push_back(std::make_unique<ASTNode_Math2>(pos, "=", std::make_unique<ASTNode_Var>(pos, var_id),
+                                                  std::move(node)));
+  node = std::make_unique<ASTNode_Var>(pos, var_id);
+}
+
+// Find the invariant expressions below a loop in one pass from the bottom up: each node
+// that is invariant (with all of its children) is left for its parent to hoist as part of a
+// bigger expression, if it can.
+inline void LoopInvariants::Find(ASTNode & loop) {
+  std::vector<bool> invariant;   // For each node done whose parent is not (in order).
+  WalkTree(loop, [](ASTNode &) { return true; }, [this, &invariant](ASTNode & node) {
+    const auto children = node.Children();
+    const size_t num_children = std::count_if(children.begin(), children.end(),
+                                              [](const ASTNode::ptr_t & child){ return child != nullptr; });
+    if (!num_children) { invariant.push_back(node.IsInvariant(*this)); return; }
+    const size_t first = invariant.size() - num_children;
+    const bool all_invariant = std::find(invariant.begin() + first, invariant.end(), false) == invariant.end();
+    const bool hoist_here = !(all_invariant && node.CanHoist());  // Else the parent may take more.
+    size_t id = first;
+    for (ASTNode::ptr_t & child : children) {
+      if (!child) continue;
+      if (hoist_here && invariant[id]) Hoist(child);
+      ++id;
+    }
+    invariant.resize(first);
+    invariant.push_back(!hoist_here);
+  });
+}
+
+template <typename THEN_T>
+void ValueNumbering::Visit(ASTNode::ptr_t & slot, NumberSteps & steps, THEN_T then) {
+  steps.Call([this, &slot, &steps]() { slot->NumberValues(*this, steps); },
+             [this, &slot, then](size_t number) { then(Reuse(slot, number)); });
+}
+
+inline size_t ValueNumbering::Reuse(ASTNode::ptr_t & slot, size_t number) {
+  if (!number || !slot->IsValueOp()) return number;  // Variables and literals are cheap.
+
+  auto it = available.find(number);
+  if (it == available.end()) {
+    if (!conditional) available[number] = std::make_shared<Available>(&slot, slot.get());
+    return number;
+  }
 
+  // Already computed: make sure the first copy saves its value (in passing), then use it.
+  Available & first = *it->second;
+  if (first.var_id == SymbolTable::NO_ID) {
+    if (first.slot->get() != first.node) return number;  // First copy was replaced.
+    const FilePos pos = first.node->GetFilePos();
+    first.var_id = symbols.AddTempVar("_common", pos, first.node->ReturnType(symbols));
+    new_vars.push_back(first.var_id);
+    *first.slot = std::make_unique<ASTNode_Math2>(pos, "=", std::make_unique<ASTNode_Var>(pos, first.var_id),
+                                                  std::move(*first.slot));
+  }
+  slot = std::make_unique<ASTNode_Var>(slot->GetFilePos(), first.var_id);
+  return number;
+}
+
+inline FilePos ASTNode::GetFirstPos() const {
+  FilePos first_pos = file_pos;
+  WalkTree(*this, [&first_pos](const ASTNode & node) {
+    if (node.file_pos < first_pos) first_pos = node.file_pos;
+    return true;
+  });
+  return first_pos;
+}
+
+inline void ASTNode::Print(std::string prefix) const {
+  WalkTree(*this, [&prefix](const ASTNode & node) {
+    std::cout << prefix << node.GetTypeName() << std::endl;
+    prefix += "  ";
+    return true;
+  }, [&prefix](const ASTNode &) { prefix.resize(prefix.size() - 2); });
+}
+
+inline size_t ASTNode::CountNodes() const {
+  size_t count = 0;
+  WalkTree(*this, [&count](const ASTNode &) { ++count; return true; });
+  return count;
+}
+
+inline void ASTNode::CountKinds(std::map<std::string, size_t> & counts) const {
+  WalkTree(*this, [&counts](const ASTNode & node) {
+    const std::string name = node.GetTypeName();
+    ++counts[name.substr(0, name.find(':'))];
+    return true;
+  });
+}
+
+inline bool ASTNode::HasEffect() const {
+  bool found = false;
+  WalkTree(*this, [&found](const ASTNode & node) {
+    found = found || node.HasOwnEffect();
+    return !found;
+  });
+  return found;
+}
+
+inline void ASTNode::FindAssigned(std::set<size_t> & var_ids) const {
+  WalkTree(*this, [&var_ids](const ASTNode & node) {
+    if (const size_t var_id = node.AssignedVar(); var_id != SymbolTable::NO_ID) var_ids.insert(var_id);
+    return true;
+  });
+}
+
+inline void ASTNode::OptimizeTree(ConstantTable & constants) {
+  FoldSteps steps;
+  steps.Run([this, &constants, &steps]() { Optimize(constants, steps); });
+}
+
+// Each loop collects its setup on the way down, before any loops nested in it; the setup
+// goes in front of the loop on the way back up.
+inline void ASTNode::HoistTree(SymbolTable & symbols, std::vector<size_t> & new_vars) {
+  WalkTree(*this, [&symbols, &new_vars](ASTNode & node) { node.HoistLoops(symbols, new_vars); return true; },
+           [](ASTNode & node) {
+             for (ptr_t & child : node.Children()) {
+               if (!child) continue;
+               std::vector<ptr_t> setup = child->TakeLoopSetup();
+               if (setup.empty()) continue;
+               auto block = std::make_unique<ASTNode_Block>(child->GetFilePos());
+               for (ptr_t & assign : setup) block->AddChild(std::move(assign));
+               block->AddChild(std::move(child));
+               child = std::move(block);
+             }
+           });
+}
+
+inline void ASTNode::NumberTree(ValueNumbering & table) {
+  NumberSteps steps;
+  steps.Run([this, &table, &steps]() { NumberValues(table, steps); });
+}
+
+inline void ASTNode::TypeCheckTree(const SymbolTable & symbols) {
+  WalkTree(*this, [&symbols](ASTNode & node) { node.PreTypeCheck(symbols); return true; },
+           [&symbols](ASTNode & node) { node.TypeCheck(symbols); });
+}
+
+inline void ASTNode::InitializeTreeWAT(Control & control) {
+  WalkTree(*this, [&control](ASTNode & node) { node.InitializeWAT(control); return true; });
+}
+
+inline bool ASTNode::TreeToWAT(Control & control) {
+  bool has_out = false;
+  control.RunSteps([this, &has_out](Control & control) { has_out = ToWAT(control); });
+  return has_out;
+}
@@ -0,0 +1,299 @@
+// Benchmarks for the compiler's phases on synthetic programs of any size.
+//
+// Usage: Bench [--functions=N] [--depth=N] [--expr=N] [--id-length=N] [--seed=N]
+//              [--repeat=N] [--label=TEXT] [--generate]
+//
+// With no size options, runs the standard suite of workloads (see SUITE); with any of
+// them, runs a single workload of that shape.  Results are written to standard output as
+// JSON.  With --generate, prints the generated program instead, e.g. to time Project3 on it.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lexer.hpp"
+#include "Passes.hpp"
+#include "Tubular.hpp"
+
+// The shape of a generated program.
+struct Shape {
+  std::string name = "custom";
+  size_t functions = 50;     // Number of functions.
+  size_t depth = 3;          // How deeply if/while statements nest in each function.
+  size_t expr = 8;           // Number of leaves (variables and literals) in each expression.
+  size_t id_length = 6;      // Length of every identifier (at least long enough to be unique).
+  uint64_t seed = 1;
+};
+
+// The standard workloads: one baseline, then one scaling each dimension.
+static const Shape SUITE[] = {
+  {"baseline",          50,  3,   8,  6, 1},
+  {"many_functions",  1000,  3,   8,  6, 2},
+  {"deep_nesting",      20, 50,   8,  6, 3},
+  {"large_expressions", 20,  3, 300,  6, 4},
+  {"long_identifiers", 200,  3,   8, 64, 5},
+};
+
+// Writes a random, valid program of a given shape.  The same shape (and seed) always
+// gives the same program.
+class Generator {
+private:
+  const Shape & shape;
+  uint64_t state;
+  std::ostringstream out{};
+  size_t next_loop = 0;   // Loop counters are numbered across each function.
+
+  uint64_t Random() {   // xorshift64*
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+  }
+  size_t Random(size_t limit) { return static_cast<size_t>(Random() % limit); }
+
+  // Pad an identifier with filler to the requested length.
+  std::string Id(std::string base) const {
+    if (base.size() + 1 >= shape.id_length) return base;
+    base += '_';
+    while (base.size() < shape.id_length) base += static_cast<char>('a' + base.size() % 26);
+    return base;
+  }
+
+  void Indent(size_t level) { out << std::string(2 * level + 2, ' '); }
+
+  // Each function has int parameters p0 and p1, double parameter p2, int variables v0-v3,
+  // and double variables d0 and d1.
+  std::string IntLeaf() {
+    switch (Random(4)) {
+    case 0: return std::to_string(1 + Random(99));
+    case 1: return Id("p" + std::to_string(Random(2)));
+    default: return Id("v" + std::to_string(Random(4)));
+    }
+  }
+  std::string DoubleLeaf() {
+    switch (Random(4)) {
+    case 0: return std::to_string(1 + Random(99)) + ".5";
+    case 1: return Id("p2");
+    default: return Id("d" + std::to_string(Random(2)));
+    }
+  }
+
+  // Expressions with a given number of leaves, fully parenthesized (comparisons cannot
+  // be chained).
+  std::string IntExpr(size_t leaves) {
+    if (leaves <= 1) return IntLeaf();
+    const size_t left = 1 + Random(leaves - 1);
+    const size_t kind = Random(20);
+    if (kind == 0) return "(" + DoubleExpr(leaves) + "):int";
+    if (kind == 1) return "(" + DoubleExpr(left) + " < " + DoubleExpr(leaves - left) + ")";
+    static const char * OPS[] = {"+", "-", "*", "/", "%", "+", "-", "*", "<", "==", "&&", "||"};
+    const char * op = OPS[Random(std::size(OPS))];
+    return "(" + IntExpr(left) + " " + op + " " + IntExpr(leaves - left) + ")";
+  }
+  std::string DoubleExpr(size_t leaves) {
+    if (leaves <= 1) return DoubleLeaf();
+    const size_t left = 1 + Random(leaves - 1);
+    const size_t kind = Random(20);
+    if (kind == 0) return "(" + IntExpr(leaves) + "):double";
+    if (kind == 1) return "sqrt(" + DoubleExpr(leaves) + ")";
+    static const char * OPS[] = {"+", "-", "*", "/"};
+    const char * op = OPS[Random(std::size(OPS))];
+    return "(" + DoubleExpr(left) + " " + op + " " + DoubleExpr(leaves - left) + ")";
+  }
+
+  void Assignment(size_t level) {
+    Indent(level);
+    if (Random(3)) out << Id("v" + std::to_string(Random(4))) << " = " << IntExpr(shape.expr) << ";\n";
+    else out << Id("d" + std::to_string(Random(2))) << " = " << DoubleExpr(shape.expr) << ";\n";
+  }
+
+  // A few assignments, with one nested if or (bounded) while statement going one level
+  // deeper, so that the program grows linearly with depth.
+  void Statements(size_t level, size_t depth) {
+    const size_t count = 2 + Random(3);
+    const size_t nest_at = Random(count);
+    for (size_t i = 0; i < count; ++i) {
+      if (i != nest_at || depth == 0) { Assignment(level); continue; }
+      if (Random(2)) {
+        Indent(level); out << "if (" << IntExpr(shape.expr) << ") {\n";
+        Statements(level + 1, depth - 1);
+        Indent(level); out << "} else {\n";
+        Statements(level + 1, 0);
+        Indent(level); out << "}\n";
+      } else {
+        const std::string counter = Id("k" + std::to_string(next_loop++));
+        Indent(level); out << "int " << counter << " = 0;\n";
+        Indent(level); out << "while (" << counter << " < " << 1 + Random(10) << ") {\n";
+        Indent(level + 1); out << counter << " = " << counter << " + 1;\n";
+        Statements(level + 1, depth - 1);
+        Indent(level); out << "}\n";
+      }
+    }
+  }
+
+  void Function(size_t id) {
+    next_loop = 0;
+    out << "function " << Id("F" + std::to_string(id)) << "(int " << Id("p0") << ", int " << Id("p1")
+        << ", double " << Id("p2") << ") : int {\n";
+    for (size_t i = 0; i < 4; ++i) {
+      out << "  int " << Id("v" + std::to_string(i)) << " = " << Id("p" + std::to_string(i % 2))
+          << " + " << Random(100) << ";\n";
+    }
+    for (size_t i = 0; i < 2; ++i) {
+      out << "  double " << Id("d" + std::to_string(i)) << " = " << Id("p2") << " * " << Random(100) << ".5;\n";
+    }
+    Statements(0, shape.depth);
+    out << "  return " << IntExpr(shape.expr) << ";\n}\n";
+  }
+
+public:
+  Generator(const Shape & shape) : shape(shape), state(shape.seed * 0x9E3779B97F4A7C15ULL + 1) { }
+
+  std::string Generate() {
+    for (size_t id = 0; id < shape.functions; ++id) Function(id);
+    return out.str();
+  }
+};
+
+// Run a benchmark repeatedly: setup (untimed) prepares fresh state, then the timed step
+// runs on it.  Return the fastest and median times, in seconds.
+template <typename SETUP_T, typename STEP_T>
+static std::pair<double, double> Time(size_t repeat, SETUP_T setup, STEP_T step) {
+  std::vector<double> times;
+  for (size_t i = 0; i < repeat; ++i) {
+    auto state = setup();
+    const auto start = std::chrono::steady_clock::now();
+    step(*state);
+    times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  }
+  std::sort(times.begin(), times.end());
+  return {times.front(), times[times.size() / 2]};
+}
+
+// One line of JSON for a phase, with rates (per second, from the fastest run) for each
+// amount it processed.
+static std::string PhaseJSON(const std::string & name, std::pair<double, double> times,
+                             const std::vector<std::pair<std::string, double>> & amounts) {
+  std::ostringstream os;
+  os << "        \"" << name << "\": {\"best_s\": " << times.first << ", \"median_s\": " << times.second;
+  for (const auto & [unit, amount] : amounts) os << ", \"" << unit << "\": " << (times.first ? amount / times.first : 0.0);
+  os << "}";
+  return os.str();
+}
+
+static std::string RunWorkload(const Shape & shape, size_t repeat) {
+  const std::string source = Generator(shape).Generate();
+  const double megabytes = static_cast<double>(source.size()) / 1e6;
+
+  // Measure the sizes that rates are computed from.
+  std::istringstream sizing_in(source);
+  Tubular sizing(sizing_in);
+  const double num_tokens = static_cast<double>(sizing.CountTokens());
+  sizing.ParseOnly();
+  const double num_nodes = static_cast<double>(sizing.CountNodes());
+  sizing.TypeCheck();
+  sizing.OptimizeAST();
+  const double optimized_nodes = static_cast<double>(sizing.CountNodes());
+  sizing.ToWAT();
+  std::ostringstream wat;
+  sizing.PrintCode(wat);
+  const double wat_megabytes = static_cast<double>(wat.str().size()) / 1e6;
+
+  // Build a compiler that has completed every phase before the one being timed.
+  auto upto = [&source](size_t phase) {
+    return [&source, phase]() {
+      std::istringstream in(source);
+      auto prog = std::make_unique<Tubular>(in);
+      if (phase > 0) prog->ParseOnly();
+      if (phase > 1) prog->TypeCheck();
+      if (phase > 2) { prog->OptimizeAST(); prog->ToWAT(); }
+      return prog;
+    };
+  };
+
+  std::vector<std::string> phases;
+  phases.push_back(PhaseJSON("tokenize",
+    Time(repeat, [&source](){ return std::make_unique<std::string>(source); },
+         [](std::string & text){ emplex::Lexer lexer; lexer.Tokenize(text); }),
+    {{"mb_per_s", megabytes}, {"tokens_per_s", num_tokens}}));
+  phases.push_back(PhaseJSON("parse", Time(repeat, upto(0), [](Tubular & prog){ prog.ParseOnly(); }),
+    {{"tokens_per_s", num_tokens}, {"nodes_per_s", num_nodes}}));
+  phases.push_back(PhaseJSON("type_check", Time(repeat, upto(1), [](Tubular & prog){ prog.TypeCheck(); }),
+    {{"nodes_per_s", num_nodes}}));
+  phases.push_back(PhaseJSON("optimize_ast", Time(repeat, upto(2), [](Tubular & prog){ prog.OptimizeAST(); }),
+    {{"nodes_per_s", num_nodes}}));
+  phases.push_back(PhaseJSON("to_wat",
+    Time(repeat, [&](){ auto prog = upto(2)(); prog->OptimizeAST(); return prog; },
+         [](Tubular & prog){ prog.ToWAT(); }),
+    {{"nodes_per_s", optimized_nodes}}));
+  phases.push_back(PhaseJSON("print_code",
+    Time(repeat, upto(3), [](Tubular & prog){ std::ostringstream os; prog.PrintCode(os); }),
+    {{"mb_per_s", wat_megabytes}}));
+
+  std::ostringstream os;
+  os << "    {\n"
+     << "      \"name\": \"" << shape.name << "\",\n"
+     << "      \"shape\": {\"functions\": " << shape.functions << ", \"depth\": " << shape.depth
+     << ", \"expr\": " << shape.expr << ", \"id_length\": " << shape.id_length << ", \"seed\": " << shape.seed << "},\n"
+     << "      \"source_bytes\": " << source.size() << ", \"tokens\": " << num_tokens
+     << ", \"nodes\": " << num_nodes << ", \"optimized_nodes\": " << optimized_nodes
+     << ", \"wat_bytes\": " << wat.str().size() << ",\n"
+     << "      \"phases\": {\n";
+  for (size_t i = 0; i < phases.size(); ++i) os << phases[i] << (i + 1 < phases.size() ? ",\n" : "\n");
+  os << "      }\n    }";
+  return os.str();
+}
+
+int main(int argc, char * argv[])
+{
+  auto usage = [argv]() {
+    std::cerr << "Format: " << argv[0] << " [--functions=N] [--depth=N] [--expr=N] [--id-length=N]"
+              << " [--seed=N] [--repeat=N] [--label=TEXT] [--generate]" << std::endl;
+    exit(1);
+  };
+
+  Shape shape;
+  bool custom = false;     // Was any part of the shape given?
+  bool generate = false;   // Print the program rather than benchmarking it?
+  size_t repeat = 3;
+  std::string label;       // Identifies this run in the results (such as a version).
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    const size_t eq = arg.find('=');
+    const std::string name = arg.substr(0, eq);
+    const std::string value = (eq == std::string::npos) ? "" : arg.substr(eq + 1);
+    auto number = [&]() -> size_t {
+      if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) usage();
+      return std::stoul(value);
+    };
+    if (arg == "--generate") generate = true;
+    else if (name == "--functions") { shape.functions = number(); custom = true; }
+    else if (name == "--depth") { shape.depth = number(); custom = true; }
+    else if (name == "--expr") { shape.expr = std::max<size_t>(1, number()); custom = true; }
+    else if (name == "--id-length") { shape.id_length = number(); custom = true; }
+    else if (name == "--seed") { shape.seed = number(); custom = true; }
+    else if (name == "--repeat") repeat = std::max<size_t>(1, number());
+    else if (name == "--label") label = value;
+    else usage();
+  }
+
+  if (generate) {
+    std::cout << Generator(shape).Generate();
+    return 0;
+  }
+
+  std::vector<Shape> workloads;
+  if (custom) workloads.push_back(shape);
+  else workloads.assign(std::begin(SUITE), std::end(SUITE));
+
+  std::cout << "{\n  \"label\": \"" << label << "\",\n  \"repeat\": " << repeat << ",\n  \"workloads\": [\n";
+  for (size_t i = 0; i < workloads.size(); ++i) {
+    std::cerr << "Benchmarking " << workloads[i].name << "..." << std::endl;
+    std::cout << RunWorkload(workloads[i], repeat) << (i + 1 < workloads.size() ? ",\n" : "\n");
+  }
+  std::cout << "  ]\n}" << std::endl;
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+// Clean-up passes that run over the instructions of one complete function:
+// - Remove code that can never run (after br, return, or unreachable).
+// - Remove locals that are never read, turning stores into them into drops (which the
+//   peephole optimizer then removes along with the stored value, if that has no effect).
+// - Collapse if statements whose branches ended up empty.
+
+#include <iostream>
+#include <vector>
+
+#include "Instruction.hpp"
+
+namespace cleanup {
+  struct Stats {
+    size_t unreachable = 0;   // Instructions removed because they could never run.
+    size_t branches = 0;      // Empty then/else branches collapsed.
+    size_t locals = 0;        // Unused locals removed.
+
+    void Add(const Stats & in) {
+      unreachable += in.unreachable;
+      branches += in.branches;
+      locals += in.locals;
+    }
+
+    void Print(std::ostream & os=std::cerr) const {
+      os << "Cleanup:\n"
+         << "  unreachable-instrs      " << unreachable << '\n'
+         << "  empty-branches          " << branches << '\n'
+         << "  unused-locals           " << locals << '\n';
+    }
+  };
+
+  // Does this instruction start a construct that is closed by an END?
+  inline bool IsOpener(Op op) {
+    return op == Op::FUNC || op == Op::BLOCK || op == Op::LOOP ||
+           op == Op::IF || op == Op::THEN || op == Op::ELSE;
+  }
+
+  inline bool IsTerminator(Op op) {
+    return op == Op::BR || op == Op::RETURN || op == Op::UNREACHABLE;
+  }
+
+  inline bool IsEmpty(const std::vector<Instr> & code, size_t start, size_t end) {
+    for (size_t i = start; i < end; ++i) {
+      if (code[i].op != Op::NOTE && code[i].op != Op::BLANK) return false;
+    }
+    return true;
+  }
+
+  // Remove everything after a br, return, or unreachable up to the end of its construct.
+  inline void RemoveUnreachable(std::vector<Instr> & code, Stats & stats) {
+    std::vector<Instr> out;
+    out.reserve(code.size());
+    for (size_t i = 0; i < code.size(); ++i) {
+      out.push_back(code[i]);
+      if (!IsTerminator(code[i].op)) continue;
+      size_t depth = 0;
+      while (i+1 < code.size() && (depth || code[i+1].op != Op::END)) {
+        ++i;
+        if (IsOpener(code[i].op)) ++depth;
+        else if (code[i].op == Op::END) --depth;
+        if (code[i].op != Op::NOTE && code[i].op != Op::BLANK) ++stats.unreachable;
+      }
+    }
+    code = std::move(out);
+  }
+
+  // Simplify if statements (without results) that have an empty branch:
+  //   if/then/else with an empty else  ->  if/then
+  //   if/then/else with an empty then  ->  eqz, if/then (using the else code)
+  //   if with all branches empty       ->  drop (the condition is still run)
+  inline void CollapseEmptyBranches(std::vector<Instr> & code, Stats & stats) {
+    static constexpr size_t NONE = static_cast<size_t>(-1);
+    struct OpenIf {
+      size_t if_pos;
+      size_t then_pos = NONE, then_end = NONE;
+      size_t else_pos = NONE, else_end = NONE;
+    };
+    std::vector<OpenIf> ifs;
+    std::vector<Op> open_stack;
+
+    std::vector<Instr> out;
+    out.reserve(code.size());
+    for (const Instr & inst : code) {
+      if (inst.op == Op::IF) ifs.push_back(OpenIf{out.size()});
+      else if (inst.op == Op::THEN) ifs.back().then_pos = out.size();
+      else if (inst.op == Op::ELSE) ifs.back().else_pos = out.size();
+
+      if (inst.op != Op::END) {
+        if (IsOpener(inst.op)) open_stack.push_back(inst.op);
+        out.push_back(inst);
+        continue;
+      }
+
+      const Op closed = open_stack.back();
+      open_stack.pop_back();
+      if (closed == Op::THEN) ifs.back().then_end = out.size();
+      if (closed == Op::ELSE) ifs.back().else_end = out.size();
+      if (closed != Op::IF) { out.push_back(inst); continue; }
+
+      OpenIf info = ifs.back();
+      ifs.pop_back();
+      const Instr if_inst = out[info.if_pos];
+      const bool has_else = info.else_pos != NONE;
+      const bool then_empty = IsEmpty(out, info.then_pos + 1, info.then_end);
+      const bool else_empty = !has_else || IsEmpty(out, info.else_pos + 1, info.else_end);
+      if (if_inst.type != ValType::NONE || (!then_empty && !(has_else && else_empty))) {
+        out.push_back(inst);
+        continue;
+      }
+
+      ++stats.branches;
+      if (then_empty && else_empty) {
+        out.resize(info.if_pos);
+        out.push_back(Instr{Op::DROP, ValType::NONE, if_inst.indent, Instr::NO_ARG, if_inst.note, if_inst.pos});
+      }
+      else if (else_empty) {
+        out.resize(info.else_pos);  // Remove the else branch.
+        out.push_back(inst);
+      }
+      else {  // Only the then branch is empty: invert the test and keep the else code.
+        std::vector<Instr> else_code(out.begin() + static_cast<std::ptrdiff_t>(info.else_pos + 1),
+                                     out.begin() + static_cast<std::ptrdiff_t>(info.else_end));
+        const Instr then_inst = out[info.then_pos];
+        const Instr then_end = out[info.then_end];
+        out.resize(info.if_pos);
+        out.push_back(Instr{Op::I32_EQZ, ValType::NONE, if_inst.indent, Instr::NO_ARG, 0, if_inst.pos});
+        out.push_back(if_inst);
+        out.push_back(then_inst);
+        out.insert(out.end(), else_code.begin(), else_code.end());
+        out.push_back(then_end);
+        out.push_back(inst);
+      }
+    }
+    code = std::move(out);
+  }
+
+  // Remove locals that are never read.  Stores into them become drops (a tee simply goes
+  // away), and all remaining locals are renumbered.  FUN_T provides 'locals' and 'num_params'.
+  template <typename FUN_T>
+  void RemoveUnusedLocals(std::vector<Instr> & code, FUN_T & fun, Stats & stats) {
+    std::vector<bool> used(fun.locals.size(), false);
+    for (size_t i = 0; i < fun.num_params; ++i) used[i] = true;   // Parameters always stay.
+    for (const Instr & inst : code) {
+      if (inst.op == Op::LOCAL_GET) used[inst.arg] = true;
+    }
+
+    std::vector<uint32_t> new_id(fun.locals.size(), Instr::NO_ARG);
+    decltype(fun.locals) locals;
+    for (size_t i = 0; i < fun.locals.size(); ++i) {
+      if (!used[i]) { ++stats.locals; continue; }
+      new_id[i] = static_cast<uint32_t>(locals.size());
+      locals.push_back(fun.locals[i]);
+    }
+    if (locals.size() == fun.locals.size()) return;
+    fun.locals = std::move(locals);
+
+    std::vector<Instr> out;
+    out.reserve(code.size());
+    for (Instr inst : code) {
+      switch (inst.op) {
+      case Op::LOCAL:
+        if (!used[inst.arg]) continue;  // Remove the declaration.
+        break;
+      case Op::LOCAL_SET:
+        if (!used[inst.arg]) { inst = Instr{Op::DROP, ValType::NONE, inst.indent, Instr::NO_ARG, 0, inst.pos}; }
+        break;
+      case Op::LOCAL_TEE:
+        if (!used[inst.arg]) continue;  // Value just stays on the stack.
+        break;
+      default:
+        break;
+      }
+      if (inst.op == Op::LOCAL || inst.op == Op::LOCAL_GET ||
+          inst.op == Op::LOCAL_SET || inst.op == Op::LOCAL_TEE) {
+        inst.arg = new_id[inst.arg];
+      }
+      out.push_back(inst);
+    }
+    code = std::move(out);
+  }
+}
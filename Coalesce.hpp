@@ -0,0 +1,184 @@
+#pragma once
+
+// Coalesce locals whose live ranges never overlap, so each function declares as few
+// i32 / f64 locals as possible.
+//
+// Control flow between instructions follows WASM's structured blocks, loops, and ifs;
+// liveness is solved over it, and two locals interfere if one is written while the other
+// is live (ignoring plain copies between them).  Locals are then greedily packed
+// into slots of the same type.  Parameters keep their own slots, but later locals may reuse
+// them once a parameter is no longer needed.
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include "Instruction.hpp"
+
+namespace coalesce {
+  struct Stats {
+    size_t merged = 0;    // Locals removed by sharing a slot with another.
+
+    void Add(const Stats & in) { merged += in.merged; }
+
+    void Print(std::ostream & os=std::cerr) const {
+      os << "Coalescing:\n"
+         << "  merged-locals           " << merged << '\n';
+    }
+  };
+
+  // A fixed-size set of local IDs.
+  class BitSet {
+  private:
+    std::vector<uint64_t> words;
+  public:
+    BitSet(size_t size=0) : words((size + 63) / 64, 0) { }
+    bool Has(size_t id) const { return (words[id >> 6] >> (id & 63)) & 1; }
+    void Set(size_t id) { words[id >> 6] |= uint64_t(1) << (id & 63); }
+    void Clear(size_t id) { words[id >> 6] &= ~(uint64_t(1) << (id & 63)); }
+    void Reset() { std::fill(words.begin(), words.end(), 0); }
+
+    // Add all IDs from another set; return whether anything changed.
+    bool Union(const BitSet & in) {
+      bool changed = false;
+      for (size_t i = 0; i < words.size(); ++i) {
+        const uint64_t merged = words[i] | in.words[i];
+        changed |= (merged != words[i]);
+        words[i] = merged;
+      }
+      return changed;
+    }
+
+    template <typename FUN_T>
+    void ForEach(FUN_T fun) const {
+      for (size_t i = 0; i < words.size(); ++i) {
+        for (uint64_t word = words[i]; word; word &= word - 1) {
+          fun(i * 64 + static_cast<size_t>(std::countr_zero(word)));
+        }
+      }
+    }
+  };
+
+  // Which instructions can run after each instruction in a function body?
+  inline std::vector<std::vector<size_t>> FindSuccessors(const std::vector<Instr> & code) {
+    static constexpr size_t NONE = static_cast<size_t>(-1);
+    const size_t size = code.size();
+    std::vector<std::vector<size_t>> succ(size);
+
+    // Match up structure: where each label jumps to, and where each if goes.
+    std::unordered_map<uint32_t, size_t> label_target;
+    std::vector<size_t> if_else(size, NONE), if_end(size, NONE), then_end_to(size, NONE);
+    struct Open { Op op; size_t pos; size_t if_pos; };
+    std::vector<Open> open;
+    for (size_t i = 0; i < size; ++i) {
+      const Op op = code[i].op;
+      if (op == Op::FUNC || op == Op::BLOCK || op == Op::LOOP || op == Op::IF) {
+        open.push_back(Open{op, i, i});
+        if (op == Op::LOOP) label_target[code[i].arg] = i;
+      }
+      else if (op == Op::THEN || op == Op::ELSE) {
+        if (op == Op::ELSE) if_else[open.back().pos] = i;
+        open.push_back(Open{op, i, open.back().pos});
+      }
+      else if (op == Op::END && open.size()) {
+        const Open closed = open.back();
+        open.pop_back();
+        if (closed.op == Op::BLOCK) label_target[code[closed.pos].arg] = i;
+        else if (closed.op == Op::IF) if_end[closed.pos] = i;
+        else if (closed.op == Op::THEN) then_end_to[i] = closed.if_pos;
+      }
+    }
+
+    for (size_t i = 0; i < size; ++i) {
+      const Instr & inst = code[i];
+      switch (inst.op) {
+      case Op::BR: succ[i].push_back(label_target[inst.arg]); break;
+      case Op::BR_IF: succ[i] = { i+1, label_target[inst.arg] }; break;
+      case Op::RETURN: case Op::UNREACHABLE: break;
+      case Op::IF:
+        succ[i] = { i+1, (if_else[i] != NONE) ? if_else[i] : if_end[i] };
+        break;
+      case Op::END:
+        if (then_end_to[i] != NONE) succ[i].push_back(if_end[then_end_to[i]]);  // Skip any else.
+        else if (i+1 < size) succ[i].push_back(i+1);
+        break;
+      default:
+        if (i+1 < size) succ[i].push_back(i+1);
+      }
+    }
+    return succ;
+  }
+
+  // Choose a slot for every local.  Returns the new ID of each old local; new IDs are
+  // numbered by first member, so parameters keep their IDs.  FUN_T provides 'locals'
+  // (each with a 'type') and 'num_params'.
+  template <typename FUN_T>
+  std::vector<uint32_t> AssignSlots(const std::vector<Instr> & code, const FUN_T & fun) {
+    const size_t num_locals = fun.locals.size();
+    const size_t size = code.size();
+    auto succ = FindSuccessors(code);
+
+    // Liveness at the start of each instruction, solved to a fixed point (backward).
+    std::vector<BitSet> live_in(size, BitSet(num_locals));
+    BitSet live(num_locals);
+    for (bool changed = true; changed; ) {
+      changed = false;
+      for (size_t i = size; i-- > 0; ) {
+        live.Reset();
+        for (size_t next : succ[i]) live.Union(live_in[next]);
+        const Instr & inst = code[i];
+        if (inst.op == Op::LOCAL_SET || inst.op == Op::LOCAL_TEE) live.Clear(inst.arg);
+        if (inst.op == Op::LOCAL_GET) live.Set(inst.arg);
+        changed |= live_in[i].Union(live);
+      }
+    }
+
+    // Build the interference graph.
+    std::vector<BitSet> conflicts(num_locals, BitSet(num_locals));
+    auto add_conflict = [&conflicts](size_t a, size_t b) {
+      if (a == b) return;
+      conflicts[a].Set(b);
+      conflicts[b].Set(a);
+    };
+    for (size_t i = 0; i < size; ++i) {
+      const Instr & inst = code[i];
+      if (inst.op != Op::LOCAL_SET && inst.op != Op::LOCAL_TEE) continue;
+      // A copy (local.get x; local.set y) does not make x and y conflict.
+      size_t copy_of = num_locals;
+      if (i > 0 && code[i-1].op == Op::LOCAL_GET) copy_of = code[i-1].arg;
+      live.Reset();
+      for (size_t next : succ[i]) live.Union(live_in[next]);
+      live.ForEach([&](size_t id){ if (id != copy_of) add_conflict(inst.arg, id); });
+    }
+
+    // Locals read before being written rely on starting at zero, so cannot share a
+    // parameter's slot.
+    if (size) {
+      live_in[0].ForEach([&](size_t id) {
+        for (size_t param = 0; param < fun.num_params; ++param) add_conflict(param, id);
+      });
+    }
+
+    // Greedily pack locals into slots.
+    std::vector<uint32_t> slot_of(num_locals);
+    std::vector<std::vector<size_t>> slots;
+    for (size_t id = 0; id < num_locals; ++id) {
+      size_t slot = slots.size();
+      if (id >= fun.num_params) {
+        for (size_t s = 0; s < slots.size(); ++s) {
+          if (fun.locals[slots[s][0]].type != fun.locals[id].type) continue;
+          bool ok = std::none_of(slots[s].begin(), slots[s].end(),
+                                 [&](size_t member){ return conflicts[id].Has(member); });
+          if (ok) { slot = s; break; }
+        }
+      }
+      if (slot == slots.size()) slots.emplace_back();
+      slots[slot].push_back(id);
+      slot_of[id] = static_cast<uint32_t>(slot);
+    }
+    return slot_of;
+  }
+}
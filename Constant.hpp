@@ -0,0 +1,160 @@
+#pragma once
+
+// Compile-time values, and folding rules that match WebAssembly semantics exactly.
+//
+// Folding never hides a trap: any operation that would trap at run time (integer
+// division by zero, INT_MIN / -1, or truncating an out-of-range double) is left for
+// the generated code to perform.  Integer math wraps modulo 2^32.  Results that would
+// be NaN are also left unfolded, since WASM does not pin down which NaN is produced.
+
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+#include "SymbolTable.hpp"
+#include "Type.hpp"
+
+struct Constant {
+  enum Kind : uint8_t { INT, CHAR, DOUBLE };
+
+  Kind kind = INT;
+  int32_t i = 0;     // Value for INT and CHAR constants.
+  double d = 0.0;    // Value for DOUBLE constants.
+
+  static Constant Int(int32_t value) { return Constant{INT, value, 0.0}; }
+  static Constant Char(int32_t value) { return Constant{CHAR, value, 0.0}; }
+  static Constant Double(double value) { return Constant{DOUBLE, 0, value}; }
+
+  static Kind KindOf(const Type & type) {
+    if (type.IsDouble()) return DOUBLE;
+    if (type.IsChar()) return CHAR;
+    return INT;
+  }
+
+  // The initial value of a local variable of the given type.
+  static Constant Zero(const Type & type) { return Constant{KindOf(type), 0, 0.0}; }
+
+  bool IsDouble() const { return kind == DOUBLE; }
+  bool IsTrue() const { return IsDouble() ? d != 0.0 : i != 0; }
+
+  // Constants are the same only if they are bit-for-bit identical (so 0.0 and -0.0 differ).
+  bool operator==(const Constant & in) const {
+    if (kind != in.kind) return false;
+    if (IsDouble()) return std::bit_cast<uint64_t>(d) == std::bit_cast<uint64_t>(in.d);
+    return i == in.i;
+  }
+};
+
+namespace fold {
+  // Integer arithmetic wraps around, as in WASM.
+  inline int32_t Wrap(int64_t value) {
+    return static_cast<int32_t>(static_cast<uint32_t>(static_cast<uint64_t>(value)));
+  }
+
+  inline std::optional<Constant> Double(double value) {
+    if (std::isnan(value)) return std::nullopt;
+    return Constant::Double(value);
+  }
+
+  // f64.convert_i32_s (or no change if already a double).
+  inline Constant ToDouble(const Constant & value) {
+    if (value.IsDouble()) return value;
+    return Constant::Double(static_cast<double>(value.i));
+  }
+
+  // i32.trunc_f64_s (or no change for ints); traps on NaN or out-of-range values.
+  inline std::optional<Constant> ToInt(const Constant & value) {
+    if (!value.IsDouble()) return Constant::Int(value.i);
+    if (!(value.d > -2147483649.0 && value.d < 2147483648.0)) return std::nullopt;
+    return Constant::Int(static_cast<int32_t>(value.d));
+  }
+
+  // Unary operators: "!", "-", or "sqrt"
+  inline std::optional<Constant> Math1(const std::string & op, const Constant & value) {
+    if (op == "!") return Constant::Int(value.IsTrue() ? 0 : 1);
+    if (op == "-") {
+      if (value.IsDouble()) return Double(-value.d);
+      return Constant{value.kind, Wrap(-static_cast<int64_t>(value.i)), 0.0};
+    }
+    if (op == "sqrt" && value.IsDouble()) return Double(std::sqrt(value.d));
+    return std::nullopt;
+  }
+
+  // Binary operators other than assignment; both sides must already have the same kind.
+  inline std::optional<Constant> Math2(const std::string & op, const Constant & a, const Constant & b) {
+    if (op == "&&") return Constant::Int(a.IsTrue() && b.IsTrue());
+    if (op == "||") return Constant::Int(a.IsTrue() || b.IsTrue());
+
+    if (a.IsDouble() != b.IsDouble()) return std::nullopt;
+
+    if (a.IsDouble()) {
+      if (op == "+") return Double(a.d + b.d);
+      if (op == "-") return Double(a.d - b.d);
+      if (op == "*") return Double(a.d * b.d);
+      if (op == "/") return Double(a.d / b.d);
+      if (op == "<") return Constant::Int(a.d < b.d);
+      if (op == "<=") return Constant::Int(a.d <= b.d);
+      if (op == ">") return Constant::Int(a.d > b.d);
+      if (op == ">=") return Constant::Int(a.d >= b.d);
+      if (op == "==") return Constant::Int(a.d == b.d);
+      if (op == "!=") return Constant::Int(a.d != b.d);
+      return std::nullopt;
+    }
+
+    const int64_t x = a.i, y = b.i;
+    if (op == "+") return Constant{a.kind, Wrap(x + y), 0.0};
+    if (op == "-") return Constant{a.kind, Wrap(x - y), 0.0};
+    if (op == "*") return Constant{a.kind, Wrap(x * y), 0.0};
+    if (op == "/") {
+      if (y == 0 || (x == std::numeric_limits<int32_t>::min() && y == -1)) return std::nullopt;  // Traps
+      return Constant{a.kind, Wrap(x / y), 0.0};
+    }
+    if (op == "%") {
+      if (y == 0) return std::nullopt;  // Traps
+      return Constant::Int(Wrap(x % y));  // INT_MIN % -1 is 0 (no trap for remainder).
+    }
+    if (op == "<") return Constant::Int(x < y);
+    if (op == "<=") return Constant::Int(x <= y);
+    if (op == ">") return Constant::Int(x > y);
+    if (op == ">=") return Constant::Int(x >= y);
+    if (op == "==") return Constant::Int(x == y);
+    if (op == "!=") return Constant::Int(x != y);
+    return std::nullopt;
+  }
+}
+
+// Track which variables are known to hold constant values at a point in the code.
+struct ConstantTable {
+  const SymbolTable & symbols;
+  std::unordered_map<size_t, Constant> values{};  // Var ID -> known value
+
+  ConstantTable(const SymbolTable & symbols) : symbols(symbols) { }
+  ConstantTable(const ConstantTable &) = default;
+
+  const Constant * Find(size_t var_id) const {
+    auto it = values.find(var_id);
+    return (it == values.end()) ? nullptr : &it->second;
+  }
+
+  void Set(size_t var_id, const Constant & value) { values.insert_or_assign(var_id, value); }
+  void Forget(size_t var_id) { values.erase(var_id); }
+  void Forget(const std::set<size_t> & var_ids) {
+    for (size_t id : var_ids) values.erase(id);
+  }
+
+  // Replace the tracked values with those from another table.
+  void Restore(const ConstantTable & in) { values = in.values; }
+
+  // After two paths join, only values that are the same along both are still known.
+  void Merge(const ConstantTable & in) {
+    std::erase_if(values, [&in](const auto & entry) {
+      const Constant * other = in.Find(entry.first);
+      return !other || !(*other == entry.second);
+    });
+  }
+};
@@ -1,155 +1,837 @@
 #pragma once
 
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cstdint>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
+#include "Cleanup.hpp"
+#include "Coalesce.hpp"
+#include "Instruction.hpp"
+#include "Passes.hpp"
+#include "Peephole.hpp"
+#include "Profile.hpp"
+#include "SourceMap.hpp"
+#include "SSA.hpp"
+#include "StrengthReduce.hpp"
+#include "StringPool.hpp"
 #include "SymbolTable.hpp"
+#include "tools.hpp"
 
 // A struct that contains all of the state information to control compilation.
 
 struct Control {
-  SymbolTable symbols{};
+private:
+  std::shared_ptr<SymbolTable> symbol_ptr = std::make_shared<SymbolTable>();
+  std::shared_ptr<strings::Pool> string_ptr = std::make_shared<strings::Pool>();
+  std::shared_ptr<profile::Table> profile_ptr = std::make_shared<profile::Table>();
+
+public:
+  SymbolTable & symbols = *symbol_ptr;
+  strings::Pool & strings = *string_ptr;   // Literal string data for the whole module.
+  profile::Table & profile = *profile_ptr; // Profiling counters for the whole module.
   int indent = 0;
   bool final_node = false;  // Are we processing the final (right-most) node in a function?
-  size_t wat_mem_pos = 0;   // Position for generating fixed data in WAT memory.
+  passes::Pipeline pipeline = *passes::ForLevel("2");  // Which optimizations to run.
+
+  std::vector<uint32_t> break_stack; // Stack of break labels for active scopes.
+  std::vector<uint32_t> loop_stack;  // Stack of continue labels for active scopes.
 
-  std::vector<std::string> break_stack; // Stack of break labels for active scopes.
-  std::vector<std::string> loop_stack;  // Stack of continue labels for active scopes.
+  // Code generation still to do (see Then and RunSteps).
+  using step_t = StepQueue<Control &>::step_t;
+  StepQueue<Control &> steps{};
 
   // Labels are made unique by adding a number to their end; track of what number we are up to!
   std::unordered_map<std::string, size_t> label_ids;
+  struct WAT_Label {
+    std::string base;
+    size_t number;
+    std::string Name() const { return base + std::to_string(number); }
+  };
+  std::vector<WAT_Label> labels;  // Full information for each label ID.
+
+  // The instruction stream, plus the pools that instruction immediates refer into.
+  std::vector<Instr> code;
+  std::vector<double> f64_pool;
+  std::vector<std::string> notes{""};                  // Comment text; ID 0 is "no comment"
+  std::unordered_map<std::string, uint32_t> note_ids;  // Comment text -> ID (for sharing)
+
+  // Source positions of the code, if tracking them (see --source-map); ID 0 is "none".
+  bool track_positions = false;
+  std::vector<FilePos> positions{FilePos{0, 0}};
+  uint32_t position = 0;                               // ID given to new instructions
+
+  struct WAT_Local {
+    std::string name;
+    ValType type;
+  };
+
+  struct WAT_Function {
+    std::string name;
+    ValType result;
+    size_t num_params = 0;           // The first num_params locals are parameters.
+    std::vector<WAT_Local> locals{};
+  };
+  std::vector<WAT_Function> functions;
+  std::unordered_map<size_t, uint32_t> var_locals;  // Var ID -> local index (current function)
 
-  struct WAT_Line {
-    int indent;
-    std::string code;
-    std::string comment;
+  struct WAT_Global {
+    std::string name;
+    ValType type;
+    bool is_mutable;
+    int32_t init;
+    bool exported = false;   // Can the host read it (under its own name)?
   };
-  std::vector<WAT_Line> code;
+  std::vector<WAT_Global> globals;
+
+  struct WAT_Data {
+    size_t offset;
+    std::string bytes;
+  };
+  std::vector<WAT_Data> data_segments;
+
+  peephole::Stats peephole_stats;  // How often each peephole rule has been applied.
+  cleanup::Stats cleanup_stats;    // How much code the clean-up passes removed.
+  coalesce::Stats coalesce_stats;  // How many locals were merged into shared slots.
+  strength::Stats strength_stats;  // Which arithmetic operations were made cheaper.
+  ssa::Stats ssa_stats;            // How functions looked in SSA form.
+  passes::Stats pass_stats;        // What each pass cost.
 
 public:  // Member functions.
 
+  Control() = default;
+
+  // Create an empty context for generating a single function on its own.  It shares the
+  // (read-only) symbol table, the string pool, and the profiling counters with this one;
+  // Append() merges it back.
+  Control Fork() const {
+    Control out(symbol_ptr, string_ptr, profile_ptr);
+    out.indent = indent;
+    out.pipeline = pipeline;
+    out.pass_stats.enabled = pass_stats.enabled;
+    out.track_positions = track_positions;
+    return out;
+  }
+
+  // Add all code from a forked context to the end of this one.  Labels, constants,
+  // comments, data, and functions are renumbered exactly as if the code had been
+  // generated here directly.
+  void Append(const Control & part) {
+    const uint32_t fun_offset = static_cast<uint32_t>(functions.size());
+    functions.insert(functions.end(), part.functions.begin(), part.functions.end());
+    std::vector<uint32_t> label_map;
+    for (const WAT_Label & label : part.labels) label_map.push_back(MakeLabel(label.base));
+    std::vector<uint32_t> note_map{0};
+    for (size_t i = 1; i < part.notes.size(); ++i) note_map.push_back(NoteID(part.notes[i]));
+    const uint32_t pos_offset = static_cast<uint32_t>(positions.size() - 1);
+    positions.insert(positions.end(), part.positions.begin() + 1, part.positions.end());
+
+    for (Instr inst : part.code) {
+      switch (inst.op) {
+      case Op::FUNC: case Op::EXPORT: inst.arg += fun_offset; break;
+      case Op::BLOCK: case Op::LOOP: case Op::BR: case Op::BR_IF: inst.arg = label_map[inst.arg]; break;
+      case Op::F64_CONST:
+        f64_pool.push_back(part.f64_pool[inst.arg]);
+        inst.arg = static_cast<uint32_t>(f64_pool.size() - 1);
+        break;
+      case Op::DATA:
+        data_segments.push_back(part.data_segments[inst.arg]);
+        inst.arg = static_cast<uint32_t>(data_segments.size() - 1);
+        break;
+      default: break;
+      }
+      inst.note = note_map[inst.note];
+      if (inst.pos) inst.pos += pos_offset;
+      code.push_back(inst);
+    }
+    peephole_stats.Add(part.peephole_stats);
+    cleanup_stats.Add(part.cleanup_stats);
+    coalesce_stats.Add(part.coalesce_stats);
+    strength_stats.Add(part.strength_stats);
+    ssa_stats.Add(part.ssa_stats);
+    pass_stats.Add(part.pass_stats);
+  }
+
   bool FinalNode() const { return final_node; }
   void FinalNode(bool in) { final_node = in; }
 
+  // Queue a step of code generation (see StepQueue in tools.hpp); trees are generated this
+  // way (see ASTNode::ToWAT) so that they can be any depth without deep recursion.
+  void Then(step_t step) { steps.Then(std::move(step)); }
+
+  // Run a step, then everything it queues.
+  void RunSteps(step_t first) { steps.Run(std::move(first), *this); }
+
   // Change the amount of indent used.
   Control &  Indent(int diff) {
     indent += diff;
     return *this;
   }
 
-  // Provide code that should be printed.
-  template <typename... Ts>
-  Control & Code(Ts &&... args) {
-    std::stringstream ss;
-    (ss << ... << std::forward<Ts>(args));
-    code.emplace_back(indent, ss.str(), "");
+  static ValType ToValType(const Type & type) {
+    if (type.IsDouble()) return ValType::F64;
+    if (type.IsNumeric()) return ValType::I32;
+    return ValType::NONE;
+  }
+
+  // Pick the int or double version of an operation, based on type.
+  static Op TypedOp(const Type & type, Op int_op, Op double_op) {
+    return type.IsDouble() ? double_op : int_op;
+  }
+
+  // Add an instruction to the code stream.
+  Control & Code(Op op, uint32_t arg=Instr::NO_ARG, ValType type=ValType::NONE) {
+    const uint16_t line_indent = static_cast<uint16_t>(std::clamp(indent, 0, 0xFFFF));
+    code.push_back(Instr{op, type, line_indent, arg, 0, position});
     return *this;
   }
 
-  // Add code for string data and return its memory position.
-  // (NOTE: THIS IS A HELPER FOR PROJECT 4!)
-  size_t Data(std::string str) {
-    Code("(data (i32.const ", wat_mem_pos ,") \"", str, "\\00\")");
-    size_t out = wat_mem_pos;
-    wat_mem_pos += str.size() + 1;
-    return out;
+  // Mark code added from here on as coming from a source position (if tracking them);
+  // return the ID of the previous position, to go back to with RestorePosition().
+  uint32_t SetPosition(FilePos pos) {
+    const uint32_t prev = position;
+    if (track_positions && positions[position] != pos) {
+      positions.push_back(pos);
+      position = static_cast<uint32_t>(positions.size() - 1);
+    }
+    return prev;
+  }
+  void RestorePosition(uint32_t id) { position = id; }
+
+  Control & I32Const(int32_t value) { return Code(Op::I32_CONST, static_cast<uint32_t>(value)); }
+  Control & F64Const(double value) {
+    f64_pool.push_back(value);
+    return Code(Op::F64_CONST, static_cast<uint32_t>(f64_pool.size() - 1));
+  }
+
+  // Access a Tubular variable (local.get, local.set, or local.tee)
+  Control & VarCode(Op op, size_t var_id) { return Code(op, VarLocal(var_id)); }
+
+  // Store a literal string (with a null terminator) and return its ID; look up its memory
+  // position with DataPosition() once all strings are placed.  Strings are shared, so nodes
+  // should add them in InitializeWAT; the pool is not thread-safe while strings are being
+  // added.  (NOTE: THESE ARE HELPERS FOR PROJECT 4!)
+  uint32_t Data(const std::string & str) { return strings.Add(str); }
+  size_t DataPosition(uint32_t id) const { return strings.Position(id); }
+
+  // Add one to a profiling counter (see --instrument).
+  Control & CountProfile(uint32_t counter) {
+    const uint32_t base = profile.BaseGlobal();
+    const uint32_t offset = profile::Table::Offset(counter);
+    return Code(Op::GLOBAL_GET, base).Code(Op::GLOBAL_GET, base)
+          .Code(Op::I32_LOAD, offset).I32Const(1).Code(Op::I32_ADD)
+          .Code(Op::I32_STORE, offset);
+  }
+
+  // Add the single data segment holding every literal string (once all are placed).
+  Control & StringData() {
+    if (strings.Bytes().empty()) return *this;
+    data_segments.emplace_back(strings.Base(), strings.Bytes());
+    return Code(Op::DATA, static_cast<uint32_t>(data_segments.size() - 1));
   }
 
   // Drop the top value on the stack.
   // Either remove the last instruction (if no side effects) or add a "(drop)"
   Control & Drop() {
-    if (code.back().code.starts_with("(local.get")) {
+    if (code.back().op == Op::LOCAL_GET) {
       code.pop_back();
     } else {
-      code.emplace_back(indent, "(drop)", "Remove unneeded value from stack.");
+      Code(Op::DROP).Comment("Remove unneeded value from stack.");
     }
     return *this;
   }
 
+  // Find (or create) the ID for a comment.
+  uint32_t NoteID(const std::string & text) {
+    auto [it, added] = note_ids.emplace(text, static_cast<uint32_t>(notes.size()));
+    if (added) notes.push_back(text);
+    return it->second;
+  }
+
   // Add a comment to the most recent line of code added.
   template <typename... Ts>
   Control & Comment(Ts &&... args) {
-    std::stringstream ss;
-    (ss << ... << std::forward<Ts>(args));
-    code.back().comment = ss.str();
+    code.back().note = NoteID(ToString(std::forward<Ts>(args)...));
     return *this;
   }
 
   // Special command for a whole-line comment that should indent with the code.
   template <typename... Ts>
   Control & CommentLine(Ts &&... args) {
-    code.emplace_back(indent, "", "");
+    Code(Op::NOTE);
     return Comment(std::forward<Ts>(args)...);
   }
 
-  // Generate code to the provided output stream (cout by default)
-  void PrintCode(std::ostream & os=std::cout) const {
+  // Skip a line in the text output.
+  Control & Blank() { return Code(Op::BLANK); }
+
+  // ----------  Module Structure --------------
+
+  // Start a new function; must be closed with Code(Op::END)
+  Control & StartFunction(std::string name, ValType result) {
+    functions.emplace_back(name, result);
+    var_locals.clear();
+    return Code(Op::FUNC, static_cast<uint32_t>(functions.size() - 1));
+  }
+
+  uint32_t AddParam(std::string name, ValType type) {
+    WAT_Function & fun = functions.back();
+    assert(fun.num_params == fun.locals.size());  // Params must precede locals.
+    fun.locals.emplace_back(name, type);
+    return static_cast<uint32_t>(fun.num_params++);
+  }
+
+  uint32_t AddLocal(std::string name, ValType type) {
+    WAT_Function & fun = functions.back();
+    fun.locals.emplace_back(name, type);
+    const uint32_t local_id = static_cast<uint32_t>(fun.locals.size() - 1);
+    Code(Op::LOCAL, local_id);
+    return local_id;
+  }
+
+  uint32_t VarLocal(size_t var_id) const {
+    auto it = var_locals.find(var_id);
+    assert(it != var_locals.end());
+    return it->second;
+  }
+
+  // Register a global variable; its declaration is placed with Code(Op::GLOBAL, id).
+  uint32_t AddGlobal(std::string name, ValType type, bool is_mutable, int32_t init=0) {
+    globals.emplace_back(name, type, is_mutable, init);
+    return static_cast<uint32_t>(globals.size() - 1);
+  }
+
+  Control & Export(size_t fun_id) { return Code(Op::EXPORT, static_cast<uint32_t>(fun_id)); }
+
+  // Run a function on the code of each complete function (from FUNC to its END) in turn.
+  template <typename FUN_T>
+  void ForEachFunction(FUN_T fun) {
+    std::vector<Instr> out, body;
+    out.reserve(code.size());
+    for (size_t i = 0; i < code.size(); ++i) {
+      if (code[i].op != Op::FUNC) { out.push_back(code[i]); continue; }
+      size_t depth = 0;
+      body.clear();
+      do {
+        if (cleanup::IsOpener(code[i].op)) ++depth;
+        else if (code[i].op == Op::END) --depth;
+        body.push_back(code[i]);
+      } while (depth && ++i < code.size());
+      fun(body, functions[body[0].arg]);
+      out.insert(out.end(), body.begin(), body.end());
+    }
+    code = std::move(out);
+  }
+
+  // Clean up inefficiencies in the code generated so far, running each code pass in the
+  // pipeline in order.
+  void OptimizeCode() {
+    ForEachFunction([this](std::vector<Instr> & body, WAT_Function & fun) {
+      pipeline.ForEach(passes::Stage::CODE, [&](passes::ID id) {
+        passes::Run(pass_stats, id, [&body](){ return passes::CountInstructions(body); },
+                    [&](){ RunCodePass(id, body, fun); });
+      });
+    });
+  }
+
+  void RunCodePass(passes::ID id, std::vector<Instr> & body, WAT_Function & fun) {
+    using enum passes::ID;
+    switch (id) {
+    case UNREACHABLE: cleanup::RemoveUnreachable(body, cleanup_stats); break;
+    case UNUSED_LOCALS: cleanup::RemoveUnusedLocals(body, fun, cleanup_stats); break;
+    case STRENGTH: strength::Reduce(body, fun, f64_pool, strength_stats); break;
+    case PEEPHOLE: peephole::Optimize(body, peephole_stats); break;
+    case COLLAPSE: cleanup::CollapseEmptyBranches(body, cleanup_stats); break;
+    case COALESCE: CoalesceLocals(body, fun); break;
+    default: assert(false);  // Not a code pass.
+    }
+  }
+
+  // Let locals that are never live at the same time share a slot.
+  void CoalesceLocals(std::vector<Instr> & body, WAT_Function & fun) {
+    const std::vector<uint32_t> slot_of = coalesce::AssignSlots(body, fun);
+    std::vector<WAT_Local> locals;
+    for (size_t id = 0; id < fun.locals.size(); ++id) {
+      if (slot_of[id] == locals.size()) locals.push_back(fun.locals[id]);
+    }
+    if (locals.size() == fun.locals.size()) return;
+    coalesce_stats.merged += fun.locals.size() - locals.size();
+    fun.locals = std::move(locals);
+
+    std::vector<Instr> out;
+    out.reserve(body.size());
+    std::unordered_map<uint32_t, size_t> slot_decl;   // Slot -> position of its declaration
+    for (Instr inst : body) {
+      if (inst.op == Op::LOCAL || inst.op == Op::LOCAL_GET ||
+          inst.op == Op::LOCAL_SET || inst.op == Op::LOCAL_TEE) {
+        const uint32_t slot = slot_of[inst.arg];
+        if (inst.op == Op::LOCAL) {
+          // Only declare each slot once (parameters are already declared), but keep comments
+          // about everything it holds.
+          if (slot < fun.num_params) continue;
+          auto [it, added] = slot_decl.emplace(slot, out.size());
+          if (!added) {
+            Instr & decl = out[it->second];
+            if (inst.note) {
+              decl.note = decl.note ? NoteID(notes[decl.note] + "; " + notes[inst.note]) : inst.note;
+            }
+            continue;
+          }
+        }
+        inst.arg = slot;
+      }
+      out.push_back(inst);
+    }
+    body = std::move(out);
+  }
+
+  // ----------  Output --------------
+
+  // Convert a double to the shortest text that reads back as the same value.
+  static std::string DoubleText(double value) {
+    char buffer[32];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    return std::string(buffer, result.ptr);
+  }
+
+  // Quote data bytes for a WAT string literal.
+  static std::string QuoteData(const std::string & bytes) {
+    static constexpr char HEX[] = "0123456789abcdef";
+    std::string out = "\"";
+    for (unsigned char c : bytes) {
+      if (c >= 32 && c < 127 && c != '"' && c != '\\') out += static_cast<char>(c);
+      else { out += '\\'; out += HEX[c >> 4]; out += HEX[c & 15]; }
+    }
+    return out + "\"";
+  }
+
+  // Generate the WAT text for a single instruction.
+  std::string InstrText(const Instr & inst, const WAT_Function * fun) const {
+    const std::string name = GetOpInfo(inst.op).name;
+    auto local_name = [fun](uint32_t id) { assert(fun); return fun->locals[id].name; };
+    switch (inst.op) {
+    case Op::MODULE: return "(module";
+    case Op::MEMORY: return ToString("(memory (export \"memory\") ", inst.arg, ")");
+    case Op::GLOBAL: {
+      const WAT_Global & global = globals[inst.arg];
+      std::string type = ValTypeName(global.type);
+      if (global.is_mutable) type = ToString("(mut ", type, ")");
+      if (global.exported) type = ToString("(export \"", global.name, "\") ", type);
+      return ToString("(global $", global.name, " ", type, " (i32.const ", global.init, "))");
+    }
+    case Op::DATA: {
+      const WAT_Data & data = data_segments[inst.arg];
+      return ToString("(data (i32.const ", data.offset, ") ", QuoteData(data.bytes), ")");
+    }
+    case Op::FUNC: {
+      const WAT_Function & func = functions[inst.arg];
+      std::string out = ToString("(func $", func.name);
+      for (size_t i = 0; i < func.num_params; ++i) {
+        out += ToString(" (param ", func.locals[i].name, " ", ValTypeName(func.locals[i].type), ")");
+      }
+      if (func.result != ValType::NONE) out += ToString(" (result ", ValTypeName(func.result), ")");
+      return out;
+    }
+    case Op::LOCAL:
+      return ToString("(local ", local_name(inst.arg), " ", ValTypeName(fun->locals[inst.arg].type), ")");
+    case Op::EXPORT: {
+      const std::string & fun_name = functions[inst.arg].name;
+      return ToString("(export \"", fun_name, "\" (func $", fun_name, "))");
+    }
+    case Op::END: return ")";
+    case Op::BLANK: case Op::NOTE: return "";
+    case Op::BLOCK: case Op::LOOP: return ToString("(", name, " ", labels[inst.arg].Name());
+    case Op::IF:
+      if (inst.type == ValType::NONE) return "(if";
+      return ToString("(if (result ", ValTypeName(inst.type), ")");
+    case Op::THEN: case Op::ELSE: return ToString("(", name);
+    case Op::BR: case Op::BR_IF: return ToString("(", name, " ", labels[inst.arg].Name(), ")");
+    case Op::LOCAL_GET: case Op::LOCAL_SET: case Op::LOCAL_TEE:
+      return ToString("(", name, " ", local_name(inst.arg), ")");
+    case Op::GLOBAL_GET: case Op::GLOBAL_SET:
+      return ToString("(", name, " $", globals[inst.arg].name, ")");
+    case Op::CALL: return ToString("(call $", functions[inst.arg].name, ")");
+    case Op::I32_LOAD8_U: case Op::I32_STORE8: case Op::I32_LOAD: case Op::I32_STORE:
+    case Op::V128_LOAD:
+      if (inst.arg == 0 || inst.arg == Instr::NO_ARG) return ToString("(", name, ")");
+      return ToString("(", name, " offset=", inst.arg, ")");
+    case Op::I32_CONST: return ToString("(i32.const ", inst.IntArg(), ")");
+    case Op::F64_CONST: return ToString("(f64.const ", DoubleText(f64_pool[inst.arg]), ")");
+    case Op::I64_CONST: return ToString("(i64.const ", inst.arg, ")");
+    default: return ToString("(", name, ")");
+    }
+  }
+
+  // Generate code to the provided output stream (cout by default), noting in map (if any)
+  // which source position each line comes from.
+  void PrintCode(std::ostream & os=std::cout, srcmap::Map * map=nullptr) const {
     // First, process code to identify the widest line with a comment.
     size_t max_width = 0;
-    for (const auto & line : code) {
-      if (line.comment.size() && line.code.size() > max_width) {
-        max_width = line.code.size();
-      }
+    const WAT_Function * fun = nullptr;
+    for (const auto & inst : code) {
+      if (inst.op == Op::FUNC) fun = &functions[inst.arg];
+      if (inst.note) max_width = std::max(max_width, InstrText(inst, fun).size());
     }
 
     // Print code, line by line.
-    for (const auto & line : code) {
-      os << std::string(line.indent, ' '); // Tabbing
-      os << line.code;
-      if (line.comment.size()) {
-        if (line.code.size()) { // If there is code on this line, align comments.
-          size_t gap = max_width - line.code.size() + 2;
+    fun = nullptr;
+    for (const auto & inst : code) {
+      if (inst.op == Op::FUNC) fun = &functions[inst.arg];
+      const std::string line = InstrText(inst, fun);
+      os << std::string(inst.indent, ' '); // Tabbing
+      os << line;
+      if (inst.note) {
+        if (line.size()) { // If there is code on this line, align comments.
+          size_t gap = max_width - line.size() + 2;
           os << std::string(gap, ' ');
         }
-        os << ";; " << line.comment;
+        os << ";; " << notes[inst.note];
+      }
+      os << '\n';
+      if (map) {
+        if (inst.op == Op::NOTE || inst.op == Op::BLANK) map->SkipLine();
+        else map->AddLine(positions[inst.pos]);
       }
-      os << std::endl;
     }
+    os.flush();
   }
 
-  // Add a unique number to the end of any label base provided.
-  // E.g., "loop" might become "loop13".
-  std::string MakeLabel(std::string base) {
-    size_t id = ++label_ids[base];
-    return base + std::to_string(id);
+  // Helpers for binary output.
+  static void AddULEB(std::string & out, uint64_t value) {
+    do {
+      uint8_t byte = value & 0x7F;
+      value >>= 7;
+      out += static_cast<char>(value ? (byte | 0x80) : byte);
+    } while (value);
+  }
+
+  static void AddSLEB(std::string & out, int64_t value) {
+    while (true) {
+      uint8_t byte = value & 0x7F;
+      value >>= 7;
+      if ((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40))) {
+        out += static_cast<char>(byte);
+        return;
+      }
+      out += static_cast<char>(byte | 0x80);
+    }
+  }
+
+  static void AddName(std::string & out, const std::string & name) {
+    AddULEB(out, name.size());
+    out += name;
+  }
+
+  static void AddSection(std::string & out, uint8_t id, size_t count, const std::string & body) {
+    std::string payload;
+    AddULEB(payload, count);
+    payload += body;
+    out += static_cast<char>(id);
+    AddULEB(out, payload.size());
+    out += payload;
+  }
+
+  // A binary module under construction; code can be encoded into it one piece at a time.
+  struct BinaryModule {
+    std::vector<std::string> types{};    // Encoded function signatures.
+    std::string func_section{}, export_section{}, code_section{}, data_section{};
+    size_t func_count = 0;
+    size_t export_count = 0;
+    size_t data_count = 0;
+    uint32_t memory_pages = 0;
+    bool has_memory = false;
+    std::vector<srcmap::Mapping> mappings{};   // Offsets into code_section (if tracking positions).
+  };
+
+  // Encode the current code stream into a binary module.
+  // Any functions in the stream must be complete.
+  void EncodeBinary(BinaryModule & module) const {
+    auto & [types, func_section, export_section, code_section, data_section,
+            func_count, export_count, data_count, memory_pages, has_memory, mappings] = module;
+
+    enum class Open { FUNC, BLOCK, THEN, ELSE };
+    std::vector<Open> open_stack;
+    std::vector<uint32_t> label_stack;   // Label IDs of open blocks (NO_ARG if unlabeled)
+    std::string body;
+    size_t body_mappings = 0;   // Where this function's mappings start.
+
+    for (const auto & inst : code) {
+      const OpInfo & info = GetOpInfo(inst.op);
+      // Code starting here comes from this instruction's position (until a later one).
+      if (track_positions && open_stack.size()) mappings.emplace_back(body.size(), positions[inst.pos]);
+      switch (inst.op) {
+      case Op::MODULE: break;
+      case Op::MEMORY:
+        has_memory = true;
+        memory_pages = inst.arg;
+        AddName(export_section, "memory");
+        export_section += '\x02';
+        AddULEB(export_section, 0);
+        ++export_count;
+        break;
+      case Op::GLOBAL:         // Globals are written from the table when finishing.
+        if (globals[inst.arg].exported) {
+          AddName(export_section, globals[inst.arg].name);
+          export_section += '\x03';
+          AddULEB(export_section, inst.arg);
+          ++export_count;
+        }
+        break;
+      case Op::DATA: {
+        const WAT_Data & data = data_segments[inst.arg];
+        data_section += '\x00';
+        data_section += '\x41';
+        AddSLEB(data_section, static_cast<int64_t>(data.offset));
+        data_section += '\x0B';
+        AddName(data_section, data.bytes);
+        ++data_count;
+        break;
+      }
+      case Op::FUNC: {
+        const WAT_Function & func = functions[inst.arg];
+        std::string sig = "\x60";
+        AddULEB(sig, func.num_params);
+        for (size_t i = 0; i < func.num_params; ++i) sig += static_cast<char>(ValTypeByte(func.locals[i].type));
+        AddULEB(sig, func.result == ValType::NONE ? 0 : 1);
+        if (func.result != ValType::NONE) sig += static_cast<char>(ValTypeByte(func.result));
+        size_t type_id = std::find(types.begin(), types.end(), sig) - types.begin();
+        if (type_id == types.size()) types.push_back(sig);
+        AddULEB(func_section, type_id);
+        ++func_count;
+
+        // Locals are declared in runs of identical types.
+        std::vector<std::pair<size_t, ValType>> runs;
+        for (size_t i = func.num_params; i < func.locals.size(); ++i) {
+          if (runs.size() && runs.back().second == func.locals[i].type) runs.back().first++;
+          else runs.emplace_back(1, func.locals[i].type);
+        }
+        body.clear();
+        AddULEB(body, runs.size());
+        for (auto [count, type] : runs) {
+          AddULEB(body, count);
+          body += static_cast<char>(ValTypeByte(type));
+        }
+        body_mappings = mappings.size();
+        open_stack.push_back(Open::FUNC);
+        break;
+      }
+      case Op::LOCAL: case Op::BLANK: case Op::NOTE: break;
+      case Op::EXPORT:
+        AddName(export_section, functions[inst.arg].name);
+        export_section += '\x00';
+        AddULEB(export_section, inst.arg);
+        ++export_count;
+        break;
+      case Op::END: {
+        if (open_stack.empty()) break;  // End of module.
+        Open closed = open_stack.back();
+        open_stack.pop_back();
+        if (closed == Open::FUNC || closed == Open::BLOCK) body += '\x0B';
+        if (closed == Open::BLOCK) label_stack.pop_back();
+        if (closed == Open::FUNC) {
+          AddULEB(code_section, body.size());
+          for (size_t i = body_mappings; i < mappings.size(); ++i) mappings[i].offset += code_section.size();
+          code_section += body;
+        }
+        break;
+      }
+      case Op::BLOCK: case Op::LOOP: case Op::IF:
+        body += static_cast<char>(info.code);
+        body += static_cast<char>(ValTypeByte(inst.type));
+        open_stack.push_back(Open::BLOCK);
+        label_stack.push_back(inst.op == Op::IF ? Instr::NO_ARG : inst.arg);
+        break;
+      case Op::THEN: open_stack.push_back(Open::THEN); break;
+      case Op::ELSE:
+        body += static_cast<char>(info.code);
+        open_stack.push_back(Open::ELSE);
+        break;
+      case Op::BR: case Op::BR_IF: {
+        auto it = std::find(label_stack.rbegin(), label_stack.rend(), inst.arg);
+        assert(it != label_stack.rend());
+        body += static_cast<char>(info.code);
+        AddULEB(body, static_cast<size_t>(it - label_stack.rbegin()));
+        break;
+      }
+      case Op::LOCAL_GET: case Op::LOCAL_SET: case Op::LOCAL_TEE:
+      case Op::GLOBAL_GET: case Op::GLOBAL_SET: case Op::CALL:
+        body += static_cast<char>(info.code);
+        AddULEB(body, inst.arg);
+        break;
+      case Op::I32_LOAD8_U: case Op::I32_STORE8: case Op::I32_LOAD: case Op::I32_STORE: {
+        const bool word = (inst.op == Op::I32_LOAD || inst.op == Op::I32_STORE);
+        body += static_cast<char>(info.code);
+        AddULEB(body, word ? 2 : 0);  // Alignment (log2 bytes): words or single bytes
+        AddULEB(body, inst.arg == Instr::NO_ARG ? 0 : inst.arg);
+        break;
+      }
+      case Op::MEMORY_SIZE: case Op::MEMORY_GROW:
+        body += static_cast<char>(info.code);
+        body += '\x00';  // Memory index
+        break;
+      case Op::MEMORY_COPY:
+        body += static_cast<char>(info.code);
+        AddULEB(body, 10);
+        body += std::string(2, '\x00');  // Destination and source memory indices
+        break;
+      case Op::MEMORY_FILL:
+        body += static_cast<char>(info.code);
+        AddULEB(body, 11);
+        body += '\x00';  // Memory index
+        break;
+      case Op::V128_LOAD:
+        body += static_cast<char>(info.code);
+        AddULEB(body, 0);
+        AddULEB(body, 4);  // Alignment hint: 16 bytes (the text default); any address works
+        AddULEB(body, inst.arg == Instr::NO_ARG ? 0 : inst.arg);
+        break;
+      case Op::I8X16_EQ: body += static_cast<char>(info.code); AddULEB(body, 35); break;
+      case Op::I8X16_ALL_TRUE: body += static_cast<char>(info.code); AddULEB(body, 99); break;
+      case Op::I32_CONST:
+        body += static_cast<char>(info.code);
+        AddSLEB(body, inst.IntArg());
+        break;
+      case Op::I64_CONST:
+        body += static_cast<char>(info.code);
+        AddSLEB(body, static_cast<int64_t>(inst.arg));
+        break;
+      case Op::F64_CONST: {
+        body += static_cast<char>(info.code);
+        uint64_t bits = std::bit_cast<uint64_t>(f64_pool[inst.arg]);
+        for (size_t i = 0; i < 8; ++i) body += static_cast<char>((bits >> (8*i)) & 0xFF);
+        break;
+      }
+      default:
+        body += static_cast<char>(info.code);
+      }
+    }
+
+    assert(open_stack.empty());
   }
 
-  // Get the most recent label made with a given name.
-  std::string GetLastLabel(std::string base) const {
-    auto it = label_ids.find(base);
-    assert(it != label_ids.end());
-    return base + std::to_string(it->second);
+  // Write out a fully encoded binary module, noting in map (if any) which source position
+  // each instruction comes from.
+  void FinishBinary(const BinaryModule & module, std::ostream & os=std::cout, srcmap::Map * map=nullptr) const {
+    std::string out("\0asm\x01\0\0\0", 8);
+    std::string type_section;
+    for (const auto & sig : module.types) type_section += sig;
+    AddSection(out, 1, module.types.size(), type_section);
+    AddSection(out, 3, module.func_count, module.func_section);
+    if (module.has_memory) {
+      std::string memory_section(1, '\x00');  // Flags: no maximum size.
+      AddULEB(memory_section, module.memory_pages);
+      AddSection(out, 5, 1, memory_section);
+    }
+    if (globals.size()) {
+      std::string global_section;
+      for (const WAT_Global & global : globals) {
+        global_section += static_cast<char>(ValTypeByte(global.type));
+        global_section += static_cast<char>(global.is_mutable ? 1 : 0);
+        global_section += '\x41';
+        AddSLEB(global_section, global.init);
+        global_section += '\x0B';
+      }
+      AddSection(out, 6, globals.size(), global_section);
+    }
+    AddSection(out, 7, module.export_count, module.export_section);
+    AddSection(out, 10, module.func_count, module.code_section);
+    if (map) {
+      const size_t code_start = out.size() - module.code_section.size();
+      for (const srcmap::Mapping & mapping : module.mappings) map->Add(code_start + mapping.offset, mapping.pos);
+    }
+    if (module.data_count) AddSection(out, 11, module.data_count, module.data_section);
+    if (map && map->URL().size()) {   // A custom section saying where the source map is.
+      std::string url_section;
+      AddName(url_section, "sourceMappingURL");
+      AddName(url_section, map->URL());
+      out += '\x00';
+      AddULEB(out, url_section.size());
+      out += url_section;
+    }
+    os.write(out.data(), static_cast<std::streamsize>(out.size()));
+    os.flush();
+  }
+
+  // Generate a binary WASM module to the provided output stream.
+  void PrintBinary(std::ostream & os=std::cout, srcmap::Map * map=nullptr) const {
+    BinaryModule module;
+    EncodeBinary(module);
+    FinishBinary(module, os, map);
+  }
+
+  // Release all code that has already been printed or encoded, keeping only the state
+  // needed by code that is still to come (label counters, function names, globals).
+  void ReleaseCode() {
+    code.clear();
+    f64_pool.clear();
+    notes.resize(1);
+    note_ids.clear();
+    positions.erase(positions.begin() + 1, positions.end());
+    position = 0;
+    labels.clear();
+    data_segments.clear();
+    for (WAT_Function & fun : functions) {
+      fun.locals.clear();
+      fun.locals.shrink_to_fit();
+    }
   }
 
-  void PushBreakLabel(std::string label) { break_stack.push_back(label); }
+  // Add a unique number to the end of any label base provided and return its ID.
+  // E.g., "loop" might become "loop13".
+  uint32_t MakeLabel(std::string base) {
+    size_t id = ++label_ids[base];
+    labels.emplace_back(base, id);
+    return static_cast<uint32_t>(labels.size() - 1);
+  }
+
+  void PushBreakLabel(uint32_t label) { break_stack.push_back(label); }
   void PopBreakLabel() { break_stack.pop_back(); }
   bool HasBreakLabel() const { return break_stack.size(); }
-  std::string GetBreakLabel() const {
+  uint32_t GetBreakLabel() const {
     assert(HasBreakLabel());
     return break_stack.back();
   }
 
-  void PushLoopLabel(std::string label) { loop_stack.push_back(label); }
+  void PushLoopLabel(uint32_t label) { loop_stack.push_back(label); }
   void PopLoopLabel() { loop_stack.pop_back(); }
   bool HasLoopLabel() const { return loop_stack.size(); }
-  std::string GetLoopLabel() const {
+  uint32_t GetLoopLabel() const {
     assert(HasLoopLabel());
     return loop_stack.back();
   }
 
   // ----------  Symbol Table Management --------------
 
+  // Declare the provided variable IDs as parameters of the current function.
+  void WATDeclareParams(const std::vector<size_t> & param_ids) {
+    for (size_t i : param_ids) {
+      var_locals[i] = AddParam(ToString("$var", i), WATType(i));
+    }
+  }
+
   // Declare the set of variable ID's provided here.
-  void WATDeclareSymbols(std::vector<size_t> var_ids) {
+  void WATDeclareSymbols(const std::vector<size_t> & var_ids) {
     // All local symbols must be declared at the beginning of the function.
     CommentLine("Variables");
     for (size_t i : var_ids) {
-      Code("(local $var", i, " ", WATType(i), ")").Comment("Variable: ", symbols.GetName(i));
+      var_locals[i] = AddLocal(ToString("$var", i), WATType(i));
+      Comment("Variable: ", symbols.GetName(i));
     }
-    Code("");
+    Blank();
   }
 
-  std::string WATType(size_t var_id) const {
-    return symbols.GetType(var_id).ToWAT();
+  ValType WATType(size_t var_id) const {
+    return ToValType(symbols.GetType(var_id));
   }
+
+private:
+  Control(std::shared_ptr<SymbolTable> symbol_ptr, std::shared_ptr<strings::Pool> string_ptr,
+          std::shared_ptr<profile::Table> profile_ptr)
+    : symbol_ptr(symbol_ptr), string_ptr(string_ptr), profile_ptr(profile_ptr) { }
 };
@@ -0,0 +1,183 @@
+#pragma once
+
+// A compact, typed representation of a single WebAssembly instruction.
+//
+// Control records generated code as a stream of Instr objects rather than formatted
+// text.  Each instruction is an opcode plus one 32-bit immediate (a local index,
+// label ID, constant, or pool index), so later passes can inspect and rewrite code
+// cheaply.  Printers render the stream as WAT text or as a binary WASM module.
+
+#include <array>
+#include <assert.h>
+#include <cstdint>
+#include <string>
+
+// Value types that WASM instructions and locals can have.
+enum class ValType : uint8_t { NONE=0, I32, I64, F64 };
+
+inline std::string ValTypeName(ValType type) {
+  switch (type) {
+    case ValType::I32: return "i32";
+    case ValType::I64: return "i64";
+    case ValType::F64: return "f64";
+    default: return "";
+  }
+}
+
+inline uint8_t ValTypeByte(ValType type) {
+  switch (type) {
+    case ValType::I32: return 0x7F;
+    case ValType::I64: return 0x7E;
+    case ValType::F64: return 0x7C;
+    default: return 0x40;  // Empty block type.
+  }
+}
+
+enum class Op : uint8_t {
+  // -- Module structure (markers only; details live in tables inside Control) --
+  MODULE,      // (module ... )
+  MEMORY,      // arg = number of pages
+  GLOBAL,      // arg = global index
+  DATA,        // arg = data segment index
+  FUNC,        // arg = function index
+  LOCAL,       // arg = local index (a declaration inside the current function)
+  EXPORT,      // arg = function index
+  END,         // Close the innermost open construct.
+  BLANK,       // Empty line in text output.
+  NOTE,        // Comment-only line in text output.
+
+  // -- Structured control flow --
+  BLOCK,       // arg = label ID
+  LOOP,        // arg = label ID
+  IF,          // type = result type (if any)
+  THEN,
+  ELSE,
+  BR,          // arg = label ID
+  BR_IF,       // arg = label ID
+  RETURN,
+  DROP,
+  SELECT,
+  UNREACHABLE,
+  NOP,
+  CALL,        // arg = function index (within the whole module)
+
+  // -- Variables --
+  LOCAL_GET,   // arg = local index
+  LOCAL_SET,
+  LOCAL_TEE,
+  GLOBAL_GET,  // arg = global index
+  GLOBAL_SET,
+
+  // -- Memory (arg = static offset) --
+  I32_LOAD8_U,
+  I32_STORE8,
+  I32_LOAD,
+  I32_STORE,
+  MEMORY_SIZE, // (no offset)
+  MEMORY_GROW,
+  MEMORY_COPY, // Bulk memory (no offset)
+  MEMORY_FILL,
+  V128_LOAD,   // SIMD (only used by the runtime, and only with --simd)
+  I8X16_EQ,
+  I8X16_ALL_TRUE,
+
+  // -- Constants --
+  I32_CONST,   // arg = value
+  F64_CONST,   // arg = index into f64 constant pool
+  I64_CONST,   // arg = value (only non-negative values up to 2^32-1 are needed)
+
+  // -- i32 operations --
+  I32_EQZ, I32_EQ, I32_NE, I32_LT_S, I32_GT_S, I32_LE_S, I32_GE_S,
+  I32_ADD, I32_SUB, I32_MUL, I32_DIV_S, I32_REM_S,
+  I32_AND, I32_OR, I32_XOR, I32_SHL, I32_SHR_S, I32_SHR_U,
+  I32_LT_U, I32_GT_U, I32_LE_U, I32_GE_U, I32_CLZ,   // (only used by the runtime)
+
+  // -- f64 operations --
+  F64_EQ, F64_NE, F64_LT, F64_GT, F64_LE, F64_GE,
+  F64_ADD, F64_SUB, F64_MUL, F64_DIV, F64_NEG, F64_SQRT,
+
+  // -- i64 operations (only used for wide multiplies) --
+  I64_MUL, I64_SHR_S,
+
+  // -- Conversions --
+  I32_TRUNC_F64_S,
+  F64_CONVERT_I32_S,
+  I32_WRAP_I64,
+  I64_EXTEND_I32_S,
+
+  NUM_OPS
+};
+
+// Static information about each opcode.
+struct OpInfo {
+  Op op;
+  const char * name;   // WAT mnemonic (empty for structural markers).
+  uint8_t code;        // Binary opcode (0 for structural markers; the prefix byte for
+                       // prefixed opcodes, whose second part the encoder adds).
+};
+
+static constexpr std::array<OpInfo, static_cast<size_t>(Op::NUM_OPS)> OP_INFO = {{
+  {Op::MODULE, "module", 0},      {Op::MEMORY, "memory", 0},     {Op::GLOBAL, "global", 0},
+  {Op::DATA, "data", 0},          {Op::FUNC, "func", 0},         {Op::LOCAL, "local", 0},
+  {Op::EXPORT, "export", 0},      {Op::END, "", 0x0B},           {Op::BLANK, "", 0},
+  {Op::NOTE, "", 0},
+  {Op::BLOCK, "block", 0x02},     {Op::LOOP, "loop", 0x03},      {Op::IF, "if", 0x04},
+  {Op::THEN, "then", 0},          {Op::ELSE, "else", 0x05},      {Op::BR, "br", 0x0C},
+  {Op::BR_IF, "br_if", 0x0D},     {Op::RETURN, "return", 0x0F},  {Op::DROP, "drop", 0x1A},
+  {Op::SELECT, "select", 0x1B},   {Op::UNREACHABLE, "unreachable", 0x00},
+  {Op::NOP, "nop", 0x01},            {Op::CALL, "call", 0x10},
+  {Op::LOCAL_GET, "local.get", 0x20},   {Op::LOCAL_SET, "local.set", 0x21},
+  {Op::LOCAL_TEE, "local.tee", 0x22},   {Op::GLOBAL_GET, "global.get", 0x23},
+  {Op::GLOBAL_SET, "global.set", 0x24},
+  {Op::I32_LOAD8_U, "i32.load8_u", 0x2D}, {Op::I32_STORE8, "i32.store8", 0x3A},
+  {Op::I32_LOAD, "i32.load", 0x28},     {Op::I32_STORE, "i32.store", 0x36},
+  {Op::MEMORY_SIZE, "memory.size", 0x3F}, {Op::MEMORY_GROW, "memory.grow", 0x40},
+  {Op::MEMORY_COPY, "memory.copy", 0xFC}, {Op::MEMORY_FILL, "memory.fill", 0xFC},
+  {Op::V128_LOAD, "v128.load", 0xFD},   {Op::I8X16_EQ, "i8x16.eq", 0xFD},
+  {Op::I8X16_ALL_TRUE, "i8x16.all_true", 0xFD},
+  {Op::I32_CONST, "i32.const", 0x41},   {Op::F64_CONST, "f64.const", 0x44},
+  {Op::I64_CONST, "i64.const", 0x42},
+  {Op::I32_EQZ, "i32.eqz", 0x45},   {Op::I32_EQ, "i32.eq", 0x46},     {Op::I32_NE, "i32.ne", 0x47},
+  {Op::I32_LT_S, "i32.lt_s", 0x48}, {Op::I32_GT_S, "i32.gt_s", 0x4A}, {Op::I32_LE_S, "i32.le_s", 0x4C},
+  {Op::I32_GE_S, "i32.ge_s", 0x4E},
+  {Op::I32_ADD, "i32.add", 0x6A},   {Op::I32_SUB, "i32.sub", 0x6B},   {Op::I32_MUL, "i32.mul", 0x6C},
+  {Op::I32_DIV_S, "i32.div_s", 0x6D}, {Op::I32_REM_S, "i32.rem_s", 0x6F},
+  {Op::I32_AND, "i32.and", 0x71},   {Op::I32_OR, "i32.or", 0x72},     {Op::I32_XOR, "i32.xor", 0x73},
+  {Op::I32_SHL, "i32.shl", 0x74},   {Op::I32_SHR_S, "i32.shr_s", 0x75}, {Op::I32_SHR_U, "i32.shr_u", 0x76},
+  {Op::I32_LT_U, "i32.lt_u", 0x49}, {Op::I32_GT_U, "i32.gt_u", 0x4B}, {Op::I32_LE_U, "i32.le_u", 0x4D},
+  {Op::I32_GE_U, "i32.ge_u", 0x4F}, {Op::I32_CLZ, "i32.clz", 0x67},
+  {Op::F64_EQ, "f64.eq", 0x61},     {Op::F64_NE, "f64.ne", 0x62},     {Op::F64_LT, "f64.lt", 0x63},
+  {Op::F64_GT, "f64.gt", 0x64},     {Op::F64_LE, "f64.le", 0x65},     {Op::F64_GE, "f64.ge", 0x66},
+  {Op::F64_ADD, "f64.add", 0xA0},   {Op::F64_SUB, "f64.sub", 0xA1},   {Op::F64_MUL, "f64.mul", 0xA2},
+  {Op::F64_DIV, "f64.div", 0xA3},   {Op::F64_NEG, "f64.neg", 0x9A},   {Op::F64_SQRT, "f64.sqrt", 0x9F},
+  {Op::I64_MUL, "i64.mul", 0x7E},   {Op::I64_SHR_S, "i64.shr_s", 0x87},
+  {Op::I32_TRUNC_F64_S, "i32.trunc_f64_s", 0xAA},
+  {Op::F64_CONVERT_I32_S, "f64.convert_i32_s", 0xB7},
+  {Op::I32_WRAP_I64, "i32.wrap_i64", 0xA7},
+  {Op::I64_EXTEND_I32_S, "i64.extend_i32_s", 0xAC},
+}};
+
+// Make sure the table above lines up with the enum.
+static constexpr bool OpInfoAligned() {
+  for (size_t i = 0; i < OP_INFO.size(); ++i) {
+    if (static_cast<size_t>(OP_INFO[i].op) != i) return false;
+  }
+  return true;
+}
+static_assert(OpInfoAligned(), "OP_INFO must list opcodes in enum order.");
+
+inline const OpInfo & GetOpInfo(Op op) { return OP_INFO[static_cast<size_t>(op)]; }
+
+// A single entry in the instruction stream (12 bytes).
+struct Instr {
+  static constexpr uint32_t NO_ARG = static_cast<uint32_t>(-1);
+
+  Op op = Op::NOP;
+  ValType type = ValType::NONE;  // Result type for IF/BLOCK/LOOP.
+  uint16_t indent = 0;           // Indentation to use in text output.
+  uint32_t arg = NO_ARG;         // Immediate (meaning depends on op).
+  uint32_t note = 0;             // Comment ID (0 = no comment).
+  uint32_t pos = 0;              // Source position ID (0 = none; see Control::positions).
+
+  int32_t IntArg() const { return static_cast<int32_t>(arg); }
+};
@@ -0,0 +1,189 @@
+#pragma once
+
+// Where compiler memory goes (see --mem-report).
+//
+// In a counting build (make memreport, which defines MEM_REPORT), every allocation carries
+// a small header recording its size and the subsystem it was made for: AST nodes and
+// types are tagged by class (see Tagged), and other allocations by the innermost Scope
+// active on their thread.  Each subsystem's live, peak, and total bytes and its allocation
+// counts are kept as they happen; the program must route its global operator new and
+// delete through Allocate and Free (as Project3.cpp does).  In a normal build, Tagged,
+// Scope and Retag compile to nothing, and only the process's peak resident set size is
+// reported.
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include <sys/resource.h>
+
+namespace memory {
+  enum class Tag : uint8_t { OTHER, TOKENS, LEXEMES, AST, TYPES, SYMBOLS, CODE, NUM_TAGS };
+  static constexpr size_t NUM_TAGS = static_cast<size_t>(Tag::NUM_TAGS);
+  static constexpr const char * TAG_NAMES[NUM_TAGS] = {
+    "other", "tokens", "lexemes", "ast", "types", "symbols", "code"
+  };
+
+#ifdef MEM_REPORT
+  static constexpr bool COUNTING = true;
+
+  struct Counter {
+    std::atomic<int64_t> live_bytes{0};
+    std::atomic<int64_t> peak_bytes{0};
+    std::atomic<uint64_t> total_bytes{0};
+    std::atomic<uint64_t> allocs{0};
+    std::atomic<uint64_t> frees{0};
+
+    void Add(size_t size) {
+      const int64_t live = live_bytes.fetch_add(static_cast<int64_t>(size), std::memory_order_relaxed)
+                         + static_cast<int64_t>(size);
+      int64_t peak = peak_bytes.load(std::memory_order_relaxed);
+      while (live > peak && !peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) { }
+      total_bytes.fetch_add(size, std::memory_order_relaxed);
+      allocs.fetch_add(1, std::memory_order_relaxed);
+    }
+    void Remove(size_t size) {
+      live_bytes.fetch_sub(static_cast<int64_t>(size), std::memory_order_relaxed);
+      frees.fetch_add(1, std::memory_order_relaxed);
+    }
+  };
+
+  inline std::array<Counter, NUM_TAGS> counters{};
+  inline Counter all_counter{};                    // Every subsystem together.
+  inline thread_local Tag current_tag = Tag::OTHER;
+
+  // Placed before each block; its size keeps the block aligned as malloc's would be.
+  struct alignas(alignof(std::max_align_t)) Header {
+    size_t size;
+    Tag tag;
+  };
+
+  inline void * Allocate(size_t size, Tag tag) {
+    auto * header = static_cast<Header *>(std::malloc(sizeof(Header) + size));
+    if (!header) throw std::bad_alloc();
+    header->size = size;
+    header->tag = tag;
+    counters[static_cast<size_t>(tag)].Add(size);
+    all_counter.Add(size);
+    return header + 1;
+  }
+  inline void * Allocate(size_t size) { return Allocate(size, current_tag); }
+
+  inline void Free(void * ptr) {
+    if (!ptr) return;
+    Header * header = static_cast<Header *>(ptr) - 1;
+    counters[static_cast<size_t>(header->tag)].Remove(header->size);
+    all_counter.Remove(header->size);
+    std::free(header);
+  }
+
+  // Charge a block that is already allocated to a different subsystem.
+  inline void Retag(const void * ptr, Tag tag) {
+    Header * header = static_cast<Header *>(const_cast<void *>(ptr)) - 1;
+    Counter & from = counters[static_cast<size_t>(header->tag)];
+    from.Remove(header->size);
+    from.allocs.fetch_sub(1, std::memory_order_relaxed);   // Moved, not allocated and freed.
+    from.frees.fetch_sub(1, std::memory_order_relaxed);
+    counters[static_cast<size_t>(tag)].Add(header->size);
+    header->tag = tag;
+  }
+
+  // Charge a string's characters (if they are not stored inside the string itself).
+  inline void Retag(const std::string & str, Tag tag) {
+    const char * data = str.data();
+    const char * object = reinterpret_cast<const char *>(&str);
+    if (data < object || data >= object + sizeof(str)) Retag(data, tag);
+  }
+
+  // Charges allocations on this thread to a subsystem until the end of its lifetime.
+  class Scope {
+  private:
+    Tag saved;
+  public:
+    Scope(Tag tag) : saved(current_tag) { current_tag = tag; }
+    Scope(const Scope &) = delete;
+    Scope & operator=(const Scope &) = delete;
+    ~Scope() { current_tag = saved; }
+  };
+
+  // A base class that charges every object of a class hierarchy to one subsystem.
+  template <Tag TAG>
+  struct Tagged {
+    static void * operator new(size_t size) { return Allocate(size, TAG); }
+    static void operator delete(void * ptr) { Free(ptr); }
+  protected:
+    ~Tagged() = default;
+  };
+#else
+  static constexpr bool COUNTING = false;
+
+  inline void Retag(const void *, Tag) { }
+  inline void Retag(const std::string &, Tag) { }
+
+  struct Scope {
+    Scope(Tag) { }
+  };
+
+  template <Tag TAG>
+  struct Tagged {
+  protected:
+    ~Tagged() = default;
+  };
+#endif
+
+  // The most memory this process has had resident at once, in bytes.
+  inline uint64_t PeakRSS() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss);           // Already in bytes.
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;    // In kilobytes.
+#endif
+  }
+
+  inline void Print(std::ostream & os=std::cerr) {
+    os << "Memory report:\n";
+#ifdef MEM_REPORT
+    auto print = [&os](const std::string & name, const Counter & counter) {
+      os << "  " << std::left << std::setw(10) << name << std::right
+         << std::setw(14) << counter.peak_bytes.load() << std::setw(14) << counter.live_bytes.load()
+         << std::setw(14) << counter.total_bytes.load() << std::setw(11) << counter.allocs.load()
+         << std::setw(11) << counter.frees.load() << '\n';
+    };
+    os << "  subsystem     peak bytes    live bytes   total bytes     allocs      frees\n";
+    for (size_t i = 0; i < NUM_TAGS; ++i) print(TAG_NAMES[i], counters[i]);
+    print("all", all_counter);
+#else
+    os << "  (allocations are only counted in a 'make memreport' build)\n";
+#endif
+    os << "  peak RSS: " << PeakRSS() << " bytes\n";
+  }
+
+  inline void PrintJSON(std::ostream & os=std::cerr) {
+    os << "{\n  \"counting\": " << (COUNTING ? "true" : "false") << ",\n";
+#ifdef MEM_REPORT
+    auto counter_json = [&os](const Counter & counter) {
+      os << "{\"peak_bytes\": " << counter.peak_bytes.load() << ", \"live_bytes\": " << counter.live_bytes.load()
+         << ", \"total_bytes\": " << counter.total_bytes.load() << ", \"allocs\": " << counter.allocs.load()
+         << ", \"frees\": " << counter.frees.load() << "}";
+    };
+    os << "  \"subsystems\": {\n";
+    for (size_t i = 0; i < NUM_TAGS; ++i) {
+      os << "    \"" << TAG_NAMES[i] << "\": ";
+      counter_json(counters[i]);
+      os << ",\n";
+    }
+    os << "    \"all\": ";
+    counter_json(all_counter);
+    os << "\n  },\n";
+#endif
+    os << "  \"peak_rss_bytes\": " << PeakRSS() << "\n}\n";
+  }
+}
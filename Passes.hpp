@@ -0,0 +1,206 @@
+#pragma once
+
+// The optimization pipeline: which passes run, in what order, and what each one cost.
+//
+// AST passes rewrite each function's tree after type checking (see Tubular::Check).  Code
+// generation options change how a tree is lowered to instructions.  Code passes rewrite
+// the instructions of each function once it is generated (see Control::OptimizeCode).
+// Each optimization level (-O0, -O1, -O2, -Os) picks a standard pipeline; --passes=...
+// lists one explicitly instead.  Within a stage, passes run in the order listed (and may
+// be listed more than once); every order produces correct code.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <initializer_list>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Instruction.hpp"
+
+namespace passes {
+  enum class Stage : uint8_t { AST, CODEGEN, CODE };
+
+  enum class ID : uint8_t {
+    FOLD, LICM, LVN,                                                      // AST passes
+    ROTATE, SSA,                                                          // Code generation
+    UNREACHABLE, UNUSED_LOCALS, STRENGTH, PEEPHOLE, COLLAPSE, COALESCE,   // Code passes
+  };
+
+  struct Info {
+    const char * name;
+    Stage stage;
+    const char * summary;
+  };
+
+  // Listed in the same order as ID.
+  static const Info INFO[] = {
+    { "fold", Stage::AST, "Fold constants and propagate known variable values." },
+    { "licm", Stage::AST, "Hoist loop-invariant expressions out of while loops." },
+    { "lvn", Stage::AST, "Reuse repeated expressions through local value numbering." },
+    { "rotate", Stage::CODEGEN, "Test while loops at the bottom (guarded do-while)." },
+    { "ssa", Stage::CODEGEN, "Generate function bodies by way of SSA form." },
+    { "unreachable", Stage::CODE, "Remove code after br, return, or unreachable." },
+    { "unused-locals", Stage::CODE, "Remove locals that are never read." },
+    { "strength", Stage::CODE, "Replace multiply, divide, and remainder by constants." },
+    { "peephole", Stage::CODE, "Rewrite short instruction sequences." },
+    { "collapse-branches", Stage::CODE, "Collapse empty if branches (best after peephole)." },
+    { "coalesce", Stage::CODE, "Share slots between locals that are never live together." },
+  };
+  static constexpr size_t NUM_PASSES = std::size(INFO);
+
+  inline const Info & GetInfo(ID id) { return INFO[static_cast<size_t>(id)]; }
+
+  inline std::optional<ID> FindPass(std::string_view name) {
+    for (size_t i = 0; i < NUM_PASSES; ++i) {
+      if (name == INFO[i].name) return static_cast<ID>(i);
+    }
+    return std::nullopt;
+  }
+
+  class Pipeline {
+  private:
+    std::vector<ID> order;
+
+  public:
+    Pipeline() = default;
+    Pipeline(std::initializer_list<ID> in) : order(in) { }
+
+    bool Has(ID id) const { return std::find(order.begin(), order.end(), id) != order.end(); }
+    void Add(ID id) { order.push_back(id); }
+
+    // Run a function on the ID of each pass in a stage, in order.
+    template <typename FUN_T>
+    void ForEach(Stage stage, FUN_T fun) const {
+      for (ID id : order) if (GetInfo(id).stage == stage) fun(id);
+    }
+
+    std::string ToString() const {
+      std::string out;
+      for (ID id : order) {
+        if (out.size()) out += ',';
+        out += GetInfo(id).name;
+      }
+      return out.size() ? out : "(none)";
+    }
+  };
+
+  // The standard pipeline for an optimization level ("0", "1", "2", or "s").
+  //   -O0: no optimization; fastest to compile.
+  //   -O1: cheap clean-ups only.
+  //   -O2: everything (the default).
+  //   -Os: skip the passes that trade code size for speed (strength reduction, loop
+  //        rotation, and hoisting).
+  inline std::optional<Pipeline> ForLevel(std::string_view level) {
+    using enum ID;
+    if (level == "0") return Pipeline{};
+    if (level == "1") return Pipeline{FOLD, UNREACHABLE, UNUSED_LOCALS, PEEPHOLE, COLLAPSE};
+    if (level == "2") {
+      return Pipeline{FOLD, LICM, LVN, ROTATE, UNREACHABLE, UNUSED_LOCALS, STRENGTH,
+                      PEEPHOLE, COLLAPSE, COALESCE, PEEPHOLE};
+    }
+    if (level == "s") {
+      return Pipeline{FOLD, LVN, UNREACHABLE, UNUSED_LOCALS, PEEPHOLE, COLLAPSE, COALESCE, PEEPHOLE};
+    }
+    return std::nullopt;
+  }
+
+  // Build a pipeline from a comma-separated list of pass names (which may be empty).  On
+  // failure, return nothing and describe the problem in 'error'.
+  inline std::optional<Pipeline> Parse(std::string_view list, std::string & error) {
+    Pipeline out;
+    while (list.size()) {
+      const size_t comma = list.find(',');
+      const std::string_view name = list.substr(0, comma);
+      if (auto id = FindPass(name)) out.Add(*id);
+      else {
+        error = "Unknown pass '" + std::string(name) + "'; available passes are:\n";
+        for (const Info & info : INFO) {
+          error += "  " + std::string(info.name) + std::string(20 - std::string(info.name).size(), ' ')
+                 + info.summary + '\n';
+        }
+        return std::nullopt;
+      }
+      list = (comma == std::string_view::npos) ? "" : list.substr(comma + 1);
+    }
+    return out;
+  }
+
+  // Instructions in a code stream, not counting comments and blank lines.
+  inline size_t CountInstructions(const std::vector<Instr> & code) {
+    size_t count = 0;
+    for (const Instr & inst : code) count += (inst.op != Op::NOTE && inst.op != Op::BLANK);
+    return count;
+  }
+
+  // What each pass cost, and how much it changed the size of what it worked on (AST nodes
+  // or instructions).  Nothing is measured unless 'enabled' is set.
+  struct Stats {
+    struct Entry {
+      size_t runs = 0;
+      uint64_t nanoseconds = 0;
+      size_t size_before = 0;
+      size_t size_after = 0;
+
+      void Add(const Entry & in) {
+        runs += in.runs;
+        nanoseconds += in.nanoseconds;
+        size_before += in.size_before;
+        size_after += in.size_after;
+      }
+    };
+
+    bool enabled = false;
+    std::array<Entry, NUM_PASSES> entries{};
+    Entry codegen;   // Generating instructions from the AST (sizes are instructions made).
+
+    void Add(const Stats & in) {
+      for (size_t i = 0; i < NUM_PASSES; ++i) entries[i].Add(in.entries[i]);
+      codegen.Add(in.codegen);
+    }
+
+    void Print(const Pipeline & pipeline, std::ostream & os=std::cerr) const {
+      auto print = [&os](const std::string & name, const Entry & entry, const char * units) {
+        os << "  " << name << std::string(24 - name.size(), ' ')
+           << std::setw(6) << entry.runs << " runs "
+           << std::fixed << std::setprecision(3) << std::setw(10) << entry.nanoseconds / 1e6 << " ms  "
+           << entry.size_before << " -> " << entry.size_after << ' ' << units << '\n';
+      };
+      const auto flags = os.flags();
+      const auto precision = os.precision();
+      os << "Pass pipeline: " << pipeline.ToString() << '\n'
+         << "Pass timing:\n";
+      for (size_t i = 0; i < NUM_PASSES; ++i) {
+        if (INFO[i].stage == Stage::CODEGEN || !entries[i].runs) continue;
+        print(INFO[i].name, entries[i], INFO[i].stage == Stage::AST ? "nodes" : "instrs");
+      }
+      print("(codegen)", codegen, "instrs");
+      os.flags(flags);
+      os.precision(precision);
+    }
+  };
+
+  // Run one pass (or other step), timing it and measuring the size of its input and
+  // output with size_fun.
+  template <typename SIZE_T, typename PASS_T>
+  void Run(Stats & stats, Stats::Entry & entry, SIZE_T size_fun, PASS_T pass) {
+    if (!stats.enabled) { pass(); return; }
+    entry.size_before += size_fun();
+    const auto start = std::chrono::steady_clock::now();
+    pass();
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    entry.nanoseconds += static_cast<uint64_t>(std::chrono::nanoseconds(elapsed).count());
+    entry.size_after += size_fun();
+    ++entry.runs;
+  }
+
+  template <typename SIZE_T, typename PASS_T>
+  void Run(Stats & stats, ID id, SIZE_T size_fun, PASS_T pass) {
+    Run(stats, stats.entries[static_cast<size_t>(id)], size_fun, pass);
+  }
+}
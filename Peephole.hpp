@@ -0,0 +1,186 @@
+#pragma once
+
+// A windowed peephole optimizer for the instruction stream.
+//
+// Instructions are moved to the output one at a time; after each one, every rule in
+// RULES is tried against the last few instructions of the output (ignoring comment-only
+// and blank lines).  A matching rule replaces those instructions, and matching starts
+// over, so rewrites can cascade (e.g. "x + 1;" drops down to nothing).
+
+#include <array>
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "Instruction.hpp"
+
+namespace peephole {
+  using window_t = std::array<Instr, 3>;
+
+  // Operations with no inputs or side effects that leave one value.
+  inline bool IsPureLoad(Op op) {
+    return op == Op::LOCAL_GET || op == Op::GLOBAL_GET || op == Op::I32_CONST || op == Op::F64_CONST;
+  }
+
+  // Operations that take one value and leave one, and can never trap.
+  inline bool IsPureUnary(Op op) {
+    return op == Op::I32_EQZ || op == Op::F64_NEG || op == Op::F64_SQRT || op == Op::F64_CONVERT_I32_S;
+  }
+
+  // Operations that take two values and leave one, and can never trap.
+  inline bool IsPureBinary(Op op) {
+    return (op >= Op::I32_EQ && op <= Op::I32_MUL) || (op >= Op::I32_AND && op <= Op::I32_SHR_U) ||
+           (op >= Op::F64_EQ && op <= Op::F64_DIV);
+  }
+
+  inline bool IsIntCompare(Op op) { return op >= Op::I32_EQ && op <= Op::I32_GE_S; }
+
+  // Operations that always produce exactly 0 or 1.
+  inline bool IsBoolean(Op op) {
+    return op == Op::I32_EQZ || IsIntCompare(op) || (op >= Op::F64_EQ && op <= Op::F64_GE);
+  }
+
+  // Instructions that only test their input against zero.
+  inline bool IsBranchTest(Op op) { return op == Op::BR_IF || op == Op::IF; }
+
+  inline bool IsConst0(const Instr & inst) { return inst.op == Op::I32_CONST && inst.arg == 0; }
+
+  inline Op InvertCompare(Op op) {
+    switch (op) {
+    case Op::I32_EQ: return Op::I32_NE;
+    case Op::I32_NE: return Op::I32_EQ;
+    case Op::I32_LT_S: return Op::I32_GE_S;
+    case Op::I32_GE_S: return Op::I32_LT_S;
+    case Op::I32_GT_S: return Op::I32_LE_S;
+    case Op::I32_LE_S: return Op::I32_GT_S;
+    default: assert(false); return op;
+    }
+  }
+
+  inline Instr With(Instr inst, Op op) { inst.op = op; return inst; }
+
+  // Change an operation, dropping a comment that would no longer describe it.
+  inline Instr Change(Instr inst, Op op) { inst.op = op; inst.note = 0; return inst; }
+
+  struct Rule {
+    const char * name;
+    size_t size;                                        // Number of instructions matched.
+    bool (*match)(const Instr * w);                     // Test w[0] .. w[size-1]
+    void (*rewrite)(const Instr * w, std::vector<Instr> & out);  // Add replacement to out
+  };
+
+  // Rules are tried in order; when two could apply, list the longer one first.
+  static const Rule RULES[] = {
+    { "set-get-to-tee", 2,
+      [](const Instr * w) { return w[0].op == Op::LOCAL_SET && w[1].op == Op::LOCAL_GET && w[0].arg == w[1].arg; },
+      [](const Instr * w, std::vector<Instr> & out) { out.push_back(With(w[0], Op::LOCAL_TEE)); } },
+    { "copy-to-self", 2,
+      [](const Instr * w) { return w[0].op == Op::LOCAL_GET && w[1].op == Op::LOCAL_SET && w[0].arg == w[1].arg; },
+      [](const Instr *, std::vector<Instr> &) { } },
+    { "tee-to-self", 2,
+      [](const Instr * w) { return w[0].op == Op::LOCAL_GET && w[1].op == Op::LOCAL_TEE && w[0].arg == w[1].arg; },
+      [](const Instr * w, std::vector<Instr> & out) { out.push_back(w[0]); } },
+    { "tee-drop-to-set", 2,
+      [](const Instr * w) { return w[0].op == Op::LOCAL_TEE && w[1].op == Op::DROP; },
+      [](const Instr * w, std::vector<Instr> & out) { out.push_back(With(w[0], Op::LOCAL_SET)); } },
+    { "drop-pure-load", 2,
+      [](const Instr * w) { return IsPureLoad(w[0].op) && w[1].op == Op::DROP; },
+      [](const Instr *, std::vector<Instr> &) { } },
+    { "drop-pure-unary", 2,
+      [](const Instr * w) { return IsPureUnary(w[0].op) && w[1].op == Op::DROP; },
+      [](const Instr * w, std::vector<Instr> & out) { out.push_back(w[1]); } },
+    { "drop-pure-binary", 2,
+      [](const Instr * w) { return IsPureBinary(w[0].op) && w[1].op == Op::DROP; },
+      [](const Instr * w, std::vector<Instr> & out) { out.push_back(w[1]); out.push_back(w[1]); } },
+    { "branch-skip-ne-zero", 3,
+      [](const Instr * w) { return IsConst0(w[0]) && w[1].op == Op::I32_NE && IsBranchTest(w[2].op); },
+      [](const Instr * w, std::vector<Instr> & out) { out.push_back(w[2]); } },
+    { "branch-skip-double-eqz", 3,
+      [](const Instr * w) { return w[0].op == Op::I32_EQZ && w[1].op == Op::I32_EQZ && IsBranchTest(w[2].op); },
+      [](const Instr * w, std::vector<Instr> & out) { out.push_back(w[2]); } },
+    { "bool-skip-ne-zero", 3,
+      [](const Instr * w) { return IsBoolean(w[0].op) && IsConst0(w[1]) && w[2].op == Op::I32_NE; },
+      [](const Instr * w, std::vector<Instr> & out) { out.push_back(w[0]); } },
+    { "bool-skip-double-eqz", 3,
+      [](const Instr * w) { return IsBoolean(w[0].op) && w[1].op == Op::I32_EQZ && w[2].op == Op::I32_EQZ; },
+      [](const Instr * w, std::vector<Instr> & out) { out.push_back(w[0]); } },
+    { "eq-zero-to-eqz", 2,
+      [](const Instr * w) { return IsConst0(w[0]) && w[1].op == Op::I32_EQ; },
+      [](const Instr * w, std::vector<Instr> & out) { out.push_back(With(w[1], Op::I32_EQZ)); } },
+    { "invert-int-compare", 2,
+      [](const Instr * w) { return IsIntCompare(w[0].op) && w[1].op == Op::I32_EQZ; },
+      [](const Instr * w, std::vector<Instr> & out) { out.push_back(Change(w[0], InvertCompare(w[0].op))); } },
+  };
+  static constexpr size_t NUM_RULES = std::size(RULES);
+
+  // How often each rule was applied.
+  struct Stats {
+    std::array<size_t, NUM_RULES> hits{};
+
+    void Add(const Stats & in) {
+      for (size_t i = 0; i < NUM_RULES; ++i) hits[i] += in.hits[i];
+    }
+
+    void Print(std::ostream & os=std::cerr) const {
+      os << "Peephole rule hits:\n";
+      for (size_t i = 0; i < NUM_RULES; ++i) {
+        os << "  " << RULES[i].name << std::string(24 - std::string(RULES[i].name).size(), ' ')
+           << hits[i] << '\n';
+      }
+    }
+  };
+
+  // Try all rules against the end of the output.  If one matches, remove the instructions
+  // it matched (keeping any comment lines between them), put their replacement in
+  // 'replacement', and return true.
+  inline bool ApplyRule(std::vector<Instr> & out, std::vector<Instr> & replacement, Stats & stats) {
+    // Find the positions of the last few real instructions.
+    std::array<size_t, std::tuple_size_v<window_t>> pos{};
+    size_t found = 0;
+    for (size_t i = out.size(); i-- > 0 && found < pos.size(); ) {
+      if (out[i].op == Op::NOTE || out[i].op == Op::BLANK) continue;
+      pos[found++] = i;
+    }
+
+    for (size_t rule_id = 0; rule_id < NUM_RULES; ++rule_id) {
+      const Rule & rule = RULES[rule_id];
+      if (rule.size > found) continue;
+
+      window_t window;
+      for (size_t i = 0; i < rule.size; ++i) window[i] = out[pos[rule.size - 1 - i]];
+      if (!rule.match(window.data())) continue;
+
+      replacement.clear();
+      rule.rewrite(window.data(), replacement);
+      for (Instr & inst : replacement) inst.indent = window[0].indent;
+      for (size_t i = 0; i < rule.size; ++i) out.erase(out.begin() + static_cast<std::ptrdiff_t>(pos[i]));
+      ++stats.hits[rule_id];
+      return true;
+    }
+    return false;
+  }
+
+  // Run all rules over a code stream until none apply.
+  inline void Optimize(std::vector<Instr> & code, Stats & stats) {
+    std::vector<Instr> out;
+    out.reserve(code.size());
+    std::vector<Instr> pending;      // Replacements still to be moved to the output (reversed).
+    std::vector<Instr> replacement;
+    size_t next = 0;
+    while (pending.size() || next < code.size()) {
+      Instr inst;
+      if (pending.size()) { inst = pending.back(); pending.pop_back(); }
+      else inst = code[next++];
+
+      out.push_back(inst);
+      if (inst.op == Op::NOTE || inst.op == Op::BLANK) continue;
+
+      // Replacements go back through the rules, so rewrites can build on each other.
+      if (ApplyRule(out, replacement, stats)) {
+        pending.insert(pending.end(), replacement.rbegin(), replacement.rend());
+      }
+    }
+    code = std::move(out);
+  }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+// Profiling counters for instrumented modules (see --instrument).
+//
+// Each counter is a word in a table that sits in linear memory between the string data
+// and the heap.  The table starts with a word holding the number of counters, and the
+// exported function _prof_dump returns its address, so a host can read every count out
+// of the exported memory.  Counters are assigned while initializing each function (in
+// source order, so they are numbered the same for any number of jobs): one counts calls
+// to a function, one counts iterations of a while loop, and one counts each branch of an
+// if that is taken (an if without an else gets an implicit one, counting the times its
+// test fails).  Only code that survives optimization is counted.
+//
+// The side table (Write) says where in the source each counter comes from.
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "tools.hpp"
+
+namespace profile {
+  enum class Kind : uint8_t { FUNCTION, LOOP, THEN, ELSE, NOT_TAKEN };
+  static constexpr const char * KIND_NAMES[] = { "function", "loop", "then", "else", "not-taken" };
+
+  struct Counter {
+    Kind kind;
+    std::string function;   // Function the counter is in.
+    FilePos pos;            // Where the counted code starts.
+  };
+
+  class Table {
+  private:
+    bool enabled = false;
+    std::vector<Counter> counters{};
+    uint32_t base_global = 0;   // Global holding the table's address.
+
+  public:
+    static constexpr uint32_t HEADER_BYTES = 4;   // Number of counters.
+    static constexpr uint32_t COUNTER_BYTES = 4;
+
+    bool Enabled() const { return enabled; }
+    void Enable(bool in) { enabled = in; }
+
+    // Add a counter; those after a function's entry counter belong to that function.
+    uint32_t Add(Kind kind, FilePos pos) {
+      const std::string function = counters.size() ? counters.back().function : "";
+      return Add(kind, function, pos);
+    }
+    uint32_t Add(Kind kind, const std::string & function, FilePos pos) {
+      counters.emplace_back(kind, function, pos);
+      return static_cast<uint32_t>(counters.size() - 1);
+    }
+
+    size_t Size() const { return counters.size(); }
+    size_t Bytes() const { return HEADER_BYTES + COUNTER_BYTES * counters.size(); }
+
+    // Byte offset of a counter from the start of the table.
+    static uint32_t Offset(uint32_t id) { return HEADER_BYTES + COUNTER_BYTES * id; }
+
+    uint32_t BaseGlobal() const { return base_global; }
+    void SetBaseGlobal(uint32_t id) { base_global = id; }
+
+    // Write the side table: one line per counter, tab-separated.
+    void Write(std::ostream & os) const {
+      os << "# counter\toffset\tkind\tfunction\tposition\n";
+      for (uint32_t id = 0; id < counters.size(); ++id) {
+        const Counter & counter = counters[id];
+        os << id << '\t' << Offset(id) << '\t' << KIND_NAMES[static_cast<size_t>(counter.kind)] << '\t'
+           << counter.function << '\t' << counter.pos.ToString() << '\n';
+      }
+    }
+  };
+}
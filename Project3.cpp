@@ -1,409 +1,177 @@
-#include <assert.h>
 #include <fstream>
-#include <memory>
+#include <iostream>
+#include <optional>
 #include <string>
-#include <unordered_map>
+#include <thread>
 #include <vector>
 
-#include "ASTNode.hpp"
-#include "Control.hpp"
-#include "lexer.hpp"
-#include "SymbolTable.hpp"
-#include "TokenQueue.hpp"
+#include "MemReport.hpp"
+#include "Passes.hpp"
+#include "Tubular.hpp"
 
-class Tubular {
-private:
-  using ast_ptr_t = std::unique_ptr<ASTNode>;
-  using fun_ptr_t = std::unique_ptr<ASTNode_Function>;
-
-  TokenQueue tokens;
-  std::vector<fun_ptr_t> functions{};
+#ifdef MEM_REPORT
+// Count every allocation in the program (see MemReport.hpp).
+void * operator new(size_t size) { return memory::Allocate(size); }
+void * operator new[](size_t size) { return memory::Allocate(size); }
+void * operator new(size_t size, const std::nothrow_t &) noexcept {
+  try { return memory::Allocate(size); } catch (...) { return nullptr; }
+}
+void * operator new[](size_t size, const std::nothrow_t &) noexcept {
+  try { return memory::Allocate(size); } catch (...) { return nullptr; }
+}
+void operator delete(void * ptr) noexcept { memory::Free(ptr); }
+void operator delete[](void * ptr) noexcept { memory::Free(ptr); }
+void operator delete(void * ptr, size_t) noexcept { memory::Free(ptr); }
+void operator delete[](void * ptr, size_t) noexcept { memory::Free(ptr); }
+void operator delete(void * ptr, const std::nothrow_t &) noexcept { memory::Free(ptr); }
+void operator delete[](void * ptr, const std::nothrow_t &) noexcept { memory::Free(ptr); }
+#endif
 
-  struct OpInfo {
-    size_t level;
-    char assoc;   // l=left; r=right; n=non
+int main(int argc, char * argv[])
+{
+  auto usage = [argv]() {
+    std::cout << "Format: " << argv[0] << " [-O0|-O1|-O2|-Os] [--passes=NAME,...] [--binary] [--stream]"
+              << " [--jobs=N] [--ssa] [--pass-stats] [--helpers=NAME,...] [--no-bulk-memory] [--simd]"
+              << " [--run=CALL ...] [--run-file=FILE] [--vm-code] [--time-report[=json]] [--mem-report[=json]]"
+              << " [--instrument[=FILE]] [--source-map[=FILE]] [filename]" << std::endl;
+    exit(1);
   };
-  std::unordered_map<std::string, OpInfo> op_map{};
-
-  Control control;
-
-  // == HELPER FUNCTIONS
-
-  template <typename... Ts>
-  void TriggerError(Ts... message) {
-    if (tokens.None()) tokens.Rewind();
-    Error(tokens.CurFilePos(), std::forward<Ts>(message)...);
-  }
-
-  template <typename NODE_T, typename... ARG_Ts>
-  static std::unique_ptr<NODE_T> MakeNode(ARG_Ts &&... args) {
-    return std::make_unique<NODE_T>( std::forward<ARG_Ts>(args)... );
-  }
-
-  ast_ptr_t MakeVarNode(emplex::Token token) {
-    return MakeNode<ASTNode_Var>(token, control.symbols);
-  }
-
-  Type GetReturnType(const ast_ptr_t & node_ptr) const {
-    return node_ptr->ReturnType(control.symbols);
-  }
-
-  // Take in the provided node and add an ASTNode converter to make it a double, as needed.
-  // Return if a change was made.
-  ast_ptr_t PromoteToDouble(ast_ptr_t && node_ptr) {
-    if (!node_ptr->ReturnType(control.symbols).IsDouble()) {
-      return MakeNode<ASTNode_ToDouble>(std::move(node_ptr));
-    }
-    return node_ptr;
-  }
-
-  // Take in the provided node and add an ASTNode converter to make it a double, as needed.
-  // Return if a change was made.
-  ast_ptr_t DemoteToInt(ast_ptr_t && node_ptr) {
-    if (node_ptr->ReturnType(control.symbols).IsDouble()) {
-      return MakeNode<ASTNode_ToInt>(std::move(node_ptr));
-    }
-    return node_ptr;
-  }
-
-  void SetupOperators() {
-    // Setup operator precedence.
-    size_t cur_prec = 0;
-    op_map["("]  = op_map["!"]  =               OpInfo{cur_prec++, 'n'};
-    op_map["*"]  = op_map["/"]  = op_map["%"] = OpInfo{cur_prec++, 'l'};
-    op_map["+"]  = op_map["-"]  =               OpInfo{cur_prec++, 'l'};
-    op_map["<"]  = op_map["<="] = op_map[">"] = op_map[">="] = OpInfo{cur_prec++, 'n'};
-    op_map["=="] = op_map["!="] =               OpInfo{cur_prec++, 'n'};
-    op_map["&&"] =                              OpInfo{cur_prec++, 'l'};
-    op_map["||"] =                              OpInfo{cur_prec++, 'l'};
-    op_map["="]  =                              OpInfo{cur_prec++, 'r'};
-  }
-
-public:
-  Tubular(std::string filename) {    
-    std::ifstream in_file(filename);              // Load the input file
-    if (in_file.fail()) {
-      std::cerr << "ERROR: Unable to open file '" << filename << "'." << std::endl;
-      exit(1);
-    }
 
-    tokens.Load(in_file);  // Load all tokens from the file.
-
-    SetupOperators();
-  }
-
-  // Convert any token representing a unary value into an ASTNode.
-  // (i.e., a leaf in an expression and associated unary operators)
-  ast_ptr_t Parse_UnaryTerm() {
-    const emplex::Token & token = tokens.Use();
-
-    if (token == '+') return Parse_UnaryTerm(); // (Operator + does nothing...)
-
-    if (token == '-' || token == '!') {  // Add node for unary prefix
-      return MakeNode<ASTNode_Math1>(token, Parse_UnaryTerm());
-    }
-
-    // Check main terms.
-    ast_ptr_t out;
-    switch (token.id) {
-    case '(': // Allow full expressions in parentheses.
-      out = Parse_Expression();
-      tokens.Use(')');
-      break;
-    case emplex::Lexer::ID_ID:
-      if (!control.symbols.Has(token.lexeme)) {
-        Error(token, "Unknown variable '", token.lexeme, "'.");
+  std::string filename;
+  bool binary = false;   // Output a binary .wasm module rather than WAT text?
+  bool stream = false;   // Compile and output one function at a time?
+  bool pass_stats = false;  // Report optimization statistics to standard error?
+  bool time_report = false; // Report time spent in each phase to standard error?
+  bool time_json = false;   // ...as JSON?
+  bool mem_report = false;  // Report memory use by each subsystem to standard error?
+  bool mem_json = false;    // ...as JSON?
+  bool use_ssa = false;     // Generate code by way of the SSA form?
+  std::string level = "2";  // Optimization level (0, 1, 2, or s)
+  std::optional<std::string> pass_list;  // Passes to run instead of the level's pipeline.
+  std::string helper_list;  // Runtime helpers to generate even if unused (alloc,copy,fill,compare,length,all)
+  bool bulk_memory = true;  // May the runtime use bulk-memory instructions?
+  bool simd = false;        // May the runtime use v128 SIMD instructions?
+  std::optional<std::string> profile_table;  // Instrument code, writing where counters are here.
+  std::optional<std::string> source_map;     // Write where code for each source position went here.
+  size_t num_jobs = std::max(1u, std::thread::hardware_concurrency());  // Codegen threads.
+  std::vector<std::string> calls;  // Calls to run in the VM instead of generating code.
+  bool run = false;                // Run calls rather than generating code?
+  bool vm_code = false;            // Print the bytecode of each function when running calls?
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--binary") binary = true;
+    else if (arg == "--stream") stream = true;
+    else if (arg == "--pass-stats") pass_stats = true;
+    else if (arg == "--time-report") time_report = true;
+    else if (arg == "--time-report=json") time_report = time_json = true;
+    else if (arg == "--mem-report") mem_report = true;
+    else if (arg == "--mem-report=json") mem_report = mem_json = true;
+    else if (arg == "--ssa") use_ssa = true;
+    else if (arg == "--no-bulk-memory") bulk_memory = false;
+    else if (arg == "--simd") simd = true;
+    else if (arg == "--instrument") profile_table = "";
+    else if (arg.starts_with("--instrument=")) profile_table = arg.substr(13);
+    else if (arg == "--source-map") source_map = "";
+    else if (arg.starts_with("--source-map=")) source_map = arg.substr(13);
+    else if (arg.starts_with("--helpers=")) helper_list = arg.substr(10);
+    else if (arg.starts_with("--run=")) { calls.push_back(arg.substr(6)); run = true; }
+    else if (arg.starts_with("--run-file=")) {
+      std::ifstream file(arg.substr(11));
+      if (!file) {
+        std::cout << "ERROR: Unable to open call file '" << arg.substr(11) << "'.\n";
+        exit(1);
       }
-      out = MakeVarNode(token);
-      break;
-    case emplex::Lexer::ID_LIT_INT:
-      out = MakeNode<ASTNode_IntLit>(token, std::stoi(token.lexeme));
-      break;
-    case emplex::Lexer::ID_LIT_CHAR:
-      out = MakeNode<ASTNode_CharLit>(token, token.lexeme[1]);
-      break;
-    case emplex::Lexer::ID_LIT_FLOAT:
-      out = MakeNode<ASTNode_FloatLit>(token, std::stod(token.lexeme));
-      break;
-    case emplex::Lexer::ID_SQRT:
-      tokens.Use('(');
-      out = PromoteToDouble(Parse_Expression());
-      tokens.Use(')');
-      out = MakeNode<ASTNode_Math1>(token, std::move(out));
-      break;
-    default:
-      Error(token, "Unexpected token '", token.lexeme, "'");
-    }
-
-    // @CAO Check for '(' or '[' to know if this is a function call or array index?
-
-    // Check to see if the term is followed by a type modifier.
-    if (tokens.UseIf(':')) {
-      auto type_token = tokens.Use(emplex::Lexer::ID_TYPE, "Expected a type specified after ':'.");
-      if (type_token.lexeme == "double") out = MakeNode<ASTNode_ToDouble>(std::move(out));
-      else if (type_token.lexeme == "int") out = MakeNode<ASTNode_ToInt>(std::move(out));
-    }
-
-    return out;
-  }
-
-  // Parse expressions.  The level input determines how restrictive this parse should be.
-  // Only continue processing with types at the target level or higher.
-  ast_ptr_t Parse_Expression(size_t prec_limit=1000) {
-    // Any expression must begin with a variable name or a literal value.
-    ast_ptr_t cur_node = Parse_UnaryTerm();
-
-    size_t skip_prec = 1000; // If we get a non-associative op, we must skip next one.
-
-    // While there are more tokens to process, try to expand this expression.
-    while (tokens.Any()) {
-      // Peek at the next token; if it is an op, keep going and get its info.
-      auto op_token = tokens.Peek();
-      if (!op_map.count(op_token.lexeme)) break;  // Not an op token; stop here!
-      OpInfo op_info = op_map[op_token.lexeme];
-
-      // If precedence of next operator is too high, return what we have.
-      if (op_info.level > prec_limit) break;
-
-      // If the next precedence is not allowed, throw an error.
-      if (op_info.level == skip_prec) {
-        Error(op_token, "Operator '", op_token.lexeme, "' is non-associative.");
+      // One call per line; blank lines and lines starting with '#' are skipped.
+      for (std::string line; std::getline(file, line); ) {
+        const size_t start = line.find_first_not_of(" \t\r");
+        if (start != std::string::npos && line[start] != '#') calls.push_back(line);
       }
-
-      // If we made it here, we have a binary operation to use, so consume it.
-      tokens.Use();
-
-      // Find the allowed precedence for the next term.
-      size_t next_limit = op_info.level;
-      if (op_info.assoc != 'r') --next_limit;
-
-      // Load the next term.
-      ast_ptr_t node2 = Parse_Expression(next_limit);
-
-      // Build the new node.
-      cur_node = MakeNode<ASTNode_Math2>(op_token, std::move(cur_node), std::move(node2));
-
-      // If operator is non-associative, skip the current precedence for next loop.
-      skip_prec = (op_info.assoc == 'n') ? op_info.level : 1000;
-    }
-
-    return cur_node;
-  }
-
-  ast_ptr_t Parse_Statement() {
-    // Test what kind of statement this is and call the appropriate function...
-    switch (tokens.Peek()) {
-      using namespace emplex;
-      case Lexer::ID_TYPE:
-        return Parse_Statement_Declare();
-      case Lexer::ID_IF:     return Parse_Statement_If();
-      case Lexer::ID_WHILE:  return Parse_Statement_While();
-      case Lexer::ID_RETURN: return Parse_Statement_Return();
-      case Lexer::ID_BREAK:  return Parse_Statement_Break();
-      case Lexer::ID_CONTINUE: return Parse_Statement_Continue();
-      case '{': return Parse_StatementList();
-      case ';':
-        tokens.Use();
-        return nullptr;
-      default: return Parse_Statement_Expression();
-    }
-  }
-
-  ast_ptr_t Parse_Statement_Declare() {
-    auto type_token = tokens.Use();
-    const auto id_token =
-      tokens.Use(emplex::Lexer::ID_ID, "Declarations must have a type followed by identifier.");
-    control.symbols.AddVar(type_token, id_token);
-    if (tokens.UseIf(';')) {
-      return nullptr;  // Variable added, nothing else to do.
-    }
-    auto op_token =
-      tokens.Use('=', "Expected ';' or '=' after declaration of variable '", id_token.lexeme, "'.");
-    auto rhs_node = Parse_Expression();
-    tokens.Use(';');
-
-    auto lhs_node = MakeVarNode(id_token);
-    Type lhs_type = lhs_node->ReturnType(control.symbols);
-    Type rhs_type = rhs_node->ReturnType(control.symbols);
-
-    return MakeNode<ASTNode_Math2>(id_token, "=", std::move(lhs_node), std::move(rhs_node));
-  }
-
-  ast_ptr_t Parse_Statement_If() {
-    auto if_token = tokens.Use(emplex::Lexer::ID_IF);
-    tokens.Use('(', "If commands must be followed by a '(");
-    ast_ptr_t condition = Parse_Expression();
-    tokens.Use(')');
-    ast_ptr_t action = Parse_Statement();
-
-    // Check if we need to add on an "else" branch
-    if (tokens.UseIf(emplex::Lexer::ID_ELSE)) {
-      ast_ptr_t alt = Parse_Statement();
-      return MakeNode<ASTNode_If>(if_token, std::move(condition), std::move(action), std::move(alt));
-    }
-
-    return MakeNode<ASTNode_If>(if_token, std::move(condition), std::move(action));
-  }
-
-  ast_ptr_t Parse_Statement_While() {
-    auto while_token = tokens.Use(emplex::Lexer::ID_WHILE);
-    tokens.Use('(', "While commands must be followed by a '(");
-    ast_ptr_t condition = Parse_Expression();
-    tokens.Use(')');
-    ast_ptr_t action = Parse_Statement();
-    return MakeNode<ASTNode_While>(while_token, std::move(condition), std::move(action));
-  }
-
-  ast_ptr_t Parse_Statement_Return() {
-    auto token = tokens.Use(emplex::Lexer::ID_RETURN);
-    ast_ptr_t return_expr = Parse_Statement_Expression();
-    return MakeNode<ASTNode_Return>(token, std::move(return_expr));
-  }
-
-  ast_ptr_t Parse_Statement_Break() {
-    auto token = tokens.Use(emplex::Lexer::ID_BREAK);
-    return MakeNode<ASTNode_Break>(token);
-  }
-
-  ast_ptr_t Parse_Statement_Continue() {
-    auto token = tokens.Use(emplex::Lexer::ID_CONTINUE);
-    return MakeNode<ASTNode_Continue>(token);
-  }
-
-  ast_ptr_t Parse_Statement_Expression() {
-    ast_ptr_t out = Parse_Expression();
-    tokens.Use(';');
-    return out;
-  }
-
-  ast_ptr_t Parse_StatementList() {
-    auto out_node = MakeNode<ASTNode_Block>(tokens.Peek());
-    tokens.Use('{', "Statement blocks must start with '{'.");
-    control.symbols.PushScope();
-    while (tokens.Any() && tokens.Peek() != '}') {
-      ast_ptr_t statement = Parse_Statement();
-      if (statement) out_node->AddChild( std::move(statement) );
+      run = true;
+    }
+    else if (arg == "--vm-code") vm_code = true;
+    else if (arg.starts_with("-O")) {
+      level = arg.substr(2);
+      if (!passes::ForLevel(level)) usage();
+    }
+    else if (arg.starts_with("--passes=")) pass_list = arg.substr(9);
+    else if (arg.starts_with("--jobs=")) {
+      const std::string count = arg.substr(7);
+      if (count.empty() || count.find_first_not_of("0123456789") != std::string::npos) usage();
+      num_jobs = std::max<size_t>(1, std::stoul(count));
+    }
+    else if (arg.starts_with("-") || filename.size()) usage();
+    else filename = arg;
+  }
+  if (filename.empty()) usage();
+  if (profile_table && profile_table->empty()) *profile_table = filename + ".prof";
+  if (source_map && source_map->empty()) *source_map = filename + (binary ? ".map" : ".lines");
+
+  passes::Pipeline pipeline = *passes::ForLevel(level);
+  if (pass_list) {
+    std::string error;
+    auto parsed = passes::Parse(*pass_list, error);
+    if (!parsed) {
+      std::cout << "ERROR: " << error;
+      exit(1);
     }
-    control.symbols.PopScope();
-    tokens.Use('}', "Statement blocks must end with '}'.");
-    return out_node;
+    pipeline = *parsed;
   }
+  if (use_ssa && !pipeline.Has(passes::ID::SSA)) pipeline.Add(passes::ID::SSA);
 
-  // A function has the format:
-  //    function ID ( PARAMETERS ) : TYPE { STATEMENT_BLOCK }
-  //    The initial ID is the function name.
-  //    PARAMETERS can be empty or a series of comma-separated "TYPE ID" declaring parameters
-  //    TYPE can be int, char, or double and is used as the return type.
-  //    STATEMENT BLOCK is a series of statements to run, ending in a return statement.
-  fun_ptr_t Parse_Function() {
-    using namespace emplex;
-    tokens.Use(Lexer::ID_FUNCTION, "Outermost scope must define functions.");
-    control.symbols.PushScope();  // Enter a special scope for the function.
-    auto name_token = tokens.Use(Lexer::ID_ID, "Function must have a name.");
-    tokens.Use('(', "Function declaration must have '(' after name.");
-    std::vector<size_t> param_ids;
-    std::vector<Type> param_types;
-    while (!tokens.UseIf(')')) {
-      auto type_token = tokens.Use(Lexer::ID_TYPE);
-      param_types.emplace_back(type_token);
-      const auto id_token =
-        tokens.Use(emplex::Lexer::ID_ID, "Function parameters must have a type followed by identifier.");
-      size_t param_id = control.symbols.AddVar(type_token, id_token);
-      param_ids.push_back(param_id);
-      if (!tokens.UseIf(',') && !tokens.Is(')')) {
-        TriggerError("Parameters must be separated by commas (','; found '", tokens.Peek().lexeme, "'.");
+  Tubular prog(filename, time_report);
+  // Write the files that go alongside the generated code.
+  auto write_side_files = [&]() {
+    auto write = [](const std::string & path, const std::string & what, auto fun) {
+      std::ofstream file(path);
+      if (!file) {
+        std::cout << "ERROR: Unable to write " << what << " '" << path << "'.\n";
+        exit(1);
       }
+      fun(file);
+    };
+    if (profile_table) {
+      write(*profile_table, "profile table", [&prog](std::ostream & os){ prog.WriteProfileTable(os); });
     }
-    tokens.Use(':');
-    Type return_type( tokens.Use(Lexer::ID_TYPE) );
-
-    // Now that we have the function signature, let the symbol table know about it.
-    size_t fun_id = control.symbols.AddFunction(name_token, param_types, return_type);
-
-    // Now parse the body of this function.
-    control.symbols.ClearFunctionVars();
-    ast_ptr_t body = Parse_StatementList();
-    control.symbols.PopScope(); // Leave the function scope.
-
-    if (!body->IsReturn()) {
-      Error(name_token, "Function '", name_token.lexeme, "' must guarantee a return statement through all paths.");
+    if (source_map) {
+      write(*source_map, "source map", [&](std::ostream & os){ prog.WriteSourceMap(os, binary, filename); });
     }
-
-    auto out_node = MakeNode<ASTNode_Function>(name_token, fun_id, param_ids, std::move(body));
-    out_node->SetVars( control.symbols.GetFunctionVars() );
-    return out_node;
-  }
-
-  void Parse() {
-    // Outer layer can only be function definitions.
-    while (tokens.Any()) {
-      functions.push_back( Parse_Function() );
-      functions.back()->TypeCheck(control.symbols);
-    }
-  }
-
-  void ToWAT() {
-    control.Code("(module");
-    control.Indent(2);
-
-    // Manage DATA (USED IN PROJECT 4!!)
-    control.CommentLine(";; Define a memory block with ten pages (640KB)");
-    control.Code("(memory (export \"memory\") 1)");
-    for (auto & fun_ptr : functions) {
-      fun_ptr->InitializeWAT(control);
-    }
-    control.Code("(global $free_mem (mut i32) (i32.const ", control.wat_mem_pos, "))")
-           .Code("");
-
-    control.Code(";; Function to allocate a string; add one to size and places null there.")
-           .Code("(func $_alloc_str (param $size i32) (result i32)")
-           .Code("  (local $null_pos i32) ;; Local variable to place null terminator.")
-           .Code("  (global.get $free_mem)").Comment("Old free mem is alloc start.")
-           .Code("  (global.get $free_mem)").Comment("Adjust new free mem.")
-           .Code("  (local.get $size)")
-           .Code("  (i32.add)")
-           .Code("  (local.set $null_pos)")
-           .Code("  (i32.store8 (local.get $null_pos) (i32.const 0))").Comment("Place null terminator.")
-           .Code("  (i32.add (i32.const 1) (local.get $null_pos))")
-           .Code("  (global.set $free_mem)").Comment("Update free memory start.")
-           .Code(")")
-           .Code("");
-
-
-    // LOTS OF OTHER HELPER FUNCTIONS SHOULD GO HERE FOR PROJECT 4!!
-
-    for (auto & fun_ptr : functions) {
-      fun_ptr->ToWAT(control);
-    }
-    control.Indent(-2);
-    control.Code(")").Comment("END program module");
-  }
-
-  void PrintCode() const { control.PrintCode(); }
-  void PrintSymbols() const { control.symbols.Print(); }
-  void PrintAST() const {
-    for (auto & fun_ptr : functions) {
-      fun_ptr->Print();
-    }
-  }
-};
-
-
-int main(int argc, char * argv[])
-{
-  if (argc != 2) {
-    std::cout << "Format: " << argv[0] << " [filename]" << std::endl;
+  };
+  auto reports = [&]() {
+    if (pass_stats) prog.PrintStats();
+    if (time_report) prog.PrintTimeReport(time_json);
+    if (mem_report) { if (mem_json) memory::PrintJSON(); else memory::Print(); }
+  };
+  prog.SetPipeline(pipeline);
+  prog.MeasurePasses(pass_stats);
+  prog.UseBulkMemory(bulk_memory);
+  prog.UseSIMD(simd);
+  prog.Instrument(profile_table.has_value());
+  if (source_map) prog.TrackPositions(true, *source_map);
+  if (!prog.RequireHelpers(helper_list)) {
+    std::cout << "ERROR: Unknown runtime helper in '" << helper_list
+              << "'; available helpers are alloc, copy, fill, compare, length, and all.\n";
     exit(1);
   }
+  if (stream) {
+    prog.StreamCode(binary);
+    write_side_files();
+    reports();
+    return 0;
+  }
 
-
-  Tubular prog(argv[1]);
   prog.Parse();
+  if (run) {
+    const bool ok = prog.RunCalls(calls, vm_code);
+    reports();
+    return ok ? 0 : 1;
+  }
 
   // -- uncomment for debugging --
   // prog.PrintSymbols();
   // prog.PrintAST();
 
-  prog.ToWAT();
-  prog.PrintCode();
+  prog.ToWAT(num_jobs);
+  prog.Output(binary);
+  write_side_files();
+  reports();
 }
@@ -0,0 +1,687 @@
+#pragma once
+
+// The runtime library: a memory allocator, plus memory helpers for strings and buffers,
+// each generated only when needed.
+//
+// Memory after the string data holds a small table of free-list heads, followed by a heap
+// of blocks.  Each block starts with a header word and ends with a footer word, both
+// holding its size in bytes (a multiple of 8, counting header and footer) plus the flag
+// bits below; the payload handed out starts right after the header and is 8-byte aligned.
+//
+// - Requests that fit in a 1024-byte block are rounded up to one of seven size classes
+//   (blocks of 16, 32, ..., 1024 bytes).  Each class has a singly-linked free list, so
+//   reusing or freeing a small block takes constant time; small blocks are never merged.
+//   An empty class is refilled by carving a whole 4 KB chunk into its blocks, which keeps
+//   small blocks packed together instead of scattered between large ones.
+// - Larger blocks are found best-fit in a doubly-linked free list and split if much too
+//   big.  Freeing one merges it with any free large neighbors, and a free block that ends
+//   at the top of the heap goes back to the heap instead.
+// - New blocks come from the top of the heap ($free_mem); memory grows as needed.
+//
+// Exported globals count allocations, frees, bytes in use (whole blocks), and pages grown.
+
+#include <algorithm>
+#include <array>
+#include <assert.h>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "Control.hpp"
+
+namespace runtime {
+  // Start a runtime function; return its ID.
+  inline uint32_t Function(Control & control, std::string name, ValType result) {
+    control.StartFunction(name, result);
+    return static_cast<uint32_t>(control.functions.size() - 1);
+  }
+
+  inline void EndFunction(Control & control, uint32_t fun_id, bool exported=false) {
+    control.Indent(-2).Code(Op::END).Blank();
+    if (exported) control.Export(fun_id).Blank();
+  }
+
+  // Return 0 from the current function if the value on the stack is true.
+  inline Control & ReturnZeroIf(Control & control, const std::string & note) {
+    return control.Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2)
+                  .I32Const(0).Code(Op::RETURN).Comment(note)
+                  .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END);
+  }
+
+  class Allocator {
+  private:
+    static constexpr int32_t USED = 1;          // Header flag: block is allocated.
+    static constexpr int32_t SMALL = 2;         // Header flag: block belongs to a size class.
+    static constexpr int32_t MAX_SMALL = 1024;  // Largest size-class block.
+    static constexpr int32_t SMALL_CHUNK = 4096;  // Carved into blocks when a class runs out.
+    static constexpr uint32_t LARGE_HEAD = 28;  // Table offset of the large free list head.
+    static constexpr int32_t FIRST_BLOCK = 36;  // Offset of the first block (header 4 mod 8).
+    static constexpr int32_t MIN_SPLIT = 32;    // Smallest remainder worth splitting off.
+    static constexpr int32_t MAX_REQUEST = 0x7FFF0000;
+
+    // Globals
+    uint32_t free_mem = 0;      // Top of the heap, where the next new block starts.
+    uint32_t heap_base = 0;     // Address of the table of free-list heads.
+    uint32_t alloc_count = 0;
+    uint32_t free_count = 0;
+    uint32_t bytes_in_use = 0;
+    uint32_t grow_count = 0;
+
+    // Functions
+    uint32_t set_tags = 0, free_push = 0, free_unlink = 0, alloc_block = 0, alloc = 0;
+
+    bool required = false;
+    bool generated = false;
+
+    // Write a block's header and footer (size plus flags).
+    void GenerateSetTags(Control & control) {
+      control.CommentLine("Write the header and footer of a block (size plus flags).");
+      set_tags = Function(control, "_set_tags", ValType::NONE);
+      const uint32_t block = control.AddParam("$block", ValType::I32);
+      const uint32_t tag = control.AddParam("$tag", ValType::I32);
+      control.Indent(2)
+             .Code(Op::LOCAL_GET, block).Code(Op::LOCAL_GET, tag)
+             .Code(Op::I32_STORE, 0).Comment("Header")
+             .Code(Op::LOCAL_GET, block).Code(Op::LOCAL_GET, tag).I32Const(-8).Code(Op::I32_AND)
+             .Code(Op::I32_ADD).I32Const(4).Code(Op::I32_SUB)
+             .Code(Op::LOCAL_GET, tag)
+             .Code(Op::I32_STORE, 0).Comment("Footer");
+      EndFunction(control, set_tags);
+    }
+
+    // Add a block to the front of the large free list (next at +4, previous at +8).
+    void GenerateFreePush(Control & control) {
+      control.CommentLine("Add a block to the front of the large free list.");
+      free_push = Function(control, "_free_push", ValType::NONE);
+      const uint32_t block = control.AddParam("$block", ValType::I32);
+      control.Indent(2);
+      const uint32_t next = control.AddLocal("$next", ValType::I32);
+      control.Code(Op::LOCAL_GET, block)
+             .Code(Op::GLOBAL_GET, heap_base).Code(Op::I32_LOAD, LARGE_HEAD)
+             .Code(Op::LOCAL_TEE, next)
+             .Code(Op::I32_STORE, 4).Comment("block.next = head")
+             .Code(Op::LOCAL_GET, block).I32Const(0)
+             .Code(Op::I32_STORE, 8).Comment("block.prev = null")
+             .Code(Op::LOCAL_GET, next)
+             .Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, next).Code(Op::LOCAL_GET, block)
+             .Code(Op::I32_STORE, 8).Comment("head.prev = block")
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Code(Op::GLOBAL_GET, heap_base).Code(Op::LOCAL_GET, block)
+             .Code(Op::I32_STORE, LARGE_HEAD).Comment("head = block");
+      EndFunction(control, free_push);
+    }
+
+    // Remove a block from the large free list.
+    void GenerateFreeUnlink(Control & control) {
+      control.CommentLine("Remove a block from the large free list.");
+      free_unlink = Function(control, "_free_unlink", ValType::NONE);
+      const uint32_t block = control.AddParam("$block", ValType::I32);
+      control.Indent(2);
+      const uint32_t next = control.AddLocal("$next", ValType::I32);
+      const uint32_t prev = control.AddLocal("$prev", ValType::I32);
+      control.Code(Op::LOCAL_GET, block).Code(Op::I32_LOAD, 4).Code(Op::LOCAL_SET, next)
+             .Code(Op::LOCAL_GET, block).Code(Op::I32_LOAD, 8).Code(Op::LOCAL_TEE, prev)
+             .Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, prev).Code(Op::LOCAL_GET, next)
+             .Code(Op::I32_STORE, 4).Comment("prev.next = next")
+             .Indent(-2).Code(Op::END)
+             .Code(Op::ELSE).Indent(2)
+             .Code(Op::GLOBAL_GET, heap_base).Code(Op::LOCAL_GET, next)
+             .Code(Op::I32_STORE, LARGE_HEAD).Comment("head = next")
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Code(Op::LOCAL_GET, next)
+             .Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, next).Code(Op::LOCAL_GET, prev)
+             .Code(Op::I32_STORE, 8).Comment("next.prev = prev")
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END);
+      EndFunction(control, free_unlink);
+    }
+
+    // Find a block of at least $need bytes: the best fit from the large free list, else from
+    // the top of the heap.  Returns the block (marked as used) or 0 if memory is full.
+    void GenerateAllocBlock(Control & control) {
+      control.CommentLine("Find a free block of at least $need bytes, or make a new one.");
+      alloc_block = Function(control, "_alloc_block", ValType::I32);
+      const uint32_t need = control.AddParam("$need", ValType::I32);
+      control.Indent(2);
+      const uint32_t block = control.AddLocal("$block", ValType::I32);
+      const uint32_t size = control.AddLocal("$size", ValType::I32);
+      const uint32_t end = control.AddLocal("$end", ValType::I32);
+      const uint32_t pages = control.AddLocal("$pages", ValType::I32);
+      const uint32_t best = control.AddLocal("$best", ValType::I32);
+      const uint32_t best_size = control.AddLocal("$best_size", ValType::I32);
+      const uint32_t done = control.MakeLabel("$done");
+      const uint32_t scan = control.MakeLabel("$scan");
+      control.Code(Op::GLOBAL_GET, heap_base).Code(Op::I32_LOAD, LARGE_HEAD).Code(Op::LOCAL_SET, block)
+             .Code(Op::BLOCK, done).Indent(2)
+             .Code(Op::LOOP, scan).Comment("Scan the large free list for the smallest fit.").Indent(2)
+             .Code(Op::LOCAL_GET, block).Code(Op::I32_EQZ).Code(Op::BR_IF, done)
+             .Code(Op::LOCAL_GET, block).Code(Op::I32_LOAD, 0).I32Const(-8).Code(Op::I32_AND)
+             .Code(Op::LOCAL_TEE, size).Code(Op::LOCAL_GET, need).Code(Op::I32_GE_U)
+             .Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, size).Code(Op::LOCAL_GET, best_size).I32Const(1).Code(Op::I32_SUB)
+             .Code(Op::I32_LT_U).Comment("(An unset $best_size of 0 wraps to the largest.)")
+             .Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, block).Code(Op::LOCAL_SET, best)
+             .Code(Op::LOCAL_GET, size).Code(Op::LOCAL_SET, best_size)
+             .Code(Op::LOCAL_GET, size).Code(Op::LOCAL_GET, need).Code(Op::I32_SUB)
+             .I32Const(MIN_SPLIT).Code(Op::I32_LT_U).Code(Op::BR_IF, done).Comment("Close enough.")
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Code(Op::LOCAL_GET, block).Code(Op::I32_LOAD, 4).Code(Op::LOCAL_SET, block)
+             .Code(Op::BR, scan)
+             .Indent(-2).Code(Op::END)
+             .Indent(-2).Code(Op::END)
+             .Code(Op::LOCAL_GET, best)
+             .Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, best).Code(Op::CALL, free_unlink)
+             .Code(Op::LOCAL_GET, best_size).Code(Op::LOCAL_GET, need).Code(Op::I32_SUB)
+             .I32Const(MIN_SPLIT).Code(Op::I32_GE_U)
+             .Code(Op::IF).Comment("Split off the rest as a new free block.")
+             .Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, best).Code(Op::LOCAL_GET, need).Code(Op::I32_ADD)
+             .Code(Op::LOCAL_GET, best_size).Code(Op::LOCAL_GET, need).Code(Op::I32_SUB)
+             .Code(Op::CALL, set_tags)
+             .Code(Op::LOCAL_GET, best).Code(Op::LOCAL_GET, need).Code(Op::I32_ADD)
+             .Code(Op::CALL, free_push)
+             .Code(Op::LOCAL_GET, need).Code(Op::LOCAL_SET, best_size)
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Code(Op::LOCAL_GET, best).Code(Op::LOCAL_GET, best_size).I32Const(USED).Code(Op::I32_OR)
+             .Code(Op::CALL, set_tags)
+             .Code(Op::LOCAL_GET, best).Code(Op::RETURN)
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .CommentLine("Nothing fits; make a new block at the top of the heap.")
+             .Code(Op::GLOBAL_GET, free_mem).Code(Op::LOCAL_TEE, block)
+             .Code(Op::LOCAL_GET, need).Code(Op::I32_ADD).Code(Op::LOCAL_TEE, end)
+             .Code(Op::MEMORY_SIZE).I32Const(16).Code(Op::I32_SHL).Code(Op::I32_GT_U)
+             .Code(Op::IF).Comment("Grow memory by enough pages to hold it.")
+             .Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, end).Code(Op::MEMORY_SIZE).I32Const(16).Code(Op::I32_SHL)
+             .Code(Op::I32_SUB).I32Const(0xFFFF).Code(Op::I32_ADD).I32Const(16).Code(Op::I32_SHR_U)
+             .Code(Op::LOCAL_TEE, pages)
+             .Code(Op::MEMORY_GROW).I32Const(-1).Code(Op::I32_EQ);
+      ReturnZeroIf(control, "Out of memory.")
+             .Code(Op::GLOBAL_GET, grow_count).Code(Op::LOCAL_GET, pages).Code(Op::I32_ADD)
+             .Code(Op::GLOBAL_SET, grow_count)
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Code(Op::LOCAL_GET, end).Code(Op::GLOBAL_SET, free_mem)
+             .Code(Op::LOCAL_GET, block).Code(Op::LOCAL_GET, need).I32Const(USED).Code(Op::I32_OR)
+             .Code(Op::CALL, set_tags)
+             .Code(Op::LOCAL_GET, block);
+      EndFunction(control, alloc_block);
+    }
+
+    // Allocate $size bytes and return their address (or 0 if memory is full).
+    void GenerateAlloc(Control & control) {
+      control.CommentLine("Allocate $size bytes; return their address (0 if out of memory).");
+      alloc = Function(control, "_alloc", ValType::I32);
+      const uint32_t size = control.AddParam("$size", ValType::I32);
+      control.Indent(2);
+      const uint32_t need = control.AddLocal("$need", ValType::I32);
+      const uint32_t head = control.AddLocal("$head", ValType::I32);
+      const uint32_t block = control.AddLocal("$block", ValType::I32);
+      const uint32_t end = control.AddLocal("$end", ValType::I32);
+      const uint32_t carve = control.MakeLabel("$carve");
+      control.Code(Op::LOCAL_GET, size).I32Const(MAX_REQUEST).Code(Op::I32_GT_U);
+      ReturnZeroIf(control, "Too big (or negative).")
+             .Code(Op::LOCAL_GET, size).I32Const(15).Code(Op::I32_ADD).I32Const(-8).Code(Op::I32_AND)
+             .Code(Op::LOCAL_TEE, need).Comment("Block size: payload, header, and footer.")
+             .I32Const(MAX_SMALL).Code(Op::I32_LE_U)
+             .Code(Op::IF).Comment("Small blocks come from the list for their size class.")
+             .Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::GLOBAL_GET, heap_base)
+             .I32Const(28)
+             .Code(Op::LOCAL_GET, need).I32Const(16)
+             .Code(Op::LOCAL_GET, need).I32Const(16).Code(Op::I32_GT_U)
+             .Code(Op::SELECT).I32Const(1).Code(Op::I32_SUB).Code(Op::I32_CLZ)
+             .Code(Op::I32_SUB).Comment("Class: blocks of 16 << class bytes")
+             .Code(Op::LOCAL_TEE, head)
+             .I32Const(2).Code(Op::I32_SHL).Code(Op::I32_ADD)
+             .I32Const(16).Code(Op::LOCAL_GET, head).Code(Op::I32_SHL).Code(Op::LOCAL_SET, need)
+             .Code(Op::LOCAL_TEE, head)
+             .Code(Op::I32_LOAD, 0).Code(Op::LOCAL_TEE, block)
+             .Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, head).Code(Op::LOCAL_GET, block).Code(Op::I32_LOAD, 4)
+             .Code(Op::I32_STORE, 0).Comment("Pop the block off the list.")
+             .Indent(-2).Code(Op::END)
+             .Code(Op::ELSE).Comment("The list is empty; carve a new chunk into blocks of this class.")
+             .Indent(2)
+             .I32Const(SMALL_CHUNK).Code(Op::CALL, alloc_block).Code(Op::LOCAL_TEE, block).Code(Op::I32_EQZ);
+      ReturnZeroIf(control, "Out of memory.")
+             .Code(Op::LOCAL_GET, block).I32Const(SMALL_CHUNK).Code(Op::I32_ADD).Code(Op::LOCAL_SET, end)
+             .Code(Op::LOOP, carve).Comment("Push every block but the first onto the list.").Indent(2)
+             .Code(Op::LOCAL_GET, end).Code(Op::LOCAL_GET, need).Code(Op::I32_SUB).Code(Op::LOCAL_TEE, end)
+             .Code(Op::LOCAL_GET, block).Code(Op::I32_NE)
+             .Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, end).Code(Op::LOCAL_GET, need).I32Const(SMALL).Code(Op::I32_OR)
+             .Code(Op::CALL, set_tags)
+             .Code(Op::LOCAL_GET, end).Code(Op::LOCAL_GET, head).Code(Op::I32_LOAD, 0)
+             .Code(Op::I32_STORE, 4).Comment("block.next = head")
+             .Code(Op::LOCAL_GET, head).Code(Op::LOCAL_GET, end)
+             .Code(Op::I32_STORE, 0).Comment("head = block")
+             .Code(Op::BR, carve)
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Indent(-2).Code(Op::END)
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Code(Op::LOCAL_GET, block).Code(Op::LOCAL_GET, need).I32Const(USED | SMALL).Code(Op::I32_OR)
+             .Code(Op::CALL, set_tags)
+             .Indent(-2).Code(Op::END)
+             .Code(Op::ELSE).Indent(2)
+             .Code(Op::LOCAL_GET, need).Code(Op::CALL, alloc_block).Code(Op::LOCAL_TEE, block).Code(Op::I32_EQZ);
+      ReturnZeroIf(control, "Out of memory.")
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Code(Op::GLOBAL_GET, alloc_count).I32Const(1).Code(Op::I32_ADD)
+             .Code(Op::GLOBAL_SET, alloc_count)
+             .Code(Op::GLOBAL_GET, bytes_in_use)
+             .Code(Op::LOCAL_GET, block).Code(Op::I32_LOAD, 0).I32Const(-8).Code(Op::I32_AND)
+             .Code(Op::I32_ADD).Code(Op::GLOBAL_SET, bytes_in_use)
+             .Code(Op::LOCAL_GET, block).I32Const(4).Code(Op::I32_ADD).Comment("Payload follows the header.");
+      EndFunction(control, alloc, true);
+    }
+
+    // Free memory returned by _alloc (0 is ignored).
+    void GenerateFree(Control & control) {
+      control.CommentLine("Free memory returned by _alloc (0 is ignored).");
+      const uint32_t free_id = Function(control, "_free", ValType::NONE);
+      const uint32_t ptr = control.AddParam("$ptr", ValType::I32);
+      control.Indent(2);
+      const uint32_t block = control.AddLocal("$block", ValType::I32);
+      const uint32_t size = control.AddLocal("$size", ValType::I32);
+      const uint32_t tag = control.AddLocal("$tag", ValType::I32);
+      control.Code(Op::LOCAL_GET, ptr).Code(Op::I32_EQZ)
+             .Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::RETURN)
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Code(Op::LOCAL_GET, ptr).I32Const(4).Code(Op::I32_SUB).Code(Op::LOCAL_TEE, block)
+             .Code(Op::I32_LOAD, 0).Code(Op::LOCAL_TEE, tag).I32Const(-8).Code(Op::I32_AND)
+             .Code(Op::LOCAL_SET, size)
+             .Code(Op::GLOBAL_GET, free_count).I32Const(1).Code(Op::I32_ADD)
+             .Code(Op::GLOBAL_SET, free_count)
+             .Code(Op::GLOBAL_GET, bytes_in_use).Code(Op::LOCAL_GET, size).Code(Op::I32_SUB)
+             .Code(Op::GLOBAL_SET, bytes_in_use)
+             .Code(Op::LOCAL_GET, tag).I32Const(SMALL).Code(Op::I32_AND)
+             .Code(Op::IF).Comment("Small blocks go back on the list for their size class.")
+             .Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, block).Code(Op::LOCAL_GET, size).I32Const(SMALL).Code(Op::I32_OR)
+             .Code(Op::CALL, set_tags)
+             .Code(Op::GLOBAL_GET, heap_base)
+             .I32Const(28).Code(Op::LOCAL_GET, size).I32Const(1).Code(Op::I32_SUB).Code(Op::I32_CLZ)
+             .Code(Op::I32_SUB).I32Const(2).Code(Op::I32_SHL).Code(Op::I32_ADD)
+             .Code(Op::LOCAL_SET, tag).Comment("Address of the list head")
+             .Code(Op::LOCAL_GET, block).Code(Op::LOCAL_GET, tag).Code(Op::I32_LOAD, 0)
+             .Code(Op::I32_STORE, 4).Comment("block.next = head")
+             .Code(Op::LOCAL_GET, tag).Code(Op::LOCAL_GET, block)
+             .Code(Op::I32_STORE, 0).Comment("head = block")
+             .Code(Op::RETURN)
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .CommentLine("Merge with the next block if it is free (and not small).")
+             .Code(Op::LOCAL_GET, block).Code(Op::LOCAL_GET, size).Code(Op::I32_ADD).Code(Op::LOCAL_TEE, tag)
+             .Code(Op::GLOBAL_GET, free_mem).Code(Op::I32_NE)
+             .Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, tag).Code(Op::I32_LOAD, 0).I32Const(USED | SMALL).Code(Op::I32_AND)
+             .Code(Op::I32_EQZ)
+             .Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, tag).Code(Op::CALL, free_unlink)
+             .Code(Op::LOCAL_GET, size).Code(Op::LOCAL_GET, tag).Code(Op::I32_LOAD, 0).Code(Op::I32_ADD)
+             .Code(Op::LOCAL_SET, size)
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .CommentLine("Merge with the previous block likewise (its footer is just below).")
+             .Code(Op::LOCAL_GET, block).Code(Op::GLOBAL_GET, heap_base).I32Const(FIRST_BLOCK)
+             .Code(Op::I32_ADD).Code(Op::I32_NE)
+             .Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, block).I32Const(4).Code(Op::I32_SUB).Code(Op::I32_LOAD, 0)
+             .Code(Op::LOCAL_TEE, tag).I32Const(USED | SMALL).Code(Op::I32_AND).Code(Op::I32_EQZ)
+             .Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, block).Code(Op::LOCAL_GET, tag).Code(Op::I32_SUB)
+             .Code(Op::LOCAL_TEE, block).Code(Op::CALL, free_unlink)
+             .Code(Op::LOCAL_GET, size).Code(Op::LOCAL_GET, tag).Code(Op::I32_ADD)
+             .Code(Op::LOCAL_SET, size)
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Code(Op::LOCAL_GET, block).Code(Op::LOCAL_GET, size).Code(Op::I32_ADD)
+             .Code(Op::GLOBAL_GET, free_mem).Code(Op::I32_EQ)
+             .Code(Op::IF).Comment("A free block at the top goes back to the heap.")
+             .Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, block).Code(Op::GLOBAL_SET, free_mem)
+             .Code(Op::RETURN)
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Code(Op::LOCAL_GET, block).Code(Op::LOCAL_GET, size).Code(Op::CALL, set_tags)
+             .Code(Op::LOCAL_GET, block).Code(Op::CALL, free_push);
+      EndFunction(control, free_id, true);
+    }
+
+    // Allocate a string; add one to size and place a null there.
+    void GenerateAllocStr(Control & control) {
+      control.CommentLine("Function to allocate a string; add one to size and places null there.");
+      const uint32_t fun_id = Function(control, "_alloc_str", ValType::I32);
+      const uint32_t size = control.AddParam("$size", ValType::I32);
+      control.Indent(2);
+      const uint32_t pos = control.AddLocal("$pos", ValType::I32);
+      control.Code(Op::LOCAL_GET, size).I32Const(1).Code(Op::I32_ADD)
+             .Code(Op::CALL, alloc).Code(Op::LOCAL_TEE, pos)
+             .Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, pos).Code(Op::LOCAL_GET, size).Code(Op::I32_ADD)
+             .I32Const(0)
+             .Code(Op::I32_STORE8, 0).Comment("Place null terminator.")
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Code(Op::LOCAL_GET, pos);
+      EndFunction(control, fun_id);
+    }
+
+  public:
+    // The allocator is generated only if something requires it (code that allocates
+    // strings or arrays, or --helpers) before the module starts.
+    void Require() {
+      assert(!generated);
+      required = true;
+    }
+    bool IsRequired() const { return required; }
+
+    // The function to call to allocate memory (the allocator must have been required).
+    uint32_t AllocID() const {
+      assert(generated && required);
+      return alloc;
+    }
+
+    // Generate the allocator's functions, if required (at the start of the module).
+    void Generate(Control & control) {
+      generated = true;
+      if (!required) return;
+      free_mem = control.AddGlobal("free_mem", ValType::I32, true);
+      heap_base = control.AddGlobal("_heap_base", ValType::I32, false);
+      alloc_count = control.AddGlobal("_alloc_count", ValType::I32, true);
+      free_count = control.AddGlobal("_free_count", ValType::I32, true);
+      bytes_in_use = control.AddGlobal("_bytes_in_use", ValType::I32, true);
+      grow_count = control.AddGlobal("_grow_count", ValType::I32, true);
+      for (uint32_t id : {alloc_count, free_count, bytes_in_use, grow_count}) {
+        control.globals[id].exported = true;
+      }
+
+      GenerateSetTags(control);
+      GenerateFreePush(control);
+      GenerateFreeUnlink(control);
+      GenerateAllocBlock(control);
+      GenerateAlloc(control);
+      GenerateFree(control);
+      GenerateAllocStr(control);
+    }
+
+    // Declare the allocator's globals; the heap starts after all data at data_end.
+    void Finish(Control & control, size_t data_end) {
+      if (!required) return;
+      const int32_t base = static_cast<int32_t>((data_end + 7) & ~size_t(7));
+      control.globals[heap_base].init = base;
+      control.globals[free_mem].init = base + FIRST_BLOCK;
+      for (uint32_t id : {free_mem, heap_base, alloc_count, free_count, bytes_in_use, grow_count}) {
+        control.Code(Op::GLOBAL, id);
+      }
+      control.Blank();
+    }
+  };
+
+  // The table of profiling counters (see Profile.hpp), generated only when instrumenting.
+  class Profiler {
+  private:
+    uint32_t base = 0;   // Global holding the table's address.
+
+  public:
+    // Generate the function that reports where the counters are (at the start of the module).
+    void Generate(Control & control) {
+      if (!control.profile.Enabled()) return;
+      base = control.AddGlobal("_prof_base", ValType::I32, false);
+      control.profile.SetBaseGlobal(base);
+      control.CommentLine("Return the address of the profiling counters (their number, then each count).");
+      const uint32_t fun_id = Function(control, "_prof_dump", ValType::I32);
+      control.Indent(2).Code(Op::GLOBAL_GET, base);
+      EndFunction(control, fun_id, true);
+    }
+
+    // Place the counters after all data at data_end; return where the memory after them starts.
+    size_t Finish(Control & control, size_t data_end) {
+      if (!control.profile.Enabled()) return data_end;
+      const size_t start = (data_end + 3) & ~size_t(3);
+      const size_t end = start + control.profile.Bytes();
+      control.globals[base].init = static_cast<int32_t>(start);
+
+      // The count is the only part that starts out non-zero.
+      std::string count_bytes;
+      for (size_t i = 0; i < profile::Table::HEADER_BYTES; ++i) {
+        count_bytes += static_cast<char>((control.profile.Size() >> (8*i)) & 0xFF);
+      }
+      control.data_segments.emplace_back(start, count_bytes);
+      control.Code(Op::DATA, static_cast<uint32_t>(control.data_segments.size() - 1))
+             .Comment("Number of profiling counters");
+
+      // Start with enough memory for the table, if the module has not been written out yet.
+      const uint32_t pages = static_cast<uint32_t>((end + 0xFFFF) >> 16);
+      for (Instr & inst : control.code) {
+        if (inst.op == Op::MEMORY) inst.arg = std::max(inst.arg, pages);
+      }
+      control.Code(Op::GLOBAL, base).Blank();
+      return end;
+    }
+  };
+
+  // Memory helpers for strings and buffers: copy, fill, compare, and length.  Each one is
+  // generated only if something requires it before the module starts.  Copy and fill
+  // are single bulk-memory instructions (memory.copy and memory.fill), or byte loops when
+  // bulk memory is turned off; compare can check 16 bytes at a time with v128 SIMD.
+  class Helpers {
+  public:
+    enum class ID : uint8_t { COPY, FILL, COMPARE, LENGTH };
+    static constexpr size_t NUM_HELPERS = 4;
+
+  private:
+    struct Info {
+      const char * name;       // Name on the command line (see --helpers)
+      const char * fun_name;   // Name of the generated (and exported) function
+    };
+    static constexpr Info INFO[NUM_HELPERS] = {
+      { "copy", "_mem_copy" }, { "fill", "_mem_fill" },
+      { "compare", "_mem_compare" }, { "length", "_str_length" },
+    };
+
+    std::array<bool, NUM_HELPERS> required{};
+    std::array<uint32_t, NUM_HELPERS> fun_ids{};
+    bool bulk_memory = true;   // Use memory.copy and memory.fill?
+    bool simd = false;         // Use v128 instructions?
+    bool generated = false;
+
+    // Copy $n bytes from $src to $dest; the ranges may overlap.
+    void GenerateCopy(Control & control) {
+      control.CommentLine("Copy $n bytes from $src to $dest (the ranges may overlap).");
+      const uint32_t fun_id = Function(control, INFO[0].fun_name, ValType::NONE);
+      const uint32_t dest = control.AddParam("$dest", ValType::I32);
+      const uint32_t src = control.AddParam("$src", ValType::I32);
+      const uint32_t n = control.AddParam("$n", ValType::I32);
+      control.Indent(2);
+      if (bulk_memory) {
+        control.Code(Op::LOCAL_GET, dest).Code(Op::LOCAL_GET, src).Code(Op::LOCAL_GET, n)
+               .Code(Op::MEMORY_COPY);
+        EndFunction(control, fun_id, true);
+        return;
+      }
+      const uint32_t i = control.AddLocal("$i", ValType::I32);
+      const uint32_t down_done = control.MakeLabel("$done");
+      const uint32_t down = control.MakeLabel("$down");
+      const uint32_t up_done = control.MakeLabel("$done");
+      const uint32_t up = control.MakeLabel("$up");
+      control.Code(Op::LOCAL_GET, dest).Code(Op::LOCAL_GET, src).Code(Op::I32_GT_U)
+             .Code(Op::IF).Comment("Copy from the end down, so overlapping bytes are read first.")
+             .Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::BLOCK, down_done).Indent(2)
+             .Code(Op::LOOP, down).Indent(2)
+             .Code(Op::LOCAL_GET, n).Code(Op::I32_EQZ).Code(Op::BR_IF, down_done)
+             .Code(Op::LOCAL_GET, n).I32Const(1).Code(Op::I32_SUB).Code(Op::LOCAL_SET, n)
+             .Code(Op::LOCAL_GET, dest).Code(Op::LOCAL_GET, n).Code(Op::I32_ADD)
+             .Code(Op::LOCAL_GET, src).Code(Op::LOCAL_GET, n).Code(Op::I32_ADD)
+             .Code(Op::I32_LOAD8_U, 0).Code(Op::I32_STORE8, 0)
+             .Code(Op::BR, down)
+             .Indent(-2).Code(Op::END)
+             .Indent(-2).Code(Op::END)
+             .Code(Op::RETURN)
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Code(Op::BLOCK, up_done).Indent(2)
+             .Code(Op::LOOP, up).Indent(2)
+             .Code(Op::LOCAL_GET, i).Code(Op::LOCAL_GET, n).Code(Op::I32_GE_U).Code(Op::BR_IF, up_done)
+             .Code(Op::LOCAL_GET, dest).Code(Op::LOCAL_GET, i).Code(Op::I32_ADD)
+             .Code(Op::LOCAL_GET, src).Code(Op::LOCAL_GET, i).Code(Op::I32_ADD)
+             .Code(Op::I32_LOAD8_U, 0).Code(Op::I32_STORE8, 0)
+             .Code(Op::LOCAL_GET, i).I32Const(1).Code(Op::I32_ADD).Code(Op::LOCAL_SET, i)
+             .Code(Op::BR, up)
+             .Indent(-2).Code(Op::END)
+             .Indent(-2).Code(Op::END);
+      EndFunction(control, fun_id, true);
+    }
+
+    // Set $n bytes at $dest to $value.
+    void GenerateFill(Control & control) {
+      control.CommentLine("Set $n bytes at $dest to $value.");
+      const uint32_t fun_id = Function(control, INFO[1].fun_name, ValType::NONE);
+      const uint32_t dest = control.AddParam("$dest", ValType::I32);
+      const uint32_t value = control.AddParam("$value", ValType::I32);
+      const uint32_t n = control.AddParam("$n", ValType::I32);
+      control.Indent(2);
+      if (bulk_memory) {
+        control.Code(Op::LOCAL_GET, dest).Code(Op::LOCAL_GET, value).Code(Op::LOCAL_GET, n)
+               .Code(Op::MEMORY_FILL);
+        EndFunction(control, fun_id, true);
+        return;
+      }
+      const uint32_t i = control.AddLocal("$i", ValType::I32);
+      const uint32_t done = control.MakeLabel("$done");
+      const uint32_t next = control.MakeLabel("$next");
+      control.Code(Op::BLOCK, done).Indent(2)
+             .Code(Op::LOOP, next).Indent(2)
+             .Code(Op::LOCAL_GET, i).Code(Op::LOCAL_GET, n).Code(Op::I32_GE_U).Code(Op::BR_IF, done)
+             .Code(Op::LOCAL_GET, dest).Code(Op::LOCAL_GET, i).Code(Op::I32_ADD)
+             .Code(Op::LOCAL_GET, value).Code(Op::I32_STORE8, 0)
+             .Code(Op::LOCAL_GET, i).I32Const(1).Code(Op::I32_ADD).Code(Op::LOCAL_SET, i)
+             .Code(Op::BR, next)
+             .Indent(-2).Code(Op::END)
+             .Indent(-2).Code(Op::END);
+      EndFunction(control, fun_id, true);
+    }
+
+    // Compare $n bytes at $a and $b (as unsigned bytes); return the difference between the
+    // first pair that differs, or 0 if they are all the same.
+    void GenerateCompare(Control & control) {
+      control.CommentLine("Compare $n bytes at $a and $b; return the first difference (or 0).");
+      const uint32_t fun_id = Function(control, INFO[2].fun_name, ValType::I32);
+      const uint32_t a = control.AddParam("$a", ValType::I32);
+      const uint32_t b = control.AddParam("$b", ValType::I32);
+      const uint32_t n = control.AddParam("$n", ValType::I32);
+      control.Indent(2);
+      const uint32_t diff = control.AddLocal("$diff", ValType::I32);
+      if (simd) {
+        const uint32_t wide_done = control.MakeLabel("$wide_done");
+        const uint32_t wide = control.MakeLabel("$wide");
+        control.Code(Op::BLOCK, wide_done).Indent(2)
+               .Code(Op::LOOP, wide).Comment("Skip 16 equal bytes at a time.").Indent(2)
+               .Code(Op::LOCAL_GET, n).I32Const(16).Code(Op::I32_LT_U).Code(Op::BR_IF, wide_done)
+               .Code(Op::LOCAL_GET, a).Code(Op::V128_LOAD, 0)
+               .Code(Op::LOCAL_GET, b).Code(Op::V128_LOAD, 0)
+               .Code(Op::I8X16_EQ).Code(Op::I8X16_ALL_TRUE).Code(Op::I32_EQZ)
+               .Code(Op::BR_IF, wide_done).Comment("The bytes loop below finds the difference.")
+               .Code(Op::LOCAL_GET, a).I32Const(16).Code(Op::I32_ADD).Code(Op::LOCAL_SET, a)
+               .Code(Op::LOCAL_GET, b).I32Const(16).Code(Op::I32_ADD).Code(Op::LOCAL_SET, b)
+               .Code(Op::LOCAL_GET, n).I32Const(16).Code(Op::I32_SUB).Code(Op::LOCAL_SET, n)
+               .Code(Op::BR, wide)
+               .Indent(-2).Code(Op::END)
+               .Indent(-2).Code(Op::END);
+      }
+      const uint32_t done = control.MakeLabel("$done");
+      const uint32_t next = control.MakeLabel("$next");
+      control.Code(Op::BLOCK, done).Indent(2)
+             .Code(Op::LOOP, next).Indent(2)
+             .Code(Op::LOCAL_GET, n).Code(Op::I32_EQZ).Code(Op::BR_IF, done)
+             .Code(Op::LOCAL_GET, a).Code(Op::I32_LOAD8_U, 0)
+             .Code(Op::LOCAL_GET, b).Code(Op::I32_LOAD8_U, 0)
+             .Code(Op::I32_SUB).Code(Op::LOCAL_TEE, diff)
+             .Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2)
+             .Code(Op::LOCAL_GET, diff).Code(Op::RETURN)
+             .Indent(-2).Code(Op::END).Indent(-2).Code(Op::END)
+             .Code(Op::LOCAL_GET, a).I32Const(1).Code(Op::I32_ADD).Code(Op::LOCAL_SET, a)
+             .Code(Op::LOCAL_GET, b).I32Const(1).Code(Op::I32_ADD).Code(Op::LOCAL_SET, b)
+             .Code(Op::LOCAL_GET, n).I32Const(1).Code(Op::I32_SUB).Code(Op::LOCAL_SET, n)
+             .Code(Op::BR, next)
+             .Indent(-2).Code(Op::END)
+             .Indent(-2).Code(Op::END)
+             .I32Const(0);
+      EndFunction(control, fun_id, true);
+    }
+
+    // Count the bytes of a string before its null terminator.
+    void GenerateLength(Control & control) {
+      control.CommentLine("Count the bytes of a string before its null terminator.");
+      const uint32_t fun_id = Function(control, INFO[3].fun_name, ValType::I32);
+      const uint32_t str = control.AddParam("$str", ValType::I32);
+      control.Indent(2);
+      const uint32_t end = control.AddLocal("$end", ValType::I32);
+      const uint32_t done = control.MakeLabel("$done");
+      const uint32_t next = control.MakeLabel("$next");
+      control.Code(Op::LOCAL_GET, str).Code(Op::LOCAL_SET, end)
+             .Code(Op::BLOCK, done).Indent(2)
+             .Code(Op::LOOP, next).Indent(2)
+             .Code(Op::LOCAL_GET, end).Code(Op::I32_LOAD8_U, 0).Code(Op::I32_EQZ).Code(Op::BR_IF, done)
+             .Code(Op::LOCAL_GET, end).I32Const(1).Code(Op::I32_ADD).Code(Op::LOCAL_SET, end)
+             .Code(Op::BR, next)
+             .Indent(-2).Code(Op::END)
+             .Indent(-2).Code(Op::END)
+             .Code(Op::LOCAL_GET, end).Code(Op::LOCAL_GET, str).Code(Op::I32_SUB);
+      EndFunction(control, fun_id, true);
+    }
+
+  public:
+    static std::optional<ID> Find(std::string_view name) {
+      for (size_t i = 0; i < NUM_HELPERS; ++i) {
+        if (name == INFO[i].name) return static_cast<ID>(i);
+      }
+      return std::nullopt;
+    }
+
+    // Require helpers from a comma-separated list of names ("all" for every one); return
+    // false if a name is unknown.
+    bool RequireList(std::string_view list) {
+      while (list.size()) {
+        const size_t comma = list.find(',');
+        const std::string_view name = list.substr(0, comma);
+        if (name == "all") required.fill(true);
+        else if (auto id = Find(name)) Require(*id);
+        else return false;
+        list = (comma == std::string_view::npos) ? "" : list.substr(comma + 1);
+      }
+      return true;
+    }
+
+    void Require(ID id) {
+      assert(!generated);  // Helpers must be required before the module starts.
+      required[static_cast<size_t>(id)] = true;
+    }
+    void UseBulkMemory(bool in) { bulk_memory = in; }
+    void UseSIMD(bool in) { simd = in; }
+
+    // The function to call for a helper (which must have been required).
+    uint32_t FunctionID(ID id) const {
+      assert(generated && required[static_cast<size_t>(id)]);
+      return fun_ids[static_cast<size_t>(id)];
+    }
+
+    // Generate the required helpers (at the start of the module).
+    void Generate(Control & control) {
+      using GenFun = void (Helpers::*)(Control &);
+      static constexpr GenFun GENERATE[NUM_HELPERS] = {
+        &Helpers::GenerateCopy, &Helpers::GenerateFill, &Helpers::GenerateCompare, &Helpers::GenerateLength,
+      };
+      for (size_t i = 0; i < NUM_HELPERS; ++i) {
+        if (!required[i]) continue;
+        fun_ids[i] = static_cast<uint32_t>(control.functions.size());
+        (this->*GENERATE[i])(control);
+      }
+      generated = true;
+    }
+  };
+}
@@ -0,0 +1,879 @@
+#pragma once
+
+// A mid-level SSA form for one function, between the AST and the instruction stream.
+//
+// A function is lowered into basic blocks of typed values (constants, parameters,
+// operations, and phis), each block ending in a jump, a two-way branch, a return, or a
+// trap.  Variables become values as they are lowered (Braun et al., "Simple and Efficient
+// Construction of Static Single Assignment Form"), so there is no separate renaming step.
+// When the Builder finishes:
+// - Blocks that can never run are removed, along with phis that merge only one value.
+// - Edges from a two-way branch into a block with phis are split, so the copies that
+//   feed a phi always sit in a block with a single exit.
+// - Blocks are put in reverse postorder and dominators are found (Cooper, Harvey, and
+//   Kennedy, "A Simple, Fast Dominance Algorithm").
+//
+// Verify() checks that a function is well formed, and Emit() rebuilds structured
+// block / loop / if code from the dominator tree (Ramsey, "Beyond Relooper"): a loop
+// wraps each loop header, and a block closes just before each node with several
+// forward edges into it.  A value used once, right where it is computed, stays on the
+// WASM stack; every other value (and every phi) gets a local of its own.  ToVM() lowers
+// the same form into bytecode, so that --run can check it.
+
+#include <algorithm>
+#include <assert.h>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Instruction.hpp"
+#include "tools.hpp"
+#include "VM.hpp"
+
+namespace ssa {
+  using ValueID = uint32_t;
+  using BlockID = uint32_t;
+  static constexpr uint32_t NONE = static_cast<uint32_t>(-1);
+
+  struct Stats {
+    size_t functions = 0;     // Functions generated through SSA form.
+    size_t blocks = 0;        // Basic blocks, after clean-up.
+    size_t phis = 0;          // Phi nodes, after clean-up.
+    size_t stack_values = 0;  // Values passed straight to their only use on the stack.
+    size_t locals = 0;        // Values (including phis) that needed a local.
+
+    void Add(const Stats & in) {
+      functions += in.functions;
+      blocks += in.blocks;
+      phis += in.phis;
+      stack_values += in.stack_values;
+      locals += in.locals;
+    }
+
+    void Print(std::ostream & os=std::cerr) const {
+      os << "SSA:\n"
+         << "  functions               " << functions << '\n'
+         << "  blocks                  " << blocks << '\n'
+         << "  phis                    " << phis << '\n'
+         << "  stack-values            " << stack_values << '\n'
+         << "  value-locals            " << locals << '\n';
+    }
+  };
+
+  // The type of value an operation takes (for every input) and leaves.
+  inline ValType ArgType(Op op) {
+    if (op == Op::I32_TRUNC_F64_S || (op >= Op::F64_EQ && op <= Op::F64_SQRT)) return ValType::F64;
+    if (op == Op::F64_CONVERT_I32_S || (op >= Op::I32_EQZ && op <= Op::I32_SHR_U)) return ValType::I32;
+    return ValType::NONE;
+  }
+
+  inline ValType ResultType(Op op) {
+    if (op == Op::F64_CONVERT_I32_S || (op >= Op::F64_ADD && op <= Op::F64_SQRT)) return ValType::F64;
+    if (op == Op::I32_TRUNC_F64_S || (op >= Op::I32_EQZ && op <= Op::F64_GE)) return ValType::I32;
+    return ValType::NONE;
+  }
+
+  inline size_t NumArgs(Op op) {
+    const bool unary = op == Op::I32_EQZ || op == Op::F64_NEG || op == Op::F64_SQRT ||
+                       op == Op::I32_TRUNC_F64_S || op == Op::F64_CONVERT_I32_S;
+    return unary ? 1 : 2;
+  }
+
+  struct Value {
+    enum Kind : uint8_t { CONST, PARAM, OP, PHI };
+
+    Kind kind = CONST;
+    ValType type = ValType::I32;
+    Op op = Op::NOP;                 // The operation (or I32_CONST / F64_CONST).
+    BlockID block = NONE;            // Block this value is defined in.
+    int32_t i = 0;                   // Value of an i32 constant, or a parameter's index.
+    double d = 0.0;                  // Value of an f64 constant.
+    std::vector<ValueID> args{};     // Inputs; a phi has one per predecessor, in order.
+  };
+
+  struct Block {
+    enum Exit : uint8_t { OPEN, JUMP, BRANCH, RETURN, TRAP };
+
+    std::vector<ValueID> phis{};
+    std::vector<ValueID> code{};     // Other values, in the order they are computed.
+    std::vector<BlockID> preds{};
+    std::vector<BlockID> succs{};    // JUMP: target.  BRANCH: if true, then if false.
+    Exit exit = OPEN;
+    ValueID value = NONE;            // Condition of a branch, or the value returned.
+  };
+
+  struct Function {
+    ValType result = ValType::NONE;
+    std::vector<Value> values{};
+    std::vector<Block> blocks{};     // Block 0 is the entry.
+
+    // Filled in by Analyze().
+    std::vector<BlockID> order{};    // Reachable blocks, in reverse postorder.
+    std::vector<uint32_t> rpo{};     // Position of each block in 'order' (NONE if unreachable).
+    std::vector<BlockID> idom{};     // Immediate dominator of each block (the entry's is itself).
+
+    // Does every path from the entry to block b pass through block a?
+    bool Dominates(BlockID a, BlockID b) const {
+      while (a != b) {
+        if (idom[b] == b || idom[b] == NONE) return false;
+        b = idom[b];
+      }
+      return true;
+    }
+  };
+
+  // Find the reverse postorder of blocks and the dominator tree.
+  inline void Analyze(Function & fun) {
+    const size_t num_blocks = fun.blocks.size();
+    fun.order.clear();
+    fun.rpo.assign(num_blocks, NONE);
+    fun.idom.assign(num_blocks, NONE);
+    if (!num_blocks) return;
+
+    // Depth-first search; successors are visited last-first so a branch's true side
+    // comes first in reverse postorder.
+    std::vector<bool> seen(num_blocks, false);
+    std::vector<std::pair<BlockID, size_t>> stack{{0, 0}};
+    seen[0] = true;
+    while (stack.size()) {
+      const BlockID block = stack.back().first;
+      const std::vector<BlockID> & succs = fun.blocks[block].succs;
+      const size_t next = stack.back().second++;
+      if (next < succs.size()) {
+        const BlockID succ = succs[succs.size() - 1 - next];
+        if (!seen[succ]) { seen[succ] = true; stack.emplace_back(succ, 0); }
+        continue;
+      }
+      fun.order.push_back(block);
+      stack.pop_back();
+    }
+    std::reverse(fun.order.begin(), fun.order.end());
+    for (size_t i = 0; i < fun.order.size(); ++i) fun.rpo[fun.order[i]] = static_cast<uint32_t>(i);
+
+    auto intersect = [&fun](BlockID a, BlockID b) {
+      while (a != b) {
+        while (fun.rpo[a] > fun.rpo[b]) a = fun.idom[a];
+        while (fun.rpo[b] > fun.rpo[a]) b = fun.idom[b];
+      }
+      return a;
+    };
+    fun.idom[0] = 0;
+    for (bool changed = true; changed; ) {
+      changed = false;
+      for (size_t i = 1; i < fun.order.size(); ++i) {
+        const BlockID block = fun.order[i];
+        BlockID new_idom = NONE;
+        for (BlockID pred : fun.blocks[block].preds) {
+          if (fun.idom[pred] == NONE) continue;   // Not processed yet (or unreachable).
+          new_idom = (new_idom == NONE) ? pred : intersect(pred, new_idom);
+        }
+        if (fun.idom[block] != new_idom) { fun.idom[block] = new_idom; changed = true; }
+      }
+    }
+  }
+
+  // Check that a function is well formed; return a description of the first problem
+  // found, or an empty string if there are none.
+  inline std::string Verify(const Function & fun) {
+    const size_t num_values = fun.values.size();
+    if (fun.blocks.empty()) return "function has no blocks";
+    if (fun.blocks[0].preds.size()) return "entry block has predecessors";
+    if (fun.order.size() != fun.blocks.size()) return "unreachable blocks remain";
+
+    // Where each value is defined (phis come before every other position).
+    static constexpr size_t PHI_POS = static_cast<size_t>(-1);
+    std::vector<size_t> def_pos(num_values, 0);
+    std::vector<bool> defined(num_values, false);
+    for (BlockID b = 0; b < fun.blocks.size(); ++b) {
+      const Block & block = fun.blocks[b];
+      for (ValueID id : block.phis) {
+        if (id >= num_values || defined[id]) return ToString("phi ", id, " defined twice");
+        defined[id] = true;
+        def_pos[id] = PHI_POS;
+      }
+      for (size_t pos = 0; pos < block.code.size(); ++pos) {
+        const ValueID id = block.code[pos];
+        if (id >= num_values || defined[id]) return ToString("value ", id, " defined twice");
+        defined[id] = true;
+        def_pos[id] = pos;
+      }
+    }
+
+    // Is the value available in block b just before position pos?
+    auto available = [&](ValueID id, BlockID b, size_t pos) {
+      if (id >= num_values || !defined[id]) return false;
+      const Value & value = fun.values[id];
+      if (value.block != b) return fun.Dominates(value.block, b);
+      return def_pos[id] == PHI_POS || def_pos[id] < pos;
+    };
+
+    for (BlockID b = 0; b < fun.blocks.size(); ++b) {
+      const Block & block = fun.blocks[b];
+      const std::string where = ToString("block ", b, ": ");
+
+      // Edges must agree in both directions, and match the way the block ends.
+      const size_t num_succs = block.exit == Block::JUMP ? 1 : block.exit == Block::BRANCH ? 2 : 0;
+      if (block.exit == Block::OPEN) return where + "block was never closed";
+      if (block.succs.size() != num_succs) return where + "successors do not match exit";
+      for (BlockID succ : block.succs) {
+        const auto & preds = fun.blocks[succ].preds;
+        if (std::count(preds.begin(), preds.end(), b) != std::count(block.succs.begin(), block.succs.end(), succ)) {
+          return ToString(where, "edge to block ", succ, " is missing from its predecessors");
+        }
+      }
+      for (BlockID pred : block.preds) {
+        const auto & succs = fun.blocks[pred].succs;
+        if (std::find(succs.begin(), succs.end(), b) == succs.end()) {
+          return ToString(where, "predecessor ", pred, " does not lead here");
+        }
+      }
+
+      for (ValueID id : block.phis) {
+        const Value & phi = fun.values[id];
+        if (phi.kind != Value::PHI || phi.block != b) return ToString(where, "bad phi ", id);
+        if (phi.args.size() != block.preds.size()) return ToString(where, "phi ", id, " needs one value per predecessor");
+        for (size_t k = 0; k < phi.args.size(); ++k) {
+          const BlockID pred = block.preds[k];
+          if (!available(phi.args[k], pred, fun.blocks[pred].code.size())) {
+            return ToString(where, "phi ", id, " input ", phi.args[k], " does not dominate block ", pred);
+          }
+          if (fun.values[phi.args[k]].type != phi.type) return ToString(where, "phi ", id, " has a mistyped input");
+        }
+        if (block.preds.size() > 1) {
+          for (BlockID pred : block.preds) {
+            if (fun.blocks[pred].succs.size() != 1) return ToString(where, "critical edge from block ", pred, " into phis");
+          }
+        }
+      }
+
+      for (size_t pos = 0; pos < block.code.size(); ++pos) {
+        const ValueID id = block.code[pos];
+        const Value & value = fun.values[id];
+        if (value.block != b) return ToString(where, "value ", id, " is in the wrong block");
+        switch (value.kind) {
+        case Value::PHI: return ToString(where, "phi ", id, " among ordinary values");
+        case Value::PARAM:
+          if (b != 0) return ToString(where, "parameter ", id, " outside of the entry block");
+          break;
+        case Value::CONST:
+          if (value.op != (value.type == ValType::F64 ? Op::F64_CONST : Op::I32_CONST)) {
+            return ToString(where, "constant ", id, " has the wrong type");
+          }
+          break;
+        case Value::OP:
+          if (ResultType(value.op) == ValType::NONE || ResultType(value.op) != value.type ||
+              value.args.size() != NumArgs(value.op)) {
+            return ToString(where, "value ", id, " has an unsupported operation");
+          }
+          for (ValueID arg : value.args) {
+            if (!available(arg, b, pos)) return ToString(where, "value ", id, " uses ", arg, " before it is defined");
+            if (fun.values[arg].type != ArgType(value.op)) return ToString(where, "value ", id, " has a mistyped input");
+          }
+          break;
+        }
+      }
+
+      if (block.exit == Block::BRANCH || block.exit == Block::RETURN) {
+        if (!available(block.value, b, block.code.size())) return where + "exit uses a value that is not defined";
+        const ValType type = (block.exit == Block::BRANCH) ? ValType::I32 : fun.result;
+        if (fun.values[block.value].type != type) return where + "exit value has the wrong type";
+      }
+    }
+    return "";
+  }
+
+  // Builds a function in SSA form as code is lowered into it, one block at a time.
+  class Builder {
+  private:
+    struct Loop { BlockID exit; BlockID next; };
+
+    Function fun{};
+    BlockID cur = 0;
+    std::vector<std::unordered_map<size_t, ValueID>> defs{};  // Per block: var ID -> value
+    std::vector<bool> sealed{};                   // Are all predecessors of a block known?
+    std::vector<std::vector<std::pair<size_t, ValueID>>> incomplete{};  // Phis awaiting them
+    std::unordered_map<size_t, ValType> var_types{};
+    std::vector<ValueID> forward{};               // Value that replaced each removed phi.
+    std::vector<Loop> loops{};
+
+    ValueID AddValue(Value value) {
+      fun.values.push_back(std::move(value));
+      forward.push_back(NONE);
+      return static_cast<ValueID>(fun.values.size() - 1);
+    }
+
+    // Add a value to the end of the current block.
+    ValueID Append(Value value) {
+      value.block = cur;
+      const ValueID id = AddValue(std::move(value));
+      fun.blocks[cur].code.push_back(id);
+      return id;
+    }
+
+    ValueID NewPhi(BlockID block, ValType type) {
+      const ValueID id = AddValue(Value{Value::PHI, type, Op::NOP, block});
+      fun.blocks[block].phis.push_back(id);
+      return id;
+    }
+
+    static Value Constant(ValType type, int32_t i, double d) {
+      if (type == ValType::F64) return Value{Value::CONST, type, Op::F64_CONST, NONE, 0, d};
+      return Value{Value::CONST, type, Op::I32_CONST, NONE, i};
+    }
+
+    // A zero to stand in for a value that no running code can ever see.
+    ValueID Zero(ValType type) {
+      Value value = Constant(type, 0, 0.0);
+      value.block = 0;
+      const ValueID id = AddValue(std::move(value));
+      auto & entry = fun.blocks[0].code;
+      entry.insert(entry.begin(), id);
+      return id;
+    }
+
+    ValueID Resolve(ValueID id) const {
+      while (forward[id] != NONE) id = forward[id];
+      return id;
+    }
+
+    void AddEdge(BlockID to) {
+      fun.blocks[cur].succs.push_back(to);
+      fun.blocks[to].preds.push_back(cur);
+    }
+
+    // Close the current block.  Code lowered before the next SetBlock() can never run.
+    void EndBlock(Block::Exit exit, ValueID value=NONE) {
+      fun.blocks[cur].exit = exit;
+      fun.blocks[cur].value = value;
+      cur = NewBlock();
+      sealed[cur] = true;
+    }
+
+    // If a phi merges only one value (besides itself), replace it with that value.
+    ValueID TryRemoveTrivialPhi(ValueID phi) {
+      ValueID same = NONE;
+      for (ValueID arg : fun.values[phi].args) {
+        arg = Resolve(arg);
+        if (arg == same || arg == phi) continue;
+        if (same != NONE) return phi;
+        same = arg;
+      }
+      if (same == NONE) same = Zero(fun.values[phi].type);  // Only reachable from itself.
+      forward[phi] = same;
+      return same;
+    }
+
+    ValueID AddPhiOperands(size_t var_id, ValueID phi) {
+      const std::vector<BlockID> preds = fun.blocks[fun.values[phi].block].preds;
+      for (BlockID pred : preds) {
+        const ValueID arg = ReadVar(var_id, pred);
+        fun.values[phi].args.push_back(arg);
+      }
+      return TryRemoveTrivialPhi(phi);
+    }
+
+    ValueID ReadVar(size_t var_id, BlockID block) {
+      auto it = defs[block].find(var_id);
+      if (it != defs[block].end()) return Resolve(it->second);
+
+      const ValType type = var_types.at(var_id);
+      const std::vector<BlockID> & preds = fun.blocks[block].preds;
+      ValueID value = NONE;
+      if (!sealed[block]) {          // More predecessors may come; fill the phi in later.
+        value = NewPhi(block, type);
+        incomplete[block].emplace_back(var_id, value);
+      }
+      else if (preds.size() == 1) value = ReadVar(var_id, preds[0]);
+      else if (preds.empty()) value = Zero(type);   // Code that can never run.
+      else {
+        value = NewPhi(block, type);
+        defs[block][var_id] = value;  // Stop the search when it comes around a loop.
+        value = AddPhiOperands(var_id, value);
+      }
+      defs[block][var_id] = value;
+      return value;
+    }
+
+    // Drop blocks that can never run (and the phi inputs that come from them).
+    void RemoveUnreachable() {
+      std::vector<BlockID> new_id(fun.blocks.size(), NONE);
+      std::vector<BlockID> stack{0};
+      new_id[0] = 0;
+      while (stack.size()) {
+        const BlockID block = stack.back();
+        stack.pop_back();
+        for (BlockID succ : fun.blocks[block].succs) {
+          if (new_id[succ] == NONE) { new_id[succ] = 0; stack.push_back(succ); }
+        }
+      }
+      BlockID next_id = 0;
+      for (BlockID & id : new_id) if (id != NONE) id = next_id++;
+
+      std::vector<Block> blocks;
+      blocks.reserve(next_id);
+      for (BlockID old_id = 0; old_id < fun.blocks.size(); ++old_id) {
+        if (new_id[old_id] == NONE) continue;
+        Block block = std::move(fun.blocks[old_id]);
+        std::vector<size_t> keep;
+        std::vector<BlockID> preds;
+        for (size_t k = 0; k < block.preds.size(); ++k) {
+          if (new_id[block.preds[k]] == NONE) continue;
+          keep.push_back(k);
+          preds.push_back(new_id[block.preds[k]]);
+        }
+        block.preds = std::move(preds);
+        for (BlockID & succ : block.succs) succ = new_id[succ];
+        for (ValueID phi : block.phis) {
+          std::vector<ValueID> args;
+          for (size_t k : keep) args.push_back(fun.values[phi].args[k]);
+          fun.values[phi].args = std::move(args);
+        }
+        for (ValueID id : block.phis) fun.values[id].block = new_id[old_id];
+        for (ValueID id : block.code) fun.values[id].block = new_id[old_id];
+        blocks.push_back(std::move(block));
+      }
+      fun.blocks = std::move(blocks);
+    }
+
+    // Remove phis made trivial by dropped edges (which can make others trivial in turn),
+    // then point every input at its final value.
+    void CleanUpPhis() {
+      for (bool changed = true; changed; ) {
+        changed = false;
+        for (const Block & block : fun.blocks) {
+          for (ValueID phi : block.phis) {
+            if (forward[phi] == NONE && TryRemoveTrivialPhi(phi) != phi) changed = true;
+          }
+        }
+      }
+      for (Block & block : fun.blocks) {
+        std::erase_if(block.phis, [this](ValueID phi){ return forward[phi] != NONE; });
+        for (ValueID id : block.phis) for (ValueID & arg : fun.values[id].args) arg = Resolve(arg);
+        for (ValueID id : block.code) for (ValueID & arg : fun.values[id].args) arg = Resolve(arg);
+        if (block.value != NONE) block.value = Resolve(block.value);
+      }
+    }
+
+    // Give each edge from a two-way branch into a block with phis a block of its own.
+    void SplitPhiEdges() {
+      const size_t num_blocks = fun.blocks.size();
+      for (BlockID succ = 0; succ < num_blocks; ++succ) {
+        if (fun.blocks[succ].phis.empty() || fun.blocks[succ].preds.size() < 2) continue;
+        for (size_t k = 0; k < fun.blocks[succ].preds.size(); ++k) {
+          const BlockID pred = fun.blocks[succ].preds[k];
+          if (fun.blocks[pred].succs.size() < 2) continue;
+          const BlockID split = static_cast<BlockID>(fun.blocks.size());
+          fun.blocks.push_back(Block{{}, {}, {pred}, {succ}, Block::JUMP});
+          auto & succs = fun.blocks[pred].succs;
+          *std::find(succs.begin(), succs.end(), succ) = split;
+          fun.blocks[succ].preds[k] = split;
+        }
+      }
+    }
+
+  public:
+    Builder(ValType result) {
+      fun.result = result;
+      cur = NewBlock();
+      sealed[cur] = true;
+    }
+
+    BlockID NewBlock() {
+      fun.blocks.emplace_back();
+      defs.emplace_back();
+      sealed.push_back(false);
+      incomplete.emplace_back();
+      return static_cast<BlockID>(fun.blocks.size() - 1);
+    }
+
+    BlockID CurBlock() const { return cur; }
+    void SetBlock(BlockID block) { cur = block; }
+
+    // All predecessors of a block are now known.
+    void Seal(BlockID block) {
+      auto phis = std::move(incomplete[block]);
+      incomplete[block].clear();
+      sealed[block] = true;
+      for (auto [var_id, phi] : phis) AddPhiOperands(var_id, phi);
+    }
+
+    // Variables must be declared (in the entry block) before they are used.
+    void Param(size_t var_id, ValType type, uint32_t index) {
+      var_types[var_id] = type;
+      Value value{Value::PARAM, type, Op::NOP, NONE, static_cast<int32_t>(index)};
+      WriteVar(var_id, Append(std::move(value)));
+    }
+    void DeclareVar(size_t var_id, ValType type) {
+      var_types[var_id] = type;
+      WriteVar(var_id, Append(Constant(type, 0, 0.0)));   // Locals start at zero.
+    }
+
+    void WriteVar(size_t var_id, ValueID value) { defs[cur][var_id] = value; }
+    ValueID ReadVar(size_t var_id) { return ReadVar(var_id, cur); }
+
+    ValueID I32(int32_t value) { return Append(Constant(ValType::I32, value, 0.0)); }
+    ValueID F64(double value) { return Append(Constant(ValType::F64, 0, value)); }
+
+    ValueID Unary(Op op, ValueID arg) {
+      return Append(Value{Value::OP, ResultType(op), op, NONE, 0, 0.0, {arg}});
+    }
+    ValueID Binary(Op op, ValueID lhs, ValueID rhs) {
+      return Append(Value{Value::OP, ResultType(op), op, NONE, 0, 0.0, {lhs, rhs}});
+    }
+
+    // Merge values into the current (sealed) block; one for each predecessor, in order.
+    ValueID Phi(ValType type, std::vector<ValueID> args) {
+      assert(sealed[cur] && args.size() == fun.blocks[cur].preds.size());
+      const ValueID phi = NewPhi(cur, type);
+      fun.values[phi].args = std::move(args);
+      return TryRemoveTrivialPhi(phi);
+    }
+
+    void Jump(BlockID target) { AddEdge(target); EndBlock(Block::JUMP); }
+    void Branch(ValueID test, BlockID if_true, BlockID if_false) {
+      AddEdge(if_true);
+      AddEdge(if_false);
+      EndBlock(Block::BRANCH, test);
+    }
+    void Return(ValueID value) { EndBlock(Block::RETURN, value); }
+
+    // Targets for break and continue in the innermost loop.
+    void PushLoop(BlockID exit, BlockID next) { loops.push_back(Loop{exit, next}); }
+    void PopLoop() { loops.pop_back(); }
+    BlockID BreakTarget() const { assert(loops.size()); return loops.back().exit; }
+    BlockID ContinueTarget() const { assert(loops.size()); return loops.back().next; }
+
+    // Close any open blocks (running off the end traps), clean up, and analyze.
+    Function Finish() {
+      for (Block & block : fun.blocks) {
+        if (block.exit == Block::OPEN) block.exit = Block::TRAP;
+      }
+      assert(std::all_of(sealed.begin(), sealed.end(), [](bool done){ return done; }));
+      RemoveUnreachable();
+      CleanUpPhis();
+      SplitPhiEdges();
+      Analyze(fun);
+      return std::move(fun);
+    }
+  };
+
+  // Rebuilds structured code for a function.  CONTROL_T provides the code-building calls
+  // of Control (Code, I32Const, F64Const, Comment, CommentLine, Indent, AddLocal, MakeLabel).
+  template <typename CONTROL_T>
+  class Emitter {
+  private:
+    const Function & fun;
+    CONTROL_T & control;
+    std::vector<uint32_t> uses;          // How many times each value is used.
+    std::vector<BlockID> use_block;      // Block of a value's use (NONE for a phi input).
+    std::vector<bool> on_stack;          // Computed right where its only use needs it?
+    std::vector<uint32_t> local_of;      // Local holding each value.
+    std::vector<std::vector<BlockID>> merge_children;  // Per block, latest first.
+    std::vector<bool> is_loop;           // Does any edge come back to this block?
+    std::vector<uint32_t> merge_labels;  // Block label for nodes with several forward edges in.
+    std::vector<uint32_t> loop_labels;   // Loop label for nodes with edges coming back.
+    size_t num_locals = 0;
+
+    bool IsFree(ValueID id) const {      // Reading it has no cost worth saving.
+      const Value::Kind kind = fun.values[id].kind;
+      return kind == Value::CONST || kind == Value::PARAM;
+    }
+
+    void CountUses() {
+      auto use = [this](ValueID id, BlockID block) { ++uses[id]; use_block[id] = block; };
+      for (BlockID b = 0; b < fun.blocks.size(); ++b) {
+        const Block & block = fun.blocks[b];
+        for (ValueID phi : block.phis) for (ValueID arg : fun.values[phi].args) use(arg, NONE);
+        for (ValueID id : block.code) for (ValueID arg : fun.values[id].args) use(arg, b);
+        if (block.value != NONE) use(block.value, b);
+      }
+    }
+
+    // Leave a value on the stack for its use if it is used just once, right after it is
+    // computed (with nothing but reads of locals or constants in between).
+    void PlanStack(BlockID b) {
+      const Block & block = fun.blocks[b];
+      std::vector<ValueID> pending;      // Values computed since the last one stored.
+      auto consume = [&](const std::vector<ValueID> & args) {
+        for (size_t k = args.size(); k-- > 0; ) {
+          const ValueID arg = args[k];
+          if (pending.size() && pending.back() == arg && uses[arg] == 1 && use_block[arg] == b) {
+            on_stack[arg] = true;
+            pending.pop_back();
+          }
+          else if (std::find(pending.begin(), pending.end(), arg) != pending.end()) break;
+        }
+        pending.clear();  // Anything else must be stored before this use runs.
+      };
+      for (ValueID id : block.code) {
+        if (IsFree(id)) continue;
+        consume(fun.values[id].args);
+        pending.push_back(id);
+      }
+      if (block.value != NONE) consume({block.value});
+    }
+
+    void PlanStructure() {
+      const size_t num_blocks = fun.blocks.size();
+      std::vector<size_t> forward_preds(num_blocks, 0);
+      for (BlockID b = 0; b < num_blocks; ++b) {
+        for (BlockID pred : fun.blocks[b].preds) {
+          if (fun.rpo[pred] < fun.rpo[b]) ++forward_preds[b];
+          else is_loop[b] = true;
+        }
+      }
+      for (auto it = fun.order.rbegin(); it != fun.order.rend(); ++it) {
+        if (*it != 0 && forward_preds[*it] > 1) merge_children[fun.idom[*it]].push_back(*it);
+      }
+      for (BlockID b = 0; b < num_blocks; ++b) {
+        if (forward_preds[b] > 1) merge_labels[b] = control.MakeLabel("$join");
+        if (is_loop[b]) loop_labels[b] = control.MakeLabel("$loop");
+      }
+    }
+
+    void DeclareLocals() {
+      control.CommentLine("SSA values");
+      for (const Block & block : fun.blocks) {
+        for (ValueID id : block.phis) {
+          local_of[id] = control.AddLocal(ToString("$phi", id), fun.values[id].type);
+          ++num_locals;
+        }
+        for (ValueID id : block.code) {
+          const Value & value = fun.values[id];
+          if (value.kind == Value::PARAM) local_of[id] = static_cast<uint32_t>(value.i);
+          else if (value.kind == Value::OP && uses[id] && !on_stack[id]) {
+            local_of[id] = control.AddLocal(ToString("$v", id), value.type);
+            ++num_locals;
+          }
+        }
+      }
+      control.Blank();
+    }
+
+    // Put a value on the stack.
+    void Push(ValueID id) {
+      const Value & value = fun.values[id];
+      if (value.kind == Value::CONST) {
+        if (value.type == ValType::F64) control.F64Const(value.d);
+        else control.I32Const(value.i);
+      }
+      else if (on_stack[id]) Compute(id);
+      else control.Code(Op::LOCAL_GET, local_of[id]);
+    }
+
+    // Compute a value from its arguments; those left on the stack for it are computed in
+    // turn, using an explicit stack since they can nest as deeply as the source does.
+    void Compute(ValueID id) {
+      std::vector<std::pair<ValueID, size_t>> pending{{id, 0}};  // Value and next argument.
+      while (pending.size()) {
+        auto & [cur_id, next] = pending.back();
+        const Value & value = fun.values[cur_id];
+        if (next == value.args.size()) {
+          control.Code(value.op);
+          pending.pop_back();
+          continue;
+        }
+        const ValueID arg = value.args[next++];
+        if (fun.values[arg].kind != Value::CONST && on_stack[arg]) pending.emplace_back(arg, 0);
+        else Push(arg);
+      }
+    }
+
+    // Compute a block's values, then set up phis in the block it jumps to.  All inputs
+    // go on the stack before any phi is set, so phis may swap values.
+    void BlockCode(BlockID b) {
+      const Block & block = fun.blocks[b];
+      for (ValueID id : block.code) {
+        if (IsFree(id) || on_stack[id]) continue;
+        Compute(id);
+        if (uses[id]) control.Code(Op::LOCAL_SET, local_of[id]);
+        else control.Code(Op::DROP);
+      }
+      if (block.exit != Block::JUMP) return;
+      const Block & succ = fun.blocks[block.succs[0]];
+      const size_t k = std::find(succ.preds.begin(), succ.preds.end(), b) - succ.preds.begin();
+      std::vector<ValueID> copies;
+      for (ValueID phi : succ.phis) {
+        if (fun.values[phi].args[k] == phi) continue;
+        Push(fun.values[phi].args[k]);
+        copies.push_back(phi);
+      }
+      for (auto it = copies.rbegin(); it != copies.rend(); ++it) control.Code(Op::LOCAL_SET, local_of[*it]);
+    }
+
+    // How does control get from one block to the next?
+    struct Path {
+      enum Kind { FALL, BR, INLINE } kind;
+      uint32_t label = NONE;           // Label to branch to (for BR).
+    };
+    Path FindPath(BlockID from, BlockID to, BlockID follow) const {
+      if (fun.rpo[to] <= fun.rpo[from]) return Path{Path::BR, loop_labels[to]};   // Back to a loop.
+      if (merge_labels[to] == NONE) return Path{Path::INLINE};  // Only reached from here.
+      if (to == follow) return Path{Path::FALL};
+      return Path{Path::BR, merge_labels[to]};
+    }
+
+    void Goto(const Path & path, BlockID to, BlockID follow) {
+      if (path.kind == Path::BR) control.Code(Op::BR, path.label);
+      else if (path.kind == Path::INLINE) Tree(to, follow);
+    }
+
+    void Exit(BlockID b, BlockID follow) {
+      const Block & block = fun.blocks[b];
+      switch (block.exit) {
+      case Block::RETURN:
+        Push(block.value);
+        control.Code(Op::RETURN);
+        return;
+      case Block::JUMP:
+        Goto(FindPath(b, block.succs[0], follow), block.succs[0], follow);
+        return;
+      case Block::BRANCH: break;
+      default:
+        control.Code(Op::UNREACHABLE);
+        return;
+      }
+
+      // Prefer br_if when either side is a plain branch; otherwise build an if.
+      const BlockID if_true = block.succs[0], if_false = block.succs[1];
+      const Path path_true = FindPath(b, if_true, follow), path_false = FindPath(b, if_false, follow);
+      Push(block.value);
+      if (path_true.kind == Path::FALL && path_false.kind == Path::FALL) control.Code(Op::DROP);
+      else if (path_true.kind == Path::BR) {
+        control.Code(Op::BR_IF, path_true.label);
+        Goto(path_false, if_false, follow);
+      }
+      else if (path_false.kind == Path::BR) {
+        control.Code(Op::I32_EQZ).Code(Op::BR_IF, path_false.label);
+        Goto(path_true, if_true, follow);
+      }
+      else if (path_true.kind == Path::FALL) {
+        control.Code(Op::I32_EQZ).Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2);
+        Tree(if_false, follow);
+        control.Indent(-2).Code(Op::END).Indent(-2).Code(Op::END);
+      }
+      else {
+        control.Code(Op::IF).Indent(2).Code(Op::THEN).Indent(2);
+        Tree(if_true, follow);
+        control.Indent(-2).Code(Op::END);
+        if (path_false.kind == Path::INLINE) {
+          control.Code(Op::ELSE).Indent(2);
+          Tree(if_false, follow);
+          control.Indent(-2).Code(Op::END);
+        }
+        control.Indent(-2).Code(Op::END);
+      }
+    }
+
+    // Code for block b, with each of its merge children from 'next' on placed after it.
+    void Within(BlockID b, size_t next, BlockID follow) {
+      const auto & children = merge_children[b];
+      if (next < children.size()) {
+        const BlockID child = children[next];
+        control.Code(Op::BLOCK, merge_labels[child]).Indent(2);
+        Within(b, next + 1, child);
+        control.Indent(-2).Code(Op::END);
+        Tree(child, follow);
+        return;
+      }
+      BlockCode(b);
+      Exit(b, follow);
+    }
+
+    // Code for block b and everything it dominates; 'follow' runs next if control falls
+    // off the end.
+    void Tree(BlockID b, BlockID follow) {
+      if (!is_loop[b]) { Within(b, 0, follow); return; }
+      control.Code(Op::LOOP, loop_labels[b]).Indent(2);
+      Within(b, 0, follow);
+      control.Indent(-2).Code(Op::END);
+    }
+
+  public:
+    Emitter(const Function & fun, CONTROL_T & control)
+      : fun(fun), control(control)
+      , uses(fun.values.size(), 0), use_block(fun.values.size(), NONE)
+      , on_stack(fun.values.size(), false), local_of(fun.values.size(), NONE)
+      , merge_children(fun.blocks.size()), is_loop(fun.blocks.size(), false)
+      , merge_labels(fun.blocks.size(), NONE), loop_labels(fun.blocks.size(), NONE) { }
+
+    void Run(Stats & stats) {
+      CountUses();
+      for (BlockID b = 0; b < fun.blocks.size(); ++b) PlanStack(b);
+      PlanStructure();
+      DeclareLocals();
+      Tree(0, NONE);
+      control.Code(Op::UNREACHABLE);   // Every path has already returned.
+
+      ++stats.functions;
+      stats.blocks += fun.blocks.size();
+      for (const Block & block : fun.blocks) stats.phis += block.phis.size();
+      stats.stack_values += static_cast<size_t>(std::count(on_stack.begin(), on_stack.end(), true));
+      stats.locals += num_locals;
+    }
+  };
+
+  // Generate the body of a function (locals and code) from its SSA form.
+  template <typename CONTROL_T>
+  void Emit(const Function & fun, CONTROL_T & control, Stats & stats) {
+    Emitter<CONTROL_T>(fun, control).Run(stats);
+  }
+
+  // Lower a function from its SSA form into bytecode, once its parameters are declared
+  // (in order).  Every other value gets a register of its own; a jump into a block with
+  // phis first copies all of their inputs into temporaries, since phis may swap values.
+  inline void ToVM(const Function & fun, vm::Builder & builder) {
+    std::vector<vm::Reg> reg_of(fun.values.size(), 0);
+    for (ValueID id = 0; id < fun.values.size(); ++id) {
+      const Value & value = fun.values[id];
+      if (value.kind == Value::PARAM) reg_of[id] = static_cast<vm::Reg>(value.i);
+      else if (value.kind != Value::CONST) reg_of[id] = builder.Temp();
+      else if (value.type == ValType::F64) reg_of[id] = builder.Double(value.d);
+      else reg_of[id] = builder.Int(value.i);
+    }
+    const vm::Reg mark = builder.Mark();   // Only phi copies need more.
+
+    std::vector<vm::Label> labels(fun.blocks.size());
+    for (vm::Label & label : labels) label = builder.NewLabel();
+    for (BlockID b = 0; b < fun.blocks.size(); ++b) {
+      const Block & block = fun.blocks[b];
+      builder.Place(labels[b]);
+      for (ValueID id : block.code) {
+        const Value & value = fun.values[id];
+        if (value.kind != Value::OP) continue;
+        if (value.args.size() == 1) builder.Emit(vm::FromOp(value.op), reg_of[id], reg_of[value.args[0]]);
+        else builder.Emit(vm::FromOp(value.op), reg_of[id], reg_of[value.args[0]], reg_of[value.args[1]]);
+      }
+
+      switch (block.exit) {
+      case Block::JUMP: {
+        const Block & succ = fun.blocks[block.succs[0]];
+        const size_t k = std::find(succ.preds.begin(), succ.preds.end(), b) - succ.preds.begin();
+        std::vector<std::pair<vm::Reg, vm::Reg>> copies;   // Phi register, temporary
+        for (ValueID phi : succ.phis) {
+          const ValueID arg = fun.values[phi].args[k];
+          if (arg == phi) continue;
+          copies.emplace_back(reg_of[phi], builder.Temp());
+          builder.Emit(vm::Code::MOV, copies.back().second, reg_of[arg]);
+        }
+        for (auto [dest, temp] : copies) builder.Emit(vm::Code::MOV, dest, temp);
+        builder.Release(mark);
+        builder.Jump(labels[block.succs[0]]);
+        break;
+      }
+      case Block::BRANCH:
+        builder.JumpIf(reg_of[block.value], labels[block.succs[0]]);
+        builder.Jump(labels[block.succs[1]]);
+        break;
+      case Block::RETURN:
+        builder.Emit(vm::Code::RETURN, reg_of[block.value]);
+        break;
+      default:
+        builder.Emit(vm::Code::TRAP, vm::UNREACHABLE);
+      }
+    }
+  }
+}
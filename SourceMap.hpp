@@ -0,0 +1,92 @@
+#pragma once
+
+// Where the code for each source position ended up in the output (see --source-map).
+//
+// Each mapping gives the output position where code from a source position starts; it
+// holds until the next mapping.  For WAT text, output positions are line numbers, written
+// out as a tab-separated line table.  For binary modules, they are byte offsets from the
+// start of the module, written as a standard (version 3) source map, with every mapping
+// on its single generated line, as WebAssembly tools expect.
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "tools.hpp"
+
+namespace srcmap {
+  struct Mapping {
+    size_t offset;   // Output line or byte offset.
+    FilePos pos;     // Source position (line 0 if the code has none).
+  };
+
+  class Map {
+  private:
+    std::vector<Mapping> mappings{};
+    size_t lines = 0;         // Lines of WAT text written so far.
+    std::string url{};        // Where a binary module should say its source map is.
+
+    static void AddVLQ(std::string & out, int64_t value) {
+      static constexpr char BASE64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+      uint64_t vlq = (value < 0) ? ((static_cast<uint64_t>(-value) << 1) | 1) : (static_cast<uint64_t>(value) << 1);
+      do {
+        uint64_t digit = vlq & 31;
+        vlq >>= 5;
+        if (vlq) digit |= 32;   // More digits follow.
+        out += BASE64[digit];
+      } while (vlq);
+    }
+
+    static std::string QuoteJSON(const std::string & text) {
+      std::string out = "\"";
+      for (char c : text) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+      }
+      return out + "\"";
+    }
+
+  public:
+    // Code from pos starts at offset (ignored if it continues the previous mapping).
+    void Add(size_t offset, FilePos pos) {
+      if (mappings.size() && mappings.back().offset == offset) mappings.pop_back();
+      if (mappings.size() ? mappings.back().pos == pos : pos.line == 0) return;
+      mappings.push_back(Mapping{offset, pos});
+    }
+
+    // Note the next line of WAT text, holding code from pos or (if skipped) no code.
+    void AddLine(FilePos pos) { Add(++lines, pos); }
+    void SkipLine() { ++lines; }
+
+    const std::string & URL() const { return url; }
+    void SetURL(const std::string & in) { url = in; }
+
+    // Write the line table for WAT text.
+    void WriteLines(std::ostream & os) const {
+      os << "# wat-line\tsource-position ('-' if none); each holds until the next line listed\n";
+      for (const Mapping & mapping : mappings) {
+        os << mapping.offset << '\t' << (mapping.pos.line ? mapping.pos.ToString() : "-") << '\n';
+      }
+    }
+
+    // Write a source map for a binary module compiled from the named source file.
+    void WriteJSON(std::ostream & os, const std::string & source) const {
+      std::string segments;
+      Mapping prev{0, FilePos{1, 0}};
+      for (const Mapping & mapping : mappings) {
+        if (segments.size()) segments += ',';
+        AddVLQ(segments, static_cast<int64_t>(mapping.offset) - static_cast<int64_t>(prev.offset));
+        prev.offset = mapping.offset;
+        if (mapping.pos.line == 0) continue;   // Generated code with no source.
+        AddVLQ(segments, 0);                   // Always the one source file.
+        AddVLQ(segments, static_cast<int64_t>(mapping.pos.line) - static_cast<int64_t>(prev.pos.line));
+        AddVLQ(segments, static_cast<int64_t>(mapping.pos.col) - static_cast<int64_t>(prev.pos.col));
+        prev.pos = mapping.pos;
+      }
+      os << "{\"version\":3,\"sources\":[" << QuoteJSON(source) << "],\"names\":[],\"mappings\":\""
+         << segments << "\"}\n";
+    }
+  };
+}
@@ -0,0 +1,258 @@
+#pragma once
+
+// Strength reduction: replace multiplication, division, and remainder by a constant with
+// cheaper shifts, masks, and multiplies.
+//
+// Each rewrite produces exactly the result of the original operation for every input (the
+// reasoning is given next to each one), and none of them hides a trap: division by zero
+// and INT_MIN / -1 are never rewritten.  The other operand is still evaluated exactly
+// once; when it is needed more than once it is kept in a scratch local.
+//
+//   x * 2^k   ->  x << k
+//   x / 2^k   ->  (x + bias) >> k                 where bias = 2^k-1 if x < 0, else 0
+//   x % 2^k   ->  x - ((x + bias) & -2^k)         (and x % -2^k == x % 2^k)
+//   x / d     ->  high bits of x * magic(d), plus 1 if x < 0     (other d > 2)
+//   x % d     ->  x - (x / d) * d
+//   x / 2^k   ->  x * 2^-k                        (f64, when 2^-k is representable)
+
+#include <assert.h>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <vector>
+
+#include "Instruction.hpp"
+
+namespace strength {
+  struct Stats {
+    size_t mul_shift = 0;     // Multiplies turned into shifts.
+    size_t div_shift = 0;     // Divisions by a power of two turned into shifts.
+    size_t rem_mask = 0;      // Remainders by a power of two turned into masks.
+    size_t div_magic = 0;     // Other divisions turned into multiplies.
+    size_t rem_magic = 0;     // Other remainders turned into multiplies.
+    size_t fdiv_recip = 0;    // Double divisions turned into multiplies by a reciprocal.
+
+    void Add(const Stats & in) {
+      mul_shift += in.mul_shift;
+      div_shift += in.div_shift;
+      rem_mask += in.rem_mask;
+      div_magic += in.div_magic;
+      rem_magic += in.rem_magic;
+      fdiv_recip += in.fdiv_recip;
+    }
+
+    void Print(std::ostream & os=std::cerr) const {
+      os << "Strength reduction:\n"
+         << "  mul-to-shift            " << mul_shift << '\n'
+         << "  div-to-shift            " << div_shift << '\n'
+         << "  rem-to-mask             " << rem_mask << '\n'
+         << "  div-to-multiply         " << div_magic << '\n'
+         << "  rem-to-multiply         " << rem_magic << '\n'
+         << "  fdiv-to-multiply        " << fdiv_recip << '\n';
+    }
+  };
+
+  // If value is 2^k, return k.
+  inline std::optional<uint32_t> Log2(uint32_t value) {
+    if (!std::has_single_bit(value)) return std::nullopt;
+    return static_cast<uint32_t>(std::countr_zero(value));
+  }
+
+  // Multiplier and shift for signed division by a constant d (3 <= d < 2^31, not a power
+  // of two), so that for every 32-bit x:
+  //   x / d == ((int64(x) * mult) >> (32 + shift)) + (x < 0 ? 1 : 0)
+  //
+  // Let L = 32 + shift, mult = ceil(2^L / d), and e = mult * d - 2^L, so 0 < e < d (e can
+  // not be 0 since d is not a power of two).  Then x * mult / 2^L = x/d + x*e/(d * 2^L).
+  // Write |x| = q*d + r.  The error term |x|*e/(d * 2^L) is positive, and is less than
+  // (d-r)/d whenever |x| * e < 2^L; |x| <= 2^31, so e < 2^(shift+1) guarantees it.
+  //   x >= 0: x*mult/2^L lies in (q, q+1), so its floor is q.
+  //   x < 0:  x*mult/2^L lies in (-q-1, -q), so its floor is -q-1, and adding 1 gives -q.
+  // Choosing shift with 2^shift < d < 2^(shift+1) always satisfies e < d < 2^(shift+1), and
+  // keeps mult < 2^32, so |x| * mult < 2^63 never overflows.
+  struct Magic { uint32_t mult; uint32_t shift; };
+
+  inline Magic FindMagic(uint32_t d) {
+    assert(d >= 3 && d < 0x80000000u && !std::has_single_bit(d));
+    const uint32_t shift = static_cast<uint32_t>(std::bit_width(d)) - 1;
+    const uint64_t power = uint64_t(1) << (32 + shift);
+    const uint64_t mult = (power + d - 1) / d;
+    assert(mult < (uint64_t(1) << 32) && mult * d - power < (uint64_t(1) << (shift + 1)));
+    return Magic{static_cast<uint32_t>(mult), shift};
+  }
+
+  // If value is a power of two whose reciprocal is exactly representable, return it.  Both
+  // x / value and x * (1/value) are then the correctly rounded result of the same real
+  // number, so they always agree.
+  inline std::optional<double> Reciprocal(double value) {
+    if (!std::isfinite(value) || value == 0.0) return std::nullopt;
+    int exp = 0;
+    if (std::abs(std::frexp(value, &exp)) != 0.5) return std::nullopt;  // Not a power of two.
+    const double recip = 1.0 / value;
+    if (!std::isfinite(recip) || std::abs(std::frexp(recip, &exp)) != 0.5) return std::nullopt;
+    if (recip * value != 1.0) return std::nullopt;
+    return recip;
+  }
+
+  // Rewrite the instructions of one complete function.  FUN_T provides 'locals'; a scratch
+  // local is added (and declared) if any rewrite needs one.
+  template <typename FUN_T>
+  void Reduce(std::vector<Instr> & code, FUN_T & fun, std::vector<double> & f64_pool, Stats & stats) {
+    uint32_t temp = Instr::NO_ARG;
+    std::vector<Instr> out;
+    out.reserve(code.size());
+
+    // Find the n-th real instruction back from the end of the output (n=0 is the last).
+    auto last_real = [&out](size_t n) -> Instr * {
+      for (size_t i = out.size(); i-- > 0; ) {
+        if (out[i].op == Op::NOTE || out[i].op == Op::BLANK) continue;
+        if (n-- == 0) return &out[i];
+      }
+      return nullptr;
+    };
+    auto remove = [&out](Instr * inst) { out.erase(out.begin() + (inst - out.data())); };
+
+    for (const Instr & inst : code) {
+      const uint16_t indent = inst.indent;
+      auto emit = [&out, indent, &inst](Op op, uint32_t arg=Instr::NO_ARG) {
+        out.push_back(Instr{op, ValType::NONE, indent, arg, 0, inst.pos});
+      };
+      auto use_temp = [&]() {
+        if (temp == Instr::NO_ARG) {
+          fun.locals.emplace_back("$_tmp", ValType::I32);
+          temp = static_cast<uint32_t>(fun.locals.size() - 1);
+        }
+        return temp;
+      };
+      // Leave the value on the stack alone, but also keep a copy in the scratch local.
+      auto keep_copy = [&]() { emit(Op::LOCAL_TEE, use_temp()); };
+      // Given x in temp and a copy on the stack, leave x + (2^k-1 if x < 0, else 0).
+      auto add_bias = [&](uint32_t k) {
+        emit(Op::LOCAL_GET, temp);
+        if (k > 1) {
+          emit(Op::I32_CONST, 31);
+          emit(Op::I32_SHR_S);                // -1 if x < 0, else 0
+        }
+        emit(Op::I32_CONST, 32 - k);
+        emit(Op::I32_SHR_U);                  // 2^k-1 if x < 0, else 0
+        emit(Op::I32_ADD);
+      };
+      // Given x in temp and a copy on the stack, replace it with x / d.
+      auto div_magic = [&](uint32_t d) {
+        const Magic magic = FindMagic(d);
+        emit(Op::I64_EXTEND_I32_S);
+        emit(Op::I64_CONST, magic.mult);
+        emit(Op::I64_MUL);
+        emit(Op::I64_CONST, 32 + magic.shift);
+        emit(Op::I64_SHR_S);
+        emit(Op::I32_WRAP_I64);               // floor(x * mult / 2^L)
+        emit(Op::LOCAL_GET, temp);
+        emit(Op::I32_CONST, 31);
+        emit(Op::I32_SHR_U);
+        emit(Op::I32_ADD);                    // +1 if x < 0 rounds toward zero.
+      };
+
+      Instr * prev = last_real(0);
+      const bool const_rhs = prev && prev->op == Op::I32_CONST;
+      const uint32_t value = const_rhs ? prev->arg : 0;
+      const int32_t signed_value = static_cast<int32_t>(value);
+
+      if (inst.op == Op::I32_MUL) {
+        // Wrapping multiplication by 2^k is a shift, even for 2^31 (INT_MIN).
+        if (const_rhs && Log2(value)) {
+          remove(prev);
+          if (*Log2(value)) { emit(Op::I32_CONST, *Log2(value)); emit(Op::I32_SHL); }
+          ++stats.mul_shift;
+          continue;
+        }
+        // The constant may also come first if the other side is a single load.
+        Instr * first = last_real(1);
+        if (prev && (prev->op == Op::LOCAL_GET || prev->op == Op::GLOBAL_GET) &&
+            first && first->op == Op::I32_CONST && Log2(first->arg)) {
+          const uint32_t k = *Log2(first->arg);
+          remove(first);
+          if (k) { emit(Op::I32_CONST, k); emit(Op::I32_SHL); }
+          ++stats.mul_shift;
+          continue;
+        }
+      }
+
+      else if (inst.op == Op::I32_DIV_S && const_rhs && signed_value > 0) {
+        remove(prev);
+        if (signed_value == 1) { }
+        else if (Log2(value)) {
+          const uint32_t k = *Log2(value);
+          keep_copy();
+          add_bias(k);
+          emit(Op::I32_CONST, k);
+          emit(Op::I32_SHR_S);
+        }
+        else {
+          keep_copy();
+          div_magic(value);
+        }
+        if (Log2(value)) ++stats.div_shift;
+        else ++stats.div_magic;
+        continue;
+      }
+
+      else if (inst.op == Op::I32_REM_S && const_rhs && value && value != 0x80000000u) {
+        // The sign of a remainder follows the dividend, so x % -d == x % d.
+        const uint32_t d = static_cast<uint32_t>(std::abs(signed_value));
+        remove(prev);
+        if (d == 1) {
+          emit(Op::DROP);
+          emit(Op::I32_CONST, 0);
+          ++stats.rem_mask;
+        }
+        else if (Log2(d)) {
+          const uint32_t k = *Log2(d);
+          keep_copy();
+          emit(Op::LOCAL_GET, temp);
+          add_bias(k);
+          emit(Op::I32_CONST, static_cast<uint32_t>(-static_cast<int32_t>(d)));
+          emit(Op::I32_AND);                  // (x / 2^k) * 2^k
+          emit(Op::I32_SUB);
+          ++stats.rem_mask;
+        }
+        else {
+          keep_copy();
+          emit(Op::LOCAL_GET, temp);
+          div_magic(d);
+          emit(Op::I32_CONST, d);
+          emit(Op::I32_MUL);                  // (x / d) * d
+          emit(Op::I32_SUB);
+          ++stats.rem_magic;
+        }
+        continue;
+      }
+
+      else if (inst.op == Op::F64_DIV && prev && prev->op == Op::F64_CONST) {
+        if (auto recip = Reciprocal(f64_pool[prev->arg])) {
+          f64_pool.push_back(*recip);
+          prev->arg = static_cast<uint32_t>(f64_pool.size() - 1);
+          prev->note = 0;
+          emit(Op::F64_MUL);
+          ++stats.fdiv_recip;
+          continue;
+        }
+      }
+
+      out.push_back(inst);
+    }
+
+    // Declare the scratch local after any others.
+    if (temp != Instr::NO_ARG) {
+      size_t pos = 1;
+      for (size_t i = 1; i < out.size() && out[i].op != Op::END; ++i) {
+        if (out[i].op == Op::LOCAL) pos = i + 1;
+      }
+      const uint16_t indent = static_cast<uint16_t>(out[0].indent + 2);
+      out.insert(out.begin() + static_cast<std::ptrdiff_t>(pos),
+                 Instr{Op::LOCAL, ValType::NONE, indent, temp, 0});
+    }
+    code = std::move(out);
+  }
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+// Literal string data for a whole module.
+//
+// Strings are interned, so each distinct string is stored only once, and a string that
+// appears at the end of another (sharing its null terminator) just points into it.  All
+// strings are packed together into a single data segment.
+//
+// Strings are added first (while initializing each function) and placed later, in
+// batches; once placed, a string never moves.  Placing the longest strings of a batch
+// first lets every shorter one share their bytes.
+
+#include <algorithm>
+#include <assert.h>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace strings {
+  struct Stats {
+    size_t requested = 0;   // Strings asked for.
+    size_t distinct = 0;    // Different strings among them.
+    size_t shared = 0;      // Distinct strings stored inside another one.
+    size_t bytes = 0;       // Size of the data segment.
+
+    void Print(std::ostream & os=std::cerr) const {
+      os << "String data:\n"
+         << "  requested               " << requested << '\n'
+         << "  distinct                " << distinct << '\n'
+         << "  shared-suffix           " << shared << '\n'
+         << "  segment-bytes           " << bytes << '\n';
+    }
+  };
+
+  class Pool {
+  private:
+    size_t base;                                     // Memory position of the segment.
+    std::string bytes;                               // Segment contents (with terminators).
+    std::unordered_map<std::string, uint32_t> ids;   // String -> ID
+    std::vector<const std::string *> text;           // ID -> string (keys of ids)
+    std::vector<size_t> positions;                   // ID -> memory position, once placed
+    std::unordered_map<std::string_view, size_t> suffixes;  // Tail of a stored string -> offset
+    size_t num_placed = 0;                           // IDs below this have been placed.
+    Stats stats;
+
+  public:
+    Pool(size_t base=0) : base(base) { }
+
+    // Ask for a string to be stored; return its ID.
+    uint32_t Add(const std::string & str) {
+      ++stats.requested;
+      auto [it, added] = ids.emplace(str, static_cast<uint32_t>(text.size()));
+      if (added) {
+        text.push_back(&it->first);
+        positions.push_back(0);
+        ++stats.distinct;
+      }
+      return it->second;
+    }
+
+    // Give a memory position to every string added since the last call.
+    void Place() {
+      std::vector<uint32_t> batch;
+      for (size_t id = num_placed; id < text.size(); ++id) batch.push_back(static_cast<uint32_t>(id));
+      std::stable_sort(batch.begin(), batch.end(),
+                       [this](uint32_t a, uint32_t b){ return text[a]->size() > text[b]->size(); });
+      for (uint32_t id : batch) {
+        const std::string_view str = *text[id];
+        auto it = suffixes.find(str);
+        if (it != suffixes.end()) {
+          positions[id] = base + it->second;
+          ++stats.shared;
+          continue;
+        }
+        const size_t offset = bytes.size();
+        bytes += str;
+        bytes += '\0';
+        // Every tail of this string (the keys of ids never move) can now point into it.
+        for (size_t start = 0; start <= str.size(); ++start) {
+          suffixes.emplace(str.substr(start), offset + start);
+        }
+        positions[id] = base + offset;
+      }
+      num_placed = text.size();
+      stats.bytes = bytes.size();
+    }
+
+    size_t Position(uint32_t id) const {
+      assert(id < num_placed);  // Strings must be placed before they are used.
+      return positions[id];
+    }
+
+    size_t Base() const { return base; }
+    size_t End() const { return base + bytes.size(); }
+    const std::string & Bytes() const { return bytes; }
+    const Stats & GetStats() const { return stats; }
+  };
+}
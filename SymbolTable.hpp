@@ -6,6 +6,7 @@
 #include <vector>
 
 #include "lexer.hpp"
+#include "MemReport.hpp"
 #include "tools.hpp"
 #include "Type.hpp"
 
@@ -34,7 +35,10 @@ public:
 
   // ----------- SCOPE MANAGEMENT ------------
 
-  void PushScope() { scope_stack.emplace_back(); }
+  void PushScope() {
+    memory::Scope mem_scope(memory::Tag::SYMBOLS);
+    scope_stack.emplace_back();
+  }
   void PopScope() {
     assert(scope_stack.size() > 1); // First level is global -- do not delete!
     scope_stack.pop_back();
@@ -86,6 +90,7 @@ public:
   // Add a variable with the provided identifier.
   size_t AddVar(emplex::Token type_token, emplex::Token id_token) {
     assert(id_token.id == emplex::Lexer::ID_ID);
+    memory::Scope mem_scope(memory::Tag::SYMBOLS);
 
     const std::string name = id_token.lexeme;
 
@@ -105,12 +110,21 @@ public:
     return id;
   }
 
+  // Add a variable made by the compiler; it is in no scope, so code cannot name it.
+  size_t AddTempVar(const std::string & name, FilePos def_pos, const Type & type) {
+    memory::Scope mem_scope(memory::Tag::SYMBOLS);
+    const size_t id = var_array.size();
+    var_array.emplace_back(name, def_pos, type);
+    return id;
+  }
+
   size_t AddFunction(
     emplex::Token id_token,
     const std::vector<Type> & param_types,
     Type return_type
   ) {
     assert(id_token.id == emplex::Lexer::ID_ID);
+    memory::Scope mem_scope(memory::Tag::SYMBOLS);
 
     const std::string name = id_token.lexeme;
 
@@ -0,0 +1,154 @@
+#pragma once
+
+// Where compilation time goes (see --time-report): wall-clock and CPU time for each phase,
+// plus counts of what each phase worked through.  Nothing is measured unless 'enabled' is
+// set; when it is not, each phase costs a single test.
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <streambuf>
+#include <string>
+
+namespace timing {
+  enum class Phase { LEX, PARSE, TYPE_CHECK, OPTIMIZE, CODEGEN, OUTPUT, NUM_PHASES };
+  static constexpr size_t NUM_PHASES = static_cast<size_t>(Phase::NUM_PHASES);
+  static constexpr const char * PHASE_NAMES[NUM_PHASES] = {
+    "lex", "parse", "type_check", "optimize", "codegen", "output"
+  };
+
+  // A stream buffer that passes everything through to another, counting the bytes.
+  class CountingBuffer : public std::streambuf {
+  private:
+    std::streambuf * target;
+    size_t count = 0;
+
+  protected:
+    int_type overflow(int_type ch) override {
+      if (traits_type::eq_int_type(ch, traits_type::eof())) return traits_type::not_eof(ch);
+      ++count;
+      return target->sputc(traits_type::to_char_type(ch));
+    }
+    std::streamsize xsputn(const char * text, std::streamsize size) override {
+      const std::streamsize written = target->sputn(text, size);
+      count += static_cast<size_t>(written);
+      return written;
+    }
+    int sync() override { return target->pubsync(); }
+
+  public:
+    CountingBuffer(std::streambuf * target) : target(target) { }
+    CountingBuffer(const CountingBuffer &) = delete;
+    CountingBuffer & operator=(const CountingBuffer &) = delete;
+    size_t Count() const { return count; }
+  };
+
+  struct Report {
+    struct Times {
+      size_t runs = 0;
+      uint64_t wall_ns = 0;
+      uint64_t cpu_ns = 0;   // Across all threads.
+    };
+
+    bool enabled = false;
+    std::array<Times, NUM_PHASES> phases{};
+
+    // What was processed.
+    size_t bytes_lexed = 0;
+    size_t tokens = 0;
+    std::map<std::string, size_t> node_kinds{};   // AST nodes as parsed, by kind.
+    size_t symbols = 0;
+    size_t instructions = 0;                      // Emitted, after optimization.
+    size_t output_bytes = 0;
+
+    // Run one step of a phase, timing it if enabled.
+    template <typename FUN_T>
+    void Run(Phase phase, FUN_T fun) {
+      if (!enabled) { fun(); return; }
+      const auto wall_start = std::chrono::steady_clock::now();
+      const std::clock_t cpu_start = std::clock();
+      fun();
+      const std::clock_t cpu_end = std::clock();
+      const auto wall = std::chrono::steady_clock::now() - wall_start;
+      Times & times = phases[static_cast<size_t>(phase)];
+      ++times.runs;
+      times.wall_ns += static_cast<uint64_t>(std::chrono::nanoseconds(wall).count());
+      times.cpu_ns += static_cast<uint64_t>(static_cast<double>(cpu_end - cpu_start) * 1e9 / CLOCKS_PER_SEC);
+    }
+
+    static double Millis(uint64_t ns) { return static_cast<double>(ns) / 1e6; }
+
+    size_t NumNodes() const {
+      size_t count = 0;
+      for (const auto & [kind, kind_count] : node_kinds) count += kind_count;
+      return count;
+    }
+
+    Times Total() const {
+      Times total;
+      for (const Times & times : phases) {
+        total.runs += times.runs;
+        total.wall_ns += times.wall_ns;
+        total.cpu_ns += times.cpu_ns;
+      }
+      return total;
+    }
+
+    void Print(std::ostream & os=std::cerr) const {
+      const auto flags = os.flags();
+      const auto precision = os.precision();
+      auto print = [&os](const std::string & name, const Times & times) {
+        os << "  " << std::left << std::setw(12) << name << std::right << std::setw(6) << times.runs
+           << std::setw(12) << Millis(times.wall_ns) << std::setw(12) << Millis(times.cpu_ns) << '\n';
+      };
+      os << std::fixed << std::setprecision(3)
+         << "Time report:\n"
+         << "  phase         runs     wall ms      cpu ms\n";
+      for (size_t i = 0; i < NUM_PHASES; ++i) print(PHASE_NAMES[i], phases[i]);
+      print("total", Total());
+      os << "Counters:\n"
+         << "  bytes lexed   " << bytes_lexed << '\n'
+         << "  tokens        " << tokens << '\n'
+         << "  AST nodes     " << NumNodes();
+      const char * separator = " (";
+      for (const auto & [kind, count] : node_kinds) { os << separator << kind << ' ' << count; separator = ", "; }
+      os << (node_kinds.empty() ? "" : ")") << '\n'
+         << "  symbols       " << symbols << '\n'
+         << "  instructions  " << instructions << '\n'
+         << "  output bytes  " << output_bytes << '\n';
+      os.flags(flags);
+      os.precision(precision);
+    }
+
+    void PrintJSON(std::ostream & os=std::cerr) const {
+      auto times_json = [&os](const Times & times) {
+        os << "{\"runs\": " << times.runs << ", \"wall_ms\": " << Millis(times.wall_ns)
+           << ", \"cpu_ms\": " << Millis(times.cpu_ns) << "}";
+      };
+      os << "{\n  \"phases\": {\n";
+      for (size_t i = 0; i < NUM_PHASES; ++i) {
+        os << "    \"" << PHASE_NAMES[i] << "\": ";
+        times_json(phases[i]);
+        os << ",\n";
+      }
+      os << "    \"total\": ";
+      times_json(Total());
+      os << "\n  },\n  \"counters\": {\n"
+         << "    \"bytes_lexed\": " << bytes_lexed << ",\n"
+         << "    \"tokens\": " << tokens << ",\n"
+         << "    \"ast_nodes\": " << NumNodes() << ",\n"
+         << "    \"ast_nodes_by_kind\": {";
+      const char * separator = "";
+      for (const auto & [kind, count] : node_kinds) { os << separator << '"' << kind << "\": " << count; separator = ", "; }
+      os << "},\n"
+         << "    \"symbols\": " << symbols << ",\n"
+         << "    \"instructions\": " << instructions << ",\n"
+         << "    \"output_bytes\": " << output_bytes << "\n"
+         << "  }\n}\n";
+    }
+  };
+}
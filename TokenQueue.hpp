@@ -17,6 +17,7 @@
 #include <vector>
 
 #include "lexer.hpp"
+#include "MemReport.hpp"
 
 class TokenQueue {
 private:
@@ -36,23 +37,36 @@ private:
     }
   }
 
+  // Charge each token's characters separately from the token array (see --mem-report).
+  void TagLexemes(size_t start) {
+    if constexpr (memory::COUNTING) {
+      for (size_t i = start; i < tokens.size(); ++i) memory::Retag(tokens[i].lexeme, memory::Tag::LEXEMES);
+    }
+  }
+
 public:
   void Reset() { tokens.resize(0); token_id = 0; }
 
   // Load in tokens from a stream.
   void Load(std::istream & is) {
+    memory::Scope mem_scope(memory::Tag::TOKENS);
     Cleanup();
+    const size_t start = tokens.size();
     auto new_tokens = lexer.Tokenize(is);
     if (tokens.size() == 0) std::swap(tokens, new_tokens);
     else tokens.insert( tokens.end(), new_tokens.begin(), new_tokens.end() );
+    TagLexemes(start);
   }
 
   // Load in tokens from a string.
   void Load(const std::string & str) {
+    memory::Scope mem_scope(memory::Tag::TOKENS);
     Cleanup();
+    const size_t start = tokens.size();
     auto new_tokens = lexer.Tokenize(str);
     if (tokens.size() == 0) std::swap(tokens, new_tokens);
     else tokens.insert( tokens.end(), new_tokens.begin(), new_tokens.end() );
+    TagLexemes(start);
   }
 
   // Count remaining tokens.
@@ -0,0 +1,678 @@
+#pragma once
+
+// The Tubular compiler: parses a source file into one AST per function, checks and
+// optimizes each, then generates a WebAssembly module (or runs calls in the VM).
+
+#include <assert.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ASTNode.hpp"
+#include "Control.hpp"
+#include "lexer.hpp"
+#include "MemReport.hpp"
+#include "Runtime.hpp"
+#include "SourceMap.hpp"
+#include "SymbolTable.hpp"
+#include "TimeReport.hpp"
+#include "TokenQueue.hpp"
+#include "VM.hpp"
+
+class Tubular {
+private:
+  using ast_ptr_t = std::unique_ptr<ASTNode>;
+  using fun_ptr_t = std::unique_ptr<ASTNode_Function>;
+
+  TokenQueue tokens{};
+  std::vector<fun_ptr_t> functions{};
+
+  struct OpInfo {
+    size_t level;
+    char assoc;   // l=left; r=right; n=non
+  };
+  std::unordered_map<std::string, OpInfo> op_map{};
+
+  // Something waiting on the operand being parsed: an operator or a parenthesized expression.
+  struct ExprFrame {
+    enum Kind : uint8_t { BINARY, PREFIX, PAREN, SQRT };
+    Kind kind;
+    const emplex::Token * token;   // The operator (or sqrt) that started this frame.
+    ast_ptr_t lhs = nullptr;       // Left operand (BINARY only).
+    size_t prec_limit = 0;         // Precedence limit to go back to (all but PREFIX).
+    OpInfo op_info{0, 'l'};        // (BINARY only)
+  };
+  std::vector<ExprFrame> expr_stack{};  // (reused by each Parse_Expression)
+
+  Control control{};
+  runtime::Allocator allocator{};  // Runtime memory management (only if required).
+  runtime::Helpers helpers{};      // Runtime memory helpers (only those required).
+  runtime::Profiler profiler{};    // Profiling counters (only if instrumenting).
+  size_t loop_depth = 0;      // How many loops are we nested inside while parsing?
+  timing::Report timing{};    // Time spent in each phase (only measured if enabled).
+  srcmap::Map source_map{};   // Where code from each source position was written.
+
+  // == HELPER FUNCTIONS
+
+  template <typename... Ts>
+  void TriggerError(Ts... message) {
+    if (tokens.None()) tokens.Rewind();
+    Error(tokens.CurFilePos(), std::forward<Ts>(message)...);
+  }
+
+  template <typename NODE_T, typename... ARG_Ts>
+  static std::unique_ptr<NODE_T> MakeNode(ARG_Ts &&... args) {
+    return std::make_unique<NODE_T>( std::forward<ARG_Ts>(args)... );
+  }
+
+  ast_ptr_t MakeVarNode(emplex::Token token) {
+    return MakeNode<ASTNode_Var>(token, control.symbols);
+  }
+
+  Type GetReturnType(const ast_ptr_t & node_ptr) const {
+    return node_ptr->ReturnType(control.symbols);
+  }
+
+  // Take in the provided node and add an ASTNode converter to make it a double, as needed.
+  // Return if a change was made.
+  ast_ptr_t PromoteToDouble(ast_ptr_t && node_ptr) {
+    if (!node_ptr->ReturnType(control.symbols).IsDouble()) {
+      return MakeNode<ASTNode_ToDouble>(std::move(node_ptr));
+    }
+    return node_ptr;
+  }
+
+  // Take in the provided node and add an ASTNode converter to make it a double, as needed.
+  // Return if a change was made.
+  ast_ptr_t DemoteToInt(ast_ptr_t && node_ptr) {
+    if (node_ptr->ReturnType(control.symbols).IsDouble()) {
+      return MakeNode<ASTNode_ToInt>(std::move(node_ptr));
+    }
+    return node_ptr;
+  }
+
+  void SetupOperators() {
+    // Setup operator precedence.
+    size_t cur_prec = 0;
+    op_map["("]  = op_map["!"]  =               OpInfo{cur_prec++, 'n'};
+    op_map["*"]  = op_map["/"]  = op_map["%"] = OpInfo{cur_prec++, 'l'};
+    op_map["+"]  = op_map["-"]  =               OpInfo{cur_prec++, 'l'};
+    op_map["<"]  = op_map["<="] = op_map[">"] = op_map[">="] = OpInfo{cur_prec++, 'n'};
+    op_map["=="] = op_map["!="] =               OpInfo{cur_prec++, 'n'};
+    op_map["&&"] =                              OpInfo{cur_prec++, 'l'};
+    op_map["||"] =                              OpInfo{cur_prec++, 'l'};
+    op_map["="]  =                              OpInfo{cur_prec++, 'r'};
+  }
+
+public:
+  Tubular(std::string filename, bool time_report=false) {
+    std::ifstream in_file(filename);              // Load the input file
+    if (in_file.fail()) {
+      std::cerr << "ERROR: Unable to open file '" << filename << "'." << std::endl;
+      exit(1);
+    }
+
+    timing.enabled = time_report;
+    Lex(in_file);  // Load all tokens from the file.
+
+    SetupOperators();
+  }
+
+  // Compile source code read from a stream.
+  Tubular(std::istream & in, bool time_report=false) {
+    timing.enabled = time_report;
+    Lex(in);
+    SetupOperators();
+  }
+
+  void Lex(std::istream & in) {
+    timing.Run(timing::Phase::LEX, [this, &in](){
+      const std::string source(std::istreambuf_iterator<char>(in), {});
+      tokens.Load(source);
+      timing.bytes_lexed += source.size();
+    });
+    timing.tokens = tokens.Size();
+  }
+
+  // Convert a token for a single value (a variable or a literal) into an ASTNode.
+  ast_ptr_t Parse_Value(const emplex::Token & token) {
+    switch (token.id) {
+    case emplex::Lexer::ID_ID:
+      if (!control.symbols.Has(token.lexeme)) {
+        Error(token, "Unknown variable '", token.lexeme, "'.");
+      }
+      return MakeVarNode(token);
+    case emplex::Lexer::ID_LIT_INT:
+      return MakeNode<ASTNode_IntLit>(token, std::stoi(token.lexeme));
+    case emplex::Lexer::ID_LIT_CHAR:
+      return MakeNode<ASTNode_CharLit>(token, token.lexeme[1]);
+    case emplex::Lexer::ID_LIT_FLOAT:
+      return MakeNode<ASTNode_FloatLit>(token, std::stod(token.lexeme));
+    default:
+      Error(token, "Unexpected token '", token.lexeme, "'");
+    }
+    return nullptr;
+  }
+
+  // @CAO Check for '(' or '[' to know if this is a function call or array index?
+
+  // Check to see if a term is followed by a type modifier.
+  ast_ptr_t Parse_TypeModifier(ast_ptr_t && out) {
+    if (tokens.UseIf(':')) {
+      auto type_token = tokens.Use(emplex::Lexer::ID_TYPE, "Expected a type specified after ':'.");
+      if (type_token.lexeme == "double") out = MakeNode<ASTNode_ToDouble>(std::move(out));
+      else if (type_token.lexeme == "int") out = MakeNode<ASTNode_ToInt>(std::move(out));
+    }
+    return std::move(out);
+  }
+
+  // Parse an expression by operator precedence.  Operands and the operators waiting on
+  // them are kept on an explicit stack rather than in nested calls, so expressions can be
+  // any length and nest parentheses to any depth.  An operator only continues the
+  // current operand if its precedence is within prec_limit (lower levels bind tighter);
+  // after a non-associative operator, another at the same level is an error.
+  ast_ptr_t Parse_Expression() {
+    std::vector<ExprFrame> & stack = expr_stack;  // Left empty by every complete parse.
+    size_t prec_limit = 1000;
+    while (true) {
+      // Start a term: prefix operators and parentheses wait on what comes after them.
+      const emplex::Token & token = tokens.Use();
+      if (token == '+') continue;  // (Operator + does nothing...)
+      if (token == '-' || token == '!') {
+        stack.push_back(ExprFrame{ExprFrame::PREFIX, &token});
+        continue;
+      }
+      if (token == '(' || token == emplex::Lexer::ID_SQRT) {
+        if (token == emplex::Lexer::ID_SQRT) tokens.Use('(');
+        stack.push_back(ExprFrame{token == '(' ? ExprFrame::PAREN : ExprFrame::SQRT, &token, nullptr, prec_limit});
+        prec_limit = 1000;
+        continue;
+      }
+      ast_ptr_t cur_node = Parse_TypeModifier(Parse_Value(token));
+      size_t skip_prec = 1000;   // If we get a non-associative op, we must skip the next one.
+      bool term_done = true;
+
+      // Extend the expression with binary operators, finishing whatever each operand completes.
+      while (true) {
+        // A complete term goes to any prefix operators in front of it.
+        while (term_done && stack.size() && stack.back().kind == ExprFrame::PREFIX) {
+          cur_node = MakeNode<ASTNode_Math1>(*stack.back().token, std::move(cur_node));
+          stack.pop_back();
+        }
+
+        // If the next token is an operator within the limit, it starts a new operand.
+        const emplex::Token & op_token = tokens.Peek();
+        const auto op_it = op_map.find(op_token.lexeme);
+        if (op_it != op_map.end() && op_it->second.level <= prec_limit) {
+          const OpInfo op_info = op_it->second;
+          if (op_info.level == skip_prec) {
+            Error(op_token, "Operator '", op_token.lexeme, "' is non-associative.");
+          }
+          tokens.Use();
+          stack.push_back(ExprFrame{ExprFrame::BINARY, &op_token, std::move(cur_node), prec_limit, op_info});
+          prec_limit = op_info.level;
+          if (op_info.assoc != 'r') --prec_limit;
+          break;
+        }
+
+        // Otherwise this operand is complete; hand it to whatever is waiting on it.
+        if (stack.empty()) return cur_node;
+        ExprFrame frame = std::move(stack.back());
+        stack.pop_back();
+        prec_limit = frame.prec_limit;
+        term_done = (frame.kind != ExprFrame::BINARY);
+        skip_prec = 1000;
+        switch (frame.kind) {
+        case ExprFrame::BINARY:
+          cur_node = MakeNode<ASTNode_Math2>(*frame.token, std::move(frame.lhs), std::move(cur_node));
+          if (frame.op_info.assoc == 'n') skip_prec = frame.op_info.level;
+          break;
+        case ExprFrame::PAREN:
+          tokens.Use(')');
+          cur_node = Parse_TypeModifier(std::move(cur_node));
+          break;
+        case ExprFrame::SQRT:
+          tokens.Use(')');
+          cur_node = MakeNode<ASTNode_Math1>(*frame.token, PromoteToDouble(std::move(cur_node)));
+          cur_node = Parse_TypeModifier(std::move(cur_node));
+          break;
+        case ExprFrame::PREFIX: assert(false);  // Prefixes are applied as soon as a term is done.
+        }
+      }
+    }
+  }
+
+  ast_ptr_t Parse_Statement() {
+    // Test what kind of statement this is and call the appropriate function...
+    switch (tokens.Peek()) {
+      using namespace emplex;
+      case Lexer::ID_TYPE:
+        return Parse_Statement_Declare();
+      case Lexer::ID_IF:     return Parse_Statement_If();
+      case Lexer::ID_WHILE:  return Parse_Statement_While();
+      case Lexer::ID_RETURN: return Parse_Statement_Return();
+      case Lexer::ID_BREAK:  return Parse_Statement_Break();
+      case Lexer::ID_CONTINUE: return Parse_Statement_Continue();
+      case '{': return Parse_StatementList();
+      case ';':
+        tokens.Use();
+        return nullptr;
+      default: return Parse_Statement_Expression();
+    }
+  }
+
+  ast_ptr_t Parse_Statement_Declare() {
+    auto type_token = tokens.Use();
+    const auto id_token =
+      tokens.Use(emplex::Lexer::ID_ID, "Declarations must have a type followed by identifier.");
+    control.symbols.AddVar(type_token, id_token);
+    if (tokens.UseIf(';')) {
+      return nullptr;  // Variable added, nothing else to do.
+    }
+    auto op_token =
+      tokens.Use('=', "Expected ';' or '=' after declaration of variable '", id_token.lexeme, "'.");
+    auto rhs_node = Parse_Expression();
+    tokens.Use(';');
+
+    auto lhs_node = MakeVarNode(id_token);
+    Type lhs_type = lhs_node->ReturnType(control.symbols);
+    Type rhs_type = rhs_node->ReturnType(control.symbols);
+
+    return MakeNode<ASTNode_Math2>(id_token, "=", std::move(lhs_node), std::move(rhs_node));
+  }
+
+  ast_ptr_t Parse_Statement_If() {
+    auto if_token = tokens.Use(emplex::Lexer::ID_IF);
+    tokens.Use('(', "If commands must be followed by a '(");
+    ast_ptr_t condition = Parse_Expression();
+    tokens.Use(')');
+    ast_ptr_t action = Parse_Statement();
+
+    // Check if we need to add on an "else" branch
+    if (tokens.UseIf(emplex::Lexer::ID_ELSE)) {
+      ast_ptr_t alt = Parse_Statement();
+      return MakeNode<ASTNode_If>(if_token, std::move(condition), std::move(action), std::move(alt));
+    }
+
+    return MakeNode<ASTNode_If>(if_token, std::move(condition), std::move(action));
+  }
+
+  ast_ptr_t Parse_Statement_While() {
+    auto while_token = tokens.Use(emplex::Lexer::ID_WHILE);
+    tokens.Use('(', "While commands must be followed by a '(");
+    ast_ptr_t condition = Parse_Expression();
+    tokens.Use(')');
+    ++loop_depth;
+    ast_ptr_t action = Parse_Statement();
+    --loop_depth;
+    return MakeNode<ASTNode_While>(while_token, std::move(condition), std::move(action));
+  }
+
+  ast_ptr_t Parse_Statement_Return() {
+    auto token = tokens.Use(emplex::Lexer::ID_RETURN);
+    ast_ptr_t return_expr = Parse_Statement_Expression();
+    return MakeNode<ASTNode_Return>(token, std::move(return_expr));
+  }
+
+  ast_ptr_t Parse_Statement_Break() {
+    auto token = tokens.Use(emplex::Lexer::ID_BREAK);
+    if (!loop_depth) Error(token, "No loop for `break` to exit.");
+    return MakeNode<ASTNode_Break>(token);
+  }
+
+  ast_ptr_t Parse_Statement_Continue() {
+    auto token = tokens.Use(emplex::Lexer::ID_CONTINUE);
+    if (!loop_depth) Error(token, "No loop for `continue` to operate on.");
+    return MakeNode<ASTNode_Continue>(token);
+  }
+
+  ast_ptr_t Parse_Statement_Expression() {
+    ast_ptr_t out = Parse_Expression();
+    tokens.Use(';');
+    return out;
+  }
+
+  ast_ptr_t Parse_StatementList() {
+    auto out_node = MakeNode<ASTNode_Block>(tokens.Peek());
+    tokens.Use('{', "Statement blocks must start with '{'.");
+    control.symbols.PushScope();
+    while (tokens.Any() && tokens.Peek() != '}') {
+      ast_ptr_t statement = Parse_Statement();
+      if (statement) out_node->AddChild( std::move(statement) );
+    }
+    control.symbols.PopScope();
+    tokens.Use('}', "Statement blocks must end with '}'.");
+    return out_node;
+  }
+
+  // A function has the format:
+  //    function ID ( PARAMETERS ) : TYPE { STATEMENT_BLOCK }
+  //    The initial ID is the function name.
+  //    PARAMETERS can be empty or a series of comma-separated "TYPE ID" declaring parameters
+  //    TYPE can be int, char, or double and is used as the return type.
+  //    STATEMENT BLOCK is a series of statements to run, ending in a return statement.
+  fun_ptr_t Parse_Function() {
+    using namespace emplex;
+    tokens.Use(Lexer::ID_FUNCTION, "Outermost scope must define functions.");
+    control.symbols.PushScope();  // Enter a special scope for the function.
+    auto name_token = tokens.Use(Lexer::ID_ID, "Function must have a name.");
+    tokens.Use('(', "Function declaration must have '(' after name.");
+    std::vector<size_t> param_ids;
+    std::vector<Type> param_types;
+    while (!tokens.UseIf(')')) {
+      auto type_token = tokens.Use(Lexer::ID_TYPE);
+      param_types.emplace_back(type_token);
+      const auto id_token =
+        tokens.Use(emplex::Lexer::ID_ID, "Function parameters must have a type followed by identifier.");
+      size_t param_id = control.symbols.AddVar(type_token, id_token);
+      param_ids.push_back(param_id);
+      if (!tokens.UseIf(',') && !tokens.Is(')')) {
+        TriggerError("Parameters must be separated by commas (','; found '", tokens.Peek().lexeme, "'.");
+      }
+    }
+    tokens.Use(':');
+    Type return_type( tokens.Use(Lexer::ID_TYPE) );
+
+    // Now that we have the function signature, let the symbol table know about it.
+    size_t fun_id = control.symbols.AddFunction(name_token, param_types, return_type);
+
+    // Now parse the body of this function.
+    control.symbols.ClearFunctionVars();
+    ast_ptr_t body = Parse_StatementList();
+    control.symbols.PopScope(); // Leave the function scope.
+
+    if (!body->IsReturn()) {
+      Error(name_token, "Function '", name_token.lexeme, "' must guarantee a return statement through all paths.");
+    }
+
+    auto out_node = MakeNode<ASTNode_Function>(name_token, fun_id, param_ids, std::move(body));
+    out_node->SetVars( control.symbols.GetFunctionVars() );
+    return out_node;
+  }
+
+  // Type-check a newly parsed function, then simplify it for code generation by running
+  // each AST pass in the pipeline in order.
+  void Check(ASTNode_Function & fun) {
+    memory::Scope mem_scope(memory::Tag::AST);
+    timing.Run(timing::Phase::TYPE_CHECK, [this, &fun](){ fun.TypeCheckTree(control.symbols); });
+    timing.Run(timing::Phase::OPTIMIZE, [this, &fun](){ OptimizeAST(fun); });
+  }
+
+  // Parse the next function, noting what it is made of if reporting times.
+  fun_ptr_t ParseNext() {
+    memory::Scope mem_scope(memory::Tag::AST);
+    fun_ptr_t fun_ptr;
+    timing.Run(timing::Phase::PARSE, [this, &fun_ptr](){ fun_ptr = Parse_Function(); });
+    if (timing.enabled) fun_ptr->CountKinds(timing.node_kinds);
+    return fun_ptr;
+  }
+
+  void OptimizeAST(ASTNode_Function & fun) {
+    control.pipeline.ForEach(passes::Stage::AST, [this, &fun](passes::ID id) {
+      passes::Run(control.pass_stats, id, [&fun](){ return fun.CountNodes(); },
+                  [this, &fun, id](){ RunASTPass(id, fun); });
+    });
+  }
+
+  void RunASTPass(passes::ID id, ASTNode_Function & fun) {
+    std::vector<size_t> new_vars;
+    switch (id) {
+    case passes::ID::FOLD: {
+      ConstantTable constants(control.symbols);
+      fun.OptimizeTree(constants);
+      break;
+    }
+    case passes::ID::LICM:
+      fun.HoistTree(control.symbols, new_vars);
+      break;
+    case passes::ID::LVN: {
+      ValueNumbering values(control.symbols, new_vars);
+      fun.NumberTree(values);
+      break;
+    }
+    default: assert(false);  // Not an AST pass.
+    }
+    for (size_t var_id : new_vars) fun.AddVar(var_id);
+  }
+
+  void Parse() {
+    // Outer layer can only be function definitions.
+    while (tokens.Any()) {
+      functions.push_back( ParseNext() );
+      Check(*functions.back());
+    }
+  }
+
+  // The same steps as Parse(), one at a time across all functions (for benchmarks).
+  void ParseOnly() {
+    while (tokens.Any()) functions.push_back( ParseNext() );
+  }
+  void TypeCheck() {
+    for (auto & fun_ptr : functions) fun_ptr->TypeCheckTree(control.symbols);
+  }
+  void OptimizeAST() {
+    for (auto & fun_ptr : functions) OptimizeAST(*fun_ptr);
+  }
+
+  size_t CountTokens() const { return tokens.Size(); }
+  size_t CountNodes() const {
+    size_t count = 0;
+    for (const auto & fun_ptr : functions) count += fun_ptr->CountNodes();
+    return count;
+  }
+
+  // Generate the start of the module: memory and runtime helper functions.
+  void ToWAT_Begin() {
+    control.Code(Op::MODULE);
+    control.Indent(2);
+
+    // Manage DATA (USED IN PROJECT 4!!)
+    control.CommentLine(";; Define a memory block with ten pages (640KB)");
+    control.Code(Op::MEMORY, 1);
+    control.Blank();
+
+    // The heap can only be placed once all data is placed (see ToWAT_End).
+    allocator.Generate(control);
+    helpers.Generate(control);
+    profiler.Generate(control);
+  }
+
+  // Generate a single function, along with any data it needs.
+  void ToWAT_Function(ASTNode_Function & fun) {
+    fun.InitializeTreeWAT(control);
+    control.strings.Place();
+    GenerateCode(fun, control);
+  }
+
+  // Generate the instructions for a function (after its data is initialized).
+  static void GenerateCode(ASTNode_Function & fun, Control & control) {
+    passes::Run(control.pass_stats, control.pass_stats.codegen,
+                [&control](){ return passes::CountInstructions(control.code); },
+                [&](){ fun.TreeToWAT(control); });
+  }
+
+  // Generate the end of the module, including data and globals that depend on all functions.
+  void ToWAT_End() {
+    control.StringData();
+    allocator.Finish(control, profiler.Finish(control, control.strings.End()));
+    control.Indent(-2);
+    control.Code(Op::END).Comment("END program module");
+  }
+
+  // Generate each function in its own context, using up to num_jobs threads, then merge
+  // the results in source order; output is identical for any number of jobs.
+  void ToWAT(size_t num_jobs=1) {
+    memory::Scope mem_scope(memory::Tag::CODE);
+    timing.Run(timing::Phase::CODEGEN, [this, num_jobs](){ ToWAT_All(num_jobs); });
+    if (timing.enabled) timing.instructions += passes::CountInstructions(control.code);
+  }
+
+  void ToWAT_All(size_t num_jobs) {
+    ToWAT_Begin();
+
+    // All contexts share one string pool, so initialize them serially; then place every
+    // string at once, so that any string can share the tail of any other.
+    std::vector<Control> parts;
+    parts.reserve(functions.size());
+    for (auto & fun_ptr : functions) {
+      parts.push_back(control.Fork());
+      fun_ptr->InitializeTreeWAT(parts.back());
+    }
+    control.strings.Place();
+
+    ParallelFor(functions.size(), num_jobs,
+                [this, &parts](size_t id){
+                  memory::Scope mem_scope(memory::Tag::CODE);   // Tags are per thread.
+                  GenerateCode(*functions[id], parts[id]);
+                  parts[id].OptimizeCode();
+                });
+
+    // Reserve room for all of the code at once; growing it a part at a time is quadratic.
+    size_t total_size = control.code.size();
+    for (const Control & part : parts) total_size += part.code.size();
+    control.code.reserve(total_size);
+    for (const Control & part : parts) control.Append(part);
+    ToWAT_End();
+  }
+
+  // Compile one function at a time: parse, type-check, and generate it, then write it out
+  // and release both its AST and its code before moving on to the next function.
+  // Comment alignment in text output is computed per function.
+  void StreamCode(bool binary) {
+    memory::Scope mem_scope(memory::Tag::CODE);   // Parsing and checking tag their own.
+    Control::BinaryModule module;
+    auto flush = [this, binary, &module]() {
+      if (timing.enabled) timing.instructions += passes::CountInstructions(control.code);
+      timing.Run(timing::Phase::OUTPUT, [this, binary, &module](){
+        if (binary) control.EncodeBinary(module);
+        else Write([this](std::ostream & os){ control.PrintCode(os, SourceMapPtr()); });
+      });
+      control.ReleaseCode();
+    };
+
+    timing.Run(timing::Phase::CODEGEN, [this](){ ToWAT_Begin(); });
+    flush();
+    while (tokens.Any()) {
+      fun_ptr_t fun_ptr = ParseNext();
+      Check(*fun_ptr);
+      timing.Run(timing::Phase::CODEGEN, [this, &fun_ptr](){
+        ToWAT_Function(*fun_ptr);
+        control.OptimizeCode();
+      });
+      flush();
+    }
+    timing.Run(timing::Phase::CODEGEN, [this](){ ToWAT_End(); });
+    flush();
+    if (binary) {
+      timing.Run(timing::Phase::OUTPUT, [this, &module](){
+        Write([this, &module](std::ostream & os){ control.FinishBinary(module, os, SourceMapPtr()); });
+      });
+    }
+  }
+
+  srcmap::Map * SourceMapPtr() { return control.track_positions ? &source_map : nullptr; }
+
+  // Write generated code to standard output, counting the bytes if reporting times.
+  template <typename FUN_T>
+  void Write(FUN_T fun) {
+    if (!timing.enabled) { fun(std::cout); return; }
+    timing::CountingBuffer buffer(std::cout.rdbuf());
+    std::ostream os(&buffer);
+    fun(os);
+    os.flush();
+    timing.output_bytes += buffer.Count();
+  }
+
+  // Write the whole module, as WAT text or in binary.
+  void Output(bool binary) {
+    memory::Scope mem_scope(memory::Tag::CODE);
+    timing.Run(timing::Phase::OUTPUT, [this, binary](){
+      Write([this, binary](std::ostream & os){
+        if (binary) control.PrintBinary(os, SourceMapPtr());
+        else control.PrintCode(os, SourceMapPtr());
+      });
+    });
+  }
+
+  // Report where the time went (to standard error), as text or JSON.
+  void PrintTimeReport(bool json) {
+    timing.symbols = control.symbols.NumVars();
+    if (json) timing.PrintJSON();
+    else timing.Print();
+  }
+
+  // Lower every function to bytecode (by way of SSA form with --ssa) and run each call
+  // in-process (see VM.hpp), printing the results; return false if any call failed or
+  // trapped.
+  bool RunCalls(const std::vector<std::string> & calls, bool print_code) {
+    vm::Machine machine;
+    for (auto & fun_ptr : functions) {
+      vm::Function fun = fun_ptr->ToVM(control.symbols, control.pipeline.Has(passes::ID::SSA));
+      if (print_code) fun.Print();
+      machine.Add(std::move(fun));
+    }
+    bool ok = true;
+    for (const std::string & call : calls) ok = machine.RunCall(call) && ok;
+    machine.PrintSummary();
+    return ok;
+  }
+
+  // Choose which optimizations to run (see Passes.hpp).
+  void SetPipeline(const passes::Pipeline & pipeline) { control.pipeline = pipeline; }
+
+  // Which runtime memory helpers (and whether the allocator, "alloc") to generate even if
+  // unused, and which instructions they may use.
+  bool RequireHelpers(std::string_view list) {
+    while (list.size()) {
+      const size_t comma = list.find(',');
+      const std::string_view name = list.substr(0, comma);
+      if (name == "alloc" || name == "all") allocator.Require();
+      if (name != "alloc" && !helpers.RequireList(name)) return false;
+      list = (comma == std::string_view::npos) ? "" : list.substr(comma + 1);
+    }
+    return true;
+  }
+  void UseBulkMemory(bool in) { helpers.UseBulkMemory(in); }
+  void UseSIMD(bool in) { helpers.UseSIMD(in); }
+
+  // Count calls, loop iterations, and branches taken in the generated code?
+  void Instrument(bool in) { control.profile.Enable(in); }
+  void WriteProfileTable(std::ostream & os) const { control.profile.Write(os); }
+
+  // Track where the code for each source position goes in the output?  A binary module
+  // names the file its source map will be written to (url) in a custom section.
+  void TrackPositions(bool in, const std::string & url="") {
+    control.track_positions = in;
+    source_map.SetURL(url);
+  }
+  // Write the positions tracked: a source map for a binary module, or a line table for text.
+  void WriteSourceMap(std::ostream & os, bool binary, const std::string & source) const {
+    if (binary) source_map.WriteJSON(os, source);
+    else source_map.WriteLines(os);
+  }
+
+  // Measure the cost of each pass?
+  void MeasurePasses(bool in) { control.pass_stats.enabled = in; }
+
+  void PrintCode(std::ostream & os=std::cout) const { control.PrintCode(os); }
+  void PrintBinary() const { control.PrintBinary(); }
+  void PrintSymbols() const { control.symbols.Print(); }
+  void PrintStats() const {
+    control.pass_stats.Print(control.pipeline);
+    control.cleanup_stats.Print();
+    control.coalesce_stats.Print();
+    control.strength_stats.Print();
+    control.peephole_stats.Print();
+    control.strings.GetStats().Print();
+    if (control.pipeline.Has(passes::ID::SSA)) control.ssa_stats.Print();
+  }
+  void PrintAST() const {
+    for (auto & fun_ptr : functions) {
+      fun_ptr->Print();
+    }
+  }
+};
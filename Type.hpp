@@ -6,6 +6,7 @@
 #include <vector>
 
 #include "lexer.hpp"
+#include "MemReport.hpp"
 #include "tools.hpp"
 
 class Type {
@@ -15,7 +16,7 @@ private:
   struct Info_Double;
   struct Info_Function;
 
-  struct Info_Base {
+  struct Info_Base : public memory::Tagged<memory::Tag::TYPES> {
     virtual ~Info_Base() { }
 
     virtual bool IsChar() const { return false; }
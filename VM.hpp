@@ -0,0 +1,559 @@
+#pragma once
+
+// A register-based bytecode virtual machine that runs compiled functions in-process,
+// without wat2wasm or a browser (see --run).
+//
+// Each function is lowered straight from its typed, optimized AST (ASTNode::ToVM) into
+// three-address instructions over a frame of 8-byte registers: parameters first, then
+// variables, then constants (copied into every new frame, so no instruction loads one),
+// then temporaries, which are reused from one statement to the next.  The interpreter
+// uses threaded dispatch (a computed goto at the end of every handler) when the compiler
+// supports it, and a switch otherwise; either way it counts the instructions it runs.
+// Arithmetic matches WASM exactly, including which operations trap.
+
+#include <algorithm>
+#include <assert.h>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Instruction.hpp"
+
+#if defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+#define VM_THREADED 1     // Labels as values are a GCC / Clang extension.
+#else
+#define VM_THREADED 0
+#endif
+
+namespace vm {
+  using Reg = uint32_t;
+  using Label = uint32_t;
+
+  // Kinds of values that functions take and return.
+  enum class Kind : uint8_t { INT, CHAR, DOUBLE };
+
+  union Value {
+    int32_t i;
+    double d;
+  };
+
+  enum class Code : uint8_t {
+    MOV,                                                 // a = b
+    ADD_I, SUB_I, MUL_I, DIV_I, REM_I, AND_I, OR_I,      // a = b op c (int)
+    EQ_I, NE_I, LT_I, LE_I, GT_I, GE_I,
+    NEG_I, EQZ_I, BOOL_I,                                // a = -b, !b, (b != 0)
+    ADD_D, SUB_D, MUL_D, DIV_D,                          // a = b op c (double)
+    EQ_D, NE_D, LT_D, LE_D, GT_D, GE_D,
+    NEG_D, SQRT_D,                                       // a = op b (double)
+    I_TO_D, D_TO_I,                                      // a = convert b
+    JUMP, JUMP_IF, JUMP_IFNOT,                           // to a (if b is true / false)
+    RETURN,                                              // return a
+    TRAP,                                                // stop with trap message a
+    NUM_CODES
+  };
+
+  // Which operands of each instruction are registers (bits: 1=a, 2=b, 4=c).
+  static constexpr uint8_t REGS_A = 1, REGS_AB = 3, REGS_ABC = 7, REGS_B = 2, REGS_NONE = 0;
+
+  struct CodeInfo {
+    Code code;
+    const char * name;
+    uint8_t regs;
+  };
+
+  static constexpr CodeInfo CODE_INFO[] = {
+    {Code::MOV, "mov", REGS_AB},
+    {Code::ADD_I, "add.i", REGS_ABC}, {Code::SUB_I, "sub.i", REGS_ABC}, {Code::MUL_I, "mul.i", REGS_ABC},
+    {Code::DIV_I, "div.i", REGS_ABC}, {Code::REM_I, "rem.i", REGS_ABC}, {Code::AND_I, "and.i", REGS_ABC},
+    {Code::OR_I, "or.i", REGS_ABC},
+    {Code::EQ_I, "eq.i", REGS_ABC}, {Code::NE_I, "ne.i", REGS_ABC}, {Code::LT_I, "lt.i", REGS_ABC},
+    {Code::LE_I, "le.i", REGS_ABC}, {Code::GT_I, "gt.i", REGS_ABC}, {Code::GE_I, "ge.i", REGS_ABC},
+    {Code::NEG_I, "neg.i", REGS_AB}, {Code::EQZ_I, "eqz.i", REGS_AB}, {Code::BOOL_I, "bool.i", REGS_AB},
+    {Code::ADD_D, "add.d", REGS_ABC}, {Code::SUB_D, "sub.d", REGS_ABC}, {Code::MUL_D, "mul.d", REGS_ABC},
+    {Code::DIV_D, "div.d", REGS_ABC},
+    {Code::EQ_D, "eq.d", REGS_ABC}, {Code::NE_D, "ne.d", REGS_ABC}, {Code::LT_D, "lt.d", REGS_ABC},
+    {Code::LE_D, "le.d", REGS_ABC}, {Code::GT_D, "gt.d", REGS_ABC}, {Code::GE_D, "ge.d", REGS_ABC},
+    {Code::NEG_D, "neg.d", REGS_AB}, {Code::SQRT_D, "sqrt.d", REGS_AB},
+    {Code::I_TO_D, "i_to_d", REGS_AB}, {Code::D_TO_I, "d_to_i", REGS_AB},
+    {Code::JUMP, "jump", REGS_NONE}, {Code::JUMP_IF, "jump_if", REGS_B},
+    {Code::JUMP_IFNOT, "jump_ifnot", REGS_B},
+    {Code::RETURN, "return", REGS_A},
+    {Code::TRAP, "trap", REGS_NONE},
+  };
+  static_assert(std::size(CODE_INFO) == static_cast<size_t>(Code::NUM_CODES));
+
+  inline const CodeInfo & GetInfo(Code code) { return CODE_INFO[static_cast<size_t>(code)]; }
+  inline bool IsJump(Code code) { return code >= Code::JUMP && code <= Code::JUMP_IFNOT; }
+  inline bool WritesA(Code code) { return code < Code::JUMP; }
+
+  // The instruction for a WASM arithmetic, comparison, or conversion operation.
+  inline Code FromOp(Op op) {
+    switch (op) {
+    case Op::I32_ADD: return Code::ADD_I;  case Op::I32_SUB: return Code::SUB_I;
+    case Op::I32_MUL: return Code::MUL_I;  case Op::I32_DIV_S: return Code::DIV_I;
+    case Op::I32_REM_S: return Code::REM_I;
+    case Op::I32_AND: return Code::AND_I;  case Op::I32_OR: return Code::OR_I;
+    case Op::I32_EQZ: return Code::EQZ_I;
+    case Op::I32_EQ: return Code::EQ_I;    case Op::I32_NE: return Code::NE_I;
+    case Op::I32_LT_S: return Code::LT_I;  case Op::I32_LE_S: return Code::LE_I;
+    case Op::I32_GT_S: return Code::GT_I;  case Op::I32_GE_S: return Code::GE_I;
+    case Op::F64_ADD: return Code::ADD_D;  case Op::F64_SUB: return Code::SUB_D;
+    case Op::F64_MUL: return Code::MUL_D;  case Op::F64_DIV: return Code::DIV_D;
+    case Op::F64_EQ: return Code::EQ_D;    case Op::F64_NE: return Code::NE_D;
+    case Op::F64_LT: return Code::LT_D;    case Op::F64_LE: return Code::LE_D;
+    case Op::F64_GT: return Code::GT_D;    case Op::F64_GE: return Code::GE_D;
+    case Op::F64_NEG: return Code::NEG_D;  case Op::F64_SQRT: return Code::SQRT_D;
+    case Op::F64_CONVERT_I32_S: return Code::I_TO_D;
+    case Op::I32_TRUNC_F64_S: return Code::D_TO_I;
+    default: assert(false); return Code::TRAP;
+    }
+  }
+
+  // Trap messages (the operand of TRAP), worded as WASM engines do.
+  enum Trap : uint32_t { UNREACHABLE, DIVIDE_BY_ZERO, INT_OVERFLOW, BAD_CONVERSION };
+  static constexpr const char * TRAP_TEXT[] = {
+    "unreachable", "integer divide by zero", "integer overflow", "invalid conversion to integer",
+  };
+
+  struct Instr {
+    Code code = Code::TRAP;
+    uint32_t a = 0, b = 0, c = 0;
+  };
+
+  struct Function {
+    std::string name{};
+    std::vector<Kind> params{};
+    Kind result = Kind::INT;
+    std::vector<Instr> code{};
+    std::vector<Value> frame{};   // Starting registers: zeros, with constants filled in.
+
+    void Print(std::ostream & os=std::cout) const {
+      os << name << ": " << params.size() << " params, " << frame.size() << " registers\n";
+      for (size_t pos = 0; pos < code.size(); ++pos) {
+        const Instr & inst = code[pos];
+        const CodeInfo & info = GetInfo(inst.code);
+        os << "  " << pos << ": " << info.name;
+        if (IsJump(inst.code) || inst.code == Code::TRAP) os << ' ' << inst.a;
+        else if (info.regs & 1) os << " r" << inst.a;
+        if (info.regs & 2) os << ", r" << inst.b;
+        if (info.regs & 4) os << ", r" << inst.c;
+        os << '\n';
+      }
+    }
+  };
+
+  // Lowers one function into bytecode; ASTNode::ToVM() returns the register holding each
+  // value.  A register returned for a variable belongs to that variable, so its value
+  // changes if the variable is assigned.
+  class Builder {
+  private:
+    static constexpr Reg TEMP = 0x80000000;   // Flag for temporaries until Finish().
+
+    Function fun{};
+    std::unordered_map<size_t, Reg> var_regs{};        // Variable ID -> register
+    std::unordered_map<int32_t, Reg> int_regs{};       // Constant value -> register
+    std::unordered_map<uint64_t, Reg> double_regs{};   // Bits of a constant -> register
+    Reg num_temps = 0;       // Temporaries in use right now
+    Reg max_temps = 0;
+    std::vector<uint32_t> label_pos{};                     // Label -> position (NONE until placed)
+    std::vector<std::pair<Label, Label>> loops{};          // Break and continue targets
+    static constexpr uint32_t NONE = static_cast<uint32_t>(-1);
+
+    Reg NewReg(Value value) {
+      fun.frame.push_back(value);
+      return static_cast<Reg>(fun.frame.size() - 1);
+    }
+
+  public:
+    Builder(std::string name, Kind result) { fun.name = name; fun.result = result; }
+
+    // Parameters must all be declared first, then variables.
+    void Param(size_t var_id, Kind kind) {
+      assert(fun.params.size() == fun.frame.size());
+      fun.params.push_back(kind);
+      var_regs[var_id] = NewReg(Value{0});
+    }
+    void DeclareVar(size_t var_id) { var_regs[var_id] = NewReg(Value{0}); }
+
+    Reg Var(size_t var_id) const {
+      assert(var_regs.count(var_id));
+      return var_regs.at(var_id);
+    }
+    bool IsVar(Reg reg) const { return !(reg & TEMP) && reg < var_regs.size(); }
+    bool IsTemp(Reg reg) const { return reg & TEMP; }
+
+    Reg Int(int32_t value) {
+      auto [it, added] = int_regs.emplace(value, 0);
+      if (added) it->second = NewReg(Value{value});
+      return it->second;
+    }
+    Reg Double(double value) {
+      auto [it, added] = double_regs.emplace(std::bit_cast<uint64_t>(value), 0);   // Keeps -0.0
+      if (added) { Value v; v.d = value; it->second = NewReg(v); }
+      return it->second;
+    }
+
+    Reg Temp() {
+      max_temps = std::max(max_temps, num_temps + 1);
+      return TEMP | num_temps++;
+    }
+    // Temporaries made after a mark can be reused once the code that needs them is done.
+    Reg Mark() const { return num_temps; }
+    void Release(Reg mark) { num_temps = mark; }
+
+    Label NewLabel() {
+      label_pos.push_back(NONE);
+      return static_cast<Label>(label_pos.size() - 1);
+    }
+    void Place(Label label) { label_pos[label] = static_cast<uint32_t>(fun.code.size()); }
+
+    void Emit(Code code, uint32_t a=0, uint32_t b=0, uint32_t c=0) { fun.code.push_back({code, a, b, c}); }
+    void Jump(Label label) { Emit(Code::JUMP, label); }
+    void JumpIf(Reg test, Label label) { Emit(Code::JUMP_IF, label, test); }
+    void JumpIfNot(Reg test, Label label) { Emit(Code::JUMP_IFNOT, label, test); }
+
+    // Copy a value into a register; if the value was just computed into a temporary, have
+    // it computed into the register instead.
+    void Move(Reg dest, Reg src) {
+      if (dest == src) return;
+      const bool label_here = std::count(label_pos.begin(), label_pos.end(), fun.code.size());
+      if (IsTemp(src) && fun.code.size() && !label_here) {
+        Instr & last = fun.code.back();
+        if (WritesA(last.code) && last.a == src) { last.a = dest; return; }
+      }
+      Emit(Code::MOV, dest, src);
+    }
+
+    void PushLoop(Label exit, Label next) { loops.emplace_back(exit, next); }
+    void PopLoop() { loops.pop_back(); }
+    bool InLoop() const { return loops.size(); }
+    Label BreakTarget() const { return loops.back().first; }
+    Label ContinueTarget() const { return loops.back().second; }
+
+    // Resolve labels and temporaries.  Falling off the end of a function traps, as it
+    // cannot happen in valid WASM.
+    Function Finish() {
+      Emit(Code::TRAP, UNREACHABLE);
+      const Reg first_temp = static_cast<Reg>(fun.frame.size());
+      fun.frame.resize(fun.frame.size() + max_temps, Value{0});
+      auto resolve = [first_temp](uint32_t & reg) { if (reg & TEMP) reg = first_temp + (reg & ~TEMP); };
+      for (Instr & inst : fun.code) {
+        const uint8_t regs = GetInfo(inst.code).regs;
+        if (IsJump(inst.code)) inst.a = label_pos[inst.a];
+        else if (regs & 1) resolve(inst.a);
+        if (regs & 2) resolve(inst.b);
+        if (regs & 4) resolve(inst.c);
+      }
+      return std::move(fun);
+    }
+  };
+
+  struct Result {
+    Value value{0};
+    const char * trap = nullptr;   // Why the call stopped, if it trapped.
+    uint64_t instructions = 0;     // Instructions run.
+  };
+
+  // Run a function on arguments (one per parameter).
+  inline Result Run(const Function & fun, const std::vector<Value> & args, std::vector<Value> & frame) {
+    assert(args.size() == fun.params.size());
+    frame = fun.frame;
+    std::copy(args.begin(), args.end(), frame.begin());
+    Value * const r = frame.data();
+    const Instr * const code = fun.code.data();
+    const Instr * ip = code;
+    Result result;
+    uint64_t count = 0;
+
+    // Every handler ends by going on to the instruction at ip.
+#if VM_THREADED
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+    static const void * const HANDLERS[] = {
+      &&L_MOV,
+      &&L_ADD_I, &&L_SUB_I, &&L_MUL_I, &&L_DIV_I, &&L_REM_I, &&L_AND_I, &&L_OR_I,
+      &&L_EQ_I, &&L_NE_I, &&L_LT_I, &&L_LE_I, &&L_GT_I, &&L_GE_I,
+      &&L_NEG_I, &&L_EQZ_I, &&L_BOOL_I,
+      &&L_ADD_D, &&L_SUB_D, &&L_MUL_D, &&L_DIV_D,
+      &&L_EQ_D, &&L_NE_D, &&L_LT_D, &&L_LE_D, &&L_GT_D, &&L_GE_D,
+      &&L_NEG_D, &&L_SQRT_D,
+      &&L_I_TO_D, &&L_D_TO_I,
+      &&L_JUMP, &&L_JUMP_IF, &&L_JUMP_IFNOT,
+      &&L_RETURN,
+      &&L_TRAP,
+    };
+    static_assert(std::size(HANDLERS) == static_cast<size_t>(Code::NUM_CODES));
+#define VM_GO() do { ++count; goto *HANDLERS[static_cast<size_t>(ip->code)]; } while (0)
+#define VM_CASE(NAME) L_##NAME:
+#define VM_NEXT() do { ++ip; VM_GO(); } while (0)
+    VM_GO();
+    {
+#else
+#define VM_GO() continue
+#define VM_CASE(NAME) case Code::NAME:
+#define VM_NEXT() ++ip; continue
+    for (;;) {
+      ++count;
+      switch (ip->code) {
+#endif
+#define VM_INT_OP(NAME, EXPR) VM_CASE(NAME) { const int32_t x = r[ip->b].i, y = r[ip->c].i; \
+                                             r[ip->a].i = (EXPR); VM_NEXT(); }
+#define VM_DOUBLE_OP(NAME, TYPE, EXPR) VM_CASE(NAME) { const double x = r[ip->b].d, y = r[ip->c].d; \
+                                                       r[ip->a].TYPE = (EXPR); VM_NEXT(); }
+#define VM_TRAP(WHY) do { result.trap = TRAP_TEXT[WHY]; goto done; } while (0)
+
+      VM_CASE(MOV) { r[ip->a] = r[ip->b]; VM_NEXT(); }
+      // Integer arithmetic wraps around, as in WASM.
+      VM_INT_OP(ADD_I, static_cast<int32_t>(static_cast<uint32_t>(x) + static_cast<uint32_t>(y)))
+      VM_INT_OP(SUB_I, static_cast<int32_t>(static_cast<uint32_t>(x) - static_cast<uint32_t>(y)))
+      VM_INT_OP(MUL_I, static_cast<int32_t>(static_cast<uint32_t>(x) * static_cast<uint32_t>(y)))
+      VM_CASE(DIV_I) {
+        const int32_t x = r[ip->b].i, y = r[ip->c].i;
+        if (y == 0) VM_TRAP(DIVIDE_BY_ZERO);
+        if (x == INT32_MIN && y == -1) VM_TRAP(INT_OVERFLOW);
+        r[ip->a].i = x / y;
+        VM_NEXT();
+      }
+      VM_CASE(REM_I) {
+        const int32_t x = r[ip->b].i, y = r[ip->c].i;
+        if (y == 0) VM_TRAP(DIVIDE_BY_ZERO);
+        r[ip->a].i = (y == -1) ? 0 : x % y;
+        VM_NEXT();
+      }
+      VM_INT_OP(AND_I, x & y)
+      VM_INT_OP(OR_I, x | y)
+      VM_INT_OP(EQ_I, x == y)
+      VM_INT_OP(NE_I, x != y)
+      VM_INT_OP(LT_I, x < y)
+      VM_INT_OP(LE_I, x <= y)
+      VM_INT_OP(GT_I, x > y)
+      VM_INT_OP(GE_I, x >= y)
+      VM_CASE(NEG_I) { r[ip->a].i = static_cast<int32_t>(0u - static_cast<uint32_t>(r[ip->b].i)); VM_NEXT(); }
+      VM_CASE(EQZ_I) { r[ip->a].i = (r[ip->b].i == 0); VM_NEXT(); }
+      VM_CASE(BOOL_I) { r[ip->a].i = (r[ip->b].i != 0); VM_NEXT(); }
+      VM_DOUBLE_OP(ADD_D, d, x + y)
+      VM_DOUBLE_OP(SUB_D, d, x - y)
+      VM_DOUBLE_OP(MUL_D, d, x * y)
+      VM_DOUBLE_OP(DIV_D, d, x / y)
+      VM_DOUBLE_OP(EQ_D, i, x == y)
+      VM_DOUBLE_OP(NE_D, i, x != y)
+      VM_DOUBLE_OP(LT_D, i, x < y)
+      VM_DOUBLE_OP(LE_D, i, x <= y)
+      VM_DOUBLE_OP(GT_D, i, x > y)
+      VM_DOUBLE_OP(GE_D, i, x >= y)
+      VM_CASE(NEG_D) { r[ip->a].d = -r[ip->b].d; VM_NEXT(); }
+      VM_CASE(SQRT_D) { r[ip->a].d = std::sqrt(r[ip->b].d); VM_NEXT(); }
+      VM_CASE(I_TO_D) { r[ip->a].d = r[ip->b].i; VM_NEXT(); }
+      VM_CASE(D_TO_I) {
+        const double x = r[ip->b].d;
+        if (std::isnan(x)) VM_TRAP(BAD_CONVERSION);
+        if (x <= -2147483649.0 || x >= 2147483648.0) VM_TRAP(INT_OVERFLOW);
+        r[ip->a].i = static_cast<int32_t>(x);
+        VM_NEXT();
+      }
+      VM_CASE(JUMP) { ip = code + ip->a; VM_GO(); }
+      VM_CASE(JUMP_IF) { ip = r[ip->b].i ? code + ip->a : ip + 1; VM_GO(); }
+      VM_CASE(JUMP_IFNOT) { ip = r[ip->b].i ? ip + 1 : code + ip->a; VM_GO(); }
+      VM_CASE(RETURN) { result.value = r[ip->a]; goto done; }
+      VM_CASE(TRAP) { VM_TRAP(ip->a); }
+#if !VM_THREADED
+      case Code::NUM_CODES: break;
+#endif
+    }
+#if !VM_THREADED
+    }
+#endif
+#undef VM_GO
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_INT_OP
+#undef VM_DOUBLE_OP
+#undef VM_TRAP
+#if VM_THREADED
+#pragma GCC diagnostic pop
+#endif
+
+  done:
+    result.instructions = count;
+    return result;
+  }
+
+  // Format a value of a given kind the way it would be written in source code.
+  inline std::string ValueText(Value value, Kind kind) {
+    if (kind == Kind::DOUBLE) {
+      char buffer[32];
+      auto out = std::to_chars(buffer, buffer + sizeof(buffer), value.d);
+      return std::string(buffer, out.ptr);
+    }
+    if (kind == Kind::CHAR && value.i >= 32 && value.i < 127 && value.i != '\'' && value.i != '\\') {
+      return std::string("'") + static_cast<char>(value.i) + "'";
+    }
+    return std::to_string(value.i);
+  }
+
+  // Runs calls written like "Name(1, 2.5, 'c')", optionally followed by "= expected".
+  class Machine {
+  private:
+    std::vector<Function> functions{};
+    std::unordered_map<std::string, size_t> by_name{};
+    std::vector<Value> frame{};   // Registers for the current call (reused across calls).
+
+    size_t calls = 0, failed = 0, trapped = 0;
+    uint64_t instructions = 0;
+    uint64_t nanoseconds = 0;
+
+    static std::string_view Trim(std::string_view text) {
+      while (text.size() && std::isspace(static_cast<unsigned char>(text.front()))) text.remove_prefix(1);
+      while (text.size() && std::isspace(static_cast<unsigned char>(text.back()))) text.remove_suffix(1);
+      return text;
+    }
+
+    // The code point of a single UTF-8 character (as JavaScript's charCodeAt gives it, for
+    // characters that fit in 16 bits).
+    static std::optional<int32_t> DecodeUTF8(std::string_view text) {
+      const auto byte = [text](size_t i) { return static_cast<unsigned char>(text[i]); };
+      const size_t length = byte(0) < 0x80 ? 1 : byte(0) >= 0xE0 ? 3 : byte(0) >= 0xC0 ? 2 : 0;
+      if (!length || text.size() != length) return std::nullopt;
+      int32_t code = (length == 1) ? byte(0) : byte(0) & (length == 2 ? 0x1F : 0x0F);
+      for (size_t i = 1; i < length; ++i) {
+        if ((byte(i) & 0xC0) != 0x80) return std::nullopt;
+        code = (code << 6) | (byte(i) & 0x3F);
+      }
+      return code;
+    }
+
+    // Read a literal: 'c', an int, or a double.
+    static std::optional<std::pair<Value, Kind>> ParseLiteral(std::string_view text) {
+      text = Trim(text);
+      if (text.size() >= 3 && text.size() <= 6 && text.front() == '\'' && text.back() == '\'' && text[1] != '\\') {
+        if (auto code = DecodeUTF8(text.substr(1, text.size() - 2))) return std::pair{Value{*code}, Kind::CHAR};
+      }
+      if (text.size() == 4 && text.front() == '\'' && text.back() == '\'' && text[1] == '\\') {
+        const char c = text[2] == 'n' ? '\n' : text[2] == 't' ? '\t' : text[2] == '0' ? '\0' : text[2];
+        return std::pair{Value{c}, Kind::CHAR};
+      }
+      const char * begin = text.data(), * end = text.data() + text.size();
+      if (text.find_first_of(".eEn") == std::string_view::npos) {
+        int32_t i = 0;
+        auto [ptr, error] = std::from_chars(begin, end, i);
+        if (ptr == end && error == std::errc{}) return std::pair{Value{i}, Kind::INT};
+      }
+      Value value;
+      auto [ptr, error] = std::from_chars(begin, end, value.d);
+      if (text.size() && ptr == end && error == std::errc{}) return std::pair{value, Kind::DOUBLE};
+      return std::nullopt;
+    }
+
+    // Read a literal for a parameter (or result) of a given kind; as with the exported WASM
+    // functions, a char can be given by its code, but a double is never truncated.  An int
+    // given for a double is read again as a double, so that "-0" keeps its sign.
+    static std::optional<Value> Convert(std::string_view text, Kind kind) {
+      auto literal = ParseLiteral(text);
+      if (!literal) return std::nullopt;
+      auto [value, from] = *literal;
+      if (kind == Kind::DOUBLE) {
+        text = Trim(text);
+        if (from == Kind::INT) std::from_chars(text.data(), text.data() + text.size(), value.d);
+        else if (from == Kind::CHAR) value.d = value.i;
+        return value;
+      }
+      if (from == Kind::DOUBLE) return std::nullopt;
+      return value;
+    }
+
+  public:
+    void Add(Function && fun) {
+      by_name[fun.name] = functions.size();
+      functions.push_back(std::move(fun));
+    }
+
+    const Function * Find(const std::string & name) const {
+      auto it = by_name.find(name);
+      return (it == by_name.end()) ? nullptr : &functions[it->second];
+    }
+
+    // Run one call and print its result; return false if it could not be run or did not
+    // give the expected result.
+    bool RunCall(std::string_view line, std::ostream & os=std::cout) {
+      line = Trim(line);
+      std::optional<std::pair<Value, Kind>> expected;
+      std::string_view expected_text;
+      const size_t close = line.rfind(')');
+      const size_t open = line.find('(');
+      auto fail = [&](const std::string & problem) {
+        os << line << "  ERROR: " << problem << '\n';
+        ++failed;
+        return false;
+      };
+      if (open == std::string_view::npos || close == std::string_view::npos || close < open) {
+        return fail("expected a call such as Name(1, 2.5, 'c')");
+      }
+      if (std::string_view rest = Trim(line.substr(close + 1)); rest.size()) {
+        expected_text = rest.substr(1);
+        if (rest[0] != '=' || !(expected = ParseLiteral(expected_text))) {
+          return fail("expected '= value' after the call");
+        }
+      }
+      const std::string name(Trim(line.substr(0, open)));
+      const Function * fun = Find(name);
+      if (!fun) return fail("unknown function '" + name + "'");
+
+      std::vector<Value> args;
+      std::string_view arg_text = Trim(line.substr(open + 1, close - open - 1));
+      while (arg_text.size()) {
+        size_t comma = arg_text.find(',');
+        if (arg_text.front() == '\'' && arg_text.size() >= 3) {   // The char may be a comma.
+          comma = arg_text.find(',', arg_text.find('\'', arg_text[1] == '\\' ? 3 : 2));
+        }
+        const std::string_view text = arg_text.substr(0, comma);
+        if (!ParseLiteral(text)) return fail("bad argument '" + std::string(Trim(text)) + "'");
+        if (args.size() == fun->params.size()) return fail("too many arguments");
+        auto value = Convert(text, fun->params[args.size()]);
+        if (!value) return fail("wrong type for argument " + std::to_string(args.size() + 1));
+        args.push_back(*value);
+        arg_text = (comma == std::string_view::npos) ? "" : arg_text.substr(comma + 1);
+      }
+      if (args.size() != fun->params.size()) {
+        return fail("expected " + std::to_string(fun->params.size()) + " arguments");
+      }
+
+      const auto start = std::chrono::steady_clock::now();
+      const Result result = Run(*fun, args, frame);
+      nanoseconds += static_cast<uint64_t>(std::chrono::nanoseconds(std::chrono::steady_clock::now() - start).count());
+      ++calls;
+      instructions += result.instructions;
+
+      os << line.substr(0, close + 1) << " = ";
+      if (result.trap) os << "trap: " << result.trap;
+      else os << ValueText(result.value, fun->result);
+      os << "  (" << result.instructions << " instructions)";
+      bool ok = !result.trap;
+      if (result.trap) ++trapped;
+      if (expected) {
+        auto want = Convert(expected_text, fun->result);
+        if (fun->result == Kind::DOUBLE) ok = ok && want && std::bit_cast<uint64_t>(want->d) == std::bit_cast<uint64_t>(result.value.d);
+        else ok = ok && want && want->i == result.value.i;
+        if (!ok) os << "  FAIL: expected " << Trim(expected_text);
+      }
+      os << '\n';
+      if (!ok) ++failed;
+      return ok;
+    }
+
+    void PrintSummary(std::ostream & os=std::cout) const {
+      os << calls << " calls (" << failed << " failed, " << trapped << " trapped), "
+         << instructions << " instructions in " << nanoseconds / 1000 << " us";
+      if (nanoseconds) os << " (" << static_cast<uint64_t>(static_cast<double>(calls) * 1e9 / static_cast<double>(nanoseconds)) << " calls/s)";
+      os << '\n';
+    }
+  };
+}
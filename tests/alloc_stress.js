@@ -0,0 +1,118 @@
+// Stress test for the runtime allocator (see Runtime.hpp), which is generated on request.
+// Usage: ../Project3 --helpers=alloc --binary test-01.tube > alloc.wasm
+//        node alloc_stress.js alloc.wasm
+//
+// Runs a long, deterministic mix of allocations and frees of small and large blocks,
+// filling every allocation with its own byte pattern, and checks that:
+// - allocations never overlap and their contents survive other allocations and frees;
+// - payloads are 8-byte aligned;
+// - the exported counters agree with what was done, and drop to zero bytes in use;
+// - memory grows when needed, and freed memory is reused (repeating the same work does
+//   not grow memory again).
+
+const fs = require('fs');
+
+const filename = process.argv[2] || 'alloc.wasm';
+const wasm_module = new WebAssembly.Module(fs.readFileSync(filename));
+const { _alloc, _free, memory, _alloc_count, _free_count, _bytes_in_use, _grow_count } =
+  new WebAssembly.Instance(wasm_module, {}).exports;
+
+let failures = 0;
+function check(condition, message) {
+  if (!condition) {
+    console.log(`FAIL: ${message}`);
+    if (++failures > 10) process.exit(1);
+  }
+}
+
+// A small deterministic random number generator (xorshift32).
+let seed = 12345;
+function random(limit) {
+  seed ^= seed << 13; seed >>>= 0;
+  seed ^= seed >>> 17;
+  seed ^= seed << 5; seed >>>= 0;
+  return seed % limit;
+}
+
+function randomSize() {
+  const kind = random(100);
+  if (kind < 70) return random(120);         // Small size classes
+  if (kind < 95) return 1000 + random(8000); // Large blocks
+  return 60000 + random(200000);             // Large enough to need more memory
+}
+
+const live = new Map();   // Address -> { size, fill }
+let allocs = 0, frees = 0;
+
+function fill(addr, size, value) { new Uint8Array(memory.buffer, addr, size).fill(value); }
+function verify(addr, size, value) {
+  const bytes = new Uint8Array(memory.buffer, addr, size);
+  for (let i = 0; i < size; i++) {
+    if (bytes[i] !== value) return false;
+  }
+  return true;
+}
+
+function allocate() {
+  const size = randomSize();
+  const addr = _alloc(size);
+  check(addr !== 0, `_alloc(${size}) failed`);
+  check(addr % 8 === 0, `_alloc(${size}) = ${addr} is not 8-byte aligned`);
+  const value = 1 + random(255);
+  fill(addr, size, value);
+  live.set(addr, { size, value });
+  allocs++;
+}
+
+function release(addr) {
+  const { size, value } = live.get(addr);
+  check(verify(addr, size, value), `block at ${addr} (${size} bytes) was overwritten`);
+  _free(addr);
+  live.delete(addr);
+  frees++;
+}
+
+function releaseRandom() {
+  const addrs = [...live.keys()];
+  release(addrs[random(addrs.length)]);
+}
+
+function checkNoOverlap() {
+  const blocks = [...live.entries()].sort((a, b) => a[0] - b[0]);
+  for (let i = 1; i < blocks.length; i++) {
+    const [prev, { size }] = blocks[i - 1];
+    check(prev + size <= blocks[i][0], `blocks at ${prev} and ${blocks[i][0]} overlap`);
+  }
+}
+
+// Each round grows a working set, churns it, then frees everything.
+function round(steps) {
+  for (let step = 0; step < steps; step++) {
+    if (live.size < 50 || random(100) < 55) allocate();
+    else releaseRandom();
+    if (step % 500 === 0) checkNoOverlap();
+  }
+  checkNoOverlap();
+  while (live.size) releaseRandom();
+}
+
+_free(0);  // Freeing null does nothing.
+const saved_seed = seed;
+round(20000);
+const pages_after_first = memory.buffer.byteLength / 65536;
+check(_grow_count.value > 0, 'memory never grew');
+check(_bytes_in_use.value === 0, `${_bytes_in_use.value} bytes still in use after freeing everything`);
+
+seed = saved_seed;  // The same work again should fit in the memory already there.
+round(20000);
+check(memory.buffer.byteLength / 65536 === pages_after_first,
+      `memory grew from ${pages_after_first} to ${memory.buffer.byteLength / 65536} pages repeating the same work`);
+
+check(_alloc_count.value === allocs, `_alloc_count is ${_alloc_count.value}, expected ${allocs}`);
+check(_free_count.value === frees, `_free_count is ${_free_count.value}, expected ${frees}`);
+check(_bytes_in_use.value === 0, `${_bytes_in_use.value} bytes still in use after freeing everything`);
+check(_alloc(0x7FFFFFFF) === 0, 'an impossible allocation did not fail');
+
+console.log(`Allocator stress test: ${allocs} allocations, ${frees} frees, ` +
+            `${pages_after_first} pages; ${failures ? 'FAILED' : 'passed'}.`);
+process.exit(failures ? 1 : 0);
@@ -0,0 +1,100 @@
+// Microbenchmark for the runtime memory helpers (see Runtime.hpp), comparing builds that
+// use bulk-memory and SIMD instructions against plain byte loops.  For example:
+//   ../Project3 --helpers=all --no-bulk-memory --binary test-01.tube > loops.wasm
+//   ../Project3 --helpers=all --binary test-01.tube > bulk.wasm
+//   ../Project3 --helpers=all --simd --binary test-01.tube > simd.wasm
+//   node bulk_bench.js loops.wasm bulk.wasm simd.wasm
+//
+// Each helper is first checked against a JavaScript version, then timed on buffers of
+// several sizes; results are in nanoseconds per byte (lower is better).
+
+const fs = require('fs');
+
+const files = process.argv.slice(2);
+if (!files.length) {
+  console.log('Usage: node bulk_bench.js module.wasm...');
+  process.exit(1);
+}
+
+const SIZES = [16, 256, 4096, 65536];
+const BYTES_PER_TEST = 1 << 25;   // Work per helper and size, so every time is comparable.
+
+function load(filename) {
+  const wasm_module = new WebAssembly.Module(fs.readFileSync(filename));
+  return new WebAssembly.Instance(wasm_module, {}).exports;
+}
+
+// Make sure each helper gives the right answers (including overlapping copies).
+function verify(name, ex) {
+  const mem = () => new Uint8Array(ex.memory.buffer);
+  const a = ex._alloc(300), b = ex._alloc(300);
+  for (let i = 0; i < 300; i++) { mem()[a + i] = i & 0xFF; mem()[b + i] = i & 0xFF; }
+  const failures = [];
+  const check = (ok, what) => { if (!ok) failures.push(what); };
+
+  check(ex._mem_compare(a, b, 300) === 0, 'compare equal');
+  mem()[b + 290] = 7;
+  check(ex._mem_compare(a, b, 300) === (290 & 0xFF) - 7, 'compare late difference');
+  check(ex._mem_compare(a, b, 290) === 0, 'compare before the difference');
+  mem()[a + 3] = 200;
+  check(ex._mem_compare(a, b, 300) === 200 - 3, 'compare early difference');
+
+  ex._mem_fill(a, 0x41, 299);
+  mem()[a + 299] = 0;
+  check(mem().slice(a, a + 299).every(x => x === 0x41), 'fill');
+  check(ex._str_length(a) === 299 && ex._str_length(a + 299) === 0, 'length');
+
+  for (let i = 0; i < 300; i++) mem()[b + i] = i & 0xFF;
+  ex._mem_copy(a, b, 300);
+  check(mem().slice(a, a + 300).every((x, i) => x === (i & 0xFF)), 'copy');
+  ex._mem_copy(a + 10, a, 200);   // Overlapping, upward
+  check(mem().slice(a + 10, a + 210).every((x, i) => x === (i & 0xFF)), 'copy up (overlapping)');
+  ex._mem_copy(b, b + 10, 200);   // Overlapping, downward
+  check(mem().slice(b, b + 200).every((x, i) => x === ((i + 10) & 0xFF)), 'copy down (overlapping)');
+
+  ex._free(a);
+  ex._free(b);
+  if (failures.length) {
+    console.log(`${name}: FAILED ${failures.join(', ')}`);
+    process.exit(1);
+  }
+}
+
+function time(fun, size) {
+  const reps = Math.max(1, BYTES_PER_TEST / size);
+  fun();   // Warm up.
+  const start = process.hrtime.bigint();
+  for (let i = 0; i < reps; i++) fun();
+  return Number(process.hrtime.bigint() - start) / (reps * size);
+}
+
+const results = {};   // Test -> module -> ns/byte
+for (const filename of files) {
+  const ex = load(filename);
+  verify(filename, ex);
+  for (const size of SIZES) {
+    const a = ex._alloc(size + 1), b = ex._alloc(size + 1);
+    ex._mem_fill(a, 0x61, size);
+    ex._mem_fill(b, 0x61, size);
+    new Uint8Array(ex.memory.buffer)[a + size] = 0;
+    const tests = {
+      copy: () => ex._mem_copy(b, a, size),
+      fill: () => ex._mem_fill(b, 0x61, size),
+      compare: () => ex._mem_compare(a, b, size),
+      length: () => ex._str_length(a),
+    };
+    for (const [test, fun] of Object.entries(tests)) {
+      const key = `${test} ${size}`;
+      results[key] = results[key] || {};
+      results[key][filename] = time(fun, size);
+    }
+    ex._free(a);
+    ex._free(b);
+  }
+}
+
+const width = Math.max(...files.map(f => f.length), 10);
+console.log('ns/byte'.padEnd(14) + files.map(f => f.padStart(width)).join(' '));
+for (const [key, row] of Object.entries(results)) {
+  console.log(key.padEnd(14) + files.map(f => row[f].toFixed(4).padStart(width)).join(' '));
+}
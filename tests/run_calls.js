@@ -0,0 +1,50 @@
+// Runs calls on a compiled module and checks their results, as Project3 --run-file does
+// in the built-in VM, but on the generated WASM itself.
+// Usage: node run_calls.js module.wasm calls.txt
+//
+// Each line of the calls file is 'Name(args) = expected'; blank lines and lines starting
+// with '#' are skipped.  Arguments and results may be ints, doubles, or quoted chars; an
+// expected result of 'trap' means that the call must trap.
+
+const fs = require('fs');
+
+const [filename, calls_file] = process.argv.slice(2);
+const wasm_module = new WebAssembly.Module(fs.readFileSync(filename));
+const functions = new WebAssembly.Instance(wasm_module, {}).exports;
+
+// A literal as a number ('c' becomes its character code).
+function parse(text) {
+  text = text.trim();
+  if (text.length >= 3 && text[0] === "'" && text[text.length - 1] === "'") {
+    const inner = text.slice(1, -1);
+    if (inner[0] !== '\\') return inner.charCodeAt(0);
+    return { n: 10, t: 9, 0: 0 }[inner[1]] ?? inner.charCodeAt(1);
+  }
+  return Number(text);
+}
+
+let failures = 0;
+for (const raw of fs.readFileSync(calls_file, 'utf8').split('\n')) {
+  const line = raw.trim();
+  if (!line || line.startsWith('#')) continue;
+  const match = line.match(/^(\w+)\s*\((.*)\)\s*=\s*(.+)$/);
+  if (!match) {
+    console.log(`ERROR: cannot read call '${line}'`);
+    ++failures;
+    continue;
+  }
+  const [, name, arg_text, expected_text] = match;
+  const args = arg_text.trim() ? arg_text.split(',').map(parse) : [];
+  const expected = (expected_text.trim() === 'trap') ? 'trap' : parse(expected_text);
+  let result;
+  try {
+    result = functions[name](...args);
+  } catch (error) {
+    result = `trap: ${error.message}`;
+  }
+  if (!Object.is(result, expected) && !(expected === 'trap' && String(result).startsWith('trap'))) {
+    console.log(`FAIL: ${name}(${arg_text}) = ${result}; expected ${expected_text.trim()}`);
+    ++failures;
+  }
+}
+process.exit(failures ? 1 : 0);
@@ -9,6 +9,21 @@ error_pass_count=0
 error_fail_count=0
 error_test_count=19
 
+vm_pass_count=0
+vm_fail_count=0
+
+ssa_pass_count=0
+ssa_fail_count=0
+
+pass_pass_count=0
+pass_fail_count=0
+
+deep_pass_count=0
+deep_fail_count=0
+
+jobs_pass_count=0
+jobs_fail_count=0
+
 # Loop through all the regular test file pairs
 for i in $(seq -w 01 $test_count); do
     # Set the file names
@@ -84,9 +99,238 @@ for i in $(seq -w 01 $error_test_count); do
     fi
 done
 
+# Run the expected calls for each regular test in the built-in VM (see test_calls.txt).
+echo ---
+echo VM Testing
+
+for i in $(seq -w 01 $test_count); do
+    if ! grep -q "^test-${i}:" test_calls.txt; then continue; fi
+    if ../Project3 --run-file=<(grep "^test-${i}:" test_calls.txt | cut -d: -f2-) "test-${i}.tube" > /dev/null; then
+        ((vm_pass_count++))
+    else
+        echo "VM test $i failed:"
+        ../Project3 --run-file=<(grep "^test-${i}:" test_calls.txt | cut -d: -f2-) "test-${i}.tube" | grep -E "FAIL|ERROR|trap"
+        ((vm_fail_count++))
+    fi
+done
+
+# Reports still go to standard error when running calls instead of generating code.
+stats=$(../Project3 --pass-stats --run='Echo(3) = 3' test-02.tube 2>&1 > /dev/null)
+if grep -q "^Pass pipeline:" <<< "$stats" && grep -q "^Pass timing:" <<< "$stats"; then
+    ((vm_pass_count++))
+else
+    echo "VM test with --pass-stats printed no pass statistics."
+    ((vm_fail_count++))
+fi
+
+# Run the same calls on the code generated by way of SSA form (--ssa), at each level: in
+# the VM, and in the generated WASM if node is here.
+echo ---
+echo SSA Testing
+
+ssa_file=$(mktemp --suffix=.wasm)
+for i in $(seq -w 01 $test_count); do
+    calls=$(grep "^test-${i}:" test_calls.txt | cut -d: -f2-)
+    [[ -z "$calls" ]] && continue
+    for level in "-O0" "-O1" "-O2"; do
+        problems=()
+        if ! vm_out=$(../Project3 --ssa $level --run-file=<(echo "$calls") "test-${i}.tube"); then
+            problems+=("calls failed in the VM:")
+            problems+=("$(grep -E "FAIL|ERROR|trap" <<< "$vm_out")")
+        fi
+        if command -v node > /dev/null; then
+            if ! (../Project3 --ssa $level --binary "test-${i}.tube" > "$ssa_file" &&
+                  node run_calls.js "$ssa_file" <(echo "$calls")); then
+                problems+=("calls failed in WASM")
+            fi
+        fi
+        if (( ${#problems[@]} == 0 )); then
+            ((ssa_pass_count++))
+        else
+            echo "SSA test $i ($level) failed:"
+            printf '  %s\n' "${problems[@]}"
+            ((ssa_fail_count++))
+        fi
+    done
+done
+rm -f "$ssa_file"
+
+# Each pass-*.tube file checks one pass (or level), using directives in its comments:
+#   // OPTIONS: flags     Compile with these flags (each OPTIONS line is checked in turn).
+#   // RUN: call = value  Call to check in the VM, and in the generated WASM if node is here.
+#   // TRAPS: call        Call that must trap (checked the same way).
+#   // REMOVES: regex     Lines of code that match at -O0 but never with the options.
+#   // FEWER: regex       Fewer lines match with the options than at -O0.
+#   // COUNT: n regex     Exactly n lines match with the options.
+#   // HOISTED: regex     With the options (but not at -O0), it first matches before a loop.
+# Only the code of the functions in the file is matched (not the runtime helpers).
+echo ---
+echo Pass Testing
+
+# The code of the functions defined in a source file, compiled with the given flags.
+function user_code() {
+    ../Project3 "${@:2}" "$1" | awk '/\(func \$[^_]/ { on = 1 } on { print } /END .* function definition/ { on = 0 }'
+}
+# Number of lines of code that match a regex.
+function count_code() { grep -cE -- "$1" || true; }
+# Line of the first match of a regex (0 for none), and of the first loop.
+function first_code() { grep -nE -m1 -- "$1" | cut -d: -f1 | grep . || echo 0; }
+
+wasm_file=$(mktemp --suffix=.wasm)
+for code_file in pass-*.tube; do
+    calls=$(sed -n 's|^// RUN: ||p' "$code_file")
+    traps=$(sed -n 's|^// TRAPS: ||p' "$code_file")
+    while read -r options; do
+        problems=()
+        if ! ../Project3 $options --run-file=<(echo "$calls") "$code_file" > /dev/null; then
+            problems+=("calls failed in the VM")
+        fi
+        while read -r call; do
+            [[ -z "$call" ]] && continue
+            if ! ../Project3 $options --run="$call" "$code_file" | grep -q "= trap:"; then
+                problems+=("$call did not trap in the VM")
+            fi
+        done <<< "$traps"
+        if command -v node > /dev/null; then
+            if ! (../Project3 $options --binary "$code_file" > "$wasm_file" &&
+                  node run_calls.js "$wasm_file" <(echo "$calls"; sed '/./s|$| = trap|' <<< "$traps")); then
+                problems+=("calls failed in WASM")
+            fi
+        fi
+        base=$(user_code "$code_file" -O0)
+        code=$(user_code "$code_file" $options)
+        while read -r regex; do
+            [[ -z "$regex" ]] && continue
+            if (( $(count_code "$regex" <<< "$base") == 0 || $(count_code "$regex" <<< "$code") > 0 )); then
+                problems+=("'$regex' was not removed")
+            fi
+        done <<< "$(sed -n 's|^// REMOVES: ||p' "$code_file")"
+        while read -r regex; do
+            [[ -z "$regex" ]] && continue
+            if (( $(count_code "$regex" <<< "$code") >= $(count_code "$regex" <<< "$base") )); then
+                problems+=("'$regex' did not match fewer lines")
+            fi
+        done <<< "$(sed -n 's|^// FEWER: ||p' "$code_file")"
+        while read -r number regex; do
+            [[ -z "$regex" ]] && continue
+            if (( $(count_code "$regex" <<< "$code") != number )); then
+                problems+=("'$regex' did not match $number lines")
+            fi
+        done <<< "$(sed -n 's|^// COUNT: ||p' "$code_file")"
+        while read -r regex; do
+            [[ -z "$regex" ]] && continue
+            base_pos=$(first_code "$regex" <<< "$base")
+            base_loop=$(first_code '\(loop' <<< "$base")
+            pos=$(first_code "$regex" <<< "$code")
+            loop=$(first_code '\(loop' <<< "$code")
+            if (( pos == 0 || pos > loop || base_pos < base_loop )); then
+                problems+=("'$regex' was not hoisted out of the loop")
+            fi
+        done <<< "$(sed -n 's|^// HOISTED: ||p' "$code_file")"
+
+        if (( ${#problems[@]} == 0 )); then
+            ((pass_pass_count++))
+        else
+            echo "Pass test $code_file ($options) failed:"
+            printf '  %s\n' "${problems[@]}"
+            ((pass_fail_count++))
+        fi
+    done <<< "$(sed -n 's|^// OPTIONS: ||p' "$code_file")"
+done
+rm -f "$wasm_file"
+
+# Generating functions in parallel must give exactly the same module as generating them
+# one at a time, as text and in binary.  All regular tests together make one module with
+# many functions (and so many jobs).
+echo ---
+echo Parallel Codegen Testing
+
+jobs_file=$(mktemp --suffix=.tube)
+cat test-??.tube > "$jobs_file"
+for code_file in test-??.tube "$jobs_file"; do
+    for mode in "" "--binary"; do
+        if cmp -s <(../Project3 --jobs=1 $mode "$code_file") <(../Project3 --jobs=8 $mode "$code_file"); then
+            ((jobs_pass_count++))
+        else
+            echo "Parallel codegen of $code_file ($mode) differs from serial output."
+            ((jobs_fail_count++))
+        fi
+    done
+done
+rm -f "$jobs_file"
+
+# Compile expressions of a million nodes with the default stack size (8 MB), so any pass
+# over whole trees that recurses once per level would crash; then run them in the VM.
+echo ---
+echo Deep Expression Testing
+
+deep_file=$(mktemp --suffix=.tube)
+deep_prefixes=("a + "      # Left-deep chain
+               "a * ("     # Right-deep, through parentheses
+               "- "        # Prefix operators
+               "b = ")     # Right-associative assignment
+deep_results=(500001 1 1 1)  # f(1) for each
+for k in "${!deep_prefixes[@]}"; do
+    prefix="${deep_prefixes[$k]}"
+    # Repeat the prefix half a million times, then end with 'a' (closing any parentheses).
+    awk -v prefix="$prefix" 'BEGIN {
+        n = 500000
+        printf "function f(int a) : int {\n  int b = 0;\n  return "
+        for (i = 0; i < n; i++) printf "%s", prefix
+        printf "a"
+        if (prefix ~ /\($/) for (i = 0; i < n; i++) printf ")"
+        printf ";\n}\n"
+    }' > "$deep_file"
+    for mode in "" "-O1" "-O0" "--binary" "--ssa" "--run=f(1)=${deep_results[$k]}" "-O0 --run=f(1)=${deep_results[$k]}"; do
+        if (ulimit -S -s 8192 && ../Project3 $mode "$deep_file" > /dev/null); then
+            ((deep_pass_count++))
+        else
+            echo "Deep expression test '${prefix}...' ($mode) failed."
+            ((deep_fail_count++))
+        fi
+    done
+done
+rm -f "$deep_file"
+
+# Check how literal strings share space in the data segment.
+echo ---
+echo String Pool Testing
+pool_test=$(mktemp)
+if ${CXX:-c++} -std=c++20 -Wall -Wextra string_pool.cpp -o "$pool_test" && "$pool_test"; then
+    pool_result="passed"
+else
+    pool_result="FAILED"
+fi
+rm -f "$pool_test"
+
+# The allocator is generated only on request; stress it if node is available.
+echo ---
+if ../Project3 test-01.tube | grep -q '_alloc'; then
+    echo "A module that never allocates carries the allocator."
+    alloc_result="FAILED"
+else
+    alloc_result="passed"
+fi
+if command -v node > /dev/null; then
+    alloc_file=$(mktemp --suffix=.wasm)
+    if ! (../Project3 --helpers=alloc --binary test-01.tube > "$alloc_file" && node alloc_stress.js "$alloc_file"); then
+        alloc_result="FAILED"
+    fi
+    rm -f "$alloc_file"
+else
+    echo "Skipping the allocator stress test (needs node)."
+fi
+
 # Report the final count of differing files
 echo ---
 echo "Of $test_count regular test files..."
 echo "...generated $wat_count WAT files"
 echo "...converted $wasm_count WAT files to wasm files for testing."
 echo "Passed $error_pass_count of $error_test_count error tests (Failed $error_fail_count)"
+echo "Passed $vm_pass_count VM tests (Failed $vm_fail_count)"
+echo "Passed $ssa_pass_count SSA tests (Failed $ssa_fail_count)"
+echo "Passed $pass_pass_count pass tests (Failed $pass_fail_count)"
+echo "Passed $jobs_pass_count parallel codegen tests (Failed $jobs_fail_count)"
+echo "Passed $deep_pass_count deep expression tests (Failed $deep_fail_count)"
+echo "String pool checks $pool_result"
+echo "Allocator checks $alloc_result"
@@ -0,0 +1,87 @@
+// Checks for the literal string pool (see StringPool.hpp) and Control::Data().
+// Usage: c++ -std=c++20 string_pool.cpp -o string_pool && ./string_pool
+//
+// Adds overlapping literals and checks the size of the data segment, how many strings
+// share the tail of another, and where each one lands:
+// - strings placed in one batch share the tail of any longer one, whatever the order
+//   they were added in;
+// - a later batch can share strings placed earlier, but placed strings never move;
+// - strings added through Control::Data() by separate functions are placed together.
+
+#include <iostream>
+#include <string>
+
+#include "../Control.hpp"
+
+static size_t failures = 0;
+
+static void Check(bool condition, const std::string & message) {
+  if (!condition) {
+    std::cout << "FAIL: " << message << '\n';
+    ++failures;
+  }
+}
+
+static void CheckStats(const strings::Pool & pool, size_t bytes, size_t shared, const std::string & name) {
+  const strings::Stats & stats = pool.GetStats();
+  Check(stats.bytes == bytes, name + ": segment is " + std::to_string(stats.bytes) +
+                              " bytes; expected " + std::to_string(bytes));
+  Check(stats.shared == shared, name + ": " + std::to_string(stats.shared) +
+                                " strings shared; expected " + std::to_string(shared));
+}
+
+int main() {
+  {  // One batch: "lo" shares the tail of "hello", even though it came first.
+    strings::Pool pool(100);
+    const uint32_t lo = pool.Add("lo");
+    const uint32_t hello = pool.Add("hello");
+    pool.Place();
+    CheckStats(pool, 6, 1, "one batch");
+    Check(pool.Position(hello) == 100, "one batch: \"hello\" should start the segment");
+    Check(pool.Position(lo) == 103, "one batch: \"lo\" should point into \"hello\"");
+  }
+
+  {  // Two batches: "lo" was already placed, so "hello" cannot cover it.
+    strings::Pool pool;
+    pool.Add("lo");
+    pool.Place();
+    pool.Add("hello");
+    pool.Place();
+    CheckStats(pool, 9, 0, "placed first");
+  }
+
+  {  // Two batches the other way: a later string shares an earlier one.
+    strings::Pool pool;
+    pool.Add("hello");
+    pool.Place();
+    const uint32_t lo = pool.Add("lo");
+    pool.Place();
+    CheckStats(pool, 6, 1, "placed later");
+    Check(pool.Position(lo) == 3, "placed later: \"lo\" should point into \"hello\"");
+  }
+
+  {  // Repeats, nested tails, the empty string, and strings that only overlap mid-way.
+    strings::Pool pool;
+    for (const char * str : {"o", "hello", "lo", "hello", "", "yellow", "hell", "ell"}) pool.Add(str);
+    pool.Place();
+    // Stored: "yellow\0" "hello\0" "hell\0"; "" shares "yellow", "lo" and "o" share "hello",
+    // and "ell" shares "hell".
+    CheckStats(pool, 18, 4, "mixed");
+    Check(pool.GetStats().requested == 8 && pool.GetStats().distinct == 7, "mixed: wrong string counts");
+  }
+
+  {  // Functions generated in their own contexts add strings that are all placed at once.
+    Control control;
+    Control first = control.Fork(), second = control.Fork();
+    const uint32_t lo = first.Data("lo");
+    const uint32_t hello = second.Data("hello");
+    Check(second.Data("lo") == lo, "Control: \"lo\" should be interned once");
+    control.strings.Place();
+    CheckStats(control.strings, 6, 1, "Control");
+    Check(first.DataPosition(lo) == second.DataPosition(hello) + 3,
+          "Control: \"lo\" should point into \"hello\"");
+  }
+
+  if (failures) return 1;
+  std::cout << "String pool checks passed.\n";
+}
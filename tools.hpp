@@ -1,8 +1,15 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "lexer.hpp"
 
@@ -44,4 +51,53 @@ void ReplaceAll(std::string & str, std::string from, std::string to) {
     str.replace(pos, from.size(), to);
     pos += to.size(); // Move past the last replacement
   }
-}
\ No newline at end of file
+}
+
+// Call fun(id) for every id in [0, count), spread across up to num_threads threads.
+// Each thread takes the next unclaimed id, so uneven work still balances out.
+template <typename FUN_T>
+void ParallelFor(size_t count, size_t num_threads, FUN_T fun) {
+  num_threads = std::min(num_threads, count);
+  if (num_threads <= 1) {
+    for (size_t id = 0; id < count; ++id) fun(id);
+    return;
+  }
+
+  std::atomic<size_t> next_id{0};
+  auto worker = [&]() {
+    for (size_t id = next_id++; id < count; id = next_id++) fun(id);
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; ++i) threads.emplace_back(worker);
+  worker();  // The calling thread does its share too.
+  for (auto & thread : threads) thread.join();
+}
+
+// Work still to do in a walk over a tree, next step last.  Each node does only the work
+// before its first child directly and queues the rest, so trees can be any depth without
+// deep recursion (see Control::Then and PassSteps in ASTNode.hpp).  Steps queued while a
+// step runs go next, in the order they were queued, ahead of anything queued before.
+template <typename... ARG_Ts>
+class StepQueue {
+public:
+  using step_t = std::function<void(ARG_Ts...)>;
+
+private:
+  std::vector<step_t> steps{};
+
+public:
+  void Then(step_t step) { steps.push_back(std::move(step)); }
+
+  // Run a step, then everything it queues, passing each the same arguments.
+  void Run(step_t first, ARG_Ts... args) {
+    const size_t base = steps.size();
+    steps.push_back(std::move(first));
+    while (steps.size() > base) {
+      step_t step = std::move(steps.back());
+      steps.pop_back();
+      const size_t mark = steps.size();
+      step(args...);
+      std::reverse(steps.begin() + static_cast<std::ptrdiff_t>(mark), steps.end());
+    }
+  }
+};